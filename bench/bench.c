@@ -0,0 +1,431 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../src/stcp.h"
+#include "histogram.h"
+
+/*
+ * Loopback benchmarks of the send, receive and accept paths.
+ *
+ * Results go to stdout as one JSON document so runs of different
+ * releases can be compared by script; progress goes to stderr.
+ * Pass --quick for a short smoke run.
+ */
+
+#define LOOPBACK_ADDRESS "127.0.0.1"
+
+#define PING_PONG_SIZE 64
+#define FAN_IN_MESSAGE_SIZE 64
+#define RECEIVE_BUFFER_SIZE (256 * 1024)
+#define SHARED_RING_SIZE (64 * 1024)
+#define TIMEOUT 10000
+
+static const int THROUGHPUT_SIZES[] = { 64, 1024, 16384, 262144 };
+#define THROUGHPUT_SIZE_COUNT ((int) (sizeof(THROUGHPUT_SIZES) / sizeof(THROUGHPUT_SIZES[0])))
+
+typedef struct settings
+{
+	bool quick;
+	int ping_pong_iterations;
+	long long throughput_bytes;
+	int accept_count;
+	int fan_in_connections;
+	int fan_in_messages;
+} settings;
+
+static char port[8];
+
+// Where the benchmarks connect, switched to a unix socket for the local runs
+static const char* address = LOOPBACK_ADDRESS;
+static char local_address[64];
+
+// Accepting closes server ends first, which leaves its port in TIME_WAIT
+static char accept_port[8];
+
+#define CHECK(condition) \
+	do { \
+		if (!(condition)) \
+		{ \
+			fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #condition); \
+			exit(-1); \
+		} \
+	} while (0)
+
+void report_error(stcp_error e, void* user_data)
+{
+	(void) user_data;
+	fprintf(stderr, "stcp error: %s\n", stcp_error_to_string(e));
+}
+
+static uint64_t now_nanoseconds()
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t) now.tv_sec * 1000000000ull + (uint64_t) now.tv_nsec;
+}
+
+static double seconds_since(uint64_t start)
+{
+	return (double) (now_nanoseconds() - start) / 1e9;
+}
+
+// Connects a low-latency client to the server and accepts it
+static void open_pair(stcp_server* server, stcp_channel** client, stcp_channel** accepted)
+{
+	stcp_options options = stcp_make_options(STCP_PROFILE_LOW_LATENCY);
+	*client = stcp_connect_with_options(address, port, &options);
+	CHECK(*client);
+	*accepted = stcp_accept(server, TIMEOUT);
+	CHECK(*accepted);
+}
+
+static stcp_server* open_server(int max_pending_channels)
+{
+	stcp_options options = stcp_make_options(STCP_PROFILE_LOW_LATENCY);
+	stcp_server* server = stcp_open_server_with_options(address, port, max_pending_channels, &options);
+	CHECK(server);
+	return server;
+}
+
+// Receives exactly length bytes
+static void receive_all(stcp_channel* channel, char* buffer, int length)
+{
+	int received = 0;
+	while (received < length)
+	{
+		int ret = stcp_receive(channel, buffer + received, length - received, TIMEOUT);
+		CHECK(ret > 0);
+		received += ret;
+	}
+}
+
+// ----- Ping-pong latency -----
+typedef struct echo_args
+{
+	stcp_channel* channel;
+	int iterations;
+	bool shared;
+} echo_args;
+
+static void* echo(void* user_data)
+{
+	echo_args* args = (echo_args*) user_data;
+	if (args->shared)
+		CHECK(stcp_enable_shared_memory(args->channel, SHARED_RING_SIZE, TIMEOUT));
+
+	char buffer[PING_PONG_SIZE];
+	for (int i = 0; i < args->iterations; ++i)
+	{
+		receive_all(args->channel, buffer, PING_PONG_SIZE);
+		CHECK(stcp_send(args->channel, buffer, PING_PONG_SIZE, TIMEOUT));
+	}
+	return NULL;
+}
+
+// Both ends spin for up to max_spin_microseconds before sleeping when it isn't 0,
+// and move the channel onto shared memory rings when shared is set
+static void bench_ping_pong(const settings* s, bool first, const char* name, int max_spin_microseconds, bool shared)
+{
+	fprintf(stderr, "%s...\n", name);
+	stcp_server* server = open_server(4);
+	stcp_channel* client;
+	stcp_channel* accepted;
+	open_pair(server, &client, &accepted);
+	stcp_set_busy_poll(client, max_spin_microseconds);
+	stcp_set_busy_poll(accepted, max_spin_microseconds);
+
+	// Warm up caches and the connection before timing
+	int warmup = s->ping_pong_iterations / 10;
+	echo_args args = { accepted, warmup + s->ping_pong_iterations, shared };
+	pthread_t thread;
+	CHECK(pthread_create(&thread, NULL, echo, &args) == 0);
+	if (shared)
+		CHECK(stcp_enable_shared_memory(client, SHARED_RING_SIZE, TIMEOUT));
+
+	static histogram h;
+	histogram_reset(&h);
+
+	char buffer[PING_PONG_SIZE];
+	memset(buffer, 'p', sizeof(buffer));
+	for (int i = 0; i < warmup + s->ping_pong_iterations; ++i)
+	{
+		uint64_t start = now_nanoseconds();
+		CHECK(stcp_send(client, buffer, PING_PONG_SIZE, TIMEOUT));
+		receive_all(client, buffer, PING_PONG_SIZE);
+		if (i >= warmup)
+			histogram_record(&h, now_nanoseconds() - start);
+	}
+
+	CHECK(pthread_join(thread, NULL) == 0);
+	stcp_stats stats;
+	stcp_get_channel_stats(client, &stats);
+	stcp_close_channel(client);
+	stcp_close_channel(accepted);
+	stcp_close_server(server);
+
+	printf("%s\n    {\"name\": \"%s\", \"message_size\": %d, \"iterations\": %d, \"latency_ns\": "
+			"{\"min\": %llu, \"p50\": %llu, \"p90\": %llu, \"p99\": %llu, \"p999\": %llu, \"max\": %llu, \"mean\": %.1f}, "
+			"\"poll_waits\": %llu, \"busy_poll_hits\": %llu}",
+			first ? "" : ",",
+			name,
+			PING_PONG_SIZE,
+			s->ping_pong_iterations,
+			(unsigned long long) h.min,
+			(unsigned long long) histogram_percentile(&h, 0.5),
+			(unsigned long long) histogram_percentile(&h, 0.9),
+			(unsigned long long) histogram_percentile(&h, 0.99),
+			(unsigned long long) histogram_percentile(&h, 0.999),
+			(unsigned long long) h.max,
+			histogram_mean(&h),
+			stats.poll_waits,
+			stats.busy_poll_hits);
+}
+
+// ----- Streaming throughput -----
+typedef struct sink_args
+{
+	stcp_channel* channel;
+	long long length;
+} sink_args;
+
+static void* sink(void* user_data)
+{
+	sink_args* args = (sink_args*) user_data;
+	char* buffer = (char*) malloc(RECEIVE_BUFFER_SIZE);
+	CHECK(buffer);
+
+	long long received = 0;
+	while (received < args->length)
+	{
+		int ret = stcp_receive(args->channel, buffer, RECEIVE_BUFFER_SIZE, TIMEOUT);
+		CHECK(ret > 0);
+		received += ret;
+	}
+
+	free(buffer);
+	return NULL;
+}
+
+static void bench_throughput(const settings* s, int message_size)
+{
+	fprintf(stderr, "throughput %d...\n", message_size);
+	stcp_server* server = open_server(4);
+	stcp_channel* client;
+	stcp_channel* accepted;
+	open_pair(server, &client, &accepted);
+
+	long long messages = s->throughput_bytes / message_size;
+	sink_args args = { accepted, messages * message_size };
+
+	char* buffer = (char*) malloc(message_size);
+	CHECK(buffer);
+	memset(buffer, 't', message_size);
+
+	uint64_t start = now_nanoseconds();
+	pthread_t thread;
+	CHECK(pthread_create(&thread, NULL, sink, &args) == 0);
+	for (long long i = 0; i < messages; ++i)
+		CHECK(stcp_send(client, buffer, message_size, TIMEOUT));
+	CHECK(pthread_join(thread, NULL) == 0);
+	double seconds = seconds_since(start);
+
+	free(buffer);
+	stcp_close_channel(client);
+	stcp_close_channel(accepted);
+	stcp_close_server(server);
+
+	printf(",\n    {\"name\": \"throughput\", \"message_size\": %d, \"bytes\": %lld, \"seconds\": %.6f, "
+			"\"megabytes_per_second\": %.1f, \"messages_per_second\": %.0f}",
+			message_size,
+			args.length,
+			seconds,
+			(double) args.length / seconds / 1e6,
+			(double) messages / seconds);
+}
+
+// ----- Accept rate -----
+typedef struct connector_args
+{
+	int count;
+} connector_args;
+
+static void* connector(void* user_data)
+{
+	connector_args* args = (connector_args*) user_data;
+	for (int i = 0; i < args->count; ++i)
+	{
+		stcp_channel* channel = stcp_connect(LOOPBACK_ADDRESS, accept_port);
+		CHECK(channel);
+
+		// Wait for the server to close its end, so connections never pile up
+		char byte;
+		stcp_receive(channel, &byte, 1, TIMEOUT);
+		stcp_close_channel(channel);
+	}
+	return NULL;
+}
+
+static void bench_accept(const settings* s)
+{
+	fprintf(stderr, "accept_rate...\n");
+	stcp_server* server = stcp_open_server(LOOPBACK_ADDRESS, accept_port, 128);
+	connector_args args = { s->accept_count };
+
+	uint64_t start = now_nanoseconds();
+	pthread_t thread;
+	CHECK(pthread_create(&thread, NULL, connector, &args) == 0);
+	for (int accepted = 0; accepted < s->accept_count;)
+	{
+		stcp_channel* channels[64];
+		int n = stcp_accept_batch(server, channels, 64, TIMEOUT);
+		CHECK(n > 0);
+		for (int i = 0; i < n; ++i)
+			stcp_close_channel(channels[i]);
+
+		accepted += n;
+	}
+	CHECK(pthread_join(thread, NULL) == 0);
+	double seconds = seconds_since(start);
+	stcp_close_server(server);
+
+	printf(",\n    {\"name\": \"accept_rate\", \"connections\": %d, \"seconds\": %.6f, \"accepts_per_second\": %.0f}",
+			s->accept_count,
+			seconds,
+			(double) s->accept_count / seconds);
+}
+
+// ----- Fan-in -----
+typedef struct fan_in_args
+{
+	stcp_channel** channels;
+	int connections;
+	int messages;
+} fan_in_args;
+
+// Sends every channel's messages in turns, so they all stay busy
+static void* fan_in_clients(void* user_data)
+{
+	fan_in_args* args = (fan_in_args*) user_data;
+	char buffer[FAN_IN_MESSAGE_SIZE];
+	memset(buffer, 'f', sizeof(buffer));
+
+	for (int m = 0; m < args->messages; ++m)
+	{
+		for (int c = 0; c < args->connections; ++c)
+			CHECK(stcp_send(args->channels[c], buffer, FAN_IN_MESSAGE_SIZE, TIMEOUT));
+	}
+	return NULL;
+}
+
+static void bench_fan_in(const settings* s)
+{
+	fprintf(stderr, "fan_in...\n");
+	int connections = s->fan_in_connections;
+	stcp_server* server = open_server(connections);
+	stcp_channel** clients = (stcp_channel**) malloc(connections * sizeof(stcp_channel*));
+	stcp_channel** accepted = (stcp_channel**) malloc(connections * sizeof(stcp_channel*));
+	CHECK(clients && accepted);
+
+	stcp_event_loop* loop = stcp_open_event_loop(false);
+	CHECK(loop);
+	for (int i = 0; i < connections; ++i)
+	{
+		open_pair(server, &clients[i], &accepted[i]);
+		CHECK(stcp_event_loop_add_channel(loop, accepted[i], STCP_EVENT_READ, accepted[i]));
+	}
+
+	fan_in_args args = { clients, connections, s->fan_in_messages };
+	long long total = (long long) connections * s->fan_in_messages * FAN_IN_MESSAGE_SIZE;
+
+	uint64_t start = now_nanoseconds();
+	pthread_t thread;
+	CHECK(pthread_create(&thread, NULL, fan_in_clients, &args) == 0);
+
+	// One thread serves every connection
+	stcp_event events[256];
+	char* buffer = (char*) malloc(RECEIVE_BUFFER_SIZE);
+	CHECK(buffer);
+	long long received = 0;
+	while (received < total)
+	{
+		int n = stcp_event_loop_wait(loop, events, 256, TIMEOUT);
+		CHECK(n > 0);
+		for (int i = 0; i < n; ++i)
+		{
+			int ret = stcp_try_receive((stcp_channel*) events[i].user_data, buffer, RECEIVE_BUFFER_SIZE);
+			CHECK(ret != 0);
+			if (ret > 0)
+				received += ret;
+		}
+	}
+
+	CHECK(pthread_join(thread, NULL) == 0);
+	double seconds = seconds_since(start);
+
+	free(buffer);
+	for (int i = 0; i < connections; ++i)
+	{
+		stcp_event_loop_remove_channel(loop, accepted[i]);
+		stcp_close_channel(clients[i]);
+		stcp_close_channel(accepted[i]);
+	}
+	stcp_close_event_loop(loop);
+	free(clients);
+	free(accepted);
+	stcp_close_server(server);
+
+	printf(",\n    {\"name\": \"fan_in\", \"connections\": %d, \"message_size\": %d, \"messages\": %lld, "
+			"\"seconds\": %.6f, \"messages_per_second\": %.0f, \"megabytes_per_second\": %.1f}",
+			connections,
+			FAN_IN_MESSAGE_SIZE,
+			(long long) connections * s->fan_in_messages,
+			seconds,
+			(double) connections * s->fan_in_messages / seconds,
+			(double) total / seconds / 1e6);
+}
+
+int main(int argc, char** argv)
+{
+	settings s = { false, 100000, 1024LL * 1024 * 1024, 5000, 256, 2000 };
+	if (argc > 1 && strcmp(argv[1], "--quick") == 0)
+	{
+		settings quick = { true, 2000, 16LL * 1024 * 1024, 200, 32, 100 };
+		s = quick;
+	}
+	else if (argc > 1)
+	{
+		fprintf(stderr, "usage: %s [--quick]\n", argv[0]);
+		return 1;
+	}
+
+	snprintf(port, sizeof(port), "%d", 20000 + getpid() % 20000);
+	snprintf(accept_port, sizeof(accept_port), "%d", 40000 + getpid() % 20000);
+	snprintf(local_address, sizeof(local_address), "unix:/tmp/stcp-bench-%d.sock", (int) getpid());
+	stcp_set_error_callback(report_error, NULL);
+	CHECK(stcp_initialize());
+
+	printf("{\n  \"quick\": %s,\n  \"benchmarks\": [", s.quick ? "true" : "false");
+	bench_ping_pong(&s, true, "ping_pong", 0, false);
+	bench_ping_pong(&s, false, "ping_pong_busy_poll", 50, false);
+
+	// Same-host traffic without the TCP stack
+	address = local_address;
+	bench_ping_pong(&s, false, "ping_pong_unix", 0, false);
+	address = LOOPBACK_ADDRESS;
+#ifdef __linux__
+	bench_ping_pong(&s, false, "ping_pong_shared", 0, true);
+#endif
+
+	for (int i = 0; i < THROUGHPUT_SIZE_COUNT; ++i)
+		bench_throughput(&s, THROUGHPUT_SIZES[i]);
+	bench_accept(&s);
+	bench_fan_in(&s);
+	printf("\n  ]\n}\n");
+
+	stcp_terminate();
+	return 0;
+}
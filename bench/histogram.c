@@ -0,0 +1,85 @@
+// histogram.c
+#include "histogram.h"
+
+#include <string.h>
+
+// Index of the highest set bit
+static int magnitude(uint64_t value)
+{
+	int bit = 0;
+	while (value >>= 1)
+		++bit;
+	return bit;
+}
+
+static int bucket_index(uint64_t value)
+{
+	if (value < HISTOGRAM_SUB_BUCKETS)
+		return (int) value;
+
+	// value >> shift lands in the upper half of the sub-buckets
+	int shift = magnitude(value) - 6;
+	return HISTOGRAM_SUB_BUCKETS + (shift - 1) * HISTOGRAM_HALF_BUCKETS
+			+ (int) (value >> shift) - HISTOGRAM_HALF_BUCKETS;
+}
+
+// Highest value counted in a bucket
+static uint64_t bucket_value(int index)
+{
+	if (index < HISTOGRAM_SUB_BUCKETS)
+		return (uint64_t) index;
+
+	int shift = (index - HISTOGRAM_SUB_BUCKETS) / HISTOGRAM_HALF_BUCKETS + 1;
+	uint64_t sub_bucket = (uint64_t) ((index - HISTOGRAM_SUB_BUCKETS) % HISTOGRAM_HALF_BUCKETS + HISTOGRAM_HALF_BUCKETS);
+	return ((sub_bucket + 1) << shift) - 1;
+}
+
+void histogram_reset(histogram* h)
+{
+	memset(h, 0, sizeof(histogram));
+	h->min = UINT64_MAX;
+}
+
+void histogram_record(histogram* h, uint64_t value)
+{
+	const uint64_t max_value = ((uint64_t) 1 << HISTOGRAM_MAX_BITS) - 1;
+	if (value > max_value)
+		value = max_value;
+
+	++h->counts[bucket_index(value)];
+	++h->count;
+	h->sum += (double) value;
+	if (value < h->min)
+		h->min = value;
+	if (value > h->max)
+		h->max = value;
+}
+
+uint64_t histogram_percentile(const histogram* h, double fraction)
+{
+	if (h->count == 0)
+		return 0;
+
+	uint64_t target = (uint64_t) (fraction * (double) h->count + 0.5);
+	if (target < 1)
+		target = 1;
+
+	uint64_t seen = 0;
+	for (int i = 0; i < HISTOGRAM_BUCKETS; ++i)
+	{
+		seen += h->counts[i];
+		if (seen >= target)
+		{
+			// A bucket's upper edge can overshoot what was actually recorded
+			uint64_t value = bucket_value(i);
+			return value < h->max ? value : h->max;
+		}
+	}
+
+	return h->max;
+}
+
+double histogram_mean(const histogram* h)
+{
+	return h->count ? h->sum / (double) h->count : 0.0;
+}
@@ -0,0 +1,44 @@
+// histogram.h
+#ifndef BENCH_HISTOGRAM_H_
+#define BENCH_HISTOGRAM_H_
+
+/*
+ * Log-linear latency histogram in the style of HdrHistogram.
+ *
+ * Each power of two is split into 64 linear buckets, so any recorded
+ * value is reported within 1.6% of itself, from 1 ns up to 2^40 ns,
+ * in a fixed 18 KiB of counts. Recording is a couple of shifts and
+ * an increment, cheap enough to sit inside a timed loop.
+ */
+
+#include <stdint.h>
+
+// Values below this are counted exactly
+#define HISTOGRAM_SUB_BUCKETS 128
+#define HISTOGRAM_HALF_BUCKETS (HISTOGRAM_SUB_BUCKETS / 2)
+
+// Largest recordable value is 2^HISTOGRAM_MAX_BITS - 1
+#define HISTOGRAM_MAX_BITS 40
+#define HISTOGRAM_BUCKETS (HISTOGRAM_SUB_BUCKETS + (HISTOGRAM_MAX_BITS - 7) * HISTOGRAM_HALF_BUCKETS)
+
+typedef struct histogram
+{
+	uint64_t counts[HISTOGRAM_BUCKETS];
+	uint64_t count;
+	uint64_t min;
+	uint64_t max;
+	double sum;
+} histogram;
+
+void histogram_reset(histogram* h);
+
+// Counts one value, clamped to the recordable range
+void histogram_record(histogram* h, uint64_t value);
+
+// The value at or below which the given fraction (0 to 1) of recorded values fall,
+// reported as the highest value its bucket holds
+uint64_t histogram_percentile(const histogram* h, double fraction);
+
+double histogram_mean(const histogram* h);
+
+#endif /* BENCH_HISTOGRAM_H_ */
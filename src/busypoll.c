@@ -0,0 +1,111 @@
+// busypoll.c
+#include "stcp.h"
+
+#include <assert.h>
+
+#include "internal.h"
+
+/*
+ * Adaptive busy polling.
+ *
+ * stcp_receive() spins on non-blocking reads for up to a budget
+ * before sleeping in poll(). The budget follows how long receives
+ * actually wait for data, the way KVM sizes its halt polling: a
+ * message that arrives soon after the spin gave up doubles the
+ * budget, one that arrives after the channel's limit halves it, and
+ * a spin that finds data leaves it alone.
+ */
+
+// Smallest spin worth making, and where the budget starts growing from
+#define STCP_BUSY_POLL_MIN_MICROSECONDS 10
+
+struct stcp_busy_poll
+{
+	// microseconds
+	int max_spin;
+	int budget;
+};
+
+void stcp_set_busy_poll(stcp_channel* channel, int max_spin_microseconds)
+{
+	assert(channel);
+	assert(max_spin_microseconds >= 0);
+
+	if (max_spin_microseconds == 0)
+	{
+		if (channel->busy_poll)
+			stcp_busy_poll_close(channel);
+
+		return;
+	}
+
+	if (!channel->busy_poll)
+	{
+		channel->busy_poll = MALLOC(stcp_busy_poll);
+		channel->busy_poll->budget = STCP_BUSY_POLL_MIN_MICROSECONDS;
+	}
+
+	channel->busy_poll->max_spin = max_spin_microseconds;
+	if (channel->busy_poll->budget > max_spin_microseconds)
+		channel->busy_poll->budget = max_spin_microseconds;
+}
+
+int stcp_get_busy_poll_budget(const stcp_channel* channel)
+{
+	assert(channel);
+	return channel->busy_poll ? channel->busy_poll->budget : 0;
+}
+
+int stcp_busy_poll_read(stcp_channel* channel, char* buffer, int n, long long started, int timeout_milliseconds)
+{
+	long long budget = channel->busy_poll->budget;
+	if (timeout_milliseconds >= 0 && budget > (long long) timeout_milliseconds * 1000)
+		budget = (long long) timeout_milliseconds * 1000;
+
+	if (budget == 0)
+		return STCP_SOCKET_WOULD_BLOCK;
+
+	long long now = started;
+	int ret;
+	do
+	{
+		ret = stcp_channel_read(channel, buffer, n);
+		now = stcp_clock_microseconds();
+	} while (ret == STCP_SOCKET_WOULD_BLOCK && now - started < budget);
+
+	stcp_count(channel, STCP_COUNT_BUSY_POLL_MICROSECONDS, (unsigned long long) (now - started));
+	stcp_count(channel, ret == STCP_SOCKET_WOULD_BLOCK ? STCP_COUNT_BUSY_POLL_MISSES : STCP_COUNT_BUSY_POLL_HITS, 1);
+	return ret;
+}
+
+void stcp_busy_poll_record(stcp_channel* channel, long long started)
+{
+	stcp_busy_poll* busy_poll = channel->busy_poll;
+	long long waited = stcp_clock_microseconds() - started;
+
+	// Spinning already covers it
+	if (waited <= busy_poll->budget)
+		return;
+
+	if (waited <= busy_poll->max_spin)
+	{
+		long long budget = busy_poll->budget < STCP_BUSY_POLL_MIN_MICROSECONDS
+				? STCP_BUSY_POLL_MIN_MICROSECONDS
+				: (long long) busy_poll->budget * 2;
+
+		busy_poll->budget = budget < busy_poll->max_spin ? (int) budget : busy_poll->max_spin;
+	}
+	else
+	{
+		// Spinning wouldn't have caught it, so spin less
+		busy_poll->budget /= 2;
+		if (busy_poll->budget < STCP_BUSY_POLL_MIN_MICROSECONDS)
+			busy_poll->budget = 0;
+	}
+}
+
+void stcp_busy_poll_close(stcp_channel* channel)
+{
+	stcp_free(channel->busy_poll);
+	channel->busy_poll = NULL;
+}
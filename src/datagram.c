@@ -0,0 +1,172 @@
+// datagram.c
+#include "stcp.h"
+
+#include <assert.h>
+
+#include "internal.h"
+
+/*
+ * UDP sockets that move datagrams in batches.
+ *
+ * Each call hands the kernel as many messages as one sendmmsg or
+ * recvmmsg takes, and consecutive datagrams of the same size going
+ * to the same address are merged into a single UDP GSO send, which
+ * the kernel splits back up after the stack has been walked once.
+ * Addresses are resolved through the same cache as channels.
+ */
+
+struct stcp_datagram
+{
+	socket_t socket;
+
+	// whether the kernel takes segmented sends
+	bool segment;
+};
+
+// private function to create the socket for a new datagram
+static stcp_datagram* create_datagram(const stcp_address* address)
+{
+	stcp_datagram* datagram = MALLOC(stcp_datagram);
+	datagram->socket = stcp_socket_create(address, STCP_SOCKET_DATAGRAM);
+	datagram->segment = stcp_socket_can_segment(&datagram->socket);
+	return datagram;
+}
+
+stcp_datagram* stcp_open_datagram(const char* address, const char* protocol)
+{
+	assert(address);
+	assert(protocol);
+
+	stcp_address* resolved = stcp_socket_resolve(address, protocol);
+	if (!resolved)
+		return NULL;
+
+	stcp_datagram* datagram = create_datagram(resolved);
+	bool bound = stcp_socket_bind(&datagram->socket, resolved);
+	stcp_socket_free_address(resolved);
+	if (!bound)
+	{
+		stcp_close_datagram(datagram);
+		return NULL;
+	}
+
+	return datagram;
+}
+
+stcp_datagram* stcp_connect_datagram(const char* address, const char* protocol)
+{
+	assert(address);
+	assert(protocol);
+
+	stcp_address* resolved = stcp_socket_resolve(address, protocol);
+	if (!resolved)
+		return NULL;
+
+	stcp_datagram* datagram = create_datagram(resolved);
+	bool connected = stcp_socket_connect_address(&datagram->socket, resolved);
+	stcp_socket_free_address(resolved);
+	if (!connected)
+	{
+		stcp_close_datagram(datagram);
+		return NULL;
+	}
+
+	return datagram;
+}
+
+void stcp_set_message_address(stcp_message* message, const stcp_address* address)
+{
+	assert(message);
+	assert(address);
+
+	stcp_socket_first_address(address, &message->address);
+}
+
+int stcp_send_datagrams(stcp_datagram* datagram,
+		const stcp_message* messages,
+		int count,
+		int timeout_milliseconds)
+{
+	assert(datagram);
+	assert(messages);
+	assert(count > 0);
+
+	long long deadline = stcp_make_deadline(timeout_milliseconds);
+	int sent = 0;
+	while (sent < count)
+	{
+		int ret = stcp_socket_send_datagrams(&datagram->socket, messages + sent, count - sent, &datagram->segment);
+		stcp_count(NULL, STCP_COUNT_SEND_CALLS, 1);
+		if (ret == STCP_SOCKET_WOULD_BLOCK)
+		{
+			int remaining = stcp_remaining_milliseconds(deadline);
+			if (remaining == 0)
+			{
+				stcp_count(NULL, STCP_COUNT_TIMEOUTS, 1);
+				stcp_raise_error(STCP_ETIMEDOUT);
+				break;
+			}
+
+			if (!stcp_socket_poll_write(&datagram->socket, remaining))
+				break;
+
+			continue;
+		}
+
+		if (ret == 0)
+			break;
+
+		unsigned long long bytes_sent = 0;
+		for (int i = sent; i < sent + ret; ++i)
+			bytes_sent += (unsigned long long) messages[i].length;
+
+		stcp_count(NULL, STCP_COUNT_BYTES_SENT, bytes_sent);
+		sent += ret;
+	}
+
+	return sent;
+}
+
+int stcp_receive_datagrams(stcp_datagram* datagram,
+		stcp_message* messages,
+		int count,
+		int timeout_milliseconds)
+{
+	assert(datagram);
+	assert(messages);
+	assert(count > 0);
+
+	// Reading first saves the poll whenever datagrams are already queued
+	int received = stcp_socket_receive_datagrams(&datagram->socket, messages, count);
+	stcp_count(NULL, STCP_COUNT_RECEIVE_CALLS, 1);
+	if (received == STCP_SOCKET_WOULD_BLOCK)
+	{
+		if (timeout_milliseconds == 0 || !stcp_socket_poll_read(&datagram->socket, timeout_milliseconds))
+			return 0;
+
+		received = stcp_socket_receive_datagrams(&datagram->socket, messages, count);
+		stcp_count(NULL, STCP_COUNT_RECEIVE_CALLS, 1);
+		if (received == STCP_SOCKET_WOULD_BLOCK)
+		{
+			// The poll can report a datagram that is gone by the time it's read
+			stcp_raise_error(STCP_EWOULDBLOCK);
+			return 0;
+		}
+	}
+
+	unsigned long long bytes_received = 0;
+	for (int i = 0; i < received; ++i)
+		bytes_received += (unsigned long long) messages[i].length;
+
+	stcp_count(NULL, STCP_COUNT_BYTES_RECEIVED, bytes_received);
+	return received;
+}
+
+void stcp_close_datagram(stcp_datagram* datagram)
+{
+	if (datagram)
+	{
+		stcp_socket_close(&datagram->socket);
+		stcp_free(datagram);
+	}
+}
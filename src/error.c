@@ -5,18 +5,84 @@
 #include <winsock2.h>
 #endif
 
+#include <assert.h>
+#include <stdatomic.h>
 #include <stddef.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <errno.h>
 
-static stcp_error_callback_fn _error_callback = NULL;
-static void* _user_data = NULL;
+#include "native/native.h"
+#include "internal.h"
+
+#ifdef STCP_TLS
+#include <openssl/err.h>
+#include <openssl/ssl.h>
+#endif
+
+// Each callback and user data pair set so far. Slots are filled once and never
+// rewritten, so a thread still reading the previous pair always sees a whole one
+#define STCP_ERROR_HANDLERS 16
+
+static stcp_error_handler _error_handlers[STCP_ERROR_HANDLERS];
+static int _error_handler_count = 0;
+static stcp_mutex _error_handler_lock = STCP_MUTEX_INIT;
+
+// Shared by every thread, and read without locks
+static _Atomic(const stcp_error_handler*) _error_handler = NULL;
+
+// The last error raised on each thread
+static STCP_THREAD_LOCAL stcp_error _thread_error = STCP_NO_ERROR;
+
+// Set while a channel with its own callback is in use
+static STCP_THREAD_LOCAL const stcp_error_handler* _thread_handler = NULL;
 
 void stcp_set_error_callback(stcp_error_callback_fn error_callback, void* user_data)
 {
-	_error_callback = error_callback;
-	_user_data = user_data;
+	if (!error_callback)
+	{
+		atomic_store_explicit(&_error_handler, NULL, memory_order_release);
+		return;
+	}
+
+	STCP_LOCK(&_error_handler_lock);
+	const stcp_error_handler* handler = NULL;
+	for (int i = 0; i < _error_handler_count && !handler; ++i)
+	{
+		if (_error_handlers[i].callback == error_callback && _error_handlers[i].user_data == user_data)
+			handler = &_error_handlers[i];
+	}
+
+	if (!handler)
+	{
+		assert(_error_handler_count < STCP_ERROR_HANDLERS && "too many distinct error callbacks");
+		stcp_error_handler* slot = &_error_handlers[_error_handler_count++];
+		slot->callback = error_callback;
+		slot->user_data = user_data;
+		handler = slot;
+	}
+
+	// The release pairs the slot's contents with the pointer readers load
+	atomic_store_explicit(&_error_handler, handler, memory_order_release);
+	STCP_UNLOCK(&_error_handler_lock);
+}
+
+stcp_error stcp_get_thread_error()
+{
+	return _thread_error;
+}
+
+void stcp_clear_thread_error()
+{
+	_thread_error = STCP_NO_ERROR;
+}
+
+const stcp_error_handler* stcp_swap_error_handler(const stcp_error_handler* handler)
+{
+	const stcp_error_handler* previous = _thread_handler;
+	_thread_handler = handler;
+	return previous;
 }
 
 stcp_error stcp_get_last_error()
@@ -30,8 +96,39 @@ stcp_error stcp_get_last_error()
 
 void stcp_raise_error(stcp_error err)
 {
-	if (_error_callback)
-		_error_callback(err, _user_data);
+	_thread_error = err;
+
+	const stcp_error_handler* handler = _thread_handler;
+	if (handler)
+	{
+		handler->callback(err, handler->user_data);
+		return;
+	}
+
+	handler = atomic_load_explicit(&_error_handler, memory_order_acquire);
+	if (handler)
+		handler->callback(err, handler->user_data);
+}
+
+void stcp_raise_ssl_error(int err)
+{
+#ifdef STCP_TLS
+	if (err == SSL_ERROR_SYSCALL)
+	{
+		// The socket failed underneath, or the peer vanished without a close_notify
+		stcp_error last_error = stcp_get_last_error();
+		stcp_raise_error(last_error != STCP_NO_ERROR ? last_error : STCP_ECONNRESET);
+	}
+	else
+	{
+		stcp_raise_error(STCP_ETLS);
+	}
+
+	ERR_clear_error();
+#else
+	(void) err;
+	stcp_raise_error(STCP_ETLS);
+#endif
 }
 
 const char* stcp_error_to_string(stcp_error err)
@@ -126,6 +223,8 @@ const char* stcp_error_to_string(stcp_error err)
 		return "ESTALE";
 	case STCP_EREMOTE:
 		return "EREMOTE";
+	case STCP_ETLS:
+		return "TLS failure";
 	default:
 		return "Unknown STCP error";
 	}
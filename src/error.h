@@ -104,19 +104,33 @@ typedef enum stcp_error
 	STCP_ESTALE		              = ESTALE,
 	STCP_EREMOTE		          = EREMOTE,
 #endif
+
+	// Failures inside the TLS library, such as a bad certificate or record
+	STCP_ETLS                     = 0x10000,
 } stcp_error;
 
 // Function pointer to void (stcp_error e, void* user_data)
 typedef void (*stcp_error_callback_fn)(stcp_error, void*);
 
-// Sets the error callback and optional user data pointer
+// Sets the error callback and optional user data pointer, shared by every thread.
+// Other threads see either the old pair or the new one, never a mix, and can still
+// be calling the old callback after this returns. A process can set at most 16
+// distinct pairs. Channels can override it with stcp_set_channel_error_callback()
 void stcp_set_error_callback(stcp_error_callback_fn error_callback, void* user_data);
 
 // Grabs the last network error
 stcp_error stcp_get_last_error();
 
+// The last error raised on the calling thread, or STCP_NO_ERROR. Never changed by other threads
+stcp_error stcp_get_thread_error();
+
+// Resets the calling thread's error to STCP_NO_ERROR
+void stcp_clear_thread_error();
+
 // Forwards an error to the error callback
 void stcp_raise_error(stcp_error err);
+
+// Forwards an OpenSSL SSL_get_error() result as an error, and clears OpenSSL's error queue
 void stcp_raise_ssl_error(int err);
 
 // Convert an error to a human readable string
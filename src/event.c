@@ -0,0 +1,457 @@
+// event.c
+#include "stcp.h"
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "internal.h"
+#include "native/native.h"
+
+#ifdef __linux__
+#include <sys/epoll.h>
+#endif
+
+typedef struct pollfd pollfd;
+
+// Larger polls allocate their descriptor set on the heap
+#define STCP_POLL_STACK_SIZE 64
+
+static short to_poll_events(int events)
+{
+	short native_events = 0;
+	if (events & STCP_EVENT_READ)
+		native_events |= POLLIN;
+	if (events & STCP_EVENT_WRITE)
+		native_events |= POLLOUT;
+
+	return native_events;
+}
+
+static int from_poll_events(short native_events)
+{
+	int events = 0;
+	if (native_events & POLLIN)
+		events |= STCP_EVENT_READ;
+	if (native_events & POLLOUT)
+		events |= STCP_EVENT_WRITE;
+	if (native_events & POLLHUP)
+		events |= STCP_EVENT_HANGUP;
+	if (native_events & (POLLERR | POLLNVAL))
+		events |= STCP_EVENT_ERROR;
+
+	return events;
+}
+
+#ifdef __linux__
+// ----- epoll backend -----
+typedef struct epoll_event epoll_event;
+
+struct stcp_event_loop
+{
+	int epoll;
+	bool edge_triggered;
+
+	// scratch space for epoll_wait, grown to the largest max_events seen
+	epoll_event* ready;
+	int ready_capacity;
+};
+
+static unsigned int to_native_events(const stcp_event_loop* loop, int events)
+{
+	unsigned int native_events = EPOLLRDHUP;
+	if (events & STCP_EVENT_READ)
+		native_events |= EPOLLIN;
+	if (events & STCP_EVENT_WRITE)
+		native_events |= EPOLLOUT;
+	if (loop->edge_triggered)
+		native_events |= EPOLLET;
+
+	return native_events;
+}
+
+static int from_native_events(unsigned int native_events)
+{
+	int events = 0;
+	if (native_events & EPOLLIN)
+		events |= STCP_EVENT_READ;
+	if (native_events & EPOLLOUT)
+		events |= STCP_EVENT_WRITE;
+	if (native_events & (EPOLLHUP | EPOLLRDHUP))
+		events |= STCP_EVENT_HANGUP;
+	if (native_events & EPOLLERR)
+		events |= STCP_EVENT_ERROR;
+
+	return events;
+}
+
+stcp_event_loop* stcp_open_event_loop(bool edge_triggered)
+{
+	stcp_event_loop* loop = MALLOC(stcp_event_loop);
+
+	loop->epoll = epoll_create1(EPOLL_CLOEXEC);
+	if (loop->epoll == -1)
+	{
+		stcp_raise_error(stcp_get_last_error());
+		stcp_free(loop);
+		return NULL;
+	}
+
+	loop->edge_triggered = edge_triggered;
+	loop->ready = NULL;
+	loop->ready_capacity = 0;
+	return loop;
+}
+
+static bool control(stcp_event_loop* loop, int op, socket_t s, int events, void* user_data)
+{
+	assert(loop);
+
+	epoll_event event;
+	memset(&event, 0, sizeof(epoll_event));
+	event.events = to_native_events(loop, events);
+	event.data.ptr = user_data;
+
+	if (0 != epoll_ctl(loop->epoll, op, (int) s, &event))
+	{
+		stcp_raise_error(stcp_get_last_error());
+		return false;
+	}
+
+	return true;
+}
+
+static bool add_socket(stcp_event_loop* loop, socket_t s, int events, void* user_data)
+{
+	return control(loop, EPOLL_CTL_ADD, s, events, user_data);
+}
+
+static bool modify_socket(stcp_event_loop* loop, socket_t s, int events, void* user_data)
+{
+	return control(loop, EPOLL_CTL_MOD, s, events, user_data);
+}
+
+static bool remove_socket(stcp_event_loop* loop, socket_t s)
+{
+	return control(loop, EPOLL_CTL_DEL, s, 0, NULL);
+}
+
+int stcp_event_loop_wait(stcp_event_loop* loop,
+		stcp_event* events,
+		int max_events,
+		int timeout_milliseconds)
+{
+	assert(loop);
+	assert(events);
+	assert(max_events > 0);
+
+	if (max_events > loop->ready_capacity)
+	{
+		stcp_free(loop->ready);
+		loop->ready = (epoll_event*) stcp_malloc(max_events * sizeof(epoll_event));
+		loop->ready_capacity = max_events;
+	}
+
+	int ready = epoll_wait(loop->epoll,
+			loop->ready,
+			max_events,
+			timeout_milliseconds < 0 ? -1 : timeout_milliseconds);
+
+	if (ready == -1)
+	{
+		// A signal interrupting the wait is treated as a timeout
+		if (stcp_get_last_error() != STCP_EINTR)
+			stcp_raise_error(stcp_get_last_error());
+
+		return 0;
+	}
+
+	for (int i = 0; i < ready; ++i)
+	{
+		events[i].events = from_native_events(loop->ready[i].events);
+		events[i].user_data = loop->ready[i].data.ptr;
+	}
+
+	return ready;
+}
+
+void stcp_close_event_loop(stcp_event_loop* loop)
+{
+	if (loop)
+	{
+		close(loop->epoll);
+		stcp_free(loop->ready);
+		stcp_free(loop);
+	}
+}
+
+#else
+// ----- poll backend -----
+struct stcp_event_loop
+{
+	pollfd* sockets;
+	void** user_data;
+	int count;
+	int capacity;
+
+	// rotates the scan so a small max_events can't starve later sockets
+	int next;
+};
+
+static int find_socket(const stcp_event_loop* loop, socket_t s)
+{
+	for (int i = 0; i < loop->count; ++i)
+	{
+		if (loop->sockets[i].fd == s)
+			return i;
+	}
+
+	return -1;
+}
+
+stcp_event_loop* stcp_open_event_loop(bool edge_triggered)
+{
+	if (edge_triggered)
+	{
+		stcp_raise_error(STCP_EOPNOTSUPP);
+		return NULL;
+	}
+
+	stcp_event_loop* loop = MALLOC(stcp_event_loop);
+
+	loop->sockets = NULL;
+	loop->user_data = NULL;
+	loop->count = 0;
+	loop->capacity = 0;
+	loop->next = 0;
+	return loop;
+}
+
+static bool add_socket(stcp_event_loop* loop, socket_t s, int events, void* user_data)
+{
+	assert(loop);
+
+	if (find_socket(loop, s) != -1)
+	{
+		stcp_raise_error(STCP_EINVAL);
+		return false;
+	}
+
+	if (loop->count == loop->capacity)
+	{
+		int capacity = loop->capacity ? loop->capacity * 2 : 16;
+		loop->sockets = (pollfd*) stcp_realloc(loop->sockets,
+				loop->capacity * sizeof(pollfd),
+				capacity * sizeof(pollfd));
+		loop->user_data = (void**) stcp_realloc(loop->user_data,
+				loop->capacity * sizeof(void*),
+				capacity * sizeof(void*));
+		loop->capacity = capacity;
+	}
+
+	loop->sockets[loop->count].fd = s;
+	loop->sockets[loop->count].events = to_poll_events(events);
+	loop->sockets[loop->count].revents = 0;
+	loop->user_data[loop->count] = user_data;
+	++loop->count;
+	return true;
+}
+
+static bool modify_socket(stcp_event_loop* loop, socket_t s, int events, void* user_data)
+{
+	assert(loop);
+
+	int i = find_socket(loop, s);
+	if (i == -1)
+	{
+		stcp_raise_error(STCP_EINVAL);
+		return false;
+	}
+
+	loop->sockets[i].events = to_poll_events(events);
+	loop->user_data[i] = user_data;
+	return true;
+}
+
+static bool remove_socket(stcp_event_loop* loop, socket_t s)
+{
+	assert(loop);
+
+	int i = find_socket(loop, s);
+	if (i == -1)
+	{
+		stcp_raise_error(STCP_EINVAL);
+		return false;
+	}
+
+	--loop->count;
+	loop->sockets[i] = loop->sockets[loop->count];
+	loop->user_data[i] = loop->user_data[loop->count];
+	return true;
+}
+
+int stcp_event_loop_wait(stcp_event_loop* loop,
+		stcp_event* events,
+		int max_events,
+		int timeout_milliseconds)
+{
+	assert(loop);
+	assert(events);
+	assert(max_events > 0);
+
+	if (loop->count == 0)
+		return 0;
+
+	int ready = STCP_POLL(loop->sockets,
+			loop->count,
+			timeout_milliseconds < 0 ? -1 : timeout_milliseconds);
+
+	if (ready == -1)
+	{
+		if (stcp_get_last_error() != STCP_EINTR)
+			stcp_raise_error(stcp_get_last_error());
+
+		return 0;
+	}
+
+	int n = 0;
+	for (int scanned = 0; scanned < loop->count && n < ready && n < max_events; ++scanned)
+	{
+		int i = (loop->next + scanned) % loop->count;
+		if (loop->sockets[i].revents)
+		{
+			events[n].events = from_poll_events(loop->sockets[i].revents);
+			events[n].user_data = loop->user_data[i];
+			++n;
+		}
+	}
+
+	loop->next = (loop->next + 1) % loop->count;
+	return n;
+}
+
+void stcp_close_event_loop(stcp_event_loop* loop)
+{
+	if (loop)
+	{
+		stcp_free(loop->sockets);
+		stcp_free(loop->user_data);
+		stcp_free(loop);
+	}
+}
+#endif
+
+// ----- Registration -----
+bool stcp_event_loop_add_channel(stcp_event_loop* loop,
+		stcp_channel* channel,
+		int events,
+		void* user_data)
+{
+	assert(channel);
+	return add_socket(loop, channel->socket, events, user_data);
+}
+
+bool stcp_event_loop_add_server(stcp_event_loop* loop,
+		stcp_server* server,
+		int events,
+		void* user_data)
+{
+	assert(server);
+	return add_socket(loop, server->socket, events, user_data);
+}
+
+bool stcp_event_loop_modify_channel(stcp_event_loop* loop,
+		stcp_channel* channel,
+		int events,
+		void* user_data)
+{
+	assert(channel);
+	return modify_socket(loop, channel->socket, events, user_data);
+}
+
+bool stcp_event_loop_modify_server(stcp_event_loop* loop,
+		stcp_server* server,
+		int events,
+		void* user_data)
+{
+	assert(server);
+	return modify_socket(loop, server->socket, events, user_data);
+}
+
+bool stcp_event_loop_remove_channel(stcp_event_loop* loop, stcp_channel* channel)
+{
+	assert(channel);
+	return remove_socket(loop, channel->socket);
+}
+
+bool stcp_event_loop_remove_server(stcp_event_loop* loop, stcp_server* server)
+{
+	assert(server);
+	return remove_socket(loop, server->socket);
+}
+
+// ----- Polling -----
+int stcp_poll(stcp_poll_entry* entries, int n, int timeout_milliseconds)
+{
+	assert(entries);
+	assert(n > 0);
+
+	pollfd stack_set[STCP_POLL_STACK_SIZE];
+	pollfd* socket_set = stack_set;
+	if (n > STCP_POLL_STACK_SIZE)
+	{
+		socket_set = (pollfd*) stcp_malloc(n * sizeof(pollfd));
+	}
+
+	// Data already read off the socket never makes it readable again
+	bool buffered = false;
+	for (int i = 0; i < n; ++i)
+	{
+		assert((entries[i].channel != NULL) != (entries[i].server != NULL));
+		socket_set[i].fd = entries[i].channel ? entries[i].channel->socket : entries[i].server->socket;
+		socket_set[i].events = to_poll_events(entries[i].events);
+		socket_set[i].revents = 0;
+
+		if (entries[i].channel && (entries[i].events & STCP_EVENT_READ)
+				&& stcp_has_buffered_read(entries[i].channel))
+		{
+			buffered = true;
+		}
+	}
+
+	if (buffered)
+		timeout_milliseconds = 0;
+
+	int ready = STCP_POLL(socket_set, n, timeout_milliseconds < 0 ? -1 : timeout_milliseconds);
+	if (ready == -1)
+	{
+		if (stcp_get_last_error() != STCP_EINTR)
+			stcp_raise_error(stcp_get_last_error());
+
+		ready = 0;
+	}
+
+	for (int i = 0; i < n; ++i)
+		entries[i].revents = from_poll_events(socket_set[i].revents);
+
+	if (buffered)
+	{
+		ready = 0;
+		for (int i = 0; i < n; ++i)
+		{
+			if (entries[i].channel && (entries[i].events & STCP_EVENT_READ)
+					&& stcp_has_buffered_read(entries[i].channel))
+			{
+				entries[i].revents |= STCP_EVENT_READ;
+			}
+
+			if (entries[i].revents)
+				++ready;
+		}
+	}
+
+	if (socket_set != stack_set)
+		stcp_free(socket_set);
+
+	return ready;
+}
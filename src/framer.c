@@ -0,0 +1,347 @@
+// framer.c
+#include "stcp.h"
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "internal.h"
+
+/*
+ * Message framing over a channel's receive ring.
+ *
+ * Frames are parsed straight out of the ring and handed to the
+ * callback in place; a frame that has only partly arrived stays in
+ * the ring until the rest of it does. Frame writes put the headers
+ * and payloads of a whole batch into one scatter/gather send.
+ */
+
+// Longest varint needed for an int
+#define STCP_VARINT_MAX 5
+
+// Frames encoded per stcp_sendv() call, each taking a header and a payload buffer
+#define STCP_FRAME_BATCH (STCP_IOV_MAX / 2)
+
+typedef enum stcp_framing
+{
+	STCP_FRAMING_LENGTH,
+	STCP_FRAMING_VARINT,
+	STCP_FRAMING_DELIMITER
+} stcp_framing;
+
+struct stcp_framer
+{
+	stcp_channel* channel;
+	stcp_framing framing;
+	int max_frame_size;
+
+	// width of a fixed length prefix
+	int prefix_width;
+
+	char* delimiter;
+	int delimiter_length;
+
+	// bytes of the current frame already searched for the delimiter
+	int scanned;
+
+	// the receive callback, during stcp_receive_frames()
+	frame_output_fn frame_output;
+	void* user_data;
+};
+
+static stcp_framer* open_framer(stcp_channel* channel, stcp_framing framing, int max_frame_size, int header_size)
+{
+	assert(channel);
+	assert(max_frame_size > 0);
+
+	// The ring must hold the largest frame in one piece
+	int ring_size = max_frame_size + header_size;
+	if (stcp_get_receive_buffer_size(channel) < ring_size
+			&& !stcp_set_receive_buffer(channel, ring_size))
+		return NULL;
+
+	stcp_framer* framer = MALLOC(stcp_framer);
+	memset(framer, 0, sizeof(stcp_framer));
+	framer->channel = channel;
+	framer->framing = framing;
+	framer->max_frame_size = max_frame_size;
+	return framer;
+}
+
+stcp_framer* stcp_open_length_framer(stcp_channel* channel, int prefix_width, int max_frame_size)
+{
+	assert(prefix_width == 1 || prefix_width == 2 || prefix_width == 4);
+
+	// A narrow prefix would wrap around and corrupt the stream
+	if (prefix_width < 4 && max_frame_size >= 1 << (8 * prefix_width))
+	{
+		stcp_raise_error(STCP_EINVAL);
+		return NULL;
+	}
+
+	stcp_framer* framer = open_framer(channel, STCP_FRAMING_LENGTH, max_frame_size, prefix_width);
+	if (framer)
+		framer->prefix_width = prefix_width;
+
+	return framer;
+}
+
+stcp_framer* stcp_open_varint_framer(stcp_channel* channel, int max_frame_size)
+{
+	return open_framer(channel, STCP_FRAMING_VARINT, max_frame_size, STCP_VARINT_MAX);
+}
+
+stcp_framer* stcp_open_delimiter_framer(stcp_channel* channel,
+		const char* delimiter,
+		int delimiter_length,
+		int max_frame_size)
+{
+	assert(delimiter);
+	assert(delimiter_length > 0);
+
+	stcp_framer* framer = open_framer(channel, STCP_FRAMING_DELIMITER, max_frame_size, delimiter_length);
+	if (framer)
+	{
+		framer->delimiter = (char*) stcp_malloc(delimiter_length);
+		memcpy(framer->delimiter, delimiter, delimiter_length);
+		framer->delimiter_length = delimiter_length;
+	}
+
+	return framer;
+}
+
+void stcp_close_framer(stcp_framer* framer)
+{
+	if (framer)
+	{
+		stcp_free(framer->delimiter);
+		stcp_free(framer);
+	}
+}
+
+// ----- Decoding -----
+// Finds the next frame in buffer
+// Returns the bytes it spans (0 if it's incomplete) or -1 on error, and sets its payload
+static int decode(stcp_framer* framer, const char* buffer, int length, const char** payload, int* size)
+{
+	int header = 0;
+	unsigned int value = 0;
+
+	switch (framer->framing)
+	{
+	case STCP_FRAMING_LENGTH:
+		if (length < framer->prefix_width)
+			return 0;
+
+		// Network byte order
+		for (; header < framer->prefix_width; ++header)
+			value = (value << 8) | (unsigned char) buffer[header];
+		break;
+
+	case STCP_FRAMING_VARINT:
+		while (true)
+		{
+			if (header == length)
+				return 0;
+
+			if (header == STCP_VARINT_MAX)
+			{
+				stcp_raise_error(STCP_EINVAL);
+				return -1;
+			}
+
+			unsigned char byte = (unsigned char) buffer[header];
+			if (header == STCP_VARINT_MAX - 1 && byte > 0x0f)
+			{
+				// More than 32 bits
+				stcp_raise_error(STCP_EINVAL);
+				return -1;
+			}
+
+			value |= (unsigned int) (byte & 0x7f) << (7 * header);
+			++header;
+
+			if (!(byte & 0x80))
+				break;
+		}
+		break;
+
+	case STCP_FRAMING_DELIMITER:
+	{
+		// Resume the search where the last one stopped, minus a partial delimiter
+		int start = framer->scanned - (framer->delimiter_length - 1);
+		if (start < 0)
+			start = 0;
+
+		for (int i = start; i + framer->delimiter_length <= length; ++i)
+		{
+			if (buffer[i] == framer->delimiter[0]
+					&& memcmp(buffer + i, framer->delimiter, framer->delimiter_length) == 0)
+			{
+				if (i > framer->max_frame_size)
+					break;
+
+				framer->scanned = 0;
+				*payload = buffer;
+				*size = i;
+				return i + framer->delimiter_length;
+			}
+		}
+
+		if (length > framer->max_frame_size + framer->delimiter_length - 1)
+		{
+			stcp_raise_error(STCP_EMSGSIZE);
+			return -1;
+		}
+
+		framer->scanned = length;
+		return 0;
+	}
+	}
+
+	if (value > (unsigned int) framer->max_frame_size)
+	{
+		stcp_raise_error(STCP_EMSGSIZE);
+		return -1;
+	}
+
+	if (length - header < (int) value)
+		return 0;
+
+	*payload = buffer + header;
+	*size = (int) value;
+	return header + (int) value;
+}
+
+static int parse_frames(const char* buffer, int length, void* user_data)
+{
+	stcp_framer* framer = (stcp_framer*) user_data;
+
+	int consumed = 0;
+	while (consumed < length)
+	{
+		const char* payload;
+		int size;
+		int ret = decode(framer, buffer + consumed, length - consumed, &payload, &size);
+		if (ret == -1)
+			return -1;
+
+		if (ret == 0)
+			break;
+
+		if (!framer->frame_output(payload, size, framer->user_data))
+			return -1;
+
+		consumed += ret;
+	}
+
+	return consumed;
+}
+
+bool stcp_receive_frames(stcp_framer* framer,
+		frame_output_fn frame_output,
+		void* user_data,
+		int timeout_milliseconds)
+{
+	assert(framer);
+	assert(frame_output);
+
+	framer->frame_output = frame_output;
+	framer->user_data = user_data;
+	return stcp_stream_consume(framer->channel, parse_frames, framer, timeout_milliseconds);
+}
+
+// ----- Encoding -----
+// Writes a frame's header into header
+// Returns its length
+static int encode(const stcp_framer* framer, int size, char* header)
+{
+	int length = 0;
+	unsigned int value = (unsigned int) size;
+
+	switch (framer->framing)
+	{
+	case STCP_FRAMING_LENGTH:
+		for (; length < framer->prefix_width; ++length)
+			header[length] = (char) (value >> (8 * (framer->prefix_width - length - 1)));
+		break;
+
+	case STCP_FRAMING_VARINT:
+		do
+		{
+			unsigned char byte = value & 0x7f;
+			value >>= 7;
+			header[length++] = (char) (value ? byte | 0x80 : byte);
+		} while (value);
+		break;
+
+	case STCP_FRAMING_DELIMITER:
+		break;
+	}
+
+	return length;
+}
+
+bool stcp_send_frames(stcp_framer* framer,
+		const stcp_iovec* frames,
+		int count,
+		int timeout_milliseconds)
+{
+	assert(framer);
+	assert(frames);
+	assert(count > 0);
+
+	// Checked up front, so an oversized frame never leaves a batch half sent
+	for (int i = 0; i < count; ++i)
+	{
+		if (frames[i].length > (size_t) framer->max_frame_size)
+		{
+			stcp_raise_error(STCP_EMSGSIZE);
+			return false;
+		}
+	}
+
+	long long deadline = stcp_make_deadline(timeout_milliseconds);
+
+	char headers[STCP_FRAME_BATCH][STCP_VARINT_MAX];
+	stcp_iovec buffers[STCP_FRAME_BATCH * 2];
+
+	for (int first = 0; first < count; first += STCP_FRAME_BATCH)
+	{
+		int n = 0;
+		for (int i = first; i < count && i < first + STCP_FRAME_BATCH; ++i)
+		{
+			if (framer->framing == STCP_FRAMING_DELIMITER)
+			{
+				buffers[n++] = frames[i];
+				buffers[n].base = framer->delimiter;
+				buffers[n++].length = framer->delimiter_length;
+			}
+			else
+			{
+				char* header = headers[i - first];
+				buffers[n].base = header;
+				buffers[n++].length = encode(framer, (int) frames[i].length, header);
+				buffers[n++] = frames[i];
+			}
+		}
+
+		if (!stcp_sendv(framer->channel, buffers, n, stcp_remaining_milliseconds(deadline)))
+			return false;
+	}
+
+	return true;
+}
+
+bool stcp_send_frame(stcp_framer* framer,
+		const char* buffer,
+		int length,
+		int timeout_milliseconds)
+{
+	assert(buffer || length == 0);
+
+	stcp_iovec frame;
+	frame.base = (void*) buffer;
+	frame.length = length;
+	return stcp_send_frames(framer, &frame, 1, timeout_milliseconds);
+}
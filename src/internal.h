@@ -0,0 +1,273 @@
+// internal.h
+#ifndef SRC_INTERNAL_H_
+#define SRC_INTERNAL_H_
+
+/*
+ * Private definitions shared by the translation units
+ * that implement the public stcp.h interface.
+ * Not part of the public API.
+ */
+
+#include <stdatomic.h>
+
+#include "stcp.h"
+#include "memory.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#ifdef _MSC_VER
+#define STCP_THREAD_LOCAL __declspec(thread)
+#else
+#define STCP_THREAD_LOCAL _Thread_local
+#endif
+
+typedef struct stcp_zerocopy stcp_zerocopy;
+typedef struct stcp_send_queue stcp_send_queue;
+typedef struct stcp_ring stcp_ring;
+typedef struct stcp_tls stcp_tls;
+typedef struct stcp_busy_poll stcp_busy_poll;
+typedef struct stcp_shared stcp_shared;
+
+// ----- Errors -----
+typedef struct stcp_error_handler
+{
+	stcp_error_callback_fn callback;
+	void* user_data;
+} stcp_error_handler;
+
+// Sends errors raised on the calling thread to handler rather than the shared callback
+// (NULL to go back to it). Returns the handler it replaces
+const stcp_error_handler* stcp_swap_error_handler(const stcp_error_handler* handler);
+
+// Sends errors raised inside a channel function to the channel's callback, if it has one.
+// Returns what stcp_leave_channel() restores when the function is done
+const stcp_error_handler* stcp_enter_channel(stcp_channel* channel);
+void stcp_leave_channel(const stcp_error_handler* previous);
+
+// ----- Statistics -----
+typedef enum stcp_counter
+{
+	STCP_COUNT_BYTES_SENT,
+	STCP_COUNT_SEND_CALLS,
+	STCP_COUNT_BYTES_RECEIVED,
+	STCP_COUNT_RECEIVE_CALLS,
+	STCP_COUNT_PARTIAL_WRITES,
+	STCP_COUNT_POLL_WAITS,
+	STCP_COUNT_POLL_WAIT_MICROSECONDS,
+	STCP_COUNT_TIMEOUTS,
+	STCP_COUNT_ACCEPTS,
+	STCP_COUNT_BUSY_POLL_HITS,
+	STCP_COUNT_BUSY_POLL_MISSES,
+	STCP_COUNT_BUSY_POLL_MICROSECONDS,
+	STCP_COUNTERS
+} stcp_counter;
+
+typedef struct stcp_counters
+{
+	atomic_ullong values[STCP_COUNTERS];
+} stcp_counters;
+
+void stcp_reset_counters(stcp_counters* counters);
+
+// Adds to a channel's counter (if channel isn't NULL) and the library's
+void stcp_count(stcp_channel* channel, stcp_counter counter, unsigned long long n);
+
+// Counts a transfer call by its socket_t result
+void stcp_count_write(stcp_channel* channel, long long requested, int ret);
+void stcp_count_read(stcp_channel* channel, int ret);
+
+// Counts a poll that began at started (from stcp_clock_microseconds())
+void stcp_count_wait(stcp_channel* channel, long long started, bool ready, int timeout_milliseconds);
+
+// ----- TCP/IP socket types -----
+struct stcp_channel
+{
+	socket_t socket;
+
+	// NULL unless zero-copy sends are enabled
+	stcp_zerocopy* zerocopy;
+
+	// NULL until data is queued with stcp_queue_send()
+	stcp_send_queue* send_queue;
+
+	// NULL unless stcp_set_receive_buffer() was called
+	stcp_ring* receive_ring;
+
+	// The pool's entry for the channel's address, or NULL if it isn't pooled
+	void* pool_entry;
+
+	// NULL unless the channel runs TLS
+	stcp_tls* tls;
+
+	// NULL unless stcp_receive() spins before waiting
+	stcp_busy_poll* busy_poll;
+
+	// NULL unless transfers go through shared memory rings
+	stcp_shared* shared;
+
+	// filled in by accept, otherwise length is 0
+	stcp_socket_address peer;
+
+	// overrides the shared error callback when set
+	stcp_error_handler error_handler;
+
+	// transfer statistics since the channel was created
+	stcp_counters counters;
+};
+
+struct stcp_server
+{
+	socket_t socket;
+
+	// applied to accepted channels
+	bool has_options;
+	stcp_options options;
+
+	// handshakes accepted channels when set, each within tls_timeout
+	stcp_tls_context* tls;
+	int tls_timeout;
+};
+
+// Wraps a connected socket in a new channel
+stcp_channel* stcp_create_channel(socket_t s);
+
+// Pooled channel and server objects
+stcp_channel* stcp_alloc_channel();
+void stcp_free_channel(stcp_channel* channel);
+stcp_server* stcp_alloc_server();
+void stcp_free_server(stcp_server* server);
+
+// ----- Socket options -----
+typedef enum stcp_options_target
+{
+	STCP_OPTIONS_LISTENER,
+	STCP_OPTIONS_CONNECTING,
+	STCP_OPTIONS_ACCEPTED,
+	STCP_OPTIONS_CONNECTED
+} stcp_options_target;
+
+// Sets the options that apply to a socket in the given role. Zero values are skipped
+// Returns true if successful
+bool stcp_apply_options(const socket_t* s, const stcp_options* options, stcp_options_target target);
+
+// ----- Timeouts -----
+// Milliseconds from a monotonic clock
+long long stcp_clock_milliseconds();
+
+// Microseconds from the same clock, for timing short waits
+long long stcp_clock_microseconds();
+
+// Converts a timeout into an absolute deadline, or -1 for none
+long long stcp_make_deadline(int timeout_milliseconds);
+
+// Milliseconds left until a deadline (never negative), or -1 for none
+int stcp_remaining_milliseconds(long long deadline);
+
+// Waits for buffer space once a transfer would block, failing at the deadline
+bool stcp_wait_write(stcp_channel* channel, long long deadline);
+
+// Waits for data to read, counting data TLS has already decrypted or the shared ring holds
+bool stcp_wait_read(stcp_channel* channel, int timeout_milliseconds);
+
+// Like stcp_wait_read(), but without counting bytes left in the receive ring
+bool stcp_wait_transport_read(stcp_channel* channel, int timeout_milliseconds);
+
+// True if the receive ring or TLS holds data that the socket won't signal again
+bool stcp_has_buffered_read(const stcp_channel* channel);
+
+// ----- Transfers -----
+// The socket_t transfers, going through shared memory or TLS when the channel has it
+int stcp_channel_write(stcp_channel* channel, const char* buffer, int n);
+int stcp_channel_writev(stcp_channel* channel, const stcp_iovec* buffers, int count);
+int stcp_channel_read(stcp_channel* channel, char* buffer, int n);
+int stcp_channel_readv(stcp_channel* channel, stcp_iovec* buffers, int count);
+int stcp_channel_send_file(stcp_channel* channel, int fd, long long offset, int n);
+
+// Reads go to the receive ring first while it holds bytes, this one skips it
+int stcp_transport_read(stcp_channel* channel, char* buffer, int n);
+
+// ----- Zero-copy sends -----
+// Smallest send that goes through the zero-copy path
+int stcp_zerocopy_threshold(const stcp_channel* channel);
+
+// Sends a buffer through the kernel without copying it.
+// The buffer is released through the channel's callback once the kernel is done with it
+bool stcp_zerocopy_send(stcp_channel* channel, const char* buffer, int length, long long deadline);
+
+// Releases the buffers the kernel reports within a short wait, then frees the zero-copy state
+void stcp_zerocopy_close(stcp_channel* channel);
+
+// ----- Send queues -----
+// Writes out every queued byte, failing at the deadline
+bool stcp_send_queue_drain(stcp_channel* channel, long long deadline);
+
+// Frees the queue, dropping anything unsent
+void stcp_send_queue_close(stcp_channel* channel);
+
+// ----- Receive rings -----
+// Reads into the channel's ring and passes everything unread to stream_output
+bool stcp_ring_stream_receive(stcp_channel* channel, stream_output_fn stream_output, void* user_data);
+
+// Copies out and consumes the unread bytes. Returns how many there were
+int stcp_ring_readv(stcp_channel* channel, stcp_iovec* buffers, int count);
+
+// Frees the ring, dropping anything unread
+void stcp_ring_close(stcp_channel* channel);
+
+// ----- Busy polling -----
+// Reads until data arrives or the spin budget (capped by the timeout) runs out,
+// starting the clock at started. Returns the last read's result
+int stcp_busy_poll_read(stcp_channel* channel, char* buffer, int n, long long started, int timeout_milliseconds);
+
+// Adapts the spin budget to a receive that began at started, missed the spin
+// and has just got data
+void stcp_busy_poll_record(stcp_channel* channel, long long started);
+
+// Frees the busy poll state
+void stcp_busy_poll_close(stcp_channel* channel);
+
+// ----- Shared memory -----
+// Transfers with the same results as their socket_t counterparts
+int stcp_shared_write(stcp_channel* channel, const char* buffer, int n);
+int stcp_shared_writev(stcp_channel* channel, const stcp_iovec* buffers, int count);
+int stcp_shared_read(stcp_channel* channel, char* buffer, int n);
+int stcp_shared_readv(stcp_channel* channel, stcp_iovec* buffers, int count);
+int stcp_shared_send_file(stcp_channel* channel, int fd, long long offset, int n);
+
+// Wait like a poll on the socket would, but on the rings
+bool stcp_shared_wait_write(stcp_channel* channel, int timeout_milliseconds);
+bool stcp_shared_wait_read(stcp_channel* channel, int timeout_milliseconds);
+
+// stcp_stream_consume() for shared channels, handing the callback the peer's ring in place
+bool stcp_shared_consume(stcp_channel* channel, stream_consume_fn stream_consume, void* user_data, int timeout_milliseconds);
+
+// Tells the peer the stream has ended and unmaps the rings
+void stcp_shared_close(stcp_channel* channel);
+
+// ----- TLS -----
+// Handshakes as the server side, failing at the deadline. The channel is left without TLS on failure
+bool stcp_tls_accept(stcp_channel* channel, stcp_tls_context* context, long long deadline);
+
+// Transfers with the same results as their socket_t counterparts
+int stcp_tls_write(stcp_channel* channel, const char* buffer, int n);
+int stcp_tls_writev(stcp_channel* channel, const stcp_iovec* buffers, int count);
+int stcp_tls_read(stcp_channel* channel, char* buffer, int n);
+int stcp_tls_readv(stcp_channel* channel, stcp_iovec* buffers, int count);
+int stcp_tls_send_file(stcp_channel* channel, int fd, long long offset, int n);
+
+// Whether the last transfer that would block is waiting for the socket to be readable
+bool stcp_tls_wants_read(const stcp_channel* channel);
+
+// Whether decrypted data is waiting to be read
+bool stcp_tls_pending(const stcp_channel* channel);
+
+// Sends a close_notify and frees the TLS state
+void stcp_tls_close(stcp_channel* channel);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* SRC_INTERNAL_H_ */
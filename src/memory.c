@@ -0,0 +1,377 @@
+// memory.c
+#include "stcp.h"
+
+#include <assert.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "internal.h"
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <pthread.h>
+#endif
+
+/*
+ * Fixed size object pools.
+ *
+ * Each thread keeps a small cache of free objects per slab, so
+ * allocating and freeing a channel normally touches no shared state.
+ * Caches that run empty or full trade a batch of objects with the
+ * slab's shared depot, which is the only place that takes a lock.
+ * Memory comes from the allocator hooks in blocks and is only
+ * returned when the library terminates, and then only for slabs whose
+ * objects are all back in the depot: an object still in use, or in
+ * another thread's cache, keeps its slab's blocks until a later
+ * terminate finds it empty.
+ */
+
+// Most objects a thread keeps per slab, and most bytes, so large classes keep fewer.
+// Half of a slab's cache moves to or from the depot at once
+#define STCP_SLAB_CACHE_SIZE 32
+#define STCP_SLAB_CACHE_BYTES 65536
+#define STCP_SLAB_MIN_CACHE_SIZE 2
+
+// Bytes requested from the allocator per block
+#define STCP_SLAB_BLOCK_SIZE 65536
+#define STCP_SLAB_MIN_OBJECTS_PER_BLOCK 4
+
+// Buffer size classes are powers of two from 256 bytes to 64 KiB
+#define STCP_BUFFER_MIN_SHIFT 8
+#define STCP_BUFFER_MAX_SHIFT 16
+#define STCP_BUFFER_CLASSES (STCP_BUFFER_MAX_SHIFT - STCP_BUFFER_MIN_SHIFT + 1)
+
+#define STCP_SLAB_COUNT (2 + STCP_BUFFER_CLASSES)
+#define STCP_ALIGNMENT 16
+
+// ----- Allocator hooks -----
+static void* default_allocate(size_t size, void* user_data)
+{
+	(void) user_data;
+	return malloc(size);
+}
+
+static void default_deallocate(void* pointer, void* user_data)
+{
+	(void) user_data;
+	free(pointer);
+}
+
+static stcp_allocate_fn _allocate = default_allocate;
+static stcp_deallocate_fn _deallocate = default_deallocate;
+static void* _allocator_user_data = NULL;
+
+void stcp_set_allocator(stcp_allocate_fn allocate, stcp_deallocate_fn deallocate, void* user_data)
+{
+	assert((allocate == NULL) == (deallocate == NULL));
+
+	_allocate = allocate ? allocate : default_allocate;
+	_deallocate = deallocate ? deallocate : default_deallocate;
+	_allocator_user_data = user_data;
+}
+
+void* stcp_malloc(size_t size)
+{
+	void* pointer = _allocate(size, _allocator_user_data);
+	assert(pointer);
+	return pointer;
+}
+
+void* stcp_realloc(void* pointer, size_t old_size, size_t new_size)
+{
+	void* resized = stcp_malloc(new_size);
+	if (pointer)
+	{
+		memcpy(resized, pointer, old_size < new_size ? old_size : new_size);
+		stcp_free(pointer);
+	}
+
+	return resized;
+}
+
+void stcp_free(void* pointer)
+{
+	if (pointer)
+		_deallocate(pointer, _allocator_user_data);
+}
+
+// ----- Slabs -----
+typedef struct stcp_free_object
+{
+	struct stcp_free_object* next;
+} stcp_free_object;
+
+typedef struct stcp_slab_block
+{
+	struct stcp_slab_block* next;
+} stcp_slab_block;
+
+typedef struct stcp_slab
+{
+	size_t object_size;
+	int objects_per_block;
+	int cache_size;
+	int batch_size;
+
+	atomic_int lock;
+	stcp_free_object* depot;
+	stcp_slab_block* blocks;
+
+	// objects out of the depot, in use or in a thread cache
+	int outstanding;
+} stcp_slab;
+
+typedef struct stcp_slab_cache
+{
+	void* objects[STCP_SLAB_CACHE_SIZE];
+	int count;
+} stcp_slab_cache;
+
+typedef struct stcp_thread_caches
+{
+	stcp_slab_cache slabs[STCP_SLAB_COUNT];
+	bool registered;
+} stcp_thread_caches;
+
+static stcp_slab _slabs[STCP_SLAB_COUNT];
+
+static STCP_THREAD_LOCAL stcp_thread_caches _caches;
+
+static void lock_slab(stcp_slab* slab)
+{
+	while (atomic_exchange_explicit(&slab->lock, 1, memory_order_acquire))
+		;
+}
+
+static void unlock_slab(stcp_slab* slab)
+{
+	atomic_store_explicit(&slab->lock, 0, memory_order_release);
+}
+
+// Sizes a slab on its first allocation. Call with the lock held
+static void init_slab(stcp_slab* slab, size_t object_size)
+{
+	slab->object_size = (object_size + STCP_ALIGNMENT - 1) & ~(size_t) (STCP_ALIGNMENT - 1);
+	slab->objects_per_block = (int) (STCP_SLAB_BLOCK_SIZE / slab->object_size);
+	if (slab->objects_per_block < STCP_SLAB_MIN_OBJECTS_PER_BLOCK)
+		slab->objects_per_block = STCP_SLAB_MIN_OBJECTS_PER_BLOCK;
+
+	size_t cache_size = STCP_SLAB_CACHE_BYTES / slab->object_size;
+	if (cache_size > STCP_SLAB_CACHE_SIZE)
+		cache_size = STCP_SLAB_CACHE_SIZE;
+	else if (cache_size < STCP_SLAB_MIN_CACHE_SIZE)
+		cache_size = STCP_SLAB_MIN_CACHE_SIZE;
+
+	slab->cache_size = (int) cache_size;
+	slab->batch_size = slab->cache_size / 2;
+}
+
+static size_t block_header()
+{
+	return (sizeof(stcp_slab_block) + STCP_ALIGNMENT - 1) & ~(size_t) (STCP_ALIGNMENT - 1);
+}
+
+// Adds a new block's objects to the depot. Call with the lock held
+static void grow_slab(stcp_slab* slab, char* memory)
+{
+	size_t header = block_header();
+	stcp_slab_block* block = (stcp_slab_block*) memory;
+	block->next = slab->blocks;
+	slab->blocks = block;
+
+	for (int i = slab->objects_per_block - 1; i >= 0; --i)
+	{
+		stcp_free_object* object = (stcp_free_object*) (memory + header + slab->object_size * i);
+		object->next = slab->depot;
+		slab->depot = object;
+	}
+}
+
+static void flush_cache(stcp_slab* slab, stcp_slab_cache* cache, int count)
+{
+	lock_slab(slab);
+	for (int i = 0; i < count; ++i)
+	{
+		stcp_free_object* object = (stcp_free_object*) cache->objects[--cache->count];
+		object->next = slab->depot;
+		slab->depot = object;
+	}
+	slab->outstanding -= count;
+	unlock_slab(slab);
+}
+
+static void release_thread_caches(void* caches)
+{
+	stcp_thread_caches* thread_caches = (stcp_thread_caches*) caches;
+	for (int i = 0; i < STCP_SLAB_COUNT; ++i)
+		flush_cache(&_slabs[i], &thread_caches->slabs[i], thread_caches->slabs[i].count);
+}
+
+// ----- Thread exit -----
+#ifdef _WIN32
+static DWORD _cache_key = FLS_OUT_OF_INDEXES;
+
+static void WINAPI on_thread_exit(void* caches)
+{
+	if (caches)
+		release_thread_caches(caches);
+}
+
+static void register_thread()
+{
+	if (_cache_key == FLS_OUT_OF_INDEXES)
+		_cache_key = FlsAlloc(on_thread_exit);
+
+	FlsSetValue(_cache_key, &_caches);
+}
+#else
+static pthread_key_t _cache_key;
+static pthread_once_t _cache_key_once = PTHREAD_ONCE_INIT;
+
+static void create_cache_key()
+{
+	pthread_key_create(&_cache_key, release_thread_caches);
+}
+
+static void register_thread()
+{
+	pthread_once(&_cache_key_once, create_cache_key);
+	pthread_setspecific(_cache_key, &_caches);
+}
+#endif
+
+// Returns this thread's caches, registered to be flushed when the thread exits
+static stcp_thread_caches* thread_caches()
+{
+	if (!_caches.registered)
+	{
+		register_thread();
+		_caches.registered = true;
+	}
+
+	return &_caches;
+}
+
+static void* slab_alloc(int index, size_t object_size)
+{
+	stcp_slab* slab = &_slabs[index];
+	stcp_slab_cache* cache = &thread_caches()->slabs[index];
+
+	if (cache->count == 0)
+	{
+		lock_slab(slab);
+		if (slab->object_size == 0)
+			init_slab(slab, object_size);
+
+		while (cache->count < slab->batch_size)
+		{
+			// The user's allocator may be slow or lock, so other threads keep the slab meanwhile
+			if (!slab->depot)
+			{
+				unlock_slab(slab);
+				char* memory = (char*) stcp_malloc(block_header() + slab->object_size * slab->objects_per_block);
+				lock_slab(slab);
+				grow_slab(slab, memory);
+			}
+
+			cache->objects[cache->count++] = slab->depot;
+			slab->depot = slab->depot->next;
+			++slab->outstanding;
+		}
+		unlock_slab(slab);
+	}
+
+	return cache->objects[--cache->count];
+}
+
+static void slab_free(int index, void* object)
+{
+	stcp_slab* slab = &_slabs[index];
+	stcp_slab_cache* cache = &thread_caches()->slabs[index];
+	if (cache->count == slab->cache_size)
+		flush_cache(slab, cache, slab->batch_size);
+
+	cache->objects[cache->count++] = object;
+}
+
+void stcp_free_slabs()
+{
+	stcp_thread_caches* caches = thread_caches();
+	for (int i = 0; i < STCP_SLAB_COUNT; ++i)
+	{
+		stcp_slab* slab = &_slabs[i];
+		flush_cache(slab, &caches->slabs[i], caches->slabs[i].count);
+
+		// Blocks holding live objects stay until they're all freed.
+		// With nothing outstanding, every thread cache of this slab is empty
+		lock_slab(slab);
+		if (slab->outstanding == 0)
+		{
+			while (slab->blocks)
+			{
+				stcp_slab_block* next = slab->blocks->next;
+				stcp_free(slab->blocks);
+				slab->blocks = next;
+			}
+			slab->depot = NULL;
+		}
+		unlock_slab(slab);
+	}
+}
+
+// ----- Objects -----
+stcp_channel* stcp_alloc_channel()
+{
+	return (stcp_channel*) slab_alloc(0, sizeof(stcp_channel));
+}
+
+void stcp_free_channel(stcp_channel* channel)
+{
+	slab_free(0, channel);
+}
+
+stcp_server* stcp_alloc_server()
+{
+	return (stcp_server*) slab_alloc(1, sizeof(stcp_server));
+}
+
+void stcp_free_server(stcp_server* server)
+{
+	slab_free(1, server);
+}
+
+// ----- Buffers -----
+static int buffer_class(size_t size)
+{
+	int shift = STCP_BUFFER_MIN_SHIFT;
+	while (((size_t) 1 << shift) < size)
+		++shift;
+
+	return shift;
+}
+
+void* stcp_alloc_buffer(size_t* size)
+{
+	assert(size);
+
+	int shift = buffer_class(*size);
+	if (shift > STCP_BUFFER_MAX_SHIFT)
+		return stcp_malloc(*size);
+
+	*size = (size_t) 1 << shift;
+	return slab_alloc(2 + shift - STCP_BUFFER_MIN_SHIFT, *size);
+}
+
+void stcp_free_buffer(void* buffer, size_t size)
+{
+	if (!buffer)
+		return;
+
+	int shift = buffer_class(size);
+	if (shift > STCP_BUFFER_MAX_SHIFT)
+		stcp_free(buffer);
+	else
+		slab_free(2 + shift - STCP_BUFFER_MIN_SHIFT, buffer);
+}
@@ -0,0 +1,36 @@
+// memory.h
+#ifndef SRC_MEMORY_H_
+#define SRC_MEMORY_H_
+
+/*
+ * Private allocation functions. All library memory goes
+ * through the hooks set with stcp_set_allocator()
+ */
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// sometimes these get long
+#define MALLOC(type) (type*) stcp_malloc(sizeof(type))
+
+// Never return NULL
+void* stcp_malloc(size_t size);
+void* stcp_realloc(void* pointer, size_t old_size, size_t new_size);
+void stcp_free(void* pointer);
+
+// Pooled buffers. The size is rounded up to the capacity actually allocated,
+// and the same size must be passed back when freeing
+void* stcp_alloc_buffer(size_t* size);
+void stcp_free_buffer(void* buffer, size_t size);
+
+// Returns pooled memory to the allocator, keeping the slabs of objects still in use
+void stcp_free_slabs();
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* SRC_MEMORY_H_ */
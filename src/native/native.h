@@ -5,24 +5,55 @@
 #ifdef _WIN32
 	#include <winsock2.h>
 	#include <Ws2tcpip.h>
+	#include <io.h>
 #else
 	#include <sys/socket.h>
 	#include <sys/ioctl.h>
+	#include <sys/uio.h>
+	#include <sys/un.h>
 	#include <arpa/inet.h>
 	#include <netdb.h>
+	#include <netinet/in.h>
+	#include <netinet/tcp.h>
+	#include <poll.h>
+	#include <pthread.h>
 	#include <unistd.h>
 #endif
 
+#ifdef __linux__
+	#include <sys/sendfile.h>
+	#include <sys/stat.h>
+	#include <fcntl.h>
+	#include <linux/errqueue.h>
+	#include <netinet/udp.h>
+#endif
+
 #ifdef _WIN32
 	#define STCP_INVALID_SOCKET (~0ULL)
 	#define STCP_SET_NON_BLOCKING(s, value) ioctlsocket(s, FIONBIO, value)
 	#define STCP_SHUTDOWN_SOCKET(s) shutdown(s, SD_BOTH)
 	#define STCP_CLOSE_SOCKET(s) closesocket(s)
+	#define STCP_POLL(fds, n, timeout) WSAPoll(fds, n, timeout)
+
+	typedef SRWLOCK stcp_mutex;
+	#define STCP_MUTEX_INIT SRWLOCK_INIT
+	#define STCP_MUTEX_CREATE(m) InitializeSRWLock(m)
+	#define STCP_MUTEX_DESTROY(m) ((void) (m))
+	#define STCP_LOCK(m) AcquireSRWLockExclusive(m)
+	#define STCP_UNLOCK(m) ReleaseSRWLockExclusive(m)
 #else
 	#define STCP_INVALID_SOCKET (-1LL)
 	#define STCP_SET_NON_BLOCKING(s, value) ioctl(s, FIONBIO, value)
 	#define STCP_SHUTDOWN_SOCKET(s) shutdown(s, SHUT_RDWR)
 	#define STCP_CLOSE_SOCKET(s) close(s)
+	#define STCP_POLL(fds, n, timeout) poll(fds, n, timeout)
+
+	typedef pthread_mutex_t stcp_mutex;
+	#define STCP_MUTEX_INIT PTHREAD_MUTEX_INITIALIZER
+	#define STCP_MUTEX_CREATE(m) pthread_mutex_init(m, NULL)
+	#define STCP_MUTEX_DESTROY(m) pthread_mutex_destroy(m)
+	#define STCP_LOCK(m) pthread_mutex_lock(m)
+	#define STCP_UNLOCK(m) pthread_mutex_unlock(m)
 #endif
 
 #endif /* SRC_NATIVE_H_ */
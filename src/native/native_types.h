@@ -2,10 +2,43 @@
 #ifndef SRC_NATIVE_TYPES_H_
 #define SRC_NATIVE_TYPES_H_
 
+#include <stddef.h>
+
 #ifdef _WIN32
 	typedef unsigned long long int socket_t;
+
+	// Scatter/gather buffer, laid out like WSABUF
+	typedef struct stcp_iovec
+	{
+		unsigned long length;
+		void* base;
+	} stcp_iovec;
 #else
 	typedef long long int socket_t;
+
+	// Scatter/gather buffer, laid out like struct iovec
+	typedef struct stcp_iovec
+	{
+		void* base;
+		size_t length;
+	} stcp_iovec;
 #endif
 
+// Room for any socket address, like struct sockaddr_storage
+typedef struct stcp_socket_address
+{
+	long long storage[16];
+	int length;
+} stcp_socket_address;
+
+// One datagram in a batch. length is the size to send, or the buffer's capacity
+// when receiving, which is replaced by the size received. address is where it goes
+// (length 0 for the connected peer) or where it came from
+typedef struct stcp_message
+{
+	char* buffer;
+	int length;
+	stcp_socket_address address;
+} stcp_message;
+
 #endif /* SRC_NATIVE_TYPES_H_ */
@@ -0,0 +1,151 @@
+// options.c
+#include "stcp.h"
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "internal.h"
+
+// Unsent bytes the low-latency profile lets pile up in the kernel
+#define STCP_LOW_LATENCY_NOT_SENT_LOW_WATER 16384
+
+// Socket buffers of the bulk profile where the kernel doesn't size them itself
+#define STCP_BULK_BUFFER_SIZE (4 * 1024 * 1024)
+
+stcp_options stcp_make_options(stcp_profile profile)
+{
+	stcp_options options;
+	memset(&options, 0, sizeof(stcp_options));
+
+	switch (profile)
+	{
+	case STCP_PROFILE_LOW_LATENCY:
+		// Send small writes at once, acknowledge at once, and keep
+		// little unsent data queued behind the next write
+		options.no_delay = true;
+#ifdef __linux__
+		options.quick_ack = true;
+#endif
+#if defined(__linux__) || defined(__APPLE__)
+		options.not_sent_low_water = STCP_LOW_LATENCY_NOT_SENT_LOW_WATER;
+#endif
+		break;
+
+	case STCP_PROFILE_BULK_THROUGHPUT:
+		// Linux autotunes its buffers past anything set here, and a
+		// fixed size would turn that off
+#ifndef __linux__
+		options.send_buffer_size = STCP_BULK_BUFFER_SIZE;
+		options.receive_buffer_size = STCP_BULK_BUFFER_SIZE;
+#endif
+		break;
+
+	case STCP_PROFILE_DEFAULT:
+		break;
+	}
+
+	return options;
+}
+
+// private function to set an option unless it's left at the system default
+static bool set_option(const socket_t* s, stcp_socket_option option, int value)
+{
+	return value == 0 || stcp_socket_set_option(s, option, value);
+}
+
+bool stcp_apply_options(const socket_t* s, const stcp_options* options, stcp_options_target target)
+{
+	assert(s);
+	assert(options);
+
+	// Buffer sizes have to be set before the handshake to take part in window scaling.
+	// Accepted sockets inherit them from the listener
+	if (target != STCP_OPTIONS_ACCEPTED)
+	{
+		if (!set_option(s, STCP_SOCKET_SEND_BUFFER, options->send_buffer_size)
+				|| !set_option(s, STCP_SOCKET_RECEIVE_BUFFER, options->receive_buffer_size))
+			return false;
+	}
+
+	// Unix sockets have no TCP layer to tune
+	if (stcp_socket_is_local(s))
+		return true;
+
+	if (target == STCP_OPTIONS_LISTENER)
+	{
+		if (!set_option(s, STCP_SOCKET_FAST_OPEN, options->fast_open)
+				|| !set_option(s, STCP_SOCKET_DEFER_ACCEPT, options->defer_accept_seconds))
+			return false;
+	}
+	else if (target == STCP_OPTIONS_CONNECTING)
+	{
+		if (!set_option(s, STCP_SOCKET_FAST_OPEN_CONNECT, options->fast_open ? 1 : 0))
+			return false;
+	}
+
+	return set_option(s, STCP_SOCKET_NO_DELAY, options->no_delay)
+			&& set_option(s, STCP_SOCKET_QUICK_ACK, options->quick_ack)
+			&& set_option(s, STCP_SOCKET_BUSY_POLL, options->busy_poll_microseconds)
+			&& set_option(s, STCP_SOCKET_NOT_SENT_LOW_WATER, options->not_sent_low_water);
+}
+
+// private function to read an option, leaving 0 if the platform doesn't have it
+static int get_option(const socket_t* s, stcp_socket_option option)
+{
+	int value = 0;
+	stcp_socket_get_option(s, option, &value);
+	return value;
+}
+
+// Reads back what the kernel applied, which may differ from what was asked for
+static void read_options(const socket_t* s, stcp_options* options, bool listener)
+{
+	memset(options, 0, sizeof(stcp_options));
+	options->send_buffer_size = get_option(s, STCP_SOCKET_SEND_BUFFER);
+	options->receive_buffer_size = get_option(s, STCP_SOCKET_RECEIVE_BUFFER);
+	if (stcp_socket_is_local(s))
+		return;
+
+	options->no_delay = get_option(s, STCP_SOCKET_NO_DELAY) != 0;
+
+#ifdef __linux__
+	options->quick_ack = get_option(s, STCP_SOCKET_QUICK_ACK) != 0;
+	options->busy_poll_microseconds = get_option(s, STCP_SOCKET_BUSY_POLL);
+	if (listener)
+	{
+		options->fast_open = get_option(s, STCP_SOCKET_FAST_OPEN);
+		options->defer_accept_seconds = get_option(s, STCP_SOCKET_DEFER_ACCEPT);
+	}
+	else
+	{
+		options->fast_open = get_option(s, STCP_SOCKET_FAST_OPEN_CONNECT);
+	}
+#else
+	(void) listener;
+#endif
+
+#if defined(__linux__) || defined(__APPLE__)
+	options->not_sent_low_water = get_option(s, STCP_SOCKET_NOT_SENT_LOW_WATER);
+#endif
+}
+
+bool stcp_set_channel_options(stcp_channel* channel, const stcp_options* options)
+{
+	assert(channel);
+	return stcp_apply_options(&channel->socket, options, STCP_OPTIONS_CONNECTED);
+}
+
+void stcp_get_channel_options(const stcp_channel* channel, stcp_options* options)
+{
+	assert(channel);
+	assert(options);
+	read_options(&channel->socket, options, false);
+}
+
+void stcp_get_server_options(const stcp_server* server, stcp_options* options)
+{
+	assert(server);
+	assert(options);
+	read_options(&server->socket, options, true);
+}
@@ -0,0 +1,264 @@
+// pool.c
+#include "stcp.h"
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "internal.h"
+#include "native/native.h"
+
+/*
+ * Outbound connection pool.
+ *
+ * Idle channels are kept per (address, protocol) in a small hash
+ * table. Acquire and release only push or pop a channel under the
+ * pool's lock; resolving and connecting happen outside of it.
+ */
+
+#define STCP_POOL_BUCKETS 64
+
+typedef struct stcp_pool_entry
+{
+	struct stcp_pool_entry* next;
+	char* address;
+	char* protocol;
+	unsigned int hash;
+
+	// most recently released channel last, so it's reused first
+	stcp_channel** idle;
+	int idle_count;
+} stcp_pool_entry;
+
+struct stcp_pool
+{
+	stcp_mutex lock;
+	int max_idle;
+	int max_total;
+
+	// idle and checked out channels
+	int total;
+
+	stcp_pool_entry* buckets[STCP_POOL_BUCKETS];
+};
+
+static unsigned int hash_string(unsigned int hash, const char* s)
+{
+	// FNV-1a, including the terminator so "ab" + "c" != "a" + "bc"
+	do
+	{
+		hash ^= (unsigned char) *s;
+		hash *= 16777619u;
+	} while (*s++);
+
+	return hash;
+}
+
+static char* copy_string(const char* s)
+{
+	size_t length = strlen(s) + 1;
+	char* copy = (char*) stcp_malloc(length);
+	memcpy(copy, s, length);
+	return copy;
+}
+
+// Finds or creates the entry for an address. Call with the lock held
+static stcp_pool_entry* find_entry(stcp_pool* pool, const char* address, const char* protocol)
+{
+	unsigned int hash = hash_string(hash_string(2166136261u, address), protocol);
+	stcp_pool_entry** bucket = &pool->buckets[hash % STCP_POOL_BUCKETS];
+
+	for (stcp_pool_entry* entry = *bucket; entry; entry = entry->next)
+	{
+		if (entry->hash == hash && strcmp(entry->address, address) == 0
+				&& strcmp(entry->protocol, protocol) == 0)
+			return entry;
+	}
+
+	stcp_pool_entry* entry = MALLOC(stcp_pool_entry);
+	entry->address = copy_string(address);
+	entry->protocol = copy_string(protocol);
+	entry->hash = hash;
+	entry->idle = pool->max_idle ? (stcp_channel**) stcp_malloc(pool->max_idle * sizeof(stcp_channel*)) : NULL;
+	entry->idle_count = 0;
+	entry->next = *bucket;
+	*bucket = entry;
+	return entry;
+}
+
+// An idle channel should have nothing to read: readiness means the peer closed it,
+// reset it, or sent something nobody is waiting for
+static bool is_alive(const stcp_channel* channel)
+{
+	return !stcp_socket_poll_read(&channel->socket, 0);
+}
+
+stcp_pool* stcp_open_pool(int max_idle_per_address, int max_total)
+{
+	assert(max_idle_per_address >= 0);
+	assert(max_total > 0);
+
+	stcp_pool* pool = MALLOC(stcp_pool);
+	memset(pool, 0, sizeof(stcp_pool));
+
+	STCP_MUTEX_CREATE(&pool->lock);
+	pool->max_idle = max_idle_per_address;
+	pool->max_total = max_total;
+	return pool;
+}
+
+stcp_channel* stcp_pool_acquire(stcp_pool* pool, const char* address, const char* protocol)
+{
+	assert(pool);
+	assert(address);
+	assert(protocol);
+
+	STCP_LOCK(&pool->lock);
+	stcp_pool_entry* entry = find_entry(pool, address, protocol);
+
+	// Reuse the warmest idle channel that is still alive
+	while (entry->idle_count > 0)
+	{
+		stcp_channel* channel = entry->idle[--entry->idle_count];
+		STCP_UNLOCK(&pool->lock);
+
+		if (is_alive(channel))
+			return channel;
+
+		stcp_close_channel(channel);
+
+		STCP_LOCK(&pool->lock);
+		--pool->total;
+	}
+
+	if (pool->total >= pool->max_total)
+	{
+		STCP_UNLOCK(&pool->lock);
+		stcp_raise_error(STCP_EWOULDBLOCK);
+		return NULL;
+	}
+
+	// Reserve the slot, then connect without holding the lock.
+	// The resolver cache saves repeating the lookup
+	++pool->total;
+	STCP_UNLOCK(&pool->lock);
+
+	stcp_address* resolved = stcp_resolve(address, protocol);
+	stcp_channel* channel = resolved ? stcp_connect_address(resolved) : NULL;
+	stcp_free_address(resolved);
+
+	if (!channel)
+	{
+		STCP_LOCK(&pool->lock);
+		--pool->total;
+		STCP_UNLOCK(&pool->lock);
+		return NULL;
+	}
+
+	channel->pool_entry = entry;
+	return channel;
+}
+
+int stcp_pool_warm(stcp_pool* pool, const char* address, const char* protocol, int count, int timeout_milliseconds)
+{
+	assert(pool);
+	assert(address);
+	assert(protocol);
+	assert(count > 0);
+
+	// Reserve the slots, then connect without holding the lock
+	STCP_LOCK(&pool->lock);
+	stcp_pool_entry* entry = find_entry(pool, address, protocol);
+	if (count > pool->max_idle - entry->idle_count)
+		count = pool->max_idle - entry->idle_count;
+	if (count > pool->max_total - pool->total)
+		count = pool->max_total - pool->total;
+
+	pool->total += count > 0 ? count : 0;
+	STCP_UNLOCK(&pool->lock);
+
+	if (count <= 0)
+		return 0;
+
+	stcp_channel** channels = (stcp_channel**) stcp_malloc(count * sizeof(stcp_channel*));
+	int connected = stcp_connect_many(address, protocol, channels, count, timeout_milliseconds);
+
+	// Releases may have filled the idle list in the meantime
+	int added = 0;
+	STCP_LOCK(&pool->lock);
+	pool->total -= count - connected;
+	for (int i = 0; i < connected && entry->idle_count < pool->max_idle; ++i)
+	{
+		channels[i]->pool_entry = entry;
+		entry->idle[entry->idle_count++] = channels[i];
+		++added;
+	}
+
+	pool->total -= connected - added;
+	STCP_UNLOCK(&pool->lock);
+
+	for (int i = added; i < connected; ++i)
+		stcp_close_channel(channels[i]);
+
+	stcp_free(channels);
+	return added;
+}
+
+void stcp_pool_release(stcp_pool* pool, stcp_channel* channel, bool reusable)
+{
+	assert(pool);
+	assert(channel);
+	assert(channel->pool_entry);
+
+	stcp_pool_entry* entry = (stcp_pool_entry*) channel->pool_entry;
+
+	STCP_LOCK(&pool->lock);
+	if (reusable && entry->idle_count < pool->max_idle)
+	{
+		entry->idle[entry->idle_count++] = channel;
+		STCP_UNLOCK(&pool->lock);
+		return;
+	}
+
+	--pool->total;
+	STCP_UNLOCK(&pool->lock);
+
+	stcp_close_channel(channel);
+}
+
+int stcp_get_pool_size(stcp_pool* pool)
+{
+	assert(pool);
+
+	STCP_LOCK(&pool->lock);
+	int total = pool->total;
+	STCP_UNLOCK(&pool->lock);
+
+	return total;
+}
+
+void stcp_close_pool(stcp_pool* pool)
+{
+	if (!pool)
+		return;
+
+	for (int i = 0; i < STCP_POOL_BUCKETS; ++i)
+	{
+		stcp_pool_entry* entry = pool->buckets[i];
+		while (entry)
+		{
+			stcp_pool_entry* next = entry->next;
+			for (int j = 0; j < entry->idle_count; ++j)
+				stcp_close_channel(entry->idle[j]);
+
+			stcp_free(entry->idle);
+			stcp_free(entry->address);
+			stcp_free(entry->protocol);
+			stcp_free(entry);
+			entry = next;
+		}
+	}
+
+	STCP_MUTEX_DESTROY(&pool->lock);
+	stcp_free(pool);
+}
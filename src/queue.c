@@ -0,0 +1,285 @@
+// queue.c
+#include "stcp.h"
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "internal.h"
+
+/*
+ * Per-channel send queue.
+ *
+ * Data that doesn't fit in the socket buffer is copied into a chain
+ * of pooled chunks and written out with writev as the socket drains,
+ * so the caller never waits on a slow peer. Only bytes the socket
+ * refuses are copied.
+ */
+
+// Smallest and largest chunk allocations, headers included
+#define STCP_SEND_CHUNK_MIN 16384
+#define STCP_SEND_CHUNK_MAX 65536
+
+#define STCP_SEND_QUEUE_HIGH_WATER (1024 * 1024)
+
+typedef struct stcp_send_chunk
+{
+	struct stcp_send_chunk* next;
+	size_t allocated;
+
+	// unsent bytes are data()[start, end)
+	size_t start;
+	size_t end;
+	size_t capacity;
+} stcp_send_chunk;
+
+struct stcp_send_queue
+{
+	stcp_send_chunk* head;
+	stcp_send_chunk* tail;
+	size_t length;
+	size_t high_water;
+};
+
+static char* chunk_data(stcp_send_chunk* chunk)
+{
+	return (char*) (chunk + 1);
+}
+
+static stcp_send_queue* get_queue(stcp_channel* channel)
+{
+	if (!channel->send_queue)
+	{
+		channel->send_queue = MALLOC(stcp_send_queue);
+		memset(channel->send_queue, 0, sizeof(stcp_send_queue));
+		channel->send_queue->high_water = STCP_SEND_QUEUE_HIGH_WATER;
+	}
+
+	return channel->send_queue;
+}
+
+static void append(stcp_send_queue* queue, const char* buffer, size_t length)
+{
+	queue->length += length;
+
+	// Top up the last chunk first
+	stcp_send_chunk* tail = queue->tail;
+	if (tail && tail->end < tail->capacity)
+	{
+		size_t n = tail->capacity - tail->end;
+		if (n > length)
+			n = length;
+
+		memcpy(chunk_data(tail) + tail->end, buffer, n);
+		tail->end += n;
+		buffer += n;
+		length -= n;
+	}
+
+	while (length > 0)
+	{
+		size_t allocated = sizeof(stcp_send_chunk) + length;
+		if (allocated < STCP_SEND_CHUNK_MIN)
+			allocated = STCP_SEND_CHUNK_MIN;
+		if (allocated > STCP_SEND_CHUNK_MAX)
+			allocated = STCP_SEND_CHUNK_MAX;
+
+		stcp_send_chunk* chunk = (stcp_send_chunk*) stcp_alloc_buffer(&allocated);
+		chunk->next = NULL;
+		chunk->allocated = allocated;
+		chunk->capacity = allocated - sizeof(stcp_send_chunk);
+		chunk->start = 0;
+		chunk->end = length < chunk->capacity ? length : chunk->capacity;
+		memcpy(chunk_data(chunk), buffer, chunk->end);
+
+		if (queue->tail)
+			queue->tail->next = chunk;
+		else
+			queue->head = chunk;
+		queue->tail = chunk;
+
+		buffer += chunk->end;
+		length -= chunk->end;
+	}
+}
+
+// Drops sent bytes from the front of the queue
+static void consume(stcp_send_queue* queue, size_t bytes_sent)
+{
+	queue->length -= bytes_sent;
+	while (bytes_sent > 0)
+	{
+		stcp_send_chunk* chunk = queue->head;
+		size_t remaining = chunk->end - chunk->start;
+		if (bytes_sent < remaining)
+		{
+			chunk->start += bytes_sent;
+			return;
+		}
+
+		bytes_sent -= remaining;
+		queue->head = chunk->next;
+		if (!queue->head)
+			queue->tail = NULL;
+
+		stcp_free_buffer(chunk, chunk->allocated);
+	}
+}
+
+// Writes as much of the queue as the socket takes without blocking
+// Returns STCP_SOCKET_WOULD_BLOCK if data is left, 0 on error, or 1 once empty
+static int flush(stcp_channel* channel)
+{
+	stcp_send_queue* queue = channel->send_queue;
+	while (queue->length > 0)
+	{
+		stcp_iovec buffers[STCP_IOV_MAX];
+		int count = 0;
+		for (stcp_send_chunk* chunk = queue->head; chunk && count < STCP_IOV_MAX; chunk = chunk->next)
+		{
+			buffers[count].base = chunk_data(chunk) + chunk->start;
+			buffers[count].length = chunk->end - chunk->start;
+			++count;
+		}
+
+		int ret = stcp_channel_writev(channel, buffers, count);
+		if (ret == STCP_SOCKET_WOULD_BLOCK || ret == 0)
+			return ret;
+
+		consume(queue, ret);
+	}
+
+	return 1;
+}
+
+static bool queue_send(stcp_channel* channel, const char* buffer, int length)
+{
+	assert(channel);
+	assert(buffer);
+	assert(length > 0);
+
+	stcp_send_queue* queue = get_queue(channel);
+
+	// Queued data goes out first to keep the stream in order
+	if (queue->length > 0)
+	{
+		int ret = flush(channel);
+		if (ret == 0)
+			return false;
+
+		if (ret == STCP_SOCKET_WOULD_BLOCK)
+		{
+			append(queue, buffer, length);
+			return true;
+		}
+	}
+
+	// Only copy what the socket won't take right now
+	int bytes_sent = 0;
+	while (bytes_sent < length)
+	{
+		int ret = stcp_channel_write(channel, buffer + bytes_sent, length - bytes_sent);
+		if (ret == STCP_SOCKET_WOULD_BLOCK)
+		{
+			append(queue, buffer + bytes_sent, length - bytes_sent);
+			break;
+		}
+
+		if (ret == 0)
+			return false;
+
+		bytes_sent += ret;
+	}
+
+	return true;
+}
+
+bool stcp_queue_send(stcp_channel* channel, const char* buffer, int length)
+{
+	const stcp_error_handler* previous = stcp_enter_channel(channel);
+	bool queued = queue_send(channel, buffer, length);
+	stcp_leave_channel(previous);
+	return queued;
+}
+
+static bool flush_queue(stcp_channel* channel)
+{
+	assert(channel);
+
+	if (!channel->send_queue)
+		return true;
+
+	return flush(channel) != 0;
+}
+
+bool stcp_flush_send_queue(stcp_channel* channel)
+{
+	const stcp_error_handler* previous = stcp_enter_channel(channel);
+	bool flushed = flush_queue(channel);
+	stcp_leave_channel(previous);
+	return flushed;
+}
+
+bool stcp_send_queue_drain(stcp_channel* channel, long long deadline)
+{
+	while (channel->send_queue && channel->send_queue->length > 0)
+	{
+		int ret = flush(channel);
+		if (ret == 0)
+			return false;
+
+		if (ret == STCP_SOCKET_WOULD_BLOCK && !stcp_wait_write(channel, deadline))
+			return false;
+	}
+
+	return true;
+}
+
+static bool drain_queue(stcp_channel* channel, int timeout_milliseconds)
+{
+	assert(channel);
+	return stcp_send_queue_drain(channel, stcp_make_deadline(timeout_milliseconds));
+}
+
+bool stcp_drain_send_queue(stcp_channel* channel, int timeout_milliseconds)
+{
+	const stcp_error_handler* previous = stcp_enter_channel(channel);
+	bool drained = drain_queue(channel, timeout_milliseconds);
+	stcp_leave_channel(previous);
+	return drained;
+}
+
+size_t stcp_get_send_queue_length(const stcp_channel* channel)
+{
+	assert(channel);
+	return channel->send_queue ? channel->send_queue->length : 0;
+}
+
+void stcp_set_send_queue_high_water(stcp_channel* channel, size_t bytes)
+{
+	assert(channel);
+	assert(bytes > 0);
+	get_queue(channel)->high_water = bytes;
+}
+
+bool stcp_is_send_queue_full(const stcp_channel* channel)
+{
+	assert(channel);
+
+	const stcp_send_queue* queue = channel->send_queue;
+	return queue && queue->length >= queue->high_water;
+}
+
+void stcp_send_queue_close(stcp_channel* channel)
+{
+	stcp_send_queue* queue = channel->send_queue;
+	while (queue->head)
+	{
+		stcp_send_chunk* next = queue->head->next;
+		stcp_free_buffer(queue->head, queue->head->allocated);
+		queue->head = next;
+	}
+
+	stcp_free(queue);
+	channel->send_queue = NULL;
+}
@@ -0,0 +1,310 @@
+// ring.c
+#ifdef __linux__
+#define _GNU_SOURCE // memfd_create
+#endif
+
+#include "stcp.h"
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "internal.h"
+#include "native/native.h"
+
+#ifdef __linux__
+#include <sys/mman.h>
+#endif
+
+/*
+ * Per-channel receive ring.
+ *
+ * On linux the ring's pages are mapped twice, back to back, so the
+ * unread data and the free space are each contiguous no matter where
+ * they wrap. Every read fills all of the free space with one recv, and
+ * the callback sees every unread byte as one buffer. Whatever it
+ * doesn't consume stays in place for the next call.
+ *
+ * Elsewhere the ring is a plain buffer, and leftover bytes are moved
+ * to the front once the free space runs out at the end.
+ */
+
+struct stcp_ring
+{
+	char* data;
+	size_t size;
+	bool mirrored;
+
+	// unread bytes are data[start, start + length)
+	size_t start;
+	size_t length;
+};
+
+#ifdef __linux__
+static bool map_mirrored(stcp_ring* ring)
+{
+	int fd = memfd_create("stcp_ring", MFD_CLOEXEC);
+	if (fd == -1)
+		return false;
+
+	// Reserve both halves, then map the same pages over each one
+	char* data = MAP_FAILED;
+	if (0 == ftruncate(fd, (off_t) ring->size))
+		data = (char*) mmap(NULL, ring->size * 2, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+	if (data != MAP_FAILED)
+	{
+		if (mmap(data, ring->size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED
+				|| mmap(data + ring->size, ring->size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED)
+		{
+			munmap(data, ring->size * 2);
+			data = MAP_FAILED;
+		}
+	}
+
+	close(fd);
+	if (data == MAP_FAILED)
+		return false;
+
+	ring->data = data;
+	ring->mirrored = true;
+	return true;
+}
+#endif
+
+static void free_ring(stcp_ring* ring)
+{
+#ifdef __linux__
+	if (ring->mirrored)
+		munmap(ring->data, ring->size * 2);
+	else
+		stcp_free(ring->data);
+#else
+	stcp_free(ring->data);
+#endif
+
+	stcp_free(ring);
+}
+
+bool stcp_set_receive_buffer(stcp_channel* channel, int size)
+{
+	assert(channel);
+	assert(size > 0);
+
+	stcp_ring* ring = MALLOC(stcp_ring);
+	ring->data = NULL;
+	ring->mirrored = false;
+	ring->start = 0;
+	ring->length = 0;
+
+#ifdef __linux__
+	// Mappings are made of whole pages
+	size_t page = (size_t) sysconf(_SC_PAGESIZE);
+	ring->size = ((size_t) size + page - 1) / page * page;
+	if (!map_mirrored(ring))
+	{
+		stcp_raise_error(stcp_get_last_error());
+		stcp_free(ring);
+		return false;
+	}
+#else
+	ring->size = (size_t) size;
+	ring->data = (char*) stcp_malloc(ring->size);
+#endif
+
+	// Carry over unread data from the previous ring
+	stcp_ring* old = channel->receive_ring;
+	if (old)
+	{
+		if (old->length > ring->size)
+		{
+			stcp_raise_error(STCP_EMSGSIZE);
+			free_ring(ring);
+			return false;
+		}
+
+		memcpy(ring->data, old->data + old->start, old->length);
+		ring->length = old->length;
+		free_ring(old);
+	}
+
+	channel->receive_ring = ring;
+	return true;
+}
+
+int stcp_get_receive_buffer_size(const stcp_channel* channel)
+{
+	assert(channel);
+	return channel->receive_ring ? (int) channel->receive_ring->size : 0;
+}
+
+int stcp_get_receive_buffer_length(const stcp_channel* channel)
+{
+	assert(channel);
+	return channel->receive_ring ? (int) channel->receive_ring->length : 0;
+}
+
+// Reads into the free space until it's full or the socket runs dry
+// Returns false on error or a closed connection, and sets *drained once nothing is left to read
+static bool fill(stcp_channel* channel, bool* drained)
+{
+	stcp_ring* ring = channel->receive_ring;
+	*drained = false;
+
+	while (ring->length < ring->size)
+	{
+		size_t end = ring->start + ring->length;
+		if (!ring->mirrored && end == ring->size)
+		{
+			memmove(ring->data, ring->data + ring->start, ring->length);
+			ring->start = 0;
+			end = ring->length;
+		}
+
+		int free_space = (int) (ring->size - ring->length);
+		if (!ring->mirrored)
+			free_space = (int) (ring->size - end);
+
+		int ret = stcp_transport_read(channel, ring->data + end, free_space);
+		if (ret == STCP_SOCKET_WOULD_BLOCK)
+		{
+			*drained = true;
+			return true;
+		}
+
+		if (ret == 0)
+			return false;
+
+		ring->length += ret;
+
+		// A short read means the socket buffer is empty, which saves asking again.
+		// TLS reads stop at the end of a record, so that only holds without it
+		if (ret < free_space && !channel->tls)
+		{
+			*drained = true;
+			return true;
+		}
+	}
+
+	return true;
+}
+
+// Drops consumed bytes from the front of the ring
+static void consume(stcp_ring* ring, int bytes)
+{
+	assert(bytes >= 0 && (size_t) bytes <= ring->length);
+
+	ring->length -= bytes;
+	ring->start += bytes;
+	if (ring->length == 0)
+		ring->start = 0;
+	else if (ring->mirrored && ring->start >= ring->size)
+		ring->start -= ring->size;
+}
+
+static bool consume_stream(stcp_channel* channel,
+		stream_consume_fn stream_consume,
+		void* user_data,
+		int timeout_milliseconds)
+{
+	assert(channel);
+	assert(stream_consume);
+
+	// The peer's ring already holds the data contiguously
+	if (channel->shared)
+		return stcp_shared_consume(channel, stream_consume, user_data, timeout_milliseconds);
+
+	stcp_ring* ring = channel->receive_ring;
+	if (!ring)
+	{
+		stcp_raise_error(STCP_EINVAL);
+		return false;
+	}
+
+	// Whatever the callback left behind is waiting for more, so only new data counts
+	if (!stcp_wait_transport_read(channel, timeout_milliseconds))
+		return false;
+
+	bool drained = false;
+	while (!drained)
+	{
+		if (!fill(channel, &drained))
+			return false;
+
+		if (ring->length == 0)
+			break;
+
+		int consumed = stream_consume(ring->data + ring->start, (int) ring->length, user_data);
+		if (consumed < 0)
+			return false;
+
+		// A full ring that nothing can be consumed from would never make progress
+		if (consumed == 0 && ring->length == ring->size)
+		{
+			stcp_raise_error(STCP_EMSGSIZE);
+			return false;
+		}
+
+		consume(ring, consumed);
+	}
+
+	return true;
+}
+
+bool stcp_stream_consume(stcp_channel* channel,
+		stream_consume_fn stream_consume,
+		void* user_data,
+		int timeout_milliseconds)
+{
+	const stcp_error_handler* previous = stcp_enter_channel(channel);
+	bool consumed = consume_stream(channel, stream_consume, user_data, timeout_milliseconds);
+	stcp_leave_channel(previous);
+	return consumed;
+}
+
+bool stcp_ring_stream_receive(stcp_channel* channel,
+		stream_output_fn stream_output,
+		void* user_data)
+{
+	stcp_ring* ring = channel->receive_ring;
+
+	bool drained = false;
+	while (!drained)
+	{
+		if (!fill(channel, &drained))
+			return false;
+
+		if (ring->length == 0)
+			break;
+
+		if (!stream_output(ring->data + ring->start, (int) ring->length, user_data))
+			return false;
+
+		consume(ring, (int) ring->length);
+	}
+
+	return true;
+}
+
+int stcp_ring_readv(stcp_channel* channel, stcp_iovec* buffers, int count)
+{
+	stcp_ring* ring = channel->receive_ring;
+
+	// Unread bytes are always contiguous, so they copy out in order
+	int bytes_read = 0;
+	for (int i = 0; i < count && ring->length > 0; ++i)
+	{
+		size_t bytes = buffers[i].length < ring->length ? (size_t) buffers[i].length : ring->length;
+		memcpy(buffers[i].base, ring->data + ring->start, bytes);
+		consume(ring, (int) bytes);
+		bytes_read += (int) bytes;
+	}
+
+	return bytes_read;
+}
+
+void stcp_ring_close(stcp_channel* channel)
+{
+	free_ring(channel->receive_ring);
+	channel->receive_ring = NULL;
+}
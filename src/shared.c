@@ -0,0 +1,698 @@
+// shared.c
+#ifdef __linux__
+#define _GNU_SOURCE // memfd_create
+#endif
+
+#include "stcp.h"
+
+#include <assert.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "internal.h"
+#include "native/native.h"
+
+#ifdef __linux__
+#include <fcntl.h>
+#include <linux/futex.h>
+#include <stdio.h>
+#include <sys/mman.h>
+#include <sys/random.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <time.h>
+#endif
+
+/*
+ * Shared memory transport for channels between processes on one host.
+ *
+ * Each end puts the data it sends in a ring of its own, backed by a
+ * memfd and mapped twice back to back like the receive rings, and
+ * offers it over the channel's socket. The peer opens the ring through
+ * /proc/<pid>/fd/<fd> and checks the token in its header, and the
+ * channel switches over only once both ends have mapped the other's.
+ *
+ * Each ring has one producer and one consumer, so moving data is a
+ * copy and a release store of the head or tail. A side that runs out
+ * of data or space raises its waiting flag and sleeps on a futex; the
+ * other end only makes the wake-up syscall when it sees that flag.
+ */
+
+// Both ends send this first, with fd -1 to decline
+#define STCP_SHARED_MAGIC "STCPSHM1"
+
+// Longest futex sleep between checks for a peer that died without closing
+#define STCP_SHARED_SLICE_MILLISECONDS 100
+
+// Largest ring either end offers or accepts
+#define STCP_SHARED_MAX_SIZE ((size_t) 1 << 30)
+
+typedef struct stcp_shared_offer
+{
+	char magic[8];
+	uint64_t token;
+	uint64_t size;
+	int32_t pid;
+	int32_t fd;
+} stcp_shared_offer;
+
+// Lives in the first page of the memfd, the data follows
+typedef struct stcp_shared_header
+{
+	uint64_t token;
+	uint64_t size;
+
+	// written by the producer
+	_Alignas(64) atomic_ullong head;
+	atomic_uint data_sequence;
+	atomic_uint producer_waiting;
+	atomic_uint closed;
+
+	// written by the consumer
+	_Alignas(64) atomic_ullong tail;
+	atomic_uint space_sequence;
+	atomic_uint consumer_waiting;
+} stcp_shared_header;
+
+typedef struct stcp_shared_ring
+{
+	stcp_shared_header* header;
+
+	// size bytes, mapped twice
+	char* data;
+	size_t size;
+} stcp_shared_ring;
+
+struct stcp_shared
+{
+	// ours to fill, and the peer's to drain
+	stcp_shared_ring send;
+	stcp_shared_ring receive;
+
+	// the socket hung up while the peer's ring was still open
+	bool peer_gone;
+
+	// the peer moved a ring position more than the ring's size, so nothing it shares can be trusted
+	bool peer_broken;
+};
+
+// ----- Mapping -----
+#ifdef __linux__
+static size_t page_size()
+{
+	return (size_t) sysconf(_SC_PAGESIZE);
+}
+
+// private function to map a ring's header and its data twice
+static bool map_ring(stcp_shared_ring* ring, int fd, size_t size)
+{
+	size_t page = page_size();
+	void* header = mmap(NULL, page, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (header == MAP_FAILED)
+		return false;
+
+	char* data = (char*) mmap(NULL, size * 2, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (data != MAP_FAILED)
+	{
+		if (mmap(data, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, (off_t) page) == MAP_FAILED
+				|| mmap(data + size, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, (off_t) page) == MAP_FAILED)
+		{
+			munmap(data, size * 2);
+			data = MAP_FAILED;
+		}
+	}
+
+	if (data == MAP_FAILED)
+	{
+		munmap(header, page);
+		return false;
+	}
+
+	ring->header = (stcp_shared_header*) header;
+	ring->data = data;
+	ring->size = size;
+	return true;
+}
+
+static void unmap_ring(stcp_shared_ring* ring)
+{
+	if (ring->header)
+	{
+		munmap(ring->data, ring->size * 2);
+		munmap(ring->header, page_size());
+		ring->header = NULL;
+	}
+}
+
+// private function to create the ring this end sends through and describe it in an offer
+// Returns the memfd, which has to stay open until the peer has mapped it, or -1
+static int create_ring(stcp_shared_ring* ring, int ring_size, stcp_shared_offer* offer)
+{
+	// A power of two, so positions wrap with a mask
+	size_t size = page_size();
+	while (size < (size_t) ring_size && size < STCP_SHARED_MAX_SIZE)
+		size *= 2;
+
+	uint64_t token;
+	if (getrandom(&token, sizeof(token), GRND_NONBLOCK) != (ssize_t) sizeof(token))
+		token = (uint64_t) stcp_clock_microseconds() ^ ((uint64_t) getpid() << 32);
+
+	int fd = memfd_create("stcp_shared", MFD_CLOEXEC);
+	if (fd == -1)
+		return -1;
+
+	if (0 != ftruncate(fd, (off_t) (page_size() + size)) || !map_ring(ring, fd, size))
+	{
+		close(fd);
+		return -1;
+	}
+
+	ring->header->token = token;
+	ring->header->size = size;
+
+	offer->token = token;
+	offer->size = size;
+	offer->pid = (int32_t) getpid();
+	offer->fd = fd;
+	return fd;
+}
+
+// private function to map the ring the peer offered, checking it's the one it meant
+static bool map_peer_ring(stcp_shared_ring* ring, const stcp_shared_offer* offer)
+{
+	size_t size = (size_t) offer->size;
+	if (offer->fd < 0 || size < page_size() || size > STCP_SHARED_MAX_SIZE || (size & (size - 1)) != 0)
+		return false;
+
+	char path[64];
+	snprintf(path, sizeof(path), "/proc/%d/fd/%d", (int) offer->pid, (int) offer->fd);
+	int fd = open(path, O_RDWR | O_CLOEXEC);
+	if (fd == -1)
+		return false;
+
+	// Another process can reuse the pid or the fd number, hence the size and token checks
+	struct stat file;
+	bool mapped = 0 == fstat(fd, &file)
+			&& (size_t) file.st_size == page_size() + size
+			&& map_ring(ring, fd, size);
+
+	close(fd);
+	if (mapped && (ring->header->token != offer->token || ring->header->size != offer->size))
+	{
+		unmap_ring(ring);
+		mapped = false;
+	}
+
+	return mapped;
+}
+
+static void close_offer(int fd)
+{
+	close(fd);
+}
+
+static void sleep_on(atomic_uint* sequence, unsigned int expected, int timeout_milliseconds)
+{
+	struct timespec timeout;
+	timeout.tv_sec = timeout_milliseconds / 1000;
+	timeout.tv_nsec = (long) (timeout_milliseconds % 1000) * 1000000;
+
+	// Not FUTEX_PRIVATE_FLAG, the other end is usually another process
+	syscall(SYS_futex, (uint32_t*) sequence, FUTEX_WAIT, expected, &timeout, NULL, 0);
+}
+
+static void wake(atomic_uint* sequence)
+{
+	atomic_fetch_add_explicit(sequence, 1, memory_order_release);
+	syscall(SYS_futex, (uint32_t*) sequence, FUTEX_WAKE, 1, NULL, NULL, 0);
+}
+
+#else
+// Rings are only mapped on linux, so the transfers below are never reached elsewhere
+static void unmap_ring(stcp_shared_ring* ring)
+{
+	(void) ring;
+}
+
+static int create_ring(stcp_shared_ring* ring, int ring_size, stcp_shared_offer* offer)
+{
+	(void) ring;
+	(void) ring_size;
+	(void) offer;
+	return -1;
+}
+
+static bool map_peer_ring(stcp_shared_ring* ring, const stcp_shared_offer* offer)
+{
+	(void) ring;
+	(void) offer;
+	return false;
+}
+
+static void close_offer(int fd)
+{
+	(void) fd;
+}
+
+static void sleep_on(atomic_uint* sequence, unsigned int expected, int timeout_milliseconds)
+{
+	(void) sequence;
+	(void) expected;
+	(void) timeout_milliseconds;
+}
+
+static void wake(atomic_uint* sequence)
+{
+	atomic_fetch_add_explicit(sequence, 1, memory_order_release);
+}
+#endif
+
+// ----- Negotiation -----
+// private function to receive exactly n bytes, failing at the deadline
+static bool receive_exactly(stcp_channel* channel, char* buffer, int n, long long deadline)
+{
+	int received = 0;
+	while (received < n)
+	{
+		int ret = stcp_receive(channel, buffer + received, n - received, stcp_remaining_milliseconds(deadline));
+		if (ret == 0)
+			return false;
+
+		received += ret;
+	}
+
+	return true;
+}
+
+static bool enable_shared_memory(stcp_channel* channel, int ring_size, int timeout_milliseconds)
+{
+	assert(channel);
+	assert(ring_size > 0);
+	assert(!channel->shared);
+
+	long long deadline = stcp_make_deadline(timeout_milliseconds);
+	stcp_shared* shared = MALLOC(stcp_shared);
+	memset(shared, 0, sizeof(stcp_shared));
+
+	stcp_shared_offer offer;
+	memset(&offer, 0, sizeof(offer));
+	memcpy(offer.magic, STCP_SHARED_MAGIC, sizeof(offer.magic));
+	offer.fd = -1;
+
+	// TLS traffic stays encrypted, and bytes already buffered on the socket's
+	// side would arrive after those sent through the rings
+	int fd = -1;
+	if (!channel->tls
+			&& stcp_get_send_queue_length(channel) == 0
+			&& stcp_get_receive_buffer_length(channel) == 0)
+	{
+		fd = create_ring(&shared->send, ring_size, &offer);
+	}
+
+	// Each end sends before it reads, so the offers cross without either waiting on the other
+	stcp_shared_offer peer_offer;
+	bool exchanged = stcp_send(channel, (const char*) &offer, (int) sizeof(offer), stcp_remaining_milliseconds(deadline))
+			&& receive_exactly(channel, (char*) &peer_offer, (int) sizeof(peer_offer), deadline);
+
+	bool mapped = exchanged
+			&& fd != -1
+			&& 0 == memcmp(peer_offer.magic, STCP_SHARED_MAGIC, sizeof(peer_offer.magic))
+			&& map_peer_ring(&shared->receive, &peer_offer);
+
+	// Only switch once both ends know the other has mapped its ring
+	char acknowledged = mapped ? 1 : 0;
+	char peer_acknowledged = 0;
+	exchanged = exchanged
+			&& stcp_send(channel, &acknowledged, 1, stcp_remaining_milliseconds(deadline))
+			&& receive_exactly(channel, &peer_acknowledged, 1, deadline);
+
+	if (fd != -1)
+		close_offer(fd);
+
+	if (!exchanged || !mapped || peer_acknowledged != 1)
+	{
+		// A refusal leaves the channel working over its socket
+		if (exchanged)
+			stcp_raise_error(STCP_EOPNOTSUPP);
+
+		unmap_ring(&shared->send);
+		unmap_ring(&shared->receive);
+		stcp_free(shared);
+		return false;
+	}
+
+	channel->shared = shared;
+	return true;
+}
+
+bool stcp_enable_shared_memory(stcp_channel* channel, int ring_size, int timeout_milliseconds)
+{
+	const stcp_error_handler* previous = stcp_enter_channel(channel);
+	bool enabled = enable_shared_memory(channel, ring_size, timeout_milliseconds);
+	stcp_leave_channel(previous);
+	return enabled;
+}
+
+bool stcp_is_shared_memory(const stcp_channel* channel)
+{
+	assert(channel);
+	return channel->shared != NULL;
+}
+
+// ----- Rings -----
+// private function to find the free space in the send ring, contiguous thanks to the mirror
+// The peer's tail is checked, and a ring it broke has no space
+static size_t writable(stcp_shared* shared, char** start)
+{
+	stcp_shared_ring* ring = &shared->send;
+	uint64_t head = atomic_load_explicit(&ring->header->head, memory_order_relaxed);
+	uint64_t tail = atomic_load_explicit(&ring->header->tail, memory_order_acquire);
+	*start = ring->data + (head & (ring->size - 1));
+	if (head - tail > ring->size)
+	{
+		shared->peer_broken = true;
+		return 0;
+	}
+
+	return ring->size - (size_t) (head - tail);
+}
+
+// private function to find the unread data in the receive ring
+// The peer's head is checked, and a ring it broke has no data
+static size_t readable(stcp_shared* shared, char** start)
+{
+	stcp_shared_ring* ring = &shared->receive;
+	uint64_t head = atomic_load_explicit(&ring->header->head, memory_order_acquire);
+	uint64_t tail = atomic_load_explicit(&ring->header->tail, memory_order_relaxed);
+	*start = ring->data + (tail & (ring->size - 1));
+	if (head - tail > ring->size)
+	{
+		shared->peer_broken = true;
+		return 0;
+	}
+
+	return (size_t) (head - tail);
+}
+
+// private function to wake a sleeping peer, skipping the syscall when it isn't
+static void signal_peer(atomic_uint* sequence, atomic_uint* waiting)
+{
+	// Pairs with the fence in sleep_until(): either it sees the new position, or this sees its flag
+	atomic_thread_fence(memory_order_seq_cst);
+	if (atomic_load_explicit(waiting, memory_order_relaxed))
+		wake(sequence);
+}
+
+static void commit_write(stcp_shared_ring* ring, size_t n)
+{
+	stcp_shared_header* header = ring->header;
+	uint64_t head = atomic_load_explicit(&header->head, memory_order_relaxed);
+	atomic_store_explicit(&header->head, head + n, memory_order_release);
+	signal_peer(&header->data_sequence, &header->consumer_waiting);
+}
+
+static void commit_read(stcp_shared_ring* ring, size_t n)
+{
+	stcp_shared_header* header = ring->header;
+	uint64_t tail = atomic_load_explicit(&header->tail, memory_order_relaxed);
+	atomic_store_explicit(&header->tail, tail + n, memory_order_release);
+	signal_peer(&header->space_sequence, &header->producer_waiting);
+}
+
+static bool peer_closed(const stcp_shared* shared)
+{
+	return shared->peer_gone || shared->peer_broken || atomic_load_explicit(&shared->receive.header->closed, memory_order_acquire);
+}
+
+static bool can_write(stcp_shared* shared)
+{
+	char* start;
+	return peer_closed(shared) || writable(shared, &start) > 0;
+}
+
+static bool can_read(stcp_shared* shared)
+{
+	char* start;
+	return peer_closed(shared) || readable(shared, &start) > 0;
+}
+
+// private function to sleep until ready() holds or the timeout runs out
+static bool sleep_until(stcp_channel* channel,
+		bool (*ready)(stcp_shared*),
+		atomic_uint* sequence,
+		atomic_uint* waiting,
+		int timeout_milliseconds)
+{
+	stcp_shared* shared = channel->shared;
+	long long deadline = stcp_make_deadline(timeout_milliseconds);
+	while (!ready(shared))
+	{
+		int remaining = stcp_remaining_milliseconds(deadline);
+		if (remaining == 0)
+		{
+			// Like poll(), a zero timeout only checks
+			if (timeout_milliseconds != 0)
+				stcp_raise_error(STCP_ETIMEDOUT);
+
+			return false;
+		}
+
+		int slice = remaining < 0 || remaining > STCP_SHARED_SLICE_MILLISECONDS
+				? STCP_SHARED_SLICE_MILLISECONDS
+				: remaining;
+
+		unsigned int expected = atomic_load_explicit(sequence, memory_order_acquire);
+		atomic_store_explicit(waiting, 1, memory_order_relaxed);
+		atomic_thread_fence(memory_order_seq_cst);
+		if (!ready(shared))
+			sleep_on(sequence, expected, slice);
+
+		atomic_store_explicit(waiting, 0, memory_order_relaxed);
+
+		// A peer that dies never closes its ring, but its socket hangs up
+		if (!ready(shared) && stcp_socket_poll_read(&channel->socket, 0))
+			shared->peer_gone = true;
+	}
+
+	return true;
+}
+
+bool stcp_shared_wait_write(stcp_channel* channel, int timeout_milliseconds)
+{
+	stcp_shared_header* header = channel->shared->send.header;
+	return sleep_until(channel, can_write, &header->space_sequence, &header->producer_waiting, timeout_milliseconds);
+}
+
+bool stcp_shared_wait_read(stcp_channel* channel, int timeout_milliseconds)
+{
+	stcp_shared_header* header = channel->shared->receive.header;
+	return sleep_until(channel, can_read, &header->data_sequence, &header->consumer_waiting, timeout_milliseconds);
+}
+
+// ----- Transfers -----
+// private function to report a full ring like a socket would
+static int full_write(const stcp_shared* shared)
+{
+	if (shared->peer_broken)
+	{
+		stcp_raise_error(STCP_ECONNRESET);
+		return 0;
+	}
+
+	return STCP_SOCKET_WOULD_BLOCK;
+}
+
+int stcp_shared_write(stcp_channel* channel, const char* buffer, int n)
+{
+	stcp_shared* shared = channel->shared;
+	if (peer_closed(shared))
+	{
+		stcp_raise_error(STCP_ECONNRESET);
+		return 0;
+	}
+
+	char* start;
+	size_t space = writable(shared, &start);
+	if (space == 0)
+		return full_write(shared);
+
+	size_t count = (size_t) n < space ? (size_t) n : space;
+	memcpy(start, buffer, count);
+	commit_write(&shared->send, count);
+	return (int) count;
+}
+
+int stcp_shared_writev(stcp_channel* channel, const stcp_iovec* buffers, int count)
+{
+	stcp_shared* shared = channel->shared;
+	if (peer_closed(shared))
+	{
+		stcp_raise_error(STCP_ECONNRESET);
+		return 0;
+	}
+
+	char* start;
+	size_t space = writable(shared, &start);
+	if (space == 0)
+		return full_write(shared);
+
+	size_t written = 0;
+	for (int i = 0; i < count && written < space; ++i)
+	{
+		size_t part = (size_t) buffers[i].length < space - written ? (size_t) buffers[i].length : space - written;
+		memcpy(start + written, buffers[i].base, part);
+		written += part;
+	}
+
+	commit_write(&shared->send, written);
+	return (int) written;
+}
+
+int stcp_shared_send_file(stcp_channel* channel, int fd, long long offset, int n)
+{
+	stcp_shared* shared = channel->shared;
+	if (peer_closed(shared))
+	{
+		stcp_raise_error(STCP_ECONNRESET);
+		return 0;
+	}
+
+	char* start;
+	size_t space = writable(shared, &start);
+	if (space == 0)
+		return full_write(shared);
+
+	// The file is read straight into the ring
+	int bytes_read = stcp_socket_read_file(fd, offset, start, (size_t) n < space ? n : (int) space);
+	if (bytes_read == 0)
+		return 0;
+
+	commit_write(&shared->send, (size_t) bytes_read);
+	return bytes_read;
+}
+
+// private function to report an empty ring like a socket would.
+// closed has to be read before the ring was found empty, or data written just before it is missed
+static int empty_read(const stcp_shared* shared, bool closed)
+{
+	if (shared->peer_broken)
+	{
+		stcp_raise_error(STCP_ECONNRESET);
+		return 0;
+	}
+
+	// A closed ring that's been drained is the end of the stream
+	if (closed)
+		return 0;
+
+	if (shared->peer_gone)
+	{
+		stcp_raise_error(STCP_ECONNRESET);
+		return 0;
+	}
+
+	return STCP_SOCKET_WOULD_BLOCK;
+}
+
+int stcp_shared_read(stcp_channel* channel, char* buffer, int n)
+{
+	stcp_shared* shared = channel->shared;
+
+	// The flag is set after the last write, so reading it first can't miss data
+	bool closed = atomic_load_explicit(&shared->receive.header->closed, memory_order_acquire);
+	char* start;
+	size_t length = readable(shared, &start);
+	if (length == 0)
+		return empty_read(shared, closed);
+
+	size_t count = (size_t) n < length ? (size_t) n : length;
+	memcpy(buffer, start, count);
+	commit_read(&shared->receive, count);
+	return (int) count;
+}
+
+int stcp_shared_readv(stcp_channel* channel, stcp_iovec* buffers, int count)
+{
+	stcp_shared* shared = channel->shared;
+	bool closed = atomic_load_explicit(&shared->receive.header->closed, memory_order_acquire);
+	char* start;
+	size_t length = readable(shared, &start);
+	if (length == 0)
+		return empty_read(shared, closed);
+
+	size_t copied = 0;
+	for (int i = 0; i < count && copied < length; ++i)
+	{
+		size_t part = (size_t) buffers[i].length < length - copied ? (size_t) buffers[i].length : length - copied;
+		memcpy(buffers[i].base, start + copied, part);
+		copied += part;
+	}
+
+	commit_read(&shared->receive, copied);
+	return (int) copied;
+}
+
+bool stcp_shared_consume(stcp_channel* channel,
+		stream_consume_fn stream_consume,
+		void* user_data,
+		int timeout_milliseconds)
+{
+	if (!stcp_wait_read(channel, timeout_milliseconds))
+		return false;
+
+	stcp_shared* shared = channel->shared;
+	stcp_shared_ring* ring = &shared->receive;
+	for (;;)
+	{
+		bool closed = atomic_load_explicit(&ring->header->closed, memory_order_acquire);
+		char* start;
+		size_t length = readable(shared, &start);
+		if (length == 0)
+		{
+			// Like a socket read, the end of the stream fails the call
+			if (closed || shared->peer_gone || shared->peer_broken)
+			{
+				empty_read(shared, closed);
+				return false;
+			}
+
+			return true;
+		}
+
+		// The callback reads the peer's ring in place
+		int consumed = stream_consume(start, (int) length, user_data);
+		if (consumed < 0)
+			return false;
+
+		if (consumed == 0)
+		{
+			// A full ring that nothing can be consumed from would never make progress
+			if (length == ring->size)
+			{
+				stcp_raise_error(STCP_EMSGSIZE);
+				return false;
+			}
+
+			return true;
+		}
+
+		stcp_count_read(channel, consumed);
+		commit_read(ring, (size_t) consumed);
+	}
+}
+
+void stcp_shared_close(stcp_channel* channel)
+{
+	stcp_shared* shared = channel->shared;
+
+	// Wake the peer's reader to see the end of the stream, and its writer to stop waiting for space
+	atomic_store_explicit(&shared->send.header->closed, 1, memory_order_release);
+	wake(&shared->send.header->data_sequence);
+	wake(&shared->receive.header->space_sequence);
+
+	unmap_ring(&shared->send);
+	unmap_ring(&shared->receive);
+	stcp_free(shared);
+	channel->shared = NULL;
+}
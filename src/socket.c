@@ -1,282 +1,1619 @@
 // socket.c
+#ifdef __linux__
+#define _GNU_SOURCE // splice
+#endif
+
 #include "socket.h"
 
 #include <assert.h>
+#include <stdatomic.h>
+#include <stdio.h>
 #include <stdlib.h>
-#include <limits.h>
 #include <string.h>
 
 #include "native/native.h"
 #include "error.h"
+#include "internal.h"
 
-typedef struct timeval timeval;
 typedef struct sockaddr sockaddr;
 typedef struct addrinfo addrinfo;
+typedef struct pollfd pollfd;
+
+#ifdef _WIN32
+_Static_assert(sizeof(stcp_iovec) == sizeof(WSABUF), "stcp_iovec must match WSABUF");
+#else
+_Static_assert(sizeof(stcp_iovec) == sizeof(struct iovec), "stcp_iovec must match struct iovec");
+#endif
+_Static_assert(sizeof(((stcp_socket_address*) 0)->storage) >= sizeof(struct sockaddr_storage),
+		"stcp_socket_address must hold any address");
+
+// Larger polls allocate their descriptor set on the heap
+#define STCP_POLL_STACK_SIZE 64
 
-static bool init = false;
+// Bytes copied per call when a file can't be sent by the kernel
+#define STCP_FILE_COPY_SIZE 16384
 
+// Called once per start and end of the library, which stcp.c counts
 void stcp_socket_initialize_library()
 {
-	if (!init)
-	{
 #ifdef _WIN32
-		WSADATA data;
-		int err = WSAStartup(MAKEWORD(2, 2), &data);
-		if (err != 0)
-		{
-			STCP_FAIL(err);
-		}
-#endif
-		init = true;
+	WSADATA data;
+	int err = WSAStartup(MAKEWORD(2, 2), &data);
+	if (err != 0)
+	{
+		STCP_FAIL(err);
 	}
+#endif
 }
 
 void stcp_socket_terminate_library()
 {
-	if (init)
-	{
 #ifdef _WIN32
-		int err = WSACleanup();
-		if (err != 0)
-		{
-			STCP_FAIL(err);
-		}
-#endif
-		init = false;
+	int err = WSACleanup();
+	if (err != 0)
+	{
+		STCP_FAIL(err);
 	}
+#endif
 }
 
-static timeval make_timeout(int timeout_milliseconds)
+// private function to wait until all n sockets report one of the given events
+static bool poll_n(const socket_t* sockets, int n, short events, int timeout_milliseconds)
 {
-	timeval timeout;
+	assert(sockets);
+	assert(n > 0);
 
-	if (timeout_milliseconds < 0)
+	pollfd stack_set[STCP_POLL_STACK_SIZE];
+	pollfd* socket_set = stack_set;
+	if (n > STCP_POLL_STACK_SIZE)
 	{
-		timeout.tv_sec = LONG_MAX;
-		timeout.tv_usec = LONG_MAX;
+		socket_set = (pollfd*) stcp_malloc(n * sizeof(pollfd));
 	}
-	else
+
+	for (int i = 0; i < n; ++i)
+	{
+		assert(sockets[i] != STCP_INVALID_SOCKET);
+		socket_set[i].fd = sockets[i];
+		socket_set[i].events = events;
+		socket_set[i].revents = 0;
+	}
+
+	// Errors and hangups count as ready, the following transfer reports them.
+	// A signal cuts the wait short, so poll again for the time left
+	long long deadline = stcp_make_deadline(timeout_milliseconds);
+	int sockets_ready;
+	stcp_error error = STCP_NO_ERROR;
+	do
+	{
+		sockets_ready = STCP_POLL(socket_set, n, stcp_remaining_milliseconds(deadline));
+		if (sockets_ready == -1)
+			error = stcp_get_last_error();
+	}
+	while (sockets_ready == -1 && error == STCP_EINTR);
+
+	if (sockets_ready > 0)
+	{
+		sockets_ready = 0;
+		for (int i = 0; i < n; ++i)
+		{
+			if (socket_set[i].revents & (events | POLLERR | POLLHUP))
+				++sockets_ready;
+		}
+	}
+
+	if (socket_set != stack_set)
+		stcp_free(socket_set);
+
+	if (sockets_ready == n)
+	{
+		return true;
+	}
+	else if (sockets_ready == -1)
 	{
-		timeout.tv_sec = timeout_milliseconds / 1000;
-		timeout_milliseconds -= timeout.tv_sec * 1000;
-		timeout.tv_usec = timeout_milliseconds * 1000;
+		stcp_raise_error(error);
+		return false;
 	}
+	else
+	{
+		if (timeout_milliseconds != 0)
+			stcp_raise_error(STCP_ETIMEDOUT);
 
-	return timeout;
+		return false;
+	}
 }
 
-static fd_set make_socket_set(const socket_t* sockets, int n)
+// ----- Address resolution -----
+// Most resolved addresses kept per name
+#define STCP_MAX_ADDRESSES 8
+
+// The resolution cache is a set-associative table
+#define STCP_RESOLVER_SETS 64
+#define STCP_RESOLVER_WAYS 4
+#define STCP_RESOLVER_DEFAULT_TTL 60000
+
+struct stcp_address
 {
-	assert(sockets);
-	assert(n < FD_SETSIZE);
+	int count;
+	struct sockaddr_storage addresses[STCP_MAX_ADDRESSES];
+	socklen_t lengths[STCP_MAX_ADDRESSES];
+};
 
-	fd_set socket_set;
-	FD_ZERO(&socket_set);
-	for (int i = 0; i < n; ++i)
+typedef struct stcp_resolver_entry
+{
+	char* key;
+	size_t key_length;
+	long long expires;
+	stcp_address address;
+} stcp_resolver_entry;
+
+static stcp_mutex _resolver_lock = STCP_MUTEX_INIT;
+static stcp_resolver_entry* _resolver_cache[STCP_RESOLVER_SETS][STCP_RESOLVER_WAYS];
+static atomic_int _resolver_ttl = STCP_RESOLVER_DEFAULT_TTL;
+
+// Names with this prefix are unix socket paths, or abstract names after an '@'
+#define STCP_LOCAL_PREFIX "unix:"
+#define STCP_LOCAL_PREFIX_LENGTH 5
+
+// private function to fill in a unix socket address, which needs no lookup
+static bool init_local_address(const char* path, stcp_address* address)
+{
+#ifdef _WIN32
+	(void) path;
+	(void) address;
+	stcp_raise_error(STCP_EAFNOSUPPORT);
+	return false;
+#else
+	struct sockaddr_un* local = (struct sockaddr_un*) &address->addresses[0];
+	size_t length = strlen(path);
+	if (length == 0 || length >= sizeof(local->sun_path))
 	{
-		assert(sockets[i] != STCP_INVALID_SOCKET);
-		FD_SET(sockets[i], &socket_set);
+		stcp_raise_error(STCP_ENAMETOOLONG);
+		return false;
+	}
+
+	memset(local, 0, sizeof(struct sockaddr_un));
+	local->sun_family = AF_UNIX;
+	memcpy(local->sun_path, path, length);
+
+	// Abstract names (linux) start with a 0 byte and aren't terminated
+	if (path[0] == '@')
+	{
+		local->sun_path[0] = '\0';
+		address->lengths[0] = (socklen_t) (offsetof(struct sockaddr_un, sun_path) + length);
 	}
+	else
+	{
+		address->lengths[0] = (socklen_t) (offsetof(struct sockaddr_un, sun_path) + length + 1);
+	}
+
+	address->count = 1;
+	return true;
+#endif
+}
+
+// private function to find the next result in or out of a family
+static addrinfo* next_in_family(addrinfo* info, int family, bool same)
+{
+	while (info && (info->ai_family == family) != same)
+		info = info->ai_next;
 
-	return socket_set;
+	return info;
 }
 
-// private function to resolve ips and hostnames
-static sockaddr init_address(const char* name, const char* protocol)
+// private function to resolve ips and hostnames, both IPv4 and IPv6
+static bool init_address(const char* name, const char* protocol, stcp_address* address)
 {
 	assert(name || protocol);
 
 	addrinfo hints;
 	memset(&hints, 0, sizeof(addrinfo));
-	hints.ai_family = AF_INET;
-    hints.ai_socktype = SOCK_STREAM;
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
 
 	addrinfo* info = NULL;
-	sockaddr ret;
-	if (0 == getaddrinfo(name, protocol, &hints, &info))
+	int err = getaddrinfo(name, protocol, &hints, &info);
+	if (err != 0)
 	{
-		ret = *info->ai_addr;
-		freeaddrinfo(info);
+#ifdef EAI_SYSTEM
+		if (err == EAI_SYSTEM)
+		{
+			stcp_raise_error(stcp_get_last_error());
+			return false;
+		}
+#endif
+		// Name resolution errors aren't socket errors
+		stcp_raise_error(STCP_EHOSTUNREACH);
+		return false;
 	}
-	else
+
+	// Alternate the families, starting with the one the system sorted first (RFC 8305 section 4),
+	// so a connect race tries the other family second rather than after every address of the first
+	int family = info->ai_family;
+	addrinfo* preferred = info;
+	addrinfo* other = next_in_family(info, family, false);
+	bool preferred_turn = true;
+
+	address->count = 0;
+	while ((preferred || other) && address->count < STCP_MAX_ADDRESSES)
 	{
-		freeaddrinfo(info);
-		STCP_FAIL_LAST_ERROR();
+		bool take_preferred = preferred && (preferred_turn || !other);
+		addrinfo* i = take_preferred ? preferred : other;
+		memcpy(&address->addresses[address->count], i->ai_addr, i->ai_addrlen);
+		address->lengths[address->count] = (socklen_t) i->ai_addrlen;
+		++address->count;
+
+		if (take_preferred)
+			preferred = next_in_family(i->ai_next, family, true);
+		else
+			other = next_in_family(i->ai_next, family, false);
+
+		preferred_turn = !preferred_turn;
 	}
 
-	return ret;
+	freeaddrinfo(info);
+	return address->count > 0;
 }
 
-socket_t stcp_socket_create()
+// Cache keys join the name and protocol, each with its terminator
+static size_t make_key(const char* name, const char* protocol, char* key, size_t capacity)
 {
-	socket_t s = socket(AF_INET, SOCK_STREAM, 0);
-	if (s != STCP_INVALID_SOCKET)
-	{
-		unsigned long int mode = 1;
-		if (0 != STCP_SET_NON_BLOCKING(s, &mode))
-			STCP_FAIL_LAST_ERROR();
-	}
-	else
+	size_t name_length = name ? strlen(name) + 1 : 0;
+	size_t protocol_length = protocol ? strlen(protocol) + 1 : 0;
+	size_t length = 2 + name_length + protocol_length;
+	if (length > capacity)
+		return 0;
+
+	key[0] = name ? 'n' : '-';
+	key[1] = protocol ? 'p' : '-';
+	memcpy(key + 2, name, name_length);
+	memcpy(key + 2 + name_length, protocol, protocol_length);
+	return length;
+}
+
+static unsigned int hash_key(const char* key, size_t length)
+{
+	// FNV-1a
+	unsigned int hash = 2166136261u;
+	for (size_t i = 0; i < length; ++i)
 	{
-		STCP_FAIL_LAST_ERROR();
+		hash ^= (unsigned char) key[i];
+		hash *= 16777619u;
 	}
 
-	return s;
+	return hash;
 }
 
-socket_t stcp_socket_accept(const socket_t* server)
+static bool lookup_cache(const char* key, size_t key_length, stcp_address* address)
 {
-	assert(server);
+	stcp_resolver_entry** set = _resolver_cache[hash_key(key, key_length) % STCP_RESOLVER_SETS];
+	long long now = stcp_clock_milliseconds();
+	bool found = false;
 
-	socket_t s = accept(*server, NULL, NULL);
-	if (s != STCP_INVALID_SOCKET)
-	{
-		unsigned long int mode = 1;
-		if (0 != STCP_SET_NON_BLOCKING(s, &mode))
-			STCP_FAIL_LAST_ERROR();
-	}
-	else
+	STCP_LOCK(&_resolver_lock);
+	for (int i = 0; i < STCP_RESOLVER_WAYS; ++i)
 	{
-		STCP_FAIL_LAST_ERROR();
+		stcp_resolver_entry* entry = set[i];
+		if (entry && entry->expires > now && entry->key_length == key_length
+				&& memcmp(entry->key, key, key_length) == 0)
+		{
+			*address = entry->address;
+			found = true;
+			break;
+		}
 	}
+	STCP_UNLOCK(&_resolver_lock);
 
-	return s;
+	return found;
 }
 
-void stcp_socket_connect(const socket_t* s, const char* address, const char* protocol)
+static void insert_cache(const char* key, size_t key_length, const stcp_address* address, int ttl)
 {
-	assert(s);
+	stcp_resolver_entry** set = _resolver_cache[hash_key(key, key_length) % STCP_RESOLVER_SETS];
+
+	STCP_LOCK(&_resolver_lock);
 
-	sockaddr addr = init_address(address, protocol);
-	if (0 != connect(*s, &addr, sizeof(addr)))
+	// Replace the same key, an empty way, or the one expiring first
+	int victim = 0;
+	for (int i = 0; i < STCP_RESOLVER_WAYS; ++i)
 	{
-		stcp_error err = stcp_get_last_error();
+		stcp_resolver_entry* entry = set[i];
+		if (!entry || (entry->key_length == key_length && memcmp(entry->key, key, key_length) == 0))
+		{
+			victim = i;
+			break;
+		}
 
-		// Ignore these errors:
-		// This is windows/linux's way of saying the
-		// non-blocking socket is connecting asynchronously
-		if (err != STCP_EWOULDBLOCK && err != STCP_EINPROGRESS)
-			STCP_FAIL_LAST_ERROR();
+		if (entry->expires < set[victim]->expires)
+			victim = i;
 	}
-	else
+
+	stcp_resolver_entry* entry = set[victim];
+	if (!entry || entry->key_length < key_length)
 	{
-		STCP_FAIL_LAST_ERROR();
+		if (entry)
+		{
+			stcp_free(entry->key);
+			stcp_free(entry);
+		}
+
+		entry = MALLOC(stcp_resolver_entry);
+		entry->key = (char*) stcp_malloc(key_length);
+		set[victim] = entry;
 	}
+
+	memcpy(entry->key, key, key_length);
+	entry->key_length = key_length;
+	entry->expires = stcp_clock_milliseconds() + ttl;
+	entry->address = *address;
+
+	STCP_UNLOCK(&_resolver_lock);
 }
 
-void stcp_socket_bind(const socket_t* s, const char* address, const char* protocol)
+// Resolves through the cache
+static bool resolve(const char* name, const char* protocol, stcp_address* address)
 {
-	assert(s);
+	if (name && strncmp(name, STCP_LOCAL_PREFIX, STCP_LOCAL_PREFIX_LENGTH) == 0)
+		return init_local_address(name + STCP_LOCAL_PREFIX_LENGTH, address);
 
-	sockaddr addr = init_address(address, protocol);
-	if (0 != bind(*s, &addr, sizeof(addr)))
-		STCP_FAIL_LAST_ERROR();
+	char key[NI_MAXHOST + NI_MAXSERV + 4];
+	size_t key_length = make_key(name, protocol, key, sizeof(key));
+
+	int ttl = atomic_load_explicit(&_resolver_ttl, memory_order_relaxed);
+	if (ttl > 0 && key_length > 0 && lookup_cache(key, key_length, address))
+		return true;
+
+	// Resolve without holding the lock
+	if (!init_address(name, protocol, address))
+		return false;
+
+	if (ttl > 0 && key_length > 0)
+		insert_cache(key, key_length, address, ttl);
+
+	return true;
 }
 
-void stcp_socket_listen(const socket_t* s, int max_pending_channels)
+stcp_address* stcp_socket_resolve(const char* name, const char* protocol)
 {
-	assert(s);
-	assert(max_pending_channels > 0);
+	stcp_address address;
+	if (!resolve(name, protocol, &address))
+		return NULL;
 
-	if (0 != listen(*s, max_pending_channels))
-		STCP_FAIL_LAST_ERROR();
+	return stcp_socket_copy_address(&address);
 }
 
-void stcp_socket_shutdown(const socket_t* s)
+stcp_address* stcp_socket_copy_address(const stcp_address* address)
 {
-	assert(s);
-	if (0 != STCP_SHUTDOWN_SOCKET(*s))
-		STCP_FAIL_LAST_ERROR();
+	assert(address);
+
+	stcp_address* copy = MALLOC(stcp_address);
+	*copy = *address;
+	return copy;
 }
 
-bool stcp_socket_poll_write(const socket_t* socket, int timeout_milliseconds)
+void stcp_socket_free_address(stcp_address* address)
 {
-	return stcp_socket_poll_write_n(socket, 1, timeout_milliseconds);
+	stcp_free(address);
 }
 
-bool stcp_socket_poll_write_n(const socket_t* sockets, int n, int timeout_milliseconds)
+void stcp_socket_set_resolver_ttl(int ttl_milliseconds)
 {
-	assert(sockets);
-	assert(n > 0);
+	assert(ttl_milliseconds >= 0);
+	atomic_store_explicit(&_resolver_ttl, ttl_milliseconds, memory_order_relaxed);
 
-	fd_set socket_set = make_socket_set(sockets, n);
-	timeval timeout = make_timeout(timeout_milliseconds);
+	if (ttl_milliseconds == 0)
+		stcp_socket_clear_resolver_cache();
+}
 
-	int sockets_ready = select(FD_SETSIZE, NULL, &socket_set, NULL, &timeout);
-	if (sockets_ready == n)
+void stcp_socket_clear_resolver_cache()
+{
+	STCP_LOCK(&_resolver_lock);
+	for (int i = 0; i < STCP_RESOLVER_SETS; ++i)
 	{
-		return true;
+		for (int j = 0; j < STCP_RESOLVER_WAYS; ++j)
+		{
+			if (_resolver_cache[i][j])
+			{
+				stcp_free(_resolver_cache[i][j]->key);
+				stcp_free(_resolver_cache[i][j]);
+				_resolver_cache[i][j] = NULL;
+			}
+		}
 	}
-	else if (sockets_ready == -1)
+	STCP_UNLOCK(&_resolver_lock);
+}
+
+// private function to create a non-blocking socket, or STCP_INVALID_SOCKET if the family isn't available
+static socket_t create_socket(int family, stcp_socket_type type)
+{
+	socket_t s = socket(family, type == STCP_SOCKET_DATAGRAM ? SOCK_DGRAM : SOCK_STREAM, 0);
+	if (s != STCP_INVALID_SOCKET)
 	{
-		STCP_FAIL_LAST_ERROR();
-		return false;
+		unsigned long int mode = 1;
+		if (0 != STCP_SET_NON_BLOCKING(s, &mode))
+			STCP_FAIL_LAST_ERROR();
 	}
-	else
+
+	return s;
+}
+
+socket_t stcp_socket_create(const stcp_address* address, stcp_socket_type type)
+{
+	assert(address);
+	assert(address->count > 0);
+
+	socket_t s = create_socket(((const sockaddr*) &address->addresses[0])->sa_family, type);
+	if (s == STCP_INVALID_SOCKET)
+		STCP_FAIL_LAST_ERROR();
+
+	return s;
+}
+
+socket_t stcp_socket_try_create(const stcp_address* address, stcp_socket_type type)
+{
+	assert(address);
+	assert(address->count > 0);
+
+	socket_t s = create_socket(((const sockaddr*) &address->addresses[0])->sa_family, type);
+	if (s == STCP_INVALID_SOCKET)
+		stcp_raise_error(stcp_get_last_error());
+
+	return s;
+}
+
+socket_t stcp_socket_accept(const socket_t* server, stcp_socket_address* peer)
+{
+	assert(server);
+	assert(peer);
+
+	for (;;)
 	{
-		if (timeout_milliseconds != 0)
-			stcp_raise_error(STCP_ETIMEDOUT);
+		socklen_t length = sizeof(peer->storage);
+#ifdef __linux__
+		// The new socket comes out non-blocking, saving an ioctl per connection
+		socket_t s = accept4(*server, (sockaddr*) peer->storage, &length, SOCK_NONBLOCK | SOCK_CLOEXEC);
+#else
+		socket_t s = accept(*server, (sockaddr*) peer->storage, &length);
+#endif
+		if (s != STCP_INVALID_SOCKET)
+		{
+#ifndef __linux__
+			unsigned long int mode = 1;
+			if (0 != STCP_SET_NON_BLOCKING(s, &mode))
+				STCP_FAIL_LAST_ERROR();
+#endif
+			peer->length = (int) length;
+			return s;
+		}
+
+		stcp_error err = stcp_get_last_error();
+
+		// A connection reset while it waited in the backlog doesn't stop the others
+		if (err == STCP_ECONNABORTED || err == STCP_EINTR)
+			continue;
+
+		if (err != STCP_EWOULDBLOCK)
+			stcp_raise_error(err);
+
+		return STCP_INVALID_SOCKET;
+	}
+}
 
+bool stcp_socket_get_peer_address(const socket_t* s, stcp_socket_address* address)
+{
+	assert(s);
+	assert(address);
+
+	socklen_t length = sizeof(address->storage);
+	if (0 != getpeername(*s, (sockaddr*) address->storage, &length))
+	{
+		stcp_raise_error(stcp_get_last_error());
 		return false;
 	}
+
+	address->length = (int) length;
+	return true;
 }
 
-bool stcp_socket_poll_read(const socket_t* socket, int timeout_milliseconds)
+void stcp_socket_first_address(const stcp_address* address, stcp_socket_address* first)
 {
-	return stcp_socket_poll_read_n(socket, 1, timeout_milliseconds);
+	assert(address);
+	assert(address->count > 0);
+	assert(first);
+
+	memcpy(first->storage, &address->addresses[0], address->lengths[0]);
+	first->length = (int) address->lengths[0];
 }
 
-bool stcp_socket_poll_read_n(const socket_t* sockets, int n, int timeout_milliseconds)
+bool stcp_socket_format_address(const stcp_socket_address* address, char* buffer, int length)
 {
-	assert(sockets);
-	assert(n > 0);
+	assert(address);
+	assert(buffer);
+	assert(length > 0);
 
-	fd_set socket_set = make_socket_set(sockets, n);
-	timeval timeout = make_timeout(timeout_milliseconds);
+	char host[INET6_ADDRSTRLEN];
+	const sockaddr* generic = (const sockaddr*) address->storage;
+	int written;
+	if (generic->sa_family == AF_INET)
+	{
+		const struct sockaddr_in* ipv4 = (const struct sockaddr_in*) generic;
+		if (!inet_ntop(AF_INET, &ipv4->sin_addr, host, sizeof(host)))
+			return false;
 
-	int sockets_ready = select(FD_SETSIZE, &socket_set, NULL, NULL, &timeout);
-	if (sockets_ready == n)
+		written = snprintf(buffer, length, "%s:%u", host, ntohs(ipv4->sin_port));
+	}
+	else if (generic->sa_family == AF_INET6)
 	{
-		return true;
+		const struct sockaddr_in6* ipv6 = (const struct sockaddr_in6*) generic;
+		if (!inet_ntop(AF_INET6, &ipv6->sin6_addr, host, sizeof(host)))
+			return false;
+
+		written = snprintf(buffer, length, "[%s]:%u", host, ntohs(ipv6->sin6_port));
 	}
-	else if (sockets_ready == -1)
+#ifndef _WIN32
+	else if (generic->sa_family == AF_UNIX)
 	{
-		STCP_FAIL_LAST_ERROR();
-		return false;
+		// Connecting sockets are usually unnamed, which leaves just the prefix
+		const struct sockaddr_un* local = (const struct sockaddr_un*) generic;
+		int path_length = address->length - (int) offsetof(struct sockaddr_un, sun_path);
+		if (path_length > 0 && local->sun_path[0] == '\0')
+			written = snprintf(buffer, length, STCP_LOCAL_PREFIX "@%.*s", path_length - 1, local->sun_path + 1);
+		else if (path_length > 0)
+			written = snprintf(buffer, length, STCP_LOCAL_PREFIX "%.*s", path_length, local->sun_path);
+		else
+			written = snprintf(buffer, length, STCP_LOCAL_PREFIX);
 	}
+#endif
 	else
 	{
-		if (timeout_milliseconds != 0)
-			stcp_raise_error(STCP_ETIMEDOUT);
-
+		stcp_raise_error(STCP_EAFNOSUPPORT);
 		return false;
 	}
+
+	return written > 0 && written < length;
 }
 
-int stcp_socket_write(const socket_t* s, const char* buffer, int n)
+// private function to start connecting to the first address
+static bool connect_address(const socket_t* s, const stcp_address* address)
 {
-	assert(s);
+	assert(address->count > 0);
 
-	int bytes_sent = send(*s, buffer, n, 0);
-	if (bytes_sent == -1)
+	if (0 != connect(*s, (const sockaddr*) &address->addresses[0], address->lengths[0]))
+	{
+		stcp_error err = stcp_get_last_error();
+
+		// Ignore these errors:
+		// This is windows/linux's way of saying the
+		// non-blocking socket is connecting asynchronously
+		if (err != STCP_EWOULDBLOCK && err != STCP_EINPROGRESS)
+			return false;
+	}
+
+	return true;
+}
+
+socket_t stcp_socket_connect(const char* address, const char* protocol)
+{
+	stcp_address resolved;
+	if (!resolve(address, protocol, &resolved))
+		return STCP_INVALID_SOCKET;
+
+	socket_t s = stcp_socket_create(&resolved, STCP_SOCKET_STREAM);
+	if (!connect_address(&s, &resolved))
 	{
 		stcp_raise_error(stcp_get_last_error());
-		return 0;
+		stcp_socket_close(&s);
+		return STCP_INVALID_SOCKET;
 	}
 
-	return bytes_sent;
+	return s;
 }
 
-int stcp_socket_read(const socket_t* s, char* buffer, int n)
+bool stcp_socket_connect_address(const socket_t* s, const stcp_address* address)
 {
-	int bytes_received = recv(*s, buffer, n, 0);
-	if (bytes_received == -1)
+	assert(s);
+	assert(address);
+
+	if (!connect_address(s, address))
 	{
 		stcp_raise_error(stcp_get_last_error());
-		return 0;
+		return false;
 	}
 
-	return bytes_received;
+	return true;
+}
+
+int stcp_socket_wait_connected(const socket_t* sockets, int n, int* results, int timeout_milliseconds)
+{
+	assert(sockets);
+	assert(n > 0);
+	assert(results);
+
+	pollfd stack_set[STCP_POLL_STACK_SIZE];
+	pollfd* socket_set = stack_set;
+	if (n > STCP_POLL_STACK_SIZE)
+		socket_set = (pollfd*) stcp_malloc(n * sizeof(pollfd));
+
+	for (int i = 0; i < n; ++i)
+		results[i] = 0;
+
+	long long deadline = stcp_make_deadline(timeout_milliseconds);
+	stcp_error error = STCP_NO_ERROR;
+	int connected = 0;
+	int pending = n;
+	while (pending > 0)
+	{
+		// Sockets that have finished drop out of the set
+		int count = 0;
+		for (int i = 0; i < n; ++i)
+		{
+			if (results[i] == 0)
+			{
+				assert(sockets[i] != STCP_INVALID_SOCKET);
+				socket_set[count].fd = sockets[i];
+				socket_set[count].events = POLLOUT;
+				socket_set[count].revents = 0;
+				++count;
+			}
+		}
+
+		int remaining = stcp_remaining_milliseconds(deadline);
+		int ready = STCP_POLL(socket_set, count, remaining);
+		if (ready == -1)
+		{
+			// A signal cut the wait short, so poll again for the time left
+			if (stcp_get_last_error() == STCP_EINTR)
+				continue;
+
+			STCP_FAIL_LAST_ERROR();
+		}
+
+		if (ready == 0)
+		{
+			if (timeout_milliseconds != 0)
+				error = STCP_ETIMEDOUT;
+
+			break;
+		}
+
+		// The set holds the pending sockets in order
+		int j = 0;
+		for (int i = 0; i < n; ++i)
+		{
+			if (results[i] != 0)
+				continue;
+
+			if (socket_set[j++].revents & (POLLOUT | POLLERR | POLLHUP))
+			{
+				// The connect's outcome, which a writable socket doesn't tell on its own
+				int err = 0;
+				socklen_t length = sizeof(err);
+				if (0 != getsockopt(sockets[i], SOL_SOCKET, SO_ERROR, (char*) &err, &length))
+					err = (int) stcp_get_last_error();
+
+				results[i] = err == 0 ? 1 : -1;
+				if (err == 0)
+					++connected;
+				else
+					error = (stcp_error) err;
+
+				--pending;
+			}
+		}
+	}
+
+	if (socket_set != stack_set)
+		stcp_free(socket_set);
+
+	if (error != STCP_NO_ERROR)
+		stcp_raise_error(error);
+
+	return connected;
+}
+
+// ----- Connection races -----
+// A new attempt starts this long after the last one unless that one fails first (RFC 8305 section 5)
+#define STCP_CONNECTION_ATTEMPT_DELAY 250
+
+struct stcp_socket_race
+{
+	stcp_address address;
+
+	// attempts[i] connects to address i, or is STCP_INVALID_SOCKET once it failed
+	socket_t attempts[STCP_MAX_ADDRESSES];
+	int started;
+	int pending;
+
+	// when the next address gets its turn
+	long long next_attempt;
+
+	// the latest failure, reported if every attempt fails
+	stcp_error error;
+};
+
+// private function to start connecting to the next address, skipping any that fail immediately
+// Returns a socket that connected straight away, which local addresses can do
+static socket_t start_attempt(stcp_socket_race* race)
+{
+	while (race->started < race->address.count)
+	{
+		int i = race->started++;
+		const sockaddr* address = (const sockaddr*) &race->address.addresses[i];
+		socket_t s = create_socket(address->sa_family, STCP_SOCKET_STREAM);
+		if (s == STCP_INVALID_SOCKET)
+		{
+			race->error = stcp_get_last_error();
+			continue;
+		}
+
+		if (0 == connect(s, address, race->address.lengths[i]))
+			return s;
+
+		stcp_error err = stcp_get_last_error();
+		if (err == STCP_EWOULDBLOCK || err == STCP_EINPROGRESS)
+		{
+			race->attempts[i] = s;
+			++race->pending;
+			race->next_attempt = stcp_clock_milliseconds() + STCP_CONNECTION_ATTEMPT_DELAY;
+			return STCP_INVALID_SOCKET;
+		}
+
+		race->error = err;
+		stcp_socket_close(&s);
+	}
+
+	return STCP_INVALID_SOCKET;
+}
+
+stcp_socket_race* stcp_socket_start_race(const char* name, const char* protocol)
+{
+	stcp_socket_race* race = MALLOC(stcp_socket_race);
+	if (!resolve(name, protocol, &race->address))
+	{
+		stcp_free(race);
+		return NULL;
+	}
+
+	for (int i = 0; i < STCP_MAX_ADDRESSES; ++i)
+		race->attempts[i] = STCP_INVALID_SOCKET;
+
+	race->started = 0;
+	race->pending = 0;
+	race->next_attempt = 0;
+	race->error = STCP_ECONNREFUSED;
+	return race;
+}
+
+socket_t stcp_socket_run_race(stcp_socket_race* race, int timeout_milliseconds)
+{
+	assert(race);
+
+	long long deadline = stcp_make_deadline(timeout_milliseconds);
+	for (;;)
+	{
+		long long now = stcp_clock_milliseconds();
+		if (race->started < race->address.count && (race->pending == 0 || now >= race->next_attempt))
+		{
+			socket_t s = start_attempt(race);
+			if (s != STCP_INVALID_SOCKET)
+				return s;
+		}
+
+		if (race->pending == 0)
+		{
+			stcp_raise_error(race->error);
+			return STCP_INVALID_SOCKET;
+		}
+
+		// Sleep until an attempt finishes, the next one is due, or the deadline
+		int remaining = stcp_remaining_milliseconds(deadline);
+		int wait = remaining;
+		if (race->started < race->address.count)
+		{
+			int until_next = race->next_attempt > now ? (int) (race->next_attempt - now) : 0;
+			if (wait < 0 || until_next < wait)
+				wait = until_next;
+		}
+
+		pollfd attempts[STCP_MAX_ADDRESSES];
+		int indices[STCP_MAX_ADDRESSES];
+		int n = 0;
+		for (int i = 0; i < race->started; ++i)
+		{
+			if (race->attempts[i] != STCP_INVALID_SOCKET)
+			{
+				attempts[n].fd = race->attempts[i];
+				attempts[n].events = POLLOUT;
+				attempts[n].revents = 0;
+				indices[n++] = i;
+			}
+		}
+
+		if (STCP_POLL(attempts, n, wait) == -1)
+		{
+			// A signal cut the sleep short, so work out the time left again
+			if (stcp_get_last_error() == STCP_EINTR)
+				continue;
+
+			STCP_FAIL_LAST_ERROR();
+		}
+
+		for (int j = 0; j < n; ++j)
+		{
+			if (!(attempts[j].revents & (POLLOUT | POLLERR | POLLHUP)))
+				continue;
+
+			int i = indices[j];
+			socket_t s = race->attempts[i];
+			race->attempts[i] = STCP_INVALID_SOCKET;
+			--race->pending;
+
+			int err = 0;
+			socklen_t length = sizeof(err);
+			if (0 != getsockopt(s, SOL_SOCKET, SO_ERROR, (char*) &err, &length))
+				err = (int) stcp_get_last_error();
+
+			if (err == 0)
+				return s;
+
+			// A failure hands the turn to the next address straight away
+			race->error = (stcp_error) err;
+			race->next_attempt = now;
+			stcp_socket_close(&s);
+		}
+
+		if (remaining == 0 && race->pending > 0)
+		{
+			if (timeout_milliseconds != 0)
+				stcp_raise_error(STCP_ETIMEDOUT);
+
+			return STCP_INVALID_SOCKET;
+		}
+	}
+}
+
+void stcp_socket_end_race(stcp_socket_race* race)
+{
+	if (race)
+	{
+		for (int i = 0; i < race->started; ++i)
+			stcp_socket_close(&race->attempts[i]);
+
+		stcp_free(race);
+	}
+}
+
+#ifndef _WIN32
+// private function to remove a unix socket file that nothing listens on anymore,
+// left behind by a process that died before closing its server
+// Returns true if it was removed
+static bool unlink_stale(const socket_t* s, const struct sockaddr_un* local, socklen_t length)
+{
+	// Abstract names vanish with their socket
+	if (length <= offsetof(struct sockaddr_un, sun_path) || local->sun_path[0] == '\0')
+		return false;
+
+	int type = 0;
+	socklen_t type_length = sizeof(type);
+	if (0 != getsockopt(*s, SOL_SOCKET, SO_TYPE, (char*) &type, &type_length))
+		return false;
+
+	socket_t probe = socket(AF_UNIX, type, 0);
+	if (probe == STCP_INVALID_SOCKET)
+		return false;
+
+	bool stale = 0 != connect(probe, (const sockaddr*) local, length) && stcp_get_last_error() == STCP_ECONNREFUSED;
+	STCP_CLOSE_SOCKET(probe);
+	return stale && 0 == unlink(local->sun_path);
+}
+#endif
+
+bool stcp_socket_bind(const socket_t* s, const stcp_address* address)
+{
+	assert(s);
+	assert(address);
+
+	const sockaddr* generic = (const sockaddr*) &address->addresses[0];
+	if (0 == bind(*s, generic, address->lengths[0]))
+		return true;
+
+#ifndef _WIN32
+	// A unix path is a name the caller picked, so a clash is theirs to handle, not fatal
+	if (generic->sa_family == AF_UNIX)
+	{
+		stcp_error err = stcp_get_last_error();
+		if (err == STCP_EADDRINUSE && unlink_stale(s, (const struct sockaddr_un*) generic, address->lengths[0])
+				&& 0 == bind(*s, generic, address->lengths[0]))
+			return true;
+
+		stcp_raise_error(err);
+		return false;
+	}
+#endif
+
+	STCP_FAIL_LAST_ERROR();
+	return false;
+}
+
+bool stcp_socket_is_local(const socket_t* s)
+{
+	assert(s);
+
+	struct sockaddr_storage address;
+	socklen_t length = sizeof(address);
+	return 0 == getsockname(*s, (sockaddr*) &address, &length) && address.ss_family != AF_INET
+			&& address.ss_family != AF_INET6;
+}
+
+void stcp_socket_unlink(const socket_t* s)
+{
+	assert(s);
+
+#ifndef _WIN32
+	struct sockaddr_un address;
+	socklen_t length = sizeof(address);
+	if (0 == getsockname(*s, (sockaddr*) &address, &length) && address.sun_family == AF_UNIX
+			&& length > offsetof(struct sockaddr_un, sun_path) && address.sun_path[0] != '\0')
+		unlink(address.sun_path);
+#endif
+}
+
+void stcp_socket_listen(const socket_t* s, int max_pending_channels)
+{
+	assert(s);
+	assert(max_pending_channels > 0);
+
+	if (0 != listen(*s, max_pending_channels))
+		STCP_FAIL_LAST_ERROR();
+}
+
+void stcp_socket_shutdown(const socket_t* s)
+{
+	assert(s);
+	if (0 != STCP_SHUTDOWN_SOCKET(*s))
+		STCP_FAIL_LAST_ERROR();
+}
+
+bool stcp_socket_poll_write(const socket_t* socket, int timeout_milliseconds)
+{
+	return stcp_socket_poll_write_n(socket, 1, timeout_milliseconds);
+}
+
+bool stcp_socket_poll_write_n(const socket_t* sockets, int n, int timeout_milliseconds)
+{
+	return poll_n(sockets, n, POLLOUT, timeout_milliseconds);
+}
+
+bool stcp_socket_poll_read(const socket_t* socket, int timeout_milliseconds)
+{
+	return stcp_socket_poll_read_n(socket, 1, timeout_milliseconds);
+}
+
+bool stcp_socket_poll_read_n(const socket_t* sockets, int n, int timeout_milliseconds)
+{
+	return poll_n(sockets, n, POLLIN, timeout_milliseconds);
+}
+
+bool stcp_socket_poll_error(const socket_t* s, int timeout_milliseconds)
+{
+	return poll_n(s, 1, 0, timeout_milliseconds);
+}
+
+int stcp_socket_write(const socket_t* s, const char* buffer, int n)
+{
+	assert(s);
+
+	int bytes_sent = send(*s, buffer, n, 0);
+	if (bytes_sent == -1)
+	{
+		if (stcp_get_last_error() == STCP_EWOULDBLOCK)
+			return STCP_SOCKET_WOULD_BLOCK;
+
+		stcp_raise_error(stcp_get_last_error());
+		return 0;
+	}
+
+	return bytes_sent;
+}
+
+int stcp_socket_read(const socket_t* s, char* buffer, int n)
+{
+	int bytes_received = recv(*s, buffer, n, 0);
+	if (bytes_received == -1)
+	{
+		if (stcp_get_last_error() == STCP_EWOULDBLOCK)
+			return STCP_SOCKET_WOULD_BLOCK;
+
+		stcp_raise_error(stcp_get_last_error());
+		return 0;
+	}
+
+	return bytes_received;
+}
+
+int stcp_socket_writev(const socket_t* s, const stcp_iovec* buffers, int count)
+{
+	assert(s);
+	assert(buffers);
+	assert(count > 0);
+
+#ifdef _WIN32
+	DWORD bytes_sent = 0;
+	if (0 != WSASend(*s, (LPWSABUF) buffers, count, &bytes_sent, 0, NULL, NULL))
+	{
+		if (stcp_get_last_error() == STCP_EWOULDBLOCK)
+			return STCP_SOCKET_WOULD_BLOCK;
+
+		stcp_raise_error(stcp_get_last_error());
+		return 0;
+	}
+#else
+	ssize_t bytes_sent = writev(*s, (const struct iovec*) buffers, count);
+	if (bytes_sent == -1)
+	{
+		if (stcp_get_last_error() == STCP_EWOULDBLOCK)
+			return STCP_SOCKET_WOULD_BLOCK;
+
+		stcp_raise_error(stcp_get_last_error());
+		return 0;
+	}
+#endif
+
+	return (int) bytes_sent;
+}
+
+int stcp_socket_readv(const socket_t* s, stcp_iovec* buffers, int count)
+{
+	assert(s);
+	assert(buffers);
+	assert(count > 0);
+
+#ifdef _WIN32
+	DWORD bytes_received = 0;
+	DWORD flags = 0;
+	if (0 != WSARecv(*s, (LPWSABUF) buffers, count, &bytes_received, &flags, NULL, NULL))
+	{
+		if (stcp_get_last_error() == STCP_EWOULDBLOCK)
+			return STCP_SOCKET_WOULD_BLOCK;
+
+		stcp_raise_error(stcp_get_last_error());
+		return 0;
+	}
+#else
+	ssize_t bytes_received = readv(*s, (const struct iovec*) buffers, count);
+	if (bytes_received == -1)
+	{
+		if (stcp_get_last_error() == STCP_EWOULDBLOCK)
+			return STCP_SOCKET_WOULD_BLOCK;
+
+		stcp_raise_error(stcp_get_last_error());
+		return 0;
+	}
+#endif
+
+	return (int) bytes_received;
+}
+
+int stcp_socket_read_file(int fd, long long offset, char* buffer, int n)
+{
+	assert(fd >= 0);
+	assert(buffer);
+
+#ifdef _WIN32
+	int bytes_read = -1;
+	if (_lseeki64(fd, offset, SEEK_SET) != -1)
+		bytes_read = _read(fd, buffer, n);
+#else
+	int bytes_read = (int) pread(fd, buffer, n, offset);
+#endif
+
+	if (bytes_read <= 0)
+	{
+		// Reading past the end of the file is an invalid length
+		stcp_raise_error(bytes_read == 0 ? STCP_EINVAL : stcp_get_last_error());
+		return 0;
+	}
+
+	return bytes_read;
+}
+
+// private function to send a file through a user space buffer
+static int copy_file(const socket_t* s, int fd, long long offset, int n)
+{
+	char buffer[STCP_FILE_COPY_SIZE];
+	if (n > STCP_FILE_COPY_SIZE)
+		n = STCP_FILE_COPY_SIZE;
+
+	int bytes_read = stcp_socket_read_file(fd, offset, buffer, n);
+	if (bytes_read == 0)
+		return 0;
+
+	int bytes_sent = send(*s, buffer, bytes_read, 0);
+	if (bytes_sent == -1)
+	{
+		if (stcp_get_last_error() == STCP_EWOULDBLOCK)
+			return STCP_SOCKET_WOULD_BLOCK;
+
+		stcp_raise_error(stcp_get_last_error());
+		return 0;
+	}
+
+	return bytes_sent;
+}
+
+int stcp_socket_send_file(const socket_t* s, int fd, long long offset, int n)
+{
+	assert(s);
+	assert(fd >= 0);
+	assert(n > 0);
+
+#ifdef __linux__
+	off_t file_offset = offset;
+	ssize_t bytes_sent = sendfile((int) *s, fd, &file_offset, n);
+	if (bytes_sent > 0)
+		return (int) bytes_sent;
+
+	if (bytes_sent == 0)
+	{
+		stcp_raise_error(STCP_EINVAL);
+		return 0;
+	}
+
+	stcp_error err = stcp_get_last_error();
+	if (err == STCP_EWOULDBLOCK)
+		return STCP_SOCKET_WOULD_BLOCK;
+
+	// Any other failure than an unsupported descriptor is final
+	if (err != STCP_EINVAL && (int) err != ENOSYS && (int) err != ESPIPE)
+	{
+		stcp_raise_error(err);
+		return 0;
+	}
+
+	// Pipes can still move pages to the socket without a copy
+	struct stat info;
+	if (0 == fstat(fd, &info) && S_ISFIFO(info.st_mode))
+	{
+		bytes_sent = splice(fd, NULL, (int) *s, NULL, n, SPLICE_F_MOVE);
+		if (bytes_sent > 0)
+			return (int) bytes_sent;
+
+		if (bytes_sent == 0)
+		{
+			stcp_raise_error(STCP_EINVAL);
+			return 0;
+		}
+
+		if (stcp_get_last_error() == STCP_EWOULDBLOCK)
+			return STCP_SOCKET_WOULD_BLOCK;
+
+		stcp_raise_error(stcp_get_last_error());
+		return 0;
+	}
+#endif
+
+	return copy_file(s, fd, offset, n);
+}
+
+bool stcp_socket_enable_zerocopy(const socket_t* s)
+{
+	assert(s);
+
+#ifdef __linux__
+	int enable = 1;
+	if (0 != setsockopt(*s, SOL_SOCKET, SO_ZEROCOPY, &enable, sizeof(enable)))
+	{
+		stcp_raise_error(stcp_get_last_error());
+		return false;
+	}
+
+	return true;
+#else
+	stcp_raise_error(STCP_EOPNOTSUPP);
+	return false;
+#endif
+}
+
+int stcp_socket_write_zerocopy(const socket_t* s, const char* buffer, int n, bool* copied)
+{
+	assert(s);
+	assert(copied);
+
+	*copied = false;
+
+#ifdef __linux__
+	int bytes_sent = send(*s, buffer, n, MSG_ZEROCOPY);
+	if (bytes_sent == -1 && stcp_get_last_error() == STCP_ENOBUFS)
+	{
+		*copied = true;
+		bytes_sent = send(*s, buffer, n, 0);
+	}
+
+	if (bytes_sent == -1)
+	{
+		if (stcp_get_last_error() == STCP_EWOULDBLOCK)
+			return STCP_SOCKET_WOULD_BLOCK;
+
+		stcp_raise_error(stcp_get_last_error());
+		return 0;
+	}
+
+	return bytes_sent;
+#else
+	(void) buffer;
+	(void) n;
+	stcp_raise_error(STCP_EOPNOTSUPP);
+	return 0;
+#endif
+}
+
+bool stcp_socket_read_zerocopy(const socket_t* s, unsigned int* first, unsigned int* last, bool* copied)
+{
+	assert(s);
+	assert(first);
+	assert(last);
+	assert(copied);
+
+#ifdef __linux__
+	char control[128];
+	struct msghdr message;
+	memset(&message, 0, sizeof(message));
+	message.msg_control = control;
+	message.msg_controllen = sizeof(control);
+
+	while (recvmsg(*s, &message, MSG_ERRQUEUE) != -1)
+	{
+		for (struct cmsghdr* cmsg = CMSG_FIRSTHDR(&message); cmsg; cmsg = CMSG_NXTHDR(&message, cmsg))
+		{
+			bool ip_error = (cmsg->cmsg_level == SOL_IP && cmsg->cmsg_type == IP_RECVERR)
+					|| (cmsg->cmsg_level == SOL_IPV6 && cmsg->cmsg_type == IPV6_RECVERR);
+			if (!ip_error)
+				continue;
+
+			const struct sock_extended_err* err = (const struct sock_extended_err*) CMSG_DATA(cmsg);
+			if (err->ee_errno != 0 || err->ee_origin != SO_EE_ORIGIN_ZEROCOPY)
+				continue;
+
+			*first = err->ee_info;
+			*last = err->ee_data;
+			*copied = err->ee_code & SO_EE_CODE_ZEROCOPY_COPIED;
+			return true;
+		}
+
+		// Not a zero-copy notification, so skip it
+		message.msg_controllen = sizeof(control);
+	}
+
+	if (stcp_get_last_error() != STCP_EWOULDBLOCK)
+		stcp_raise_error(stcp_get_last_error());
+#endif
+
+	return false;
+}
+
+// ----- Datagrams -----
+#ifdef __linux__
+// Messages handled per sendmmsg/recvmmsg
+#define STCP_DATAGRAM_BATCH 64
+
+// A segmented send is limited to UDP_MAX_SEGMENTS datagrams in one 64 KiB packet,
+// and its segments must fit the MTU, so only datagrams that fit any path are merged
+#define STCP_MAX_SEGMENTS 64
+#define STCP_MAX_SEGMENTED_BYTES 65000
+#define STCP_MAX_SEGMENT_SIZE 1452
+
+// private function to count the datagrams from messages[0] that can go out as one segmented send
+static int segment_run(const stcp_message* messages, int count)
+{
+	int size = messages[0].length;
+	if (size == 0 || size > STCP_MAX_SEGMENT_SIZE)
+		return 1;
+
+	// Every segment is full sized except possibly the last
+	int run = 1;
+	int bytes = size;
+	while (run < count && run < STCP_MAX_SEGMENTS && bytes + messages[run].length <= STCP_MAX_SEGMENTED_BYTES)
+	{
+		const stcp_message* next = &messages[run];
+		if (next->length == 0 || next->length > size || next->address.length != messages[0].address.length
+				|| memcmp(next->address.storage, messages[0].address.storage, next->address.length) != 0)
+			break;
+
+		bytes += next->length;
+		++run;
+		if (next->length < size)
+			break;
+	}
+
+	return run;
+}
+#endif
+
+bool stcp_socket_can_segment(const socket_t* s)
+{
+#ifdef UDP_SEGMENT
+	int size = 0;
+	socklen_t length = sizeof(size);
+	return 0 == getsockopt(*s, IPPROTO_UDP, UDP_SEGMENT, &size, &length);
+#else
+	(void) s;
+	return false;
+#endif
+}
+
+int stcp_socket_send_datagrams(const socket_t* s, const stcp_message* messages, int count, bool* segment)
+{
+	assert(s);
+	assert(messages);
+	assert(count > 0);
+	assert(segment);
+
+#ifdef __linux__
+	struct mmsghdr headers[STCP_DATAGRAM_BATCH];
+	struct iovec buffers[STCP_DATAGRAM_BATCH];
+	union
+	{
+		char buffer[CMSG_SPACE(sizeof(uint16_t))];
+		struct cmsghdr align;
+	} controls[STCP_DATAGRAM_BATCH];
+
+	// Index of each header's first message, then of the message after the last
+	int firsts[STCP_DATAGRAM_BATCH + 1];
+
+	int n = 0;
+	int i = 0;
+	if (count > STCP_DATAGRAM_BATCH)
+		count = STCP_DATAGRAM_BATCH;
+
+	while (i < count)
+	{
+		int run = *segment ? segment_run(messages + i, count - i) : 1;
+		struct msghdr* header = &headers[n].msg_hdr;
+		memset(header, 0, sizeof(struct msghdr));
+		if (messages[i].address.length)
+		{
+			header->msg_name = (void*) messages[i].address.storage;
+			header->msg_namelen = (socklen_t) messages[i].address.length;
+		}
+
+		header->msg_iov = &buffers[i];
+		header->msg_iovlen = run;
+		for (int j = i; j < i + run; ++j)
+		{
+			buffers[j].iov_base = messages[j].buffer;
+			buffers[j].iov_len = messages[j].length;
+		}
+
+		// The kernel splits the gathered bytes back into datagrams of the first one's size
+		if (run > 1)
+		{
+			header->msg_control = controls[n].buffer;
+			header->msg_controllen = sizeof(controls[n].buffer);
+			struct cmsghdr* control = CMSG_FIRSTHDR(header);
+			control->cmsg_level = IPPROTO_UDP;
+			control->cmsg_type = UDP_SEGMENT;
+			control->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+			uint16_t size = (uint16_t) messages[i].length;
+			memcpy(CMSG_DATA(control), &size, sizeof(size));
+		}
+
+		firsts[n++] = i;
+		i += run;
+	}
+
+	firsts[n] = i;
+	int sent = sendmmsg(*s, headers, n, 0);
+	if (sent == -1)
+	{
+		if (stcp_get_last_error() == STCP_EWOULDBLOCK)
+			return STCP_SOCKET_WOULD_BLOCK;
+
+		// The option existing doesn't mean the device can offload it, so drop to plain sends for good
+		if (errno == EIO && n < count)
+		{
+			*segment = false;
+			return stcp_socket_send_datagrams(s, messages, count, segment);
+		}
+
+		stcp_raise_error(stcp_get_last_error());
+		return 0;
+	}
+
+	return firsts[sent];
+#else
+	*segment = false;
+	for (int i = 0; i < count; ++i)
+	{
+		const stcp_message* message = &messages[i];
+		const sockaddr* address = message->address.length ? (const sockaddr*) message->address.storage : NULL;
+		if (-1 == sendto(*s, message->buffer, message->length, 0, address, (socklen_t) message->address.length))
+		{
+			if (stcp_get_last_error() == STCP_EWOULDBLOCK)
+				return i > 0 ? i : STCP_SOCKET_WOULD_BLOCK;
+
+			// Report what was sent, the error comes back on the next call
+			if (i > 0)
+				return i;
+
+			stcp_raise_error(stcp_get_last_error());
+			return 0;
+		}
+	}
+
+	return count;
+#endif
+}
+
+int stcp_socket_receive_datagrams(const socket_t* s, stcp_message* messages, int count)
+{
+	assert(s);
+	assert(messages);
+	assert(count > 0);
+
+#ifdef __linux__
+	struct mmsghdr headers[STCP_DATAGRAM_BATCH];
+	struct iovec buffers[STCP_DATAGRAM_BATCH];
+	if (count > STCP_DATAGRAM_BATCH)
+		count = STCP_DATAGRAM_BATCH;
+
+	for (int i = 0; i < count; ++i)
+	{
+		buffers[i].iov_base = messages[i].buffer;
+		buffers[i].iov_len = messages[i].length;
+		memset(&headers[i].msg_hdr, 0, sizeof(struct msghdr));
+		headers[i].msg_hdr.msg_name = messages[i].address.storage;
+		headers[i].msg_hdr.msg_namelen = sizeof(messages[i].address.storage);
+		headers[i].msg_hdr.msg_iov = &buffers[i];
+		headers[i].msg_hdr.msg_iovlen = 1;
+	}
+
+	int received = recvmmsg(*s, headers, count, MSG_DONTWAIT, NULL);
+	if (received == -1)
+	{
+		if (stcp_get_last_error() == STCP_EWOULDBLOCK)
+			return STCP_SOCKET_WOULD_BLOCK;
+
+		stcp_raise_error(stcp_get_last_error());
+		return 0;
+	}
+
+	for (int i = 0; i < received; ++i)
+	{
+		messages[i].length = (int) headers[i].msg_len;
+		messages[i].address.length = (int) headers[i].msg_hdr.msg_namelen;
+	}
+
+	return received;
+#else
+	for (int i = 0; i < count; ++i)
+	{
+		stcp_message* message = &messages[i];
+		socklen_t length = sizeof(message->address.storage);
+		int bytes_received = recvfrom(*s, message->buffer, message->length, 0,
+				(sockaddr*) message->address.storage, &length);
+
+		if (bytes_received == -1)
+		{
+			if (stcp_get_last_error() == STCP_EWOULDBLOCK)
+				return i > 0 ? i : STCP_SOCKET_WOULD_BLOCK;
+
+			if (i > 0)
+				return i;
+
+			stcp_raise_error(stcp_get_last_error());
+			return 0;
+		}
+
+		message->length = bytes_received;
+		message->address.length = (int) length;
+	}
+
+	return count;
+#endif
+}
+
+// private function to find an option's level and name
+static bool find_option(stcp_socket_option option, int* level, int* name)
+{
+	*level = IPPROTO_TCP;
+	switch (option)
+	{
+	case STCP_SOCKET_NO_DELAY:
+		*name = TCP_NODELAY;
+		return true;
+
+	case STCP_SOCKET_SEND_BUFFER:
+		*level = SOL_SOCKET;
+		*name = SO_SNDBUF;
+		return true;
+
+	case STCP_SOCKET_RECEIVE_BUFFER:
+		*level = SOL_SOCKET;
+		*name = SO_RCVBUF;
+		return true;
+
+#ifdef TCP_QUICKACK
+	case STCP_SOCKET_QUICK_ACK:
+		*name = TCP_QUICKACK;
+		return true;
+#endif
+
+#ifdef SO_BUSY_POLL
+	case STCP_SOCKET_BUSY_POLL:
+		*level = SOL_SOCKET;
+		*name = SO_BUSY_POLL;
+		return true;
+#endif
+
+#ifdef TCP_NOTSENT_LOWAT
+	case STCP_SOCKET_NOT_SENT_LOW_WATER:
+		*name = TCP_NOTSENT_LOWAT;
+		return true;
+#endif
+
+#ifdef TCP_FASTOPEN
+	case STCP_SOCKET_FAST_OPEN:
+		*name = TCP_FASTOPEN;
+		return true;
+#endif
+
+#ifdef TCP_FASTOPEN_CONNECT
+	case STCP_SOCKET_FAST_OPEN_CONNECT:
+		*name = TCP_FASTOPEN_CONNECT;
+		return true;
+#endif
+
+#ifdef TCP_DEFER_ACCEPT
+	case STCP_SOCKET_DEFER_ACCEPT:
+		*name = TCP_DEFER_ACCEPT;
+		return true;
+#endif
+
+	default:
+		return false;
+	}
+}
+
+bool stcp_socket_set_option(const socket_t* s, stcp_socket_option option, int value)
+{
+	assert(s);
+
+	int level, name;
+	if (!find_option(option, &level, &name))
+	{
+		stcp_raise_error(STCP_ENOPROTOOPT);
+		return false;
+	}
+
+	if (0 != setsockopt(*s, level, name, (const char*) &value, sizeof(value)))
+	{
+		stcp_raise_error(stcp_get_last_error());
+		return false;
+	}
+
+	return true;
+}
+
+bool stcp_socket_get_option(const socket_t* s, stcp_socket_option option, int* value)
+{
+	assert(s);
+	assert(value);
+
+	int level, name;
+	if (!find_option(option, &level, &name))
+	{
+		stcp_raise_error(STCP_ENOPROTOOPT);
+		return false;
+	}
+
+	*value = 0;
+	socklen_t length = sizeof(*value);
+	if (0 != getsockopt(*s, level, name, (char*) value, &length))
+	{
+		stcp_raise_error(stcp_get_last_error());
+		return false;
+	}
+
+	return true;
 }
 
 void stcp_socket_close(socket_t* s)
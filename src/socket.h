@@ -23,16 +23,103 @@ extern "C" {
 void stcp_socket_initialize_library();
 void stcp_socket_terminate_library();
 
+// Resolved addresses
+typedef struct stcp_address stcp_address;
+
+// Resolves an ip or hostname and a protocol or port, using the resolution cache
+// Returns NULL and raises the error if it can't be resolved
+stcp_address* stcp_socket_resolve(const char* name, const char* protocol);
+stcp_address* stcp_socket_copy_address(const stcp_address* address);
+void stcp_socket_free_address(stcp_address* address);
+
+// Resolved addresses stay cached for ttl_milliseconds (0 disables the cache)
+void stcp_socket_set_resolver_ttl(int ttl_milliseconds);
+void stcp_socket_clear_resolver_cache();
+
 // Socket creation
-socket_t stcp_socket_create();
-socket_t stcp_socket_accept(const socket_t* server);
+typedef enum stcp_socket_type
+{
+	STCP_SOCKET_STREAM,
+	STCP_SOCKET_DATAGRAM
+} stcp_socket_type;
+
+// Creates a non-blocking socket for the family of the first resolved address
+socket_t stcp_socket_create(const stcp_address* address, stcp_socket_type type);
+
+// Like stcp_socket_create(), but raises the error and returns STCP_INVALID_SOCKET
+// when the socket can't be created, such as when the process is out of descriptors
+socket_t stcp_socket_try_create(const stcp_address* address, stcp_socket_type type);
+
+// Accepts a pending connection as a non-blocking socket and records the peer's address.
+// Returns STCP_INVALID_SOCKET once nothing is pending, raising the error if accept failed
+socket_t stcp_socket_accept(const socket_t* server, stcp_socket_address* peer);
+
+// Peer addresses
+bool stcp_socket_get_peer_address(const socket_t* s, stcp_socket_address* address);
+
+// Copies the first of the resolved addresses
+void stcp_socket_first_address(const stcp_address* address, stcp_socket_address* first);
+
+// Formats an address as host:port ([host]:port for IPv6)
+// Returns false if it doesn't fit in length bytes
+bool stcp_socket_format_address(const stcp_socket_address* address, char* buffer, int length);
 
 // Connection management
-void stcp_socket_connect(const socket_t* s, const char* address, const char* protocol);
-void stcp_socket_bind(const socket_t* s, const char* address, const char* protocol);
+// Resolves an address and starts connecting a new socket to it
+// Returns STCP_INVALID_SOCKET if it can't be resolved or connected
+socket_t stcp_socket_connect(const char* address, const char* protocol);
+bool stcp_socket_connect_address(const socket_t* s, const stcp_address* address);
+
+// Waits for connects started on non-blocking sockets to finish, polling all of them at once.
+// results[i] becomes 1 when sockets[i] connected, -1 when it failed, and stays 0 past the timeout
+// Returns the number that connected, raising the last failure or STCP_ETIMEDOUT (if timeout_milliseconds != 0)
+int stcp_socket_wait_connected(const socket_t* sockets, int n, int* results, int timeout_milliseconds);
+
+// Connection races (Happy Eyeballs, RFC 8305). Each resolved address in turn gets a
+// non-blocking connect, started when the previous one fails or has had 250ms, and
+// the first to complete wins.
+// Returns NULL if the address can't be resolved
+typedef struct stcp_socket_race stcp_socket_race;
+stcp_socket_race* stcp_socket_start_race(const char* name, const char* protocol);
+
+// Runs the race until an attempt connects, every one has failed, or the timeout
+// Returns the connected socket, which now belongs to the caller, or STCP_INVALID_SOCKET.
+// Raises the last attempt's error, or STCP_ETIMEDOUT if timeout_milliseconds != 0
+socket_t stcp_socket_run_race(stcp_socket_race* race, int timeout_milliseconds);
+
+// Closes the attempts still in flight
+void stcp_socket_end_race(stcp_socket_race* race);
+// Fails the process like the other socket calls, except for unix paths: a stale socket
+// file that nothing listens on is replaced, and other failures are raised instead
+// Returns true if bound
+bool stcp_socket_bind(const socket_t* s, const stcp_address* address);
 void stcp_socket_listen(const socket_t* s, int max_pending_channels);
 void stcp_socket_shutdown(const socket_t* s);
 
+// Whether a socket is a unix socket, which has no TCP options
+bool stcp_socket_is_local(const socket_t* s);
+
+// Removes the file a listening unix socket is bound to
+void stcp_socket_unlink(const socket_t* s);
+
+// Socket options. Flags are set with 0 or 1
+typedef enum stcp_socket_option
+{
+	STCP_SOCKET_NO_DELAY,
+	STCP_SOCKET_QUICK_ACK,
+	STCP_SOCKET_SEND_BUFFER,
+	STCP_SOCKET_RECEIVE_BUFFER,
+	STCP_SOCKET_BUSY_POLL,
+	STCP_SOCKET_NOT_SENT_LOW_WATER,
+	STCP_SOCKET_FAST_OPEN,
+	STCP_SOCKET_FAST_OPEN_CONNECT,
+	STCP_SOCKET_DEFER_ACCEPT
+} stcp_socket_option;
+
+// Returns false and raises STCP_ENOPROTOOPT if the platform doesn't have the option
+bool stcp_socket_set_option(const socket_t* s, stcp_socket_option option, int value);
+bool stcp_socket_get_option(const socket_t* s, stcp_socket_option option, int* value);
+
 // Returns true if all sockets are ready to transfer data
 // Only raises STCP_CONNECTION_TIMED_OUT if timeout_milliseconds != 0
 bool stcp_socket_poll_write(const socket_t* socket, int timeout_milliseconds);
@@ -40,9 +127,52 @@ bool stcp_socket_poll_write_n(const socket_t* sockets, int n, int timeout_millis
 bool stcp_socket_poll_read(const socket_t* s, int timeout_milliseconds);
 bool stcp_socket_poll_read_n(const socket_t* sockets, int n, int timeout_milliseconds);
 
-// Returns the number of bytes transferred
+// Waits for a pending socket error or hangup, which includes zero-copy completions
+bool stcp_socket_poll_error(const socket_t* s, int timeout_milliseconds);
+
+// Returned instead of a byte count when a non-blocking transfer would block
+// This is not raised as an error
+#define STCP_SOCKET_WOULD_BLOCK (-1)
+
+// Returns the number of bytes transferred, 0 on error,
+// or STCP_SOCKET_WOULD_BLOCK when the socket isn't ready
 int stcp_socket_write(const socket_t* s, const char* buffer, int n);
 int stcp_socket_read(const socket_t* s, char* buffer, int n);
+int stcp_socket_writev(const socket_t* s, const stcp_iovec* buffers, int count);
+int stcp_socket_readv(const socket_t* s, stcp_iovec* buffers, int count);
+
+// Reads up to n bytes of a file at offset, for sends that can't go through the kernel
+// Returns the number of bytes read, or 0 on error (including the end of the file)
+int stcp_socket_read_file(int fd, long long offset, char* buffer, int n);
+
+// Sends n bytes of a file descriptor starting at offset (ignored for pipes)
+// Returns the number of bytes transferred, 0 on error, or STCP_SOCKET_WOULD_BLOCK
+int stcp_socket_send_file(const socket_t* s, int fd, long long offset, int n);
+
+// Zero-copy sends (linux only). Each successful write is numbered by the kernel,
+// counting up from 0, and reported back once the buffer is released.
+// When the kernel can't pin more memory the write is copied instead, which sets
+// *copied and takes no number
+// Returns the number of bytes transferred, 0 on error, or STCP_SOCKET_WOULD_BLOCK
+bool stcp_socket_enable_zerocopy(const socket_t* s);
+int stcp_socket_write_zerocopy(const socket_t* s, const char* buffer, int n, bool* copied);
+
+// Reads one range of released writes from the error queue
+// Returns false once the queue is empty
+bool stcp_socket_read_zerocopy(const socket_t* s, unsigned int* first, unsigned int* last, bool* copied);
+
+// Datagram batches, moving as many messages per syscall as the platform allows
+// Whether sends can hand the kernel several same-sized datagrams as one (UDP GSO, linux 4.18+)
+bool stcp_socket_can_segment(const socket_t* s);
+
+// Sends from the start of messages. Runs of datagrams with the same size and address
+// become one segmented send when *segment is true. If the device rejects segmented sends
+// with EIO, *segment is cleared and the batch is resent one datagram at a time
+// Returns how many were sent, STCP_SOCKET_WOULD_BLOCK, or 0 on error
+int stcp_socket_send_datagrams(const socket_t* s, const stcp_message* messages, int count, bool* segment);
+
+// Returns how many were received, STCP_SOCKET_WOULD_BLOCK, or 0 on error
+int stcp_socket_receive_datagrams(const socket_t* s, stcp_message* messages, int count);
 
 // Frees a socket's resources
 void stcp_socket_close(socket_t* s);
@@ -0,0 +1,131 @@
+// stats.c
+#include "stcp.h"
+
+#include <assert.h>
+#include <stdatomic.h>
+
+#include "internal.h"
+
+/*
+ * Transfer statistics.
+ *
+ * A channel is only used by one thread at a time, so its counters
+ * are bumped with a relaxed load and store rather than a locked add.
+ * The library wide counters are split into shards, each thread adding
+ * to its own, so busy threads don't fight over one cache line.
+ * A snapshot sums the shards, and may miss counts still in flight.
+ */
+
+#define STCP_STATS_SHARDS 16
+
+typedef struct stcp_stats_shard
+{
+	stcp_counters counters;
+
+	// keeps neighbouring shards off each other's cache lines
+	char padding[64 - sizeof(stcp_counters) % 64];
+} stcp_stats_shard;
+
+static stcp_stats_shard _shards[STCP_STATS_SHARDS];
+static atomic_uint _next_shard = 0;
+static STCP_THREAD_LOCAL stcp_counters* _thread_shard = NULL;
+
+static stcp_counters* thread_shard()
+{
+	if (!_thread_shard)
+	{
+		unsigned int shard = atomic_fetch_add_explicit(&_next_shard, 1, memory_order_relaxed);
+		_thread_shard = &_shards[shard % STCP_STATS_SHARDS].counters;
+	}
+
+	return _thread_shard;
+}
+
+void stcp_reset_counters(stcp_counters* counters)
+{
+	for (int i = 0; i < STCP_COUNTERS; ++i)
+		atomic_init(&counters->values[i], 0);
+}
+
+void stcp_count(stcp_channel* channel, stcp_counter counter, unsigned long long n)
+{
+	if (channel)
+	{
+		atomic_ullong* value = &channel->counters.values[counter];
+		atomic_store_explicit(value, atomic_load_explicit(value, memory_order_relaxed) + n, memory_order_relaxed);
+	}
+
+	atomic_fetch_add_explicit(&thread_shard()->values[counter], n, memory_order_relaxed);
+}
+
+void stcp_count_write(stcp_channel* channel, long long requested, int ret)
+{
+	stcp_count(channel, STCP_COUNT_SEND_CALLS, 1);
+	if (ret > 0)
+	{
+		stcp_count(channel, STCP_COUNT_BYTES_SENT, (unsigned long long) ret);
+		if (ret < requested)
+			stcp_count(channel, STCP_COUNT_PARTIAL_WRITES, 1);
+	}
+}
+
+void stcp_count_read(stcp_channel* channel, int ret)
+{
+	stcp_count(channel, STCP_COUNT_RECEIVE_CALLS, 1);
+	if (ret > 0)
+		stcp_count(channel, STCP_COUNT_BYTES_RECEIVED, (unsigned long long) ret);
+}
+
+void stcp_count_wait(stcp_channel* channel, long long started, bool ready, int timeout_milliseconds)
+{
+	stcp_count(channel, STCP_COUNT_POLL_WAITS, 1);
+	stcp_count(channel, STCP_COUNT_POLL_WAIT_MICROSECONDS,
+			(unsigned long long) (stcp_clock_microseconds() - started));
+
+	// A zero timeout only checks, so coming back empty isn't a timeout
+	if (!ready && timeout_milliseconds != 0)
+		stcp_count(channel, STCP_COUNT_TIMEOUTS, 1);
+}
+
+// private function to copy counters into the public struct
+static void snapshot(const unsigned long long* values, stcp_stats* stats)
+{
+	stats->bytes_sent = values[STCP_COUNT_BYTES_SENT];
+	stats->send_calls = values[STCP_COUNT_SEND_CALLS];
+	stats->bytes_received = values[STCP_COUNT_BYTES_RECEIVED];
+	stats->receive_calls = values[STCP_COUNT_RECEIVE_CALLS];
+	stats->partial_writes = values[STCP_COUNT_PARTIAL_WRITES];
+	stats->poll_waits = values[STCP_COUNT_POLL_WAITS];
+	stats->poll_wait_microseconds = values[STCP_COUNT_POLL_WAIT_MICROSECONDS];
+	stats->timeouts = values[STCP_COUNT_TIMEOUTS];
+	stats->accepts = values[STCP_COUNT_ACCEPTS];
+	stats->busy_poll_hits = values[STCP_COUNT_BUSY_POLL_HITS];
+	stats->busy_poll_misses = values[STCP_COUNT_BUSY_POLL_MISSES];
+	stats->busy_poll_microseconds = values[STCP_COUNT_BUSY_POLL_MICROSECONDS];
+}
+
+void stcp_get_stats(stcp_stats* stats)
+{
+	assert(stats);
+
+	unsigned long long values[STCP_COUNTERS] = { 0 };
+	for (int shard = 0; shard < STCP_STATS_SHARDS; ++shard)
+	{
+		for (int i = 0; i < STCP_COUNTERS; ++i)
+			values[i] += atomic_load_explicit(&_shards[shard].counters.values[i], memory_order_relaxed);
+	}
+
+	snapshot(values, stats);
+}
+
+void stcp_get_channel_stats(const stcp_channel* channel, stcp_stats* stats)
+{
+	assert(channel);
+	assert(stats);
+
+	unsigned long long values[STCP_COUNTERS];
+	for (int i = 0; i < STCP_COUNTERS; ++i)
+		values[i] = atomic_load_explicit(&channel->counters.values[i], memory_order_relaxed);
+
+	snapshot(values, stats);
+}
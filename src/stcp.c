@@ -3,102 +3,650 @@
 #include "stcp.h"
 
 #include <assert.h>
+#include <stdatomic.h>
 #include <string.h>
 #include <stdlib.h>
 
-// sometimes these get long
-#define MALLOC(type) (type*) malloc(sizeof(type))
-#define REALLOC(ptr, type) (type*) realloc(ptr, sizeof(type))
+#include "internal.h"
+#include "native/native.h"
 
-// ----- TCP/IP socket types -----
-typedef struct stcp_channel
-{
-	socket_t socket;
-} stcp_channel;
-
-typedef struct stcp_server
-{
-	socket_t socket;
-} stcp_server;
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <time.h>
+#endif
 
+// sendfile moves at most this many bytes per call
+#define STCP_SEND_FILE_CHUNK 0x40000000
 
 // ----- Initialization -----
-static bool init = false;
+// Every stcp_initialize() is matched by an stcp_terminate(). Calls that don't
+// start or end the library only touch the count; the first and last take the lock
+static atomic_int _references = 0;
+static stcp_mutex _init_lock = STCP_MUTEX_INIT;
 
 bool stcp_initialize()
 {
-	if (!init)
+	int references = atomic_load_explicit(&_references, memory_order_acquire);
+	while (references > 0)
+	{
+		if (atomic_compare_exchange_weak_explicit(&_references, &references, references + 1,
+				memory_order_acq_rel, memory_order_acquire))
+			return true;
+	}
+
+	STCP_LOCK(&_init_lock);
+	if (atomic_load_explicit(&_references, memory_order_acquire) == 0)
 	{
 		// socket initialization
 		stcp_socket_initialize_library();
-
-		init = true;
 	}
 
+	atomic_fetch_add_explicit(&_references, 1, memory_order_release);
+	STCP_UNLOCK(&_init_lock);
 	return true;
 }
 
 void stcp_terminate()
 {
-	if (init)
+	int references = atomic_load_explicit(&_references, memory_order_acquire);
+	while (references > 1)
+	{
+		if (atomic_compare_exchange_weak_explicit(&_references, &references, references - 1,
+				memory_order_acq_rel, memory_order_acquire))
+			return;
+	}
+
+	STCP_LOCK(&_init_lock);
+	references = atomic_load_explicit(&_references, memory_order_acquire);
+
+	// The last reference is dropped here, so a concurrent stcp_initialize() either
+	// got in first or waits on the lock to start the library again
+	if (references > 0 && atomic_fetch_sub_explicit(&_references, 1, memory_order_acq_rel) == 1)
 	{
 		// socket cleanup
 		stcp_socket_terminate_library();
 
-		init = false;
+		// cached addresses
+		stcp_socket_clear_resolver_cache();
+
+		// pooled channels and servers
+		stcp_free_slabs();
 	}
+
+	STCP_UNLOCK(&_init_lock);
+}
+
+// ----- Timeouts -----
+long long stcp_clock_milliseconds()
+{
+#ifdef _WIN32
+	return (long long) GetTickCount64();
+#else
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (long long) now.tv_sec * 1000 + now.tv_nsec / 1000000;
+#endif
+}
+
+long long stcp_clock_microseconds()
+{
+#ifdef _WIN32
+	LARGE_INTEGER frequency;
+	LARGE_INTEGER now;
+	QueryPerformanceFrequency(&frequency);
+	QueryPerformanceCounter(&now);
+	return now.QuadPart / frequency.QuadPart * 1000000
+			+ now.QuadPart % frequency.QuadPart * 1000000 / frequency.QuadPart;
+#else
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (long long) now.tv_sec * 1000000 + now.tv_nsec / 1000;
+#endif
+}
+
+long long stcp_make_deadline(int timeout_milliseconds)
+{
+	if (timeout_milliseconds < 0)
+		return -1;
+
+	return stcp_clock_milliseconds() + timeout_milliseconds;
+}
+
+int stcp_remaining_milliseconds(long long deadline)
+{
+	if (deadline < 0)
+		return -1;
+
+	long long remaining = deadline - stcp_clock_milliseconds();
+	return remaining > 0 ? (int) remaining : 0;
+}
+
+bool stcp_wait_write(stcp_channel* channel, long long deadline)
+{
+	int timeout_milliseconds = stcp_remaining_milliseconds(deadline);
+	if (timeout_milliseconds == 0)
+	{
+		stcp_count(channel, STCP_COUNT_TIMEOUTS, 1);
+		stcp_raise_error(STCP_ETIMEDOUT);
+		return false;
+	}
+
+	long long started = stcp_clock_microseconds();
+	bool ready;
+
+	if (channel->shared)
+		ready = stcp_shared_wait_write(channel, timeout_milliseconds);
+	// TLS can need to read a record before it can write one
+	else if (channel->tls && stcp_tls_wants_read(channel))
+		ready = stcp_socket_poll_read(&channel->socket, timeout_milliseconds);
+	else
+		ready = stcp_socket_poll_write(&channel->socket, timeout_milliseconds);
+
+	stcp_count_wait(channel, started, ready, timeout_milliseconds);
+	return ready;
+}
+
+bool stcp_wait_read(stcp_channel* channel, int timeout_milliseconds)
+{
+	// Bytes a stream consumer left in the receive ring are read first
+	if (stcp_get_receive_buffer_length(channel) > 0)
+		return true;
+
+	return stcp_wait_transport_read(channel, timeout_milliseconds);
+}
+
+bool stcp_has_buffered_read(const stcp_channel* channel)
+{
+	return stcp_get_receive_buffer_length(channel) > 0
+			|| (channel->tls && stcp_tls_pending(channel));
+}
+
+bool stcp_wait_transport_read(stcp_channel* channel, int timeout_milliseconds)
+{
+	// Decrypted data never shows up on the socket
+	if (channel->tls && stcp_tls_pending(channel))
+		return true;
+
+	long long started = stcp_clock_microseconds();
+	bool ready = channel->shared
+			? stcp_shared_wait_read(channel, timeout_milliseconds)
+			: stcp_socket_poll_read(&channel->socket, timeout_milliseconds);
+
+	stcp_count_wait(channel, started, ready, timeout_milliseconds);
+	return ready;
+}
+
+// ----- Transfers -----
+int stcp_channel_write(stcp_channel* channel, const char* buffer, int n)
+{
+	int ret;
+	if (channel->shared)
+		ret = stcp_shared_write(channel, buffer, n);
+	else if (channel->tls)
+		ret = stcp_tls_write(channel, buffer, n);
+	else
+		ret = stcp_socket_write(&channel->socket, buffer, n);
+
+	stcp_count_write(channel, n, ret);
+	return ret;
+}
+
+int stcp_channel_writev(stcp_channel* channel, const stcp_iovec* buffers, int count)
+{
+	int ret;
+	if (channel->shared)
+		ret = stcp_shared_writev(channel, buffers, count);
+	else if (channel->tls)
+		ret = stcp_tls_writev(channel, buffers, count);
+	else
+		ret = stcp_socket_writev(&channel->socket, buffers, count);
+
+	long long requested = 0;
+	for (int i = 0; i < count; ++i)
+		requested += (long long) buffers[i].length;
+
+	stcp_count_write(channel, requested, ret);
+	return ret;
+}
+
+int stcp_channel_read(stcp_channel* channel, char* buffer, int n)
+{
+	// Bytes a stream consumer left in the receive ring come first.
+	// They were counted when they arrived
+	if (stcp_get_receive_buffer_length(channel) > 0)
+	{
+		stcp_iovec target;
+		target.base = buffer;
+		target.length = n;
+		return stcp_ring_readv(channel, &target, 1);
+	}
+
+	return stcp_transport_read(channel, buffer, n);
+}
+
+int stcp_transport_read(stcp_channel* channel, char* buffer, int n)
+{
+	int ret;
+	if (channel->shared)
+		ret = stcp_shared_read(channel, buffer, n);
+	else if (channel->tls)
+		ret = stcp_tls_read(channel, buffer, n);
+	else
+		ret = stcp_socket_read(&channel->socket, buffer, n);
+
+	stcp_count_read(channel, ret);
+	return ret;
+}
+
+int stcp_channel_readv(stcp_channel* channel, stcp_iovec* buffers, int count)
+{
+	if (stcp_get_receive_buffer_length(channel) > 0)
+		return stcp_ring_readv(channel, buffers, count);
+
+	int ret;
+	if (channel->shared)
+		ret = stcp_shared_readv(channel, buffers, count);
+	else if (channel->tls)
+		ret = stcp_tls_readv(channel, buffers, count);
+	else
+		ret = stcp_socket_readv(&channel->socket, buffers, count);
+
+	stcp_count_read(channel, ret);
+	return ret;
+}
+
+int stcp_channel_send_file(stcp_channel* channel, int fd, long long offset, int n)
+{
+	int ret;
+	if (channel->shared)
+		ret = stcp_shared_send_file(channel, fd, offset, n);
+	else if (channel->tls)
+		ret = stcp_tls_send_file(channel, fd, offset, n);
+	else
+		ret = stcp_socket_send_file(&channel->socket, fd, offset, n);
+
+	stcp_count_write(channel, n, ret);
+	return ret;
+}
+
+// ----- Addresses -----
+stcp_address* stcp_resolve(const char* address, const char* protocol)
+{
+	assert(address);
+	assert(protocol);
+
+	return stcp_socket_resolve(address, protocol);
+}
+
+void stcp_free_address(stcp_address* address)
+{
+	stcp_socket_free_address(address);
+}
+
+void stcp_set_resolver_cache_ttl(int ttl_milliseconds)
+{
+	stcp_socket_set_resolver_ttl(ttl_milliseconds);
+}
+
+void stcp_clear_resolver_cache()
+{
+	stcp_socket_clear_resolver_cache();
 }
 
 // ----- Servers -----
-stcp_server* stcp_open_server(const char* address, const char* protocol, int max_pending_channels)
+// private function to open a listening server, tuned when options isn't NULL
+static stcp_server* open_server(const char* address,
+		const char* protocol,
+		int max_pending_channels,
+		const stcp_options* options)
 {
-	stcp_server* server = MALLOC(stcp_server);
-	assert(server);
 	assert(address);
 	assert(max_pending_channels > 0);
 
-	server->socket = stcp_socket_create();
-	stcp_socket_bind(&server->socket, address, protocol);
+	stcp_address* resolved = stcp_resolve(address, protocol);
+	if (!resolved)
+		return NULL;
+
+	stcp_server* server = stcp_alloc_server();
+	server->socket = stcp_socket_create(resolved, STCP_SOCKET_STREAM);
+	server->has_options = options != NULL;
+	server->tls = NULL;
+	server->tls_timeout = STCP_SERVER_HANDSHAKE_TIMEOUT;
+	if (options)
+	{
+		server->options = *options;
+		if (!stcp_apply_options(&server->socket, options, STCP_OPTIONS_LISTENER))
+		{
+			stcp_free_address(resolved);
+			stcp_close_server(server);
+			return NULL;
+		}
+	}
+
+	bool bound = stcp_socket_bind(&server->socket, resolved);
+	stcp_free_address(resolved);
+	if (!bound)
+	{
+		// The path belongs to someone else, so it isn't unlinked
+		stcp_socket_close(&server->socket);
+		stcp_free_server(server);
+		return NULL;
+	}
+
 	stcp_socket_listen(&server->socket, max_pending_channels);
 	return server;
 }
 
-stcp_channel* stcp_accept(stcp_server* server, int timeout_milliseconds)
+stcp_server* stcp_open_server(const char* address, const char* protocol, int max_pending_channels)
 {
-	assert(server);
+	return open_server(address, protocol, max_pending_channels, NULL);
+}
 
-	if (!stcp_socket_poll_read(&server->socket, timeout_milliseconds))
+stcp_server* stcp_open_server_with_options(const char* address,
+		const char* protocol,
+		int max_pending_channels,
+		const stcp_options* options)
+{
+	assert(options);
+	return open_server(address, protocol, max_pending_channels, options);
+}
+
+// private function to wrap an accepted socket in a channel
+// Returns NULL, closing the socket, if its options or TLS handshake fail
+static stcp_channel* finish_accept(stcp_server* server, socket_t s, const stcp_socket_address* peer)
+{
+	stcp_channel* channel = stcp_create_channel(s);
+	channel->peer = *peer;
+	if (server->has_options && !stcp_apply_options(&channel->socket, &server->options, STCP_OPTIONS_ACCEPTED))
+	{
+		stcp_close_channel(channel);
 		return NULL;
+	}
 
-	stcp_channel* channel = MALLOC(stcp_channel);
-	assert(channel);
-	channel->socket = stcp_socket_accept(&server->socket);
+	// Each handshake gets its own timeout, the accept's may never end
+	if (server->tls && !stcp_tls_accept(channel, server->tls, stcp_make_deadline(server->tls_timeout)))
+	{
+		stcp_close_channel(channel);
+		return NULL;
+	}
+
+	stcp_count(NULL, STCP_COUNT_ACCEPTS, 1);
 	return channel;
 }
 
+int stcp_accept_batch(stcp_server* server,
+		stcp_channel** channels,
+		int max_channels,
+		int timeout_milliseconds)
+{
+	assert(server);
+	assert(channels);
+	assert(max_channels > 0);
+
+	if (!stcp_socket_poll_read(&server->socket, timeout_milliseconds))
+	{
+		if (timeout_milliseconds != 0)
+			stcp_count(NULL, STCP_COUNT_TIMEOUTS, 1);
+
+		return 0;
+	}
+
+	// One wake-up drains the backlog, until accept reports it empty
+	int count = 0;
+	while (count < max_channels)
+	{
+		stcp_socket_address peer;
+		socket_t s = stcp_socket_accept(&server->socket, &peer);
+		if (s == STCP_INVALID_SOCKET)
+			break;
+
+		stcp_channel* channel = finish_accept(server, s, &peer);
+		if (channel)
+			channels[count++] = channel;
+	}
+
+	return count;
+}
+
+stcp_channel* stcp_accept(stcp_server* server, int timeout_milliseconds)
+{
+	stcp_channel* channel;
+	return stcp_accept_batch(server, &channel, 1, timeout_milliseconds) ? channel : NULL;
+}
+
+void stcp_set_server_tls(stcp_server* server, stcp_tls_context* context)
+{
+	assert(server);
+	server->tls = context;
+}
+
+void stcp_set_server_handshake_timeout(stcp_server* server, int timeout_milliseconds)
+{
+	assert(server);
+	server->tls_timeout = timeout_milliseconds;
+}
+
 void stcp_close_server(stcp_server* server)
 {
 	if (server)
 	{
+		stcp_socket_unlink(&server->socket);
 		stcp_socket_close(&server->socket);
-		free(server);
+		stcp_free_server(server);
 	}
 }
 
 // ----- Channels -----
+stcp_channel* stcp_create_channel(socket_t s)
+{
+	stcp_channel* channel = stcp_alloc_channel();
+	channel->socket = s;
+	channel->zerocopy = NULL;
+	channel->send_queue = NULL;
+	channel->receive_ring = NULL;
+	channel->pool_entry = NULL;
+	channel->tls = NULL;
+	channel->busy_poll = NULL;
+	channel->shared = NULL;
+	channel->peer.length = 0;
+	channel->error_handler.callback = NULL;
+	channel->error_handler.user_data = NULL;
+	stcp_reset_counters(&channel->counters);
+	return channel;
+}
+
+const stcp_error_handler* stcp_enter_channel(stcp_channel* channel)
+{
+	assert(channel);
+	return stcp_swap_error_handler(channel->error_handler.callback ? &channel->error_handler : NULL);
+}
+
+void stcp_leave_channel(const stcp_error_handler* previous)
+{
+	stcp_swap_error_handler(previous);
+}
+
+bool stcp_get_peer_address(const stcp_channel* channel, char* buffer, int length)
+{
+	assert(channel);
+	assert(buffer);
+	assert(length > 0);
+
+	// Accepted channels got theirs from accept
+	if (channel->peer.length)
+		return stcp_socket_format_address(&channel->peer, buffer, length);
+
+	stcp_socket_address peer;
+	return stcp_socket_get_peer_address(&channel->socket, &peer)
+			&& stcp_socket_format_address(&peer, buffer, length);
+}
+
+void stcp_set_channel_error_callback(stcp_channel* channel,
+		stcp_error_callback_fn error_callback,
+		void* user_data)
+{
+	assert(channel);
+	channel->error_handler.callback = error_callback;
+	channel->error_handler.user_data = user_data;
+}
+
+stcp_channel* stcp_connect_async(const char* address, const char* protocol)
+{
+	assert(address);
+	assert(protocol);
+
+	socket_t s = stcp_socket_connect(address, protocol);
+	if (s == STCP_INVALID_SOCKET)
+		return NULL;
+
+	return stcp_create_channel(s);
+}
+
 stcp_channel* stcp_connect(const char* address, const char* protocol)
 {
-	stcp_channel* channel = (stcp_channel*) malloc(sizeof(stcp_channel));
+	return stcp_connect_async(address, protocol);
+}
+
+static bool connect_wait(stcp_channel* channel, int timeout_milliseconds)
+{
 	assert(channel);
+
+	int result;
+	stcp_socket_wait_connected(&channel->socket, 1, &result, timeout_milliseconds);
+	return result == 1;
+}
+
+bool stcp_connect_wait(stcp_channel* channel, int timeout_milliseconds)
+{
+	const stcp_error_handler* previous = stcp_enter_channel(channel);
+	bool connected = connect_wait(channel, timeout_milliseconds);
+	stcp_leave_channel(previous);
+	return connected;
+}
+
+int stcp_connect_many(const char* address,
+		const char* protocol,
+		stcp_channel** channels,
+		int count,
+		int timeout_milliseconds)
+{
+	assert(address);
+	assert(protocol);
+	assert(channels);
+	assert(count > 0);
+
+	for (int i = 0; i < count; ++i)
+		channels[i] = NULL;
+
+	stcp_address* resolved = stcp_socket_resolve(address, protocol);
+	if (!resolved)
+		return 0;
+
+	// Start every connect before waiting on any, so the handshakes overlap
+	socket_t* sockets = (socket_t*) stcp_malloc(count * sizeof(socket_t));
+	int started = 0;
+	for (int i = 0; i < count; ++i)
+	{
+		// A socket that can't be created leaves its slot empty, like a failed connect
+		socket_t s = stcp_socket_try_create(resolved, STCP_SOCKET_STREAM);
+		if (s == STCP_INVALID_SOCKET)
+			continue;
+
+		if (stcp_socket_connect_address(&s, resolved))
+			sockets[started++] = s;
+		else
+			stcp_socket_close(&s);
+	}
+
+	stcp_socket_free_address(resolved);
+
+	int connected = 0;
+	if (started > 0)
+	{
+		int* results = (int*) stcp_malloc(started * sizeof(int));
+		stcp_socket_wait_connected(sockets, started, results, timeout_milliseconds);
+		for (int i = 0; i < started; ++i)
+		{
+			if (results[i] == 1)
+				channels[connected++] = stcp_create_channel(sockets[i]);
+			else
+				stcp_socket_close(&sockets[i]);
+		}
+
+		stcp_free(results);
+	}
+
+	stcp_free(sockets);
+	return connected;
+}
+
+stcp_channel* stcp_connect_race(const char* address,
+		const char* protocol,
+		int timeout_milliseconds,
+		long long* connect_microseconds)
+{
 	assert(address);
 	assert(protocol);
 
-	channel->socket = stcp_socket_create();
-	stcp_socket_connect(&channel->socket, address, protocol);
+	long long started = stcp_clock_microseconds();
+	long long deadline = stcp_make_deadline(timeout_milliseconds);
+	stcp_socket_race* race = stcp_socket_start_race(address, protocol);
+	if (!race)
+		return NULL;
+
+	socket_t s = stcp_socket_run_race(race, stcp_remaining_milliseconds(deadline));
+	stcp_socket_end_race(race);
+	if (s == STCP_INVALID_SOCKET)
+		return NULL;
+
+	if (connect_microseconds)
+		*connect_microseconds = stcp_clock_microseconds() - started;
+
+	return stcp_create_channel(s);
+}
+
+stcp_channel* stcp_connect_with_options(const char* address,
+		const char* protocol,
+		const stcp_options* options)
+{
+	assert(address);
+	assert(protocol);
+	assert(options);
+
+	stcp_address* resolved = stcp_resolve(address, protocol);
+	if (!resolved)
+		return NULL;
+
+	stcp_channel* channel = stcp_create_channel(stcp_socket_create(resolved, STCP_SOCKET_STREAM));
+	bool connected = stcp_apply_options(&channel->socket, options, STCP_OPTIONS_CONNECTING)
+			&& stcp_socket_connect_address(&channel->socket, resolved);
+
+	stcp_free_address(resolved);
+	if (!connected)
+	{
+		stcp_close_channel(channel);
+		return NULL;
+	}
+
 	return channel;
 }
 
-bool stcp_send(stcp_channel* channel,
+stcp_channel* stcp_connect_address(const stcp_address* address)
+{
+	assert(address);
+
+	stcp_channel* channel = stcp_create_channel(stcp_socket_create(address, STCP_SOCKET_STREAM));
+	if (!stcp_socket_connect_address(&channel->socket, address))
+	{
+		stcp_close_channel(channel);
+		return NULL;
+	}
+
+	return channel;
+}
+
+static bool send_buffer(stcp_channel* channel,
 		const char* buffer,
 		int length,
 		int timeout_milliseconds)
@@ -107,16 +655,32 @@ bool stcp_send(stcp_channel* channel,
 	assert(buffer);
 	assert(length > 0);
 
-	if (!stcp_socket_poll_write(&channel->socket, timeout_milliseconds))
+	long long deadline = stcp_make_deadline(timeout_milliseconds);
+
+	// Queued data goes out first to keep the stream in order
+	if (channel->send_queue && !stcp_send_queue_drain(channel, deadline))
 		return false;
 
+	// TLS has to copy to encrypt anyway, and shared rings are written with a copy
+	if (channel->zerocopy && !channel->tls && !channel->shared && length >= stcp_zerocopy_threshold(channel))
+		return stcp_zerocopy_send(channel, buffer, length, deadline);
+
+	// Writing before polling saves a syscall while the socket buffer has room
 	int bytes_sent = 0;
 	while (bytes_sent < length)
 	{
-		int ret = stcp_socket_write(&channel->socket,
+		int ret = stcp_channel_write(channel,
 				buffer + bytes_sent,
 				length - bytes_sent);
 
+		if (ret == STCP_SOCKET_WOULD_BLOCK)
+		{
+			if (!stcp_wait_write(channel, deadline))
+				return false;
+
+			continue;
+		}
+
 		if (ret == 0)
 			return false;
 
@@ -126,22 +690,323 @@ bool stcp_send(stcp_channel* channel,
 	return true;
 }
 
+bool stcp_send(stcp_channel* channel,
+		const char* buffer,
+		int length,
+		int timeout_milliseconds)
+{
+	const stcp_error_handler* previous = stcp_enter_channel(channel);
+	bool sent = send_buffer(channel, buffer, length, timeout_milliseconds);
+	stcp_leave_channel(previous);
+	return sent;
+}
+
+static int receive_buffer(stcp_channel* channel,
+		char* buffer,
+		int length,
+		int timeout_milliseconds)
+{
+	assert(channel);
+	assert(buffer);
+	assert(length > 0);
+
+	long long deadline = stcp_make_deadline(timeout_milliseconds);
+	long long started = 0;
+	bool spin_missed = false;
+	int bytes_received = STCP_SOCKET_WOULD_BLOCK;
+
+	// Spinning skips the poll and the wake-up when data is about to arrive
+	if (channel->busy_poll)
+	{
+		started = stcp_clock_microseconds();
+		bytes_received = stcp_busy_poll_read(channel, buffer, length, started, timeout_milliseconds);
+		spin_missed = bytes_received == STCP_SOCKET_WOULD_BLOCK;
+	}
+
+	if (bytes_received == STCP_SOCKET_WOULD_BLOCK)
+	{
+		if (!stcp_wait_read(channel, stcp_remaining_milliseconds(deadline)))
+			return 0;
+
+		bytes_received = stcp_channel_read(channel, buffer, length);
+	}
+
+	// A TLS record can arrive in pieces, so wait for the rest of it
+	while (bytes_received == STCP_SOCKET_WOULD_BLOCK && channel->tls)
+	{
+		int remaining = stcp_remaining_milliseconds(deadline);
+		if (remaining == 0)
+		{
+			stcp_raise_error(STCP_ETIMEDOUT);
+			return 0;
+		}
+
+		if (!stcp_wait_read(channel, remaining))
+			return 0;
+
+		bytes_received = stcp_channel_read(channel, buffer, length);
+	}
+
+	if (bytes_received == STCP_SOCKET_WOULD_BLOCK)
+	{
+		// The poll can report data that is gone by the time it's read
+		stcp_raise_error(STCP_EWOULDBLOCK);
+		return 0;
+	}
+
+	// A spin that found data leaves the budget alone, however long it was descheduled
+	if (spin_missed && bytes_received > 0)
+		stcp_busy_poll_record(channel, started);
+
+	return bytes_received;
+}
+
 int stcp_receive(stcp_channel* channel,
 		char* buffer,
 		int length,
 		int timeout_milliseconds)
+{
+	const stcp_error_handler* previous = stcp_enter_channel(channel);
+	int bytes_received = receive_buffer(channel, buffer, length, timeout_milliseconds);
+	stcp_leave_channel(previous);
+	return bytes_received;
+}
+
+static int try_send(stcp_channel* channel,
+		const char* buffer,
+		int length)
+{
+	assert(channel);
+	assert(buffer);
+	assert(length > 0);
+
+	if (stcp_get_send_queue_length(channel) > 0)
+	{
+		if (!stcp_flush_send_queue(channel))
+			return 0;
+
+		if (stcp_get_send_queue_length(channel) > 0)
+			return STCP_SOCKET_WOULD_BLOCK;
+	}
+
+	return stcp_channel_write(channel, buffer, length);
+}
+
+int stcp_try_send(stcp_channel* channel,
+		const char* buffer,
+		int length)
+{
+	const stcp_error_handler* previous = stcp_enter_channel(channel);
+	int bytes_sent = try_send(channel, buffer, length);
+	stcp_leave_channel(previous);
+	return bytes_sent;
+}
+
+static int try_receive(stcp_channel* channel,
+		char* buffer,
+		int length)
 {
 	assert(channel);
 	assert(buffer);
 	assert(length > 0);
 
-	if (!stcp_socket_poll_read(&channel->socket, timeout_milliseconds))
+	return stcp_channel_read(channel, buffer, length);
+}
+
+int stcp_try_receive(stcp_channel* channel,
+		char* buffer,
+		int length)
+{
+	const stcp_error_handler* previous = stcp_enter_channel(channel);
+	int bytes_received = try_receive(channel, buffer, length);
+	stcp_leave_channel(previous);
+	return bytes_received;
+}
+
+static bool send_buffers(stcp_channel* channel,
+		const stcp_iovec* buffers,
+		int count,
+		int timeout_milliseconds)
+{
+	assert(channel);
+	assert(buffers);
+	assert(count > 0);
+
+	long long deadline = stcp_make_deadline(timeout_milliseconds);
+	if (channel->send_queue && !stcp_send_queue_drain(channel, deadline))
+		return false;
+
+	// A partial write can stop inside any buffer, so the rest
+	// is resent from a window that starts at the first unsent byte
+	stcp_iovec window[STCP_IOV_MAX];
+	int index = 0;
+	size_t offset = 0;
+	while (true)
+	{
+		while (index < count && offset == buffers[index].length)
+		{
+			++index;
+			offset = 0;
+		}
+
+		if (index == count)
+			break;
+
+		int n = 0;
+		for (; n < STCP_IOV_MAX && index + n < count; ++n)
+			window[n] = buffers[index + n];
+		window[0].base = (char*) window[0].base + offset;
+		window[0].length -= offset;
+
+		int ret = stcp_channel_writev(channel, window, n);
+		if (ret == STCP_SOCKET_WOULD_BLOCK)
+		{
+			if (!stcp_wait_write(channel, deadline))
+				return false;
+
+			continue;
+		}
+
+		if (ret == 0)
+			return false;
+
+		size_t bytes_sent = ret;
+		while (bytes_sent > 0)
+		{
+			size_t remaining = buffers[index].length - offset;
+			if (bytes_sent < remaining)
+			{
+				offset += bytes_sent;
+				break;
+			}
+
+			bytes_sent -= remaining;
+			++index;
+			offset = 0;
+		}
+	}
+
+	return true;
+}
+
+bool stcp_sendv(stcp_channel* channel,
+		const stcp_iovec* buffers,
+		int count,
+		int timeout_milliseconds)
+{
+	const stcp_error_handler* previous = stcp_enter_channel(channel);
+	bool sent = send_buffers(channel, buffers, count, timeout_milliseconds);
+	stcp_leave_channel(previous);
+	return sent;
+}
+
+static int receive_buffers(stcp_channel* channel,
+		stcp_iovec* buffers,
+		int count,
+		int timeout_milliseconds)
+{
+	assert(channel);
+	assert(buffers);
+	assert(count > 0);
+
+	if (count > STCP_IOV_MAX)
+		count = STCP_IOV_MAX;
+
+	long long deadline = stcp_make_deadline(timeout_milliseconds);
+	if (!stcp_wait_read(channel, timeout_milliseconds))
 		return 0;
 
-	return stcp_socket_read(&channel->socket, buffer, length);
+	int bytes_received = stcp_channel_readv(channel, buffers, count);
+
+	// A TLS record can arrive in pieces, so wait for the rest of it
+	while (bytes_received == STCP_SOCKET_WOULD_BLOCK && channel->tls)
+	{
+		int remaining = stcp_remaining_milliseconds(deadline);
+		if (remaining == 0)
+		{
+			stcp_raise_error(STCP_ETIMEDOUT);
+			return 0;
+		}
+
+		if (!stcp_wait_read(channel, remaining))
+			return 0;
+
+		bytes_received = stcp_channel_readv(channel, buffers, count);
+	}
+
+	if (bytes_received == STCP_SOCKET_WOULD_BLOCK)
+	{
+		// The poll can report data that is gone by the time it's read
+		stcp_raise_error(STCP_EWOULDBLOCK);
+		return 0;
+	}
+
+	return bytes_received;
 }
 
-bool stcp_stream_receive(stcp_channel* channel,
+int stcp_receivev(stcp_channel* channel,
+		stcp_iovec* buffers,
+		int count,
+		int timeout_milliseconds)
+{
+	const stcp_error_handler* previous = stcp_enter_channel(channel);
+	int bytes_received = receive_buffers(channel, buffers, count, timeout_milliseconds);
+	stcp_leave_channel(previous);
+	return bytes_received;
+}
+
+static bool send_file(stcp_channel* channel,
+		int fd,
+		long long offset,
+		long long length,
+		int timeout_milliseconds)
+{
+	assert(channel);
+	assert(fd >= 0);
+	assert(offset >= 0);
+	assert(length > 0);
+
+	long long deadline = stcp_make_deadline(timeout_milliseconds);
+	if (channel->send_queue && !stcp_send_queue_drain(channel, deadline))
+		return false;
+
+	long long bytes_sent = 0;
+	while (bytes_sent < length)
+	{
+		long long remaining = length - bytes_sent;
+		int n = remaining > STCP_SEND_FILE_CHUNK ? STCP_SEND_FILE_CHUNK : (int) remaining;
+
+		int ret = stcp_channel_send_file(channel, fd, offset + bytes_sent, n);
+		if (ret == STCP_SOCKET_WOULD_BLOCK)
+		{
+			if (!stcp_wait_write(channel, deadline))
+				return false;
+
+			continue;
+		}
+
+		if (ret == 0)
+			return false;
+
+		bytes_sent += ret;
+	}
+
+	return true;
+}
+
+bool stcp_send_file(stcp_channel* channel,
+		int fd,
+		long long offset,
+		long long length,
+		int timeout_milliseconds)
+{
+	const stcp_error_handler* previous = stcp_enter_channel(channel);
+	bool sent = send_file(channel, fd, offset, length, timeout_milliseconds);
+	stcp_leave_channel(previous);
+	return sent;
+}
+
+static bool stream_receive(stcp_channel* channel,
 		stream_output_fn stream_output,
 		void* user_data,
 		int timeout_milliseconds)
@@ -149,32 +1014,65 @@ bool stcp_stream_receive(stcp_channel* channel,
 	assert(channel);
 	assert(stream_output);
 
-	if (!stcp_socket_poll_read(&channel->socket, timeout_milliseconds))
+	if (!stcp_wait_read(channel, timeout_milliseconds))
 		return false;
 
+	if (channel->receive_ring)
+		return stcp_ring_stream_receive(channel, stream_output, user_data);
+
 	char buffer[STCP_STREAM_BUFFER_SIZE];
 	const int length = STCP_STREAM_BUFFER_SIZE;
 
-	do
+	// Read until the socket runs dry, rather than polling before every chunk
+	while (true)
 	{
-		int bytes_received = stcp_socket_read(&channel->socket, buffer, length);
+		int bytes_received = stcp_channel_read(channel, buffer, length);
+
+		if (bytes_received == STCP_SOCKET_WOULD_BLOCK)
+			return true;
 
 		if (bytes_received == 0)
 			return false;
 
 		if (!stream_output(buffer, bytes_received, user_data))
 			return false;
+	}
+}
 
-	} while (stcp_socket_poll_read(&channel->socket, 0));
-
-	return true;
+bool stcp_stream_receive(stcp_channel* channel,
+		stream_output_fn stream_output,
+		void* user_data,
+		int timeout_milliseconds)
+{
+	const stcp_error_handler* previous = stcp_enter_channel(channel);
+	bool received = stream_receive(channel, stream_output, user_data, timeout_milliseconds);
+	stcp_leave_channel(previous);
+	return received;
 }
 
 void stcp_close_channel(stcp_channel* channel)
 {
 	if (channel)
 	{
+		if (channel->zerocopy)
+			stcp_zerocopy_close(channel);
+
+		if (channel->send_queue)
+			stcp_send_queue_close(channel);
+
+		if (channel->receive_ring)
+			stcp_ring_close(channel);
+
+		if (channel->tls)
+			stcp_tls_close(channel);
+
+		if (channel->busy_poll)
+			stcp_busy_poll_close(channel);
+
+		if (channel->shared)
+			stcp_shared_close(channel);
+
 		stcp_socket_close(&channel->socket);
-		free(channel);
+		stcp_free_channel(channel);
 	}
 }
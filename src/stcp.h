@@ -13,45 +13,202 @@ extern "C" {
 #define STCP_STREAM_BUFFER_SIZE 2048
 #endif
 
+// Most buffers passed to a single scatter/gather syscall
+#define STCP_IOV_MAX 64
+
+// Default bound on each TLS handshake stcp_accept() runs, in milliseconds
+#ifndef STCP_SERVER_HANDSHAKE_TIMEOUT
+#define STCP_SERVER_HANDSHAKE_TIMEOUT 5000
+#endif
+
 // ----- TCP/IP socket types -----
 typedef struct stcp_channel stcp_channel;
 typedef struct stcp_server stcp_server;
+typedef struct stcp_event_loop stcp_event_loop;
+typedef struct stcp_uring stcp_uring;
+typedef struct stcp_pool stcp_pool;
+typedef struct stcp_framer stcp_framer;
+typedef struct stcp_tls_context stcp_tls_context;
+typedef struct stcp_datagram stcp_datagram;
+
+// ----- Socket options -----
+typedef enum stcp_profile
+{
+	STCP_PROFILE_DEFAULT,
+
+	// TCP_NODELAY, TCP_QUICKACK and a small TCP_NOTSENT_LOWAT
+	STCP_PROFILE_LOW_LATENCY,
+
+	// Large socket buffers where the kernel doesn't autotune them
+	STCP_PROFILE_BULK_THROUGHPUT
+} stcp_profile;
+
+// Socket tuning. Zero leaves the system default in place, and options
+// the platform doesn't have must stay zero
+typedef struct stcp_options
+{
+	bool no_delay;					// TCP_NODELAY
+	bool quick_ack;					// TCP_QUICKACK (linux)
+	int send_buffer_size;			// SO_SNDBUF
+	int receive_buffer_size;		// SO_RCVBUF
+	int busy_poll_microseconds;		// SO_BUSY_POLL (linux)
+	int not_sent_low_water;			// TCP_NOTSENT_LOWAT (linux, macOS)
+	int fast_open;					// TCP_FASTOPEN queue length for servers, or TCP_FASTOPEN_CONNECT for clients
+	int defer_accept_seconds;		// TCP_DEFER_ACCEPT for servers (linux)
+} stcp_options;
+
 
 // ----- Callback function pointers -----
 // Process the stream buffer
 // Return true if successful
 typedef bool (*stream_output_fn)(const char* buffer, int length, void* user_data);
 
+// Process a prefix of the buffered stream, leaving the rest for the next call
+// Return the number of bytes consumed, or -1 to stop with an error
+typedef int (*stream_consume_fn)(const char* buffer, int length, void* user_data);
+
+// Process one complete frame. The frame is only valid during the call
+// Return true if successful
+typedef bool (*frame_output_fn)(const char* frame, int length, void* user_data);
+
+// Called once the kernel no longer references a buffer sent in zero-copy mode
+// copied is true if the kernel had to copy the buffer after all
+typedef void (*zerocopy_release_fn)(const char* buffer, bool copied, void* user_data);
+
+// ----- Memory -----
+// Allocator hooks for all of the library's memory
+typedef void* (*stcp_allocate_fn)(size_t size, void* user_data);
+typedef void (*stcp_deallocate_fn)(void* pointer, void* user_data);
+
+// Replaces malloc and free (pass NULL to restore them). Call this before stcp_initialize().
+// Channels and servers are pooled on top of the hooks with per-thread caches,
+// and that memory is handed back when the library terminates
+void stcp_set_allocator(stcp_allocate_fn allocate,
+		stcp_deallocate_fn deallocate,
+		void* user_data);
+
+
 // ----- Initialization -----
 // Initializes the library. This must be called before any other function.
+// Calls are counted, so each thread or module can make its own, from any thread
 // Returns true if successful
 bool stcp_initialize();
 
-// Terminates the library
+// Terminates the library once every stcp_initialize() has been matched.
+// Channels and servers still open stay valid and can be closed afterwards;
+// their pooled memory is returned by a later stcp_terminate() once they are
 void stcp_terminate();
 
 
+// ----- Addresses -----
+// Resolves an ip or hostname and a protocol or port ahead of connecting.
+// Results are cached (60 seconds by default), so repeated connects skip the lookup.
+// Returns NULL if the address can't be resolved
+stcp_address* stcp_resolve(const char* address,
+		const char* protocol);
+
+// Frees a resolved address
+void stcp_free_address(stcp_address* address);
+
+// Sets how long resolved addresses stay cached (use 0 to disable the cache)
+void stcp_set_resolver_cache_ttl(int ttl_milliseconds);
+
+// Forgets every cached address
+void stcp_clear_resolver_cache();
+
+
 // ----- Servers -----
 // Create a TCP/IP server with the given address and max allowed pending channels.
+// Addresses starting with "unix:" are unix socket paths instead (the protocol is ignored),
+// or abstract names on linux with "unix:@name". A socket file left by a server that is
+// gone gets replaced, and closing the server removes it
+// Returns NULL if the address can't be resolved, or raises STCP_EADDRINUSE if another
+// server holds the unix address
 stcp_server* stcp_open_server(const char* address,
 		const char* protocol,
 		int max_pending_channels);
 
+// Creates a server like stcp_open_server() with tuned sockets.
+// Accepted channels get the same options
+// Returns NULL if an option can't be set
+stcp_server* stcp_open_server_with_options(const char* address,
+		const char* protocol,
+		int max_pending_channels,
+		const stcp_options* options);
+
 // Accepts a pending channel using a timeout (use a negative timeout to block).
 stcp_channel* stcp_accept(stcp_server* server,
 		int timeout_milliseconds);
 
+// Waits for pending channels like stcp_accept(), then accepts up to max_channels of them
+// without waiting again, so a burst of connections costs one wake-up
+// Returns the number of channels written to channels (0 on timeout)
+int stcp_accept_batch(stcp_server* server,
+		stcp_channel** channels,
+		int max_channels,
+		int timeout_milliseconds);
+
 // Frees a server's resources in memory
 void stcp_close_server(stcp_server* server);
 
 
 // ----- Channels -----
-// Creates a TCP/IP channel (client) connected to the given server address.
-// Returns true if successful
+// Creates a TCP/IP channel (client) connected to the given server address,
+// or a unix socket channel for "unix:" addresses like stcp_open_server() takes.
+// Only the first resolved address is tried, and the connection completes in the background:
+// use stcp_connect_wait() to find out how it went before the first transfer
+// Returns NULL if the address can't be resolved or the connection can't be started
+stcp_channel* stcp_connect_async(const char* address,
+		const char* protocol);
+
+// Same as stcp_connect_async()
 stcp_channel* stcp_connect(const char* address,
 		const char* protocol);
 
-// Sends data through a channel until the buffer is empty, or an error occurs
+// Waits for a channel's connection to be established, and reports the error if it
+// failed (such as STCP_ECONNREFUSED) rather than leaving it to the first transfer.
+// Returns true at once for channels that are already connected
+bool stcp_connect_wait(stcp_channel* channel,
+		int timeout_milliseconds);
+
+// Starts count connections to the address at once and waits for them together, so
+// opening many channels takes about one round trip rather than one per channel.
+// The channels that connected fill the front of channels, the rest of it is NULL
+// Returns how many connected, raising the last failure or STCP_ETIMEDOUT if some didn't
+int stcp_connect_many(const char* address,
+		const char* protocol,
+		stcp_channel** channels,
+		int count,
+		int timeout_milliseconds);
+
+// Creates a channel connected to whichever of the address's IPv6 and IPv4 addresses
+// answers first, racing them like Happy Eyeballs (RFC 8305): the next address is tried
+// as soon as one fails or has had 250ms, without giving up on those still in flight.
+// Waits until the connection is established. If connect_microseconds isn't NULL it
+// receives the time from the call to the established connection, resolution included
+// Returns NULL if the address can't be resolved, every address failed, or the timeout ran out
+stcp_channel* stcp_connect_race(const char* address,
+		const char* protocol,
+		int timeout_milliseconds,
+		long long* connect_microseconds);
+
+// Creates a TCP/IP channel with tuned socket options, set before connecting
+// Returns NULL if the address can't be resolved, an option can't be set, or the connection can't be started
+stcp_channel* stcp_connect_with_options(const char* address,
+		const char* protocol,
+		const stcp_options* options);
+
+// Creates a TCP/IP channel connected to an address from stcp_resolve()
+// Returns NULL if the connection can't be started
+stcp_channel* stcp_connect_address(const stcp_address* address);
+
+// Writes the peer's address as "host:port" ("[host]:port" for IPv6). Accepted channels
+// remember it from the accept, others ask the kernel
+// Returns false if it isn't known or doesn't fit in length bytes
+bool stcp_get_peer_address(const stcp_channel* channel, char* buffer, int length);
+
+// Sends data through a channel until the buffer is empty, or an error occurs.
+// Waits for buffer space whenever the socket is full, until the timeout expires
 // Returns true if successful
 bool stcp_send(stcp_channel* channel,
 		const char* buffer,
@@ -66,16 +223,555 @@ int stcp_receive(stcp_channel* channel,
 		int length,
 		int timeout_milliseconds);
 
-// Receive channel data using a callback
+// Sends or receives whatever the socket takes or holds right now, without waiting.
+// Meant for event loops, which wait for readiness themselves. Anything still in the
+// send queue (see stcp_queue_send()) goes out before the buffer
+// Returns the number of bytes transferred, 0 on error or a closed channel, or STCP_SOCKET_WOULD_BLOCK
+int stcp_try_send(stcp_channel* channel,
+		const char* buffer,
+		int length);
+int stcp_try_receive(stcp_channel* channel,
+		char* buffer,
+		int length);
+
+// Sends a list of buffers through a channel as one stream, using as few syscalls as possible
+// Returns true if successful
+bool stcp_sendv(stcp_channel* channel,
+		const stcp_iovec* buffers,
+		int count,
+		int timeout_milliseconds);
+
+// Receives data into a list of buffers, filling each one before the next
+// Only the first STCP_IOV_MAX buffers are used
+// Returns the number of bytes received
+int stcp_receivev(stcp_channel* channel,
+		stcp_iovec* buffers,
+		int count,
+		int timeout_milliseconds);
+
+// Sends length bytes of a file starting at offset, without copying them through user space
+// where the platform allows (sendfile, or splice for pipes). The offset is ignored for pipes.
+// Waits for buffer space whenever the socket is full, until the timeout expires
+// Returns true if successful
+bool stcp_send_file(stcp_channel* channel,
+		int fd,
+		long long offset,
+		long long length,
+		int timeout_milliseconds);
+
+// Receive channel data using a callback. With a receive buffer (see stcp_set_receive_buffer())
+// each call of stream_output gets everything read so far instead of STCP_STREAM_BUFFER_SIZE chunks
 // Returns true if successful
 bool stcp_stream_receive(stcp_channel* channel,
 		stream_output_fn stream_output,
 		void* user_data,
 		int timeout_milliseconds);
 
+// Sends the errors of this channel's transfers and TLS handshakes to their own callback
+// instead of the shared one (NULL to go back to it). Errors are raised on the calling thread
+void stcp_set_channel_error_callback(stcp_channel* channel,
+		stcp_error_callback_fn error_callback,
+		void* user_data);
+
 // Frees a channel's resources in memory
 void stcp_close_channel(stcp_channel* channel);
 
+
+// ----- Socket options -----
+// Returns the options of a profile, for use as is or as a starting point
+stcp_options stcp_make_options(stcp_profile profile);
+
+// Changes the options of an open channel. The fast open and server options are ignored
+// Returns true if successful
+bool stcp_set_channel_options(stcp_channel* channel,
+		const stcp_options* options);
+
+// Reads back the options in effect. Buffer sizes are the kernel's, which
+// on linux are double the requested size
+void stcp_get_channel_options(const stcp_channel* channel,
+		stcp_options* options);
+void stcp_get_server_options(const stcp_server* server,
+		stcp_options* options);
+
+
+// ----- Receive buffers -----
+// Gives a channel a receive ring buffer of at least size bytes. On linux its pages are
+// mapped twice in a row, so buffered data is always contiguous and never moved.
+// Unread data is kept when the buffer is resized.
+// Returns true if successful
+bool stcp_set_receive_buffer(stcp_channel* channel, int size);
+
+// Returns the receive buffer's size, or 0 if the channel has none
+int stcp_get_receive_buffer_size(const stcp_channel* channel);
+
+// Returns the number of received bytes that haven't been consumed yet
+int stcp_get_receive_buffer_length(const stcp_channel* channel);
+
+// Reads into the receive buffer and passes all unconsumed data to stream_consume,
+// which returns how much of it was used. The rest stays in the buffer, so messages
+// that arrive in pieces don't have to be reassembled. Fails with STCP_EMSGSIZE if the
+// buffer fills up without anything being consumed. Shared memory channels need no
+// receive buffer, the callback reads straight from the peer's ring. Bytes left in
+// the buffer are what stcp_receive(), stcp_receivev() and stcp_try_receive() return next.
+// Returns true if successful
+bool stcp_stream_consume(stcp_channel* channel,
+		stream_consume_fn stream_consume,
+		void* user_data,
+		int timeout_milliseconds);
+
+
+// ----- Framing -----
+// Frames messages on a channel with a big-endian length prefix of prefix_width bytes (1, 2 or 4)
+// The channel's receive buffer is grown to hold max_frame_size bytes in one piece
+// Returns NULL if the receive buffer can't be allocated, or with STCP_EINVAL
+// if max_frame_size doesn't fit in the prefix (255 for 1 byte, 65535 for 2)
+stcp_framer* stcp_open_length_framer(stcp_channel* channel,
+		int prefix_width,
+		int max_frame_size);
+
+// Frames messages with a varint length prefix (7 bits per byte, least significant first)
+stcp_framer* stcp_open_varint_framer(stcp_channel* channel,
+		int max_frame_size);
+
+// Frames messages that end with a delimiter, such as "\r\n". Frames can't contain it
+stcp_framer* stcp_open_delimiter_framer(stcp_channel* channel,
+		const char* delimiter,
+		int delimiter_length,
+		int max_frame_size);
+
+// Receives data and passes every complete frame to frame_output, straight from the
+// receive buffer. Partial frames are kept until the rest arrives. Oversized frames
+// fail with STCP_EMSGSIZE.
+// Returns true if successful
+bool stcp_receive_frames(stcp_framer* framer,
+		frame_output_fn frame_output,
+		void* user_data,
+		int timeout_milliseconds);
+
+// Sends one frame
+// Returns true if successful
+bool stcp_send_frame(stcp_framer* framer,
+		const char* buffer,
+		int length,
+		int timeout_milliseconds);
+
+// Sends a batch of frames, writing headers and payloads together in as few syscalls as possible.
+// Nothing is sent if any frame is over max_frame_size, which fails with STCP_EMSGSIZE
+// Returns true if successful
+bool stcp_send_frames(stcp_framer* framer,
+		const stcp_iovec* frames,
+		int count,
+		int timeout_milliseconds);
+
+// Frees a framer. The channel stays open
+void stcp_close_framer(stcp_framer* framer);
+
+
+// ----- Busy polling -----
+// Makes stcp_receive() spin on non-blocking reads for up to max_spin_microseconds before
+// sleeping until the socket is readable, trading CPU time for wake-up latency (use 0 to stop).
+// The spin budget adapts to how long receives wait: it grows while data arrives shortly
+// after the spin gives up, and shrinks while it arrives later than max_spin_microseconds.
+// Only worth it when the receiving thread has a core to itself
+void stcp_set_busy_poll(stcp_channel* channel, int max_spin_microseconds);
+
+// Returns the current spin budget in microseconds (0 while busy polling is off or has backed off)
+int stcp_get_busy_poll_budget(const stcp_channel* channel);
+
+
+// ----- Shared memory -----
+// Moves a channel between two processes on the same host onto shared memory rings
+// (linux only). Both ends call this at the same point in the stream, with nothing queued
+// or buffered, and each offers a ring of at least ring_size bytes for the data it sends.
+// Afterwards transfers are a copy into or out of the rings, and a futex wakes the other
+// end only while it sleeps. The socket stays open to carry the hangup of a peer that dies.
+// Event loops, stcp_poll() and io_uring only see the socket, so they miss shared data.
+// Returns true if both ends switched. Otherwise the channel carries on over its socket,
+// failing with STCP_EOPNOTSUPP if either end declined
+bool stcp_enable_shared_memory(stcp_channel* channel, int ring_size, int timeout_milliseconds);
+
+// Returns true if the channel's transfers go through shared memory
+bool stcp_is_shared_memory(const stcp_channel* channel);
+
+
+// ----- Zero-copy sends -----
+// Makes stcp_send() pass buffers of at least threshold bytes to the kernel without
+// copying them (MSG_ZEROCOPY, linux 4.14+). Smaller sends are still copied.
+// Such a buffer must stay unchanged until release is called for it.
+// Returns true if successful
+bool stcp_enable_zerocopy(stcp_channel* channel,
+		int threshold,
+		zerocopy_release_fn release,
+		void* user_data);
+
+// Releases the buffers the kernel is done with, waiting for at least one if
+// there are none yet (use a negative timeout to block). stcp_send() drains
+// completions as well. Closing a channel waits briefly for pending buffers, and
+// release is never called for any the kernel hasn't reported by then.
+// Returns the number of buffers released
+int stcp_drain_zerocopy(stcp_channel* channel, int timeout_milliseconds);
+
+// Returns the number of zero-copy buffers still referenced by the kernel
+int stcp_get_zerocopy_pending(const stcp_channel* channel);
+
+
+// ----- Send queues -----
+// Sends as much as the socket takes without blocking and queues the rest,
+// so the caller never waits on a slow peer. Queued data is written before
+// anything sent later, and goes out as the socket drains.
+// Returns true if successful
+bool stcp_queue_send(stcp_channel* channel,
+		const char* buffer,
+		int length);
+
+// Writes as much queued data as the socket takes without blocking.
+// Call this when an event loop reports STCP_EVENT_WRITE.
+// Returns true if successful
+bool stcp_flush_send_queue(stcp_channel* channel);
+
+// Writes out the whole queue, waiting for buffer space until the timeout expires
+// Returns true if successful
+bool stcp_drain_send_queue(stcp_channel* channel, int timeout_milliseconds);
+
+// Returns the number of queued bytes
+size_t stcp_get_send_queue_length(const stcp_channel* channel);
+
+// Sets the queue length at which stcp_is_send_queue_full() reports backpressure (1 MiB by default)
+void stcp_set_send_queue_high_water(stcp_channel* channel, size_t bytes);
+
+// Returns true once the queue reaches its high-water mark. The queue still accepts
+// data, but callers should stop producing until it drains
+bool stcp_is_send_queue_full(const stcp_channel* channel);
+
+
+// ----- Connection pools -----
+// Creates a pool of outbound channels. Up to max_idle_per_address released channels
+// are kept open per (address, protocol), and at most max_total channels exist at once.
+// The pool is thread-safe
+stcp_pool* stcp_open_pool(int max_idle_per_address,
+		int max_total);
+
+// Checks out an idle channel to the address, or connects a new one.
+// Idle channels the peer closed or reset are discarded on the way.
+// Returns NULL if the pool is at max_total or the connection can't be started
+stcp_channel* stcp_pool_acquire(stcp_pool* pool,
+		const char* address,
+		const char* protocol);
+
+// Opens up to count new idle channels to the address with stcp_connect_many(), as far
+// as max_idle_per_address and max_total allow, so later acquires skip the handshake
+// Returns how many were added
+int stcp_pool_warm(stcp_pool* pool,
+		const char* address,
+		const char* protocol,
+		int count,
+		int timeout_milliseconds);
+
+// Returns a channel to the pool. Pass reusable = false after an error or a partial
+// exchange, and the channel is closed instead. Don't close pooled channels directly
+void stcp_pool_release(stcp_pool* pool,
+		stcp_channel* channel,
+		bool reusable);
+
+// Number of idle and checked out channels
+int stcp_get_pool_size(stcp_pool* pool);
+
+// Closes the idle channels and frees the pool. Release every channel first
+void stcp_close_pool(stcp_pool* pool);
+
+
+// ----- Datagrams -----
+// Opens a UDP socket bound to a local address (use port "0" for any), which
+// receives from anyone and sends wherever each message's address says
+stcp_datagram* stcp_open_datagram(const char* address,
+		const char* protocol);
+
+// Opens a UDP socket connected to one peer: messages with no address go to it,
+// and only its datagrams are received
+// Returns NULL if the address can't be resolved or connected
+stcp_datagram* stcp_connect_datagram(const char* address,
+		const char* protocol);
+
+// Points a message at an address from stcp_resolve()
+void stcp_set_message_address(stcp_message* message, const stcp_address* address);
+
+// Sends a batch of datagrams with as few syscalls as possible (sendmmsg on linux, which
+// also merges runs of equal-sized datagrams to one address into a single UDP GSO send).
+// Waits for buffer space whenever the socket is full, until the timeout expires
+// Returns the number of datagrams sent
+int stcp_send_datagrams(stcp_datagram* datagram,
+		const stcp_message* messages,
+		int count,
+		int timeout_milliseconds);
+
+// Receives up to count datagrams in one syscall where possible (recvmmsg on linux),
+// waiting for the first until the timeout expires. Each message gets the datagram's
+// length and sender. Datagrams longer than their buffer are cut short
+// Returns the number of datagrams received
+int stcp_receive_datagrams(stcp_datagram* datagram,
+		stcp_message* messages,
+		int count,
+		int timeout_milliseconds);
+
+// Frees a datagram socket's resources in memory
+void stcp_close_datagram(stcp_datagram* datagram);
+
+
+// ----- TLS -----
+// Where the kernel encrypts or decrypts records (kernel TLS)
+typedef enum stcp_tls_offload
+{
+	STCP_TLS_OFFLOAD_SEND    = 1 << 0,
+	STCP_TLS_OFFLOAD_RECEIVE = 1 << 1,
+} stcp_tls_offload;
+
+// Creates a context for accepting TLS channels with a PEM certificate chain and private key.
+// Every TLS function raises STCP_EOPNOTSUPP when stcp is built without OpenSSL.
+// Returns NULL on error
+stcp_tls_context* stcp_open_tls_server_context(const char* certificate_file,
+		const char* private_key_file);
+
+// Creates a context for connecting TLS channels. With verify_peer, the server's certificate
+// is checked against ca_file (or the system's CAs if NULL) and the name given to stcp_start_tls().
+// The context keeps each server's last session to resume later connections.
+// Returns NULL on error
+stcp_tls_context* stcp_open_tls_client_context(const char* ca_file,
+		bool verify_peer);
+
+// Frees a context. Close every channel using it first
+void stcp_close_tls_context(stcp_tls_context* context);
+
+// Runs a client handshake over a connected channel. Every transfer afterwards is encrypted
+// and zero-copy sends fall back to copying. io_uring operations don't support TLS.
+// Returns true if successful
+bool stcp_start_tls(stcp_channel* channel,
+		stcp_tls_context* context,
+		const char* server_name,
+		int timeout_milliseconds);
+
+// Runs a server handshake over an accepted channel
+// Returns true if successful
+bool stcp_accept_tls(stcp_channel* channel,
+		stcp_tls_context* context,
+		int timeout_milliseconds);
+
+// Makes stcp_accept() handshake every channel, or NULL to stop
+void stcp_set_server_tls(stcp_server* server, stcp_tls_context* context);
+
+// Bounds each of those handshakes on its own, whatever the accept's timeout, so a silent
+// client can't hold stcp_accept() forever. STCP_SERVER_HANDSHAKE_TIMEOUT by default (-1 waits forever)
+void stcp_set_server_handshake_timeout(stcp_server* server, int timeout_milliseconds);
+
+// Whether the handshake resumed an earlier session
+bool stcp_is_tls_session_reused(const stcp_channel* channel);
+
+// STCP_TLS_OFFLOAD_* flags for the directions the kernel handles
+int stcp_get_tls_offload(const stcp_channel* channel);
+
+
+// ----- Statistics -----
+// Counters that only grow, so rates come from the difference between two snapshots.
+// Transfers count every read or write call made, including ones that would block.
+// Datagrams count toward the library's counters. io_uring operations aren't counted
+typedef struct stcp_stats
+{
+	unsigned long long bytes_sent;
+	unsigned long long send_calls;
+	unsigned long long bytes_received;
+	unsigned long long receive_calls;
+
+	// writes that the socket only took part of
+	unsigned long long partial_writes;
+
+	// waits for a channel to become readable or writable, and the time spent in them
+	unsigned long long poll_waits;
+	unsigned long long poll_wait_microseconds;
+
+	// waits (including accepts) that ran out of time
+	unsigned long long timeouts;
+	unsigned long long accepts;
+
+	// busy polled receives that found data or fell back to waiting, and the time spent spinning
+	unsigned long long busy_poll_hits;
+	unsigned long long busy_poll_misses;
+	unsigned long long busy_poll_microseconds;
+} stcp_stats;
+
+// Takes a snapshot of the counters for every channel and server since the process started.
+// Cheap enough to scrape often
+void stcp_get_stats(stcp_stats* stats);
+
+// Takes a snapshot of a channel's counters since it was created. accepts is always 0
+void stcp_get_channel_stats(const stcp_channel* channel, stcp_stats* stats);
+
+
+// ----- Event loops -----
+// Readiness flags for event loops
+typedef enum stcp_event_flags
+{
+	STCP_EVENT_READ     = 1 << 0,
+	STCP_EVENT_WRITE    = 1 << 1,
+	STCP_EVENT_HANGUP   = 1 << 2,
+	STCP_EVENT_ERROR    = 1 << 3,
+} stcp_event_flags;
+
+// A ready channel or server, identified by the user data it was added with
+typedef struct stcp_event
+{
+	int events;
+	void* user_data;
+} stcp_event;
+
+// Creates an event loop (epoll on linux, poll elsewhere).
+// Edge triggered loops only report changes in readiness, so a ready
+// channel must be drained until it would block. Not supported by the poll fallback.
+// Either way the loop only sees the socket: TLS can hold decrypted data and a receive
+// buffer can hold unconsumed bytes that never make it readable again, so keep calling
+// stcp_try_receive() on a readable channel until it returns STCP_SOCKET_WOULD_BLOCK.
+stcp_event_loop* stcp_open_event_loop(bool edge_triggered);
+
+// Registers a channel or server with the loop for the given STCP_EVENT_* flags.
+// Hangups and errors are always reported. Remove a socket before closing it.
+// Returns true if successful
+bool stcp_event_loop_add_channel(stcp_event_loop* loop,
+		stcp_channel* channel,
+		int events,
+		void* user_data);
+bool stcp_event_loop_add_server(stcp_event_loop* loop,
+		stcp_server* server,
+		int events,
+		void* user_data);
+
+// Changes the flags and user data of a registered channel or server
+// Returns true if successful
+bool stcp_event_loop_modify_channel(stcp_event_loop* loop,
+		stcp_channel* channel,
+		int events,
+		void* user_data);
+bool stcp_event_loop_modify_server(stcp_event_loop* loop,
+		stcp_server* server,
+		int events,
+		void* user_data);
+
+// Unregisters a channel or server
+// Returns true if successful
+bool stcp_event_loop_remove_channel(stcp_event_loop* loop, stcp_channel* channel);
+bool stcp_event_loop_remove_server(stcp_event_loop* loop, stcp_server* server);
+
+// Waits for registered sockets to become ready (use a negative timeout to block).
+// Timing out is not an error.
+// Returns the number of events written, or 0 on timeout
+int stcp_event_loop_wait(stcp_event_loop* loop,
+		stcp_event* events,
+		int max_events,
+		int timeout_milliseconds);
+
+// Frees an event loop. Registered channels and servers are not closed
+void stcp_close_event_loop(stcp_event_loop* loop);
+
+
+// ----- Polling -----
+// A channel or server to poll. Set exactly one of channel and server
+typedef struct stcp_poll_entry
+{
+	stcp_channel* channel;
+	stcp_server* server;
+	int events;  // requested STCP_EVENT_* flags
+	int revents; // ready STCP_EVENT_* flags, set by stcp_poll()
+} stcp_poll_entry;
+
+// Waits until any entry is ready using a single syscall (use a negative timeout to block).
+// Channels with data already decrypted by TLS or left in their receive buffer are
+// readable without waiting. Hangups and errors are always reported. Timing out is not an error.
+// Returns the number of ready entries, which are the ones with nonzero revents
+int stcp_poll(stcp_poll_entry* entries,
+		int n,
+		int timeout_milliseconds);
+
+
+// ----- io_uring -----
+// Operations queued on an io_uring
+typedef enum stcp_uring_op
+{
+	STCP_URING_ACCEPT,
+	STCP_URING_RECEIVE,
+	STCP_URING_SEND,
+	STCP_URING_CANCEL, // never reported
+} stcp_uring_op;
+
+// A completed io_uring operation
+typedef struct stcp_completion
+{
+	stcp_uring_op op;
+	void* user_data;
+
+	// Bytes transferred (0 at the end of a stream), or a negative stcp_error
+	int result;
+
+	// STCP_URING_ACCEPT: the accepted channel, owned by the caller
+	stcp_channel* channel;
+
+	// STCP_URING_RECEIVE: the registered buffer holding the data.
+	// Hand it back with stcp_uring_release_buffer() once processed
+	const char* buffer;
+	int buffer_id;
+
+	// True while a multishot operation stays armed.
+	// Otherwise it has finished and must be queued again to continue
+	bool more;
+} stcp_completion;
+
+// Creates an io_uring (linux 6.0+) with the given submission queue size and
+// buffer_count (a power of two) registered receive buffers of buffer_size bytes.
+// Returns NULL and raises STCP_EOPNOTSUPP if the kernel does not support it
+stcp_uring* stcp_open_uring(int entries,
+		int buffer_count,
+		int buffer_size);
+
+// Queues a multishot accept, which completes once per accepted channel. Channels get the
+// server's options, and a channel they fail on completes with the error instead.
+// Returns true if successful, or false and raises STCP_EOPNOTSUPP for a TLS server
+bool stcp_uring_accept(stcp_uring* ring,
+		stcp_server* server,
+		void* user_data);
+
+// Queues a multishot receive into the registered buffers, which completes once per read
+// Returns true if successful, or false and raises STCP_EOPNOTSUPP for TLS or shared memory channels
+bool stcp_uring_receive(stcp_uring* ring,
+		stcp_channel* channel,
+		void* user_data);
+
+// Queues a send of the whole buffer. The buffer must stay valid until it completes
+// Returns true if successful, or false and raises STCP_EOPNOTSUPP for TLS or shared memory channels
+bool stcp_uring_send(stcp_uring* ring,
+		stcp_channel* channel,
+		const char* buffer,
+		int length,
+		void* user_data);
+
+// Cancels every operation on a channel. Do this before closing the channel
+// Returns true if successful
+bool stcp_uring_cancel(stcp_uring* ring, stcp_channel* channel);
+
+// Cancels a server's multishot accept. Do this before closing the server,
+// whose port otherwise stays bound until the ring is closed
+// Returns true if successful
+bool stcp_uring_cancel_accept(stcp_uring* ring, stcp_server* server);
+
+// Submits all queued operations and reaps completions in the same syscall,
+// waiting for at least one (use a negative timeout to block). Timing out is not an error.
+// Returns the number of completions written
+int stcp_uring_wait(stcp_uring* ring,
+		stcp_completion* completions,
+		int max_completions,
+		int timeout_milliseconds);
+
+// Returns a receive buffer to the kernel
+void stcp_uring_release_buffer(stcp_uring* ring, int buffer_id);
+
+// Frees an io_uring, cancelling any operations in flight
+void stcp_close_uring(stcp_uring* ring);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,568 @@
+// stcp.hpp
+#ifndef STCP_HPP_
+#define STCP_HPP_
+
+/*
+ * Optional C++20 interface over the C library.
+ *
+ * Channels and servers are owned by RAII types, and accept, connect,
+ * send and receive are awaitable. A single-threaded event_loop runs
+ * every task: a transfer is tried first, and only a task that would
+ * block is parked on the loop until its socket is ready, so any number
+ * of sessions share one thread and one epoll set.
+ *
+ * Results mirror the C functions (empty channels, false, 0), and the
+ * error callback still reports why. TLS channels work once the
+ * handshake is done, but the handshake itself blocks.
+ */
+
+#include <coroutine>
+#include <cstddef>
+#include <exception>
+#include <optional>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "stcp.h"
+
+namespace stcp
+{
+
+class event_loop;
+
+// ----- Tasks -----
+// A lazily started coroutine, run by co_await-ing it or with event_loop::spawn()
+template <typename T>
+class task;
+
+namespace detail
+{
+
+// Resumes whoever awaited the task once it finishes
+struct final_awaiter
+{
+	bool await_ready() const noexcept { return false; }
+	void await_resume() const noexcept {}
+
+	template <typename Promise>
+	std::coroutine_handle<> await_suspend(std::coroutine_handle<Promise> handle) const noexcept
+	{
+		std::coroutine_handle<> continuation = handle.promise().continuation;
+		return continuation ? continuation : std::noop_coroutine();
+	}
+};
+
+struct promise_base
+{
+	std::coroutine_handle<> continuation;
+	std::exception_ptr exception;
+
+	std::suspend_always initial_suspend() const noexcept { return {}; }
+	final_awaiter final_suspend() const noexcept { return {}; }
+	void unhandled_exception() noexcept { exception = std::current_exception(); }
+};
+
+template <typename T>
+struct promise : promise_base
+{
+	std::optional<T> value;
+
+	task<T> get_return_object() noexcept;
+	void return_value(T result) { value.emplace(std::move(result)); }
+
+	T result()
+	{
+		if (exception)
+			std::rethrow_exception(exception);
+		return std::move(*value);
+	}
+};
+
+template <>
+struct promise<void> : promise_base
+{
+	task<void> get_return_object() noexcept;
+	void return_void() const noexcept {}
+
+	void result()
+	{
+		if (exception)
+			std::rethrow_exception(exception);
+	}
+};
+
+} // namespace detail
+
+template <typename T>
+class task
+{
+public:
+	using promise_type = detail::promise<T>;
+
+	explicit task(std::coroutine_handle<promise_type> handle) noexcept : _handle(handle) {}
+	task(task&& other) noexcept : _handle(std::exchange(other._handle, nullptr)) {}
+	task(const task&) = delete;
+	task& operator=(const task&) = delete;
+
+	task& operator=(task&& other) noexcept
+	{
+		if (this != &other)
+		{
+			if (_handle)
+				_handle.destroy();
+			_handle = std::exchange(other._handle, nullptr);
+		}
+		return *this;
+	}
+
+	~task()
+	{
+		if (_handle)
+			_handle.destroy();
+	}
+
+	// Starts the task and resumes the caller with its result once it finishes
+	auto operator co_await() && noexcept
+	{
+		struct awaiter
+		{
+			std::coroutine_handle<promise_type> handle;
+
+			bool await_ready() const noexcept { return false; }
+
+			std::coroutine_handle<> await_suspend(std::coroutine_handle<> caller) const noexcept
+			{
+				handle.promise().continuation = caller;
+				return handle;
+			}
+
+			T await_resume() const { return handle.promise().result(); }
+		};
+
+		return awaiter{_handle};
+	}
+
+private:
+	std::coroutine_handle<promise_type> _handle;
+};
+
+namespace detail
+{
+
+template <typename T>
+task<T> promise<T>::get_return_object() noexcept
+{
+	return task<T>(std::coroutine_handle<promise<T>>::from_promise(*this));
+}
+
+inline task<void> promise<void>::get_return_object() noexcept
+{
+	return task<void>(std::coroutine_handle<promise<void>>::from_promise(*this));
+}
+
+// A coroutine that starts at once and frees itself, for tasks the loop owns
+struct detached
+{
+	struct promise_type
+	{
+		detached get_return_object() const noexcept { return {}; }
+		std::suspend_never initial_suspend() const noexcept { return {}; }
+		std::suspend_never final_suspend() const noexcept { return {}; }
+		void return_void() const noexcept {}
+		void unhandled_exception() const noexcept { std::terminate(); }
+	};
+};
+
+// A task parked until its socket has one of the events it waits for
+struct readiness
+{
+	std::coroutine_handle<> handle;
+	int events = 0;
+};
+
+} // namespace detail
+
+class channel;
+class server;
+
+// ----- Event loops -----
+class event_loop
+{
+public:
+	// max_events sockets are reported per wait
+	explicit event_loop(int max_events = 256)
+		: _loop(stcp_open_event_loop(false)),
+		  _events(max_events)
+	{
+	}
+
+	event_loop(const event_loop&) = delete;
+	event_loop& operator=(const event_loop&) = delete;
+
+	~event_loop()
+	{
+		stcp_close_event_loop(_loop);
+	}
+
+	// Starts the task at once. The loop owns it and resumes it whenever it waits
+	void spawn(task<void> t)
+	{
+		++_tasks;
+		run_detached(std::move(t));
+	}
+
+	// Runs until every spawned task has finished.
+	// Rethrows the first exception a spawned task let escape, once all are done
+	void run()
+	{
+		std::vector<std::coroutine_handle<>> ready;
+		while (_tasks > 0)
+		{
+			int n = stcp_event_loop_wait(_loop, _events.data(), (int) _events.size(), -1);
+
+			// Every handle is collected before any runs, since a task can close sockets
+			// whose events are still in the batch
+			ready.clear();
+			for (int i = 0; i < n; ++i)
+				collect(*static_cast<registration*>(_events[i].user_data), _events[i].events, ready);
+
+			for (std::coroutine_handle<> handle : ready)
+				handle.resume();
+		}
+
+		if (_exception)
+			std::rethrow_exception(std::exchange(_exception, nullptr));
+	}
+
+	// Connects to a server once the handshake completes
+	// Returns an empty channel on error
+	task<channel> connect(const char* address, const char* protocol);
+
+private:
+	friend class channel;
+	friend class server;
+
+	struct registration
+	{
+		void* socket;
+		bool is_server;
+		bool added;
+
+		// events the loop is asked for, which may lag behind the waiters
+		int events;
+
+		detail::readiness* reader;
+		detail::readiness* writer;
+	};
+
+	detail::detached run_detached(task<void> t)
+	{
+		try
+		{
+			co_await std::move(t);
+		}
+		catch (...)
+		{
+			if (!_exception)
+				_exception = std::current_exception();
+		}
+
+		--_tasks;
+	}
+
+	// Parks a task until the socket has the event
+	auto wait(void* socket, bool is_server, int event)
+	{
+		struct awaiter
+		{
+			event_loop* loop;
+			void* socket;
+			bool is_server;
+			int event;
+			detail::readiness readiness;
+
+			bool await_ready() const noexcept { return false; }
+
+			bool await_suspend(std::coroutine_handle<> handle)
+			{
+				readiness.handle = handle;
+				return loop->park(socket, is_server, event, &readiness);
+			}
+
+			// The STCP_EVENT_* flags reported, which include hangups and errors
+			int await_resume() const noexcept { return readiness.events; }
+		};
+
+		return awaiter{this, socket, is_server, event, {}};
+	}
+
+	bool park(void* socket, bool is_server, int event, detail::readiness* readiness)
+	{
+		registration& r = _registrations.try_emplace(socket, registration{socket, is_server, false, 0, nullptr, nullptr}).first->second;
+		if (event == STCP_EVENT_READ)
+			r.reader = readiness;
+		else
+			r.writer = readiness;
+
+		// Leave the registration alone if the loop already reports the event
+		if (r.added && (r.events & event))
+			return true;
+
+		if (!update(r, r.events | event))
+		{
+			// Resume at once, and let the transfer report the error
+			(event == STCP_EVENT_READ ? r.reader : r.writer) = nullptr;
+			readiness->events = STCP_EVENT_ERROR;
+			return false;
+		}
+
+		return true;
+	}
+
+	void collect(registration& r, int events, std::vector<std::coroutine_handle<>>& ready)
+	{
+		const int failed = STCP_EVENT_HANGUP | STCP_EVENT_ERROR;
+		if (r.reader && (events & (STCP_EVENT_READ | failed)))
+		{
+			r.reader->events = events;
+			ready.push_back(r.reader->handle);
+			r.reader = nullptr;
+		}
+
+		if (r.writer && (events & (STCP_EVENT_WRITE | failed)))
+		{
+			r.writer->events = events;
+			ready.push_back(r.writer->handle);
+			r.writer = nullptr;
+		}
+
+		// A woken task usually waits again for the same event, so interest is only dropped
+		// once the loop reports something nobody waits for. Level triggering would repeat it
+		int waiting = (r.reader ? STCP_EVENT_READ : 0) | (r.writer ? STCP_EVENT_WRITE : 0);
+		int unwanted = events & ~waiting;
+		if (unwanted & (STCP_EVENT_READ | STCP_EVENT_WRITE))
+			update(r, waiting);
+		else if ((unwanted & failed) && waiting == 0)
+			update(r, 0);
+	}
+
+	// Registers the socket for events, or removes it if there are none
+	bool update(registration& r, int events)
+	{
+		bool ok;
+		if (events == 0)
+		{
+			ok = !r.added || (r.is_server
+					? stcp_event_loop_remove_server(_loop, static_cast<stcp_server*>(r.socket))
+					: stcp_event_loop_remove_channel(_loop, static_cast<stcp_channel*>(r.socket)));
+			r.added = false;
+		}
+		else if (r.added)
+		{
+			ok = r.is_server
+					? stcp_event_loop_modify_server(_loop, static_cast<stcp_server*>(r.socket), events, &r)
+					: stcp_event_loop_modify_channel(_loop, static_cast<stcp_channel*>(r.socket), events, &r);
+		}
+		else
+		{
+			ok = r.added = r.is_server
+					? stcp_event_loop_add_server(_loop, static_cast<stcp_server*>(r.socket), events, &r)
+					: stcp_event_loop_add_channel(_loop, static_cast<stcp_channel*>(r.socket), events, &r);
+		}
+
+		r.events = ok ? events : 0;
+		return ok;
+	}
+
+	// Drops a socket that's about to close
+	void forget(void* socket)
+	{
+		auto it = _registrations.find(socket);
+		if (it != _registrations.end())
+		{
+			update(it->second, 0);
+			_registrations.erase(it);
+		}
+	}
+
+	stcp_event_loop* _loop;
+	std::vector<stcp_event> _events;
+
+	// Node based, so registrations stay put while the loop holds pointers to them
+	std::unordered_map<void*, registration> _registrations;
+
+	std::size_t _tasks = 0;
+	std::exception_ptr _exception;
+};
+
+// ----- Channels -----
+class channel
+{
+public:
+	channel() noexcept = default;
+
+	// Takes ownership of a channel, whose transfers wait on the loop
+	channel(stcp_channel* c, event_loop& loop) noexcept : _channel(c), _loop(&loop) {}
+
+	channel(channel&& other) noexcept
+		: _channel(std::exchange(other._channel, nullptr)),
+		  _loop(other._loop)
+	{
+	}
+
+	channel& operator=(channel&& other) noexcept
+	{
+		if (this != &other)
+		{
+			close();
+			_channel = std::exchange(other._channel, nullptr);
+			_loop = other._loop;
+		}
+		return *this;
+	}
+
+	channel(const channel&) = delete;
+	channel& operator=(const channel&) = delete;
+
+	~channel()
+	{
+		close();
+	}
+
+	explicit operator bool() const noexcept { return _channel != nullptr; }
+	stcp_channel* get() const noexcept { return _channel; }
+
+	// Gives up ownership without closing the channel
+	stcp_channel* release() noexcept
+	{
+		if (_channel)
+			_loop->forget(_channel);
+		return std::exchange(_channel, nullptr);
+	}
+
+	// Closes the channel. No task may still be waiting on it
+	void close() noexcept
+	{
+		if (_channel)
+		{
+			_loop->forget(_channel);
+			stcp_close_channel(std::exchange(_channel, nullptr));
+		}
+	}
+
+	// Sends the whole buffer, waiting for space as often as needed
+	// Returns true if successful
+	task<bool> send(const char* buffer, int length)
+	{
+		int bytes_sent = 0;
+		while (bytes_sent < length)
+		{
+			int ret = stcp_try_send(_channel, buffer + bytes_sent, length - bytes_sent);
+			if (ret == STCP_SOCKET_WOULD_BLOCK)
+			{
+				co_await _loop->wait(_channel, false, STCP_EVENT_WRITE);
+				continue;
+			}
+
+			if (ret == 0)
+				co_return false;
+
+			bytes_sent += ret;
+		}
+
+		co_return true;
+	}
+
+	// Receives whatever has arrived, waiting until something has
+	// Returns the number of bytes received, or 0 on error or a closed channel
+	task<int> receive(char* buffer, int length)
+	{
+		while (true)
+		{
+			int ret = stcp_try_receive(_channel, buffer, length);
+			if (ret != STCP_SOCKET_WOULD_BLOCK)
+				co_return ret;
+
+			co_await _loop->wait(_channel, false, STCP_EVENT_READ);
+		}
+	}
+
+private:
+	friend class event_loop;
+
+	stcp_channel* _channel = nullptr;
+	event_loop* _loop = nullptr;
+};
+
+inline task<channel> event_loop::connect(const char* address, const char* protocol)
+{
+	stcp_address* resolved = stcp_resolve(address, protocol);
+	if (!resolved)
+		co_return channel();
+
+	channel c(stcp_connect_address(resolved), *this);
+	stcp_free_address(resolved);
+	if (!c)
+		co_return channel();
+
+	// The connection is up once the socket turns writable. A failed one reports an
+	// error instead, and reading then raises the reason
+	int events = co_await wait(c.get(), false, STCP_EVENT_WRITE);
+	if (events & (STCP_EVENT_ERROR | STCP_EVENT_HANGUP))
+	{
+		char byte;
+		stcp_try_receive(c.get(), &byte, 1);
+		co_return channel();
+	}
+
+	co_return c;
+}
+
+// ----- Servers -----
+class server
+{
+public:
+	// Opens a server whose accepts wait on the loop
+	server(event_loop& loop, const char* address, const char* protocol, int max_pending_channels)
+		: _server(stcp_open_server(address, protocol, max_pending_channels)),
+		  _loop(&loop)
+	{
+	}
+
+	server(const server&) = delete;
+	server& operator=(const server&) = delete;
+
+	~server()
+	{
+		_loop->forget(_server);
+		stcp_close_server(_server);
+	}
+
+	stcp_server* get() const noexcept { return _server; }
+
+	// Waits for the next channel
+	// Returns an empty channel on error
+	task<channel> accept()
+	{
+		while (true)
+		{
+			// A zero timeout only accepts what's already pending
+			stcp_channel* c = stcp_accept(_server, 0);
+			if (c)
+				co_return channel(c, *_loop);
+
+			int events = co_await _loop->wait(_server, true, STCP_EVENT_READ);
+			if (events & STCP_EVENT_ERROR)
+				co_return channel();
+		}
+	}
+
+private:
+	stcp_server* _server;
+	event_loop* _loop;
+};
+
+} // namespace stcp
+
+#endif /* STCP_HPP_ */
@@ -0,0 +1,599 @@
+// tls.c
+#include "stcp.h"
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "internal.h"
+#include "native/native.h"
+
+#ifdef STCP_TLS
+#include <openssl/err.h>
+#include <openssl/ssl.h>
+
+/*
+ * TLS over the channel's non-blocking socket, with OpenSSL.
+ *
+ * Handshakes and transfers map OpenSSL's WANT_READ / WANT_WRITE onto
+ * the same would-block handling as plain sockets. Clients keep the
+ * last session per server name so reconnects resume with a ticket
+ * instead of a full handshake. Where OpenSSL and the kernel support
+ * it, records are encrypted by the kernel (kTLS), which also lets
+ * files go out with sendfile.
+ */
+
+// Client sessions kept per context, replaced round robin
+#define STCP_TLS_SESSIONS 32
+#define STCP_TLS_SERVER_NAME_MAX 256
+
+// Largest TLS record payload
+#define STCP_TLS_RECORD_SIZE 16384
+
+typedef struct stcp_tls_session
+{
+	char server_name[STCP_TLS_SERVER_NAME_MAX];
+	SSL_SESSION* session;
+} stcp_tls_session;
+
+struct stcp_tls_context
+{
+	SSL_CTX* ctx;
+	bool verify_peer;
+
+	stcp_mutex lock;
+	stcp_tls_session sessions[STCP_TLS_SESSIONS];
+	int next_session;
+};
+
+struct stcp_tls
+{
+	SSL* ssl;
+	stcp_tls_context* context;
+
+	// the last write stopped because OpenSSL needs to read first
+	bool want_read;
+
+	char server_name[STCP_TLS_SERVER_NAME_MAX];
+};
+
+// ----- Contexts -----
+static stcp_tls_context* create_context(const SSL_METHOD* method)
+{
+	SSL_CTX* ctx = SSL_CTX_new(method);
+	if (!ctx)
+	{
+		stcp_raise_ssl_error(SSL_ERROR_SSL);
+		return NULL;
+	}
+
+	SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION);
+
+	// Writes are retried with whatever the caller still has to send
+	SSL_CTX_set_mode(ctx, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+
+#ifdef SSL_OP_ENABLE_KTLS
+	SSL_CTX_set_options(ctx, SSL_OP_ENABLE_KTLS);
+#endif
+
+	stcp_tls_context* context = MALLOC(stcp_tls_context);
+	memset(context, 0, sizeof(stcp_tls_context));
+	context->ctx = ctx;
+	STCP_MUTEX_CREATE(&context->lock);
+	return context;
+}
+
+// Keeps the newest session of each server name
+static int store_session(SSL* ssl, SSL_SESSION* session)
+{
+	stcp_tls* tls = (stcp_tls*) SSL_get_app_data(ssl);
+	if (!tls || tls->server_name[0] == '\0')
+		return 0;
+
+	stcp_tls_context* context = tls->context;
+	STCP_LOCK(&context->lock);
+
+	stcp_tls_session* slot = NULL;
+	for (int i = 0; i < STCP_TLS_SESSIONS && !slot; ++i)
+	{
+		if (context->sessions[i].session && strcmp(context->sessions[i].server_name, tls->server_name) == 0)
+			slot = &context->sessions[i];
+	}
+
+	if (!slot)
+	{
+		slot = &context->sessions[context->next_session];
+		context->next_session = (context->next_session + 1) % STCP_TLS_SESSIONS;
+	}
+
+	if (slot->session)
+		SSL_SESSION_free(slot->session);
+
+	strcpy(slot->server_name, tls->server_name);
+	slot->session = session;
+
+	STCP_UNLOCK(&context->lock);
+
+	// The context keeps the reference
+	return 1;
+}
+
+stcp_tls_context* stcp_open_tls_server_context(const char* certificate_file, const char* private_key_file)
+{
+	assert(certificate_file);
+	assert(private_key_file);
+
+	stcp_tls_context* context = create_context(TLS_server_method());
+	if (!context)
+		return NULL;
+
+	if (SSL_CTX_use_certificate_chain_file(context->ctx, certificate_file) != 1
+			|| SSL_CTX_use_PrivateKey_file(context->ctx, private_key_file, SSL_FILETYPE_PEM) != 1
+			|| SSL_CTX_check_private_key(context->ctx) != 1)
+	{
+		stcp_raise_ssl_error(SSL_ERROR_SSL);
+		stcp_close_tls_context(context);
+		return NULL;
+	}
+
+	// Stateless tickets are on by default; the id context lets cached sessions resume as well
+	SSL_CTX_set_session_id_context(context->ctx, (const unsigned char*) "stcp", 4);
+	return context;
+}
+
+stcp_tls_context* stcp_open_tls_client_context(const char* ca_file, bool verify_peer)
+{
+	stcp_tls_context* context = create_context(TLS_client_method());
+	if (!context)
+		return NULL;
+
+	if (verify_peer)
+	{
+		int loaded = ca_file
+				? SSL_CTX_load_verify_locations(context->ctx, ca_file, NULL)
+				: SSL_CTX_set_default_verify_paths(context->ctx);
+
+		if (loaded != 1)
+		{
+			stcp_raise_ssl_error(SSL_ERROR_SSL);
+			stcp_close_tls_context(context);
+			return NULL;
+		}
+
+		SSL_CTX_set_verify(context->ctx, SSL_VERIFY_PEER, NULL);
+	}
+
+	context->verify_peer = verify_peer;
+	SSL_CTX_set_session_cache_mode(context->ctx, SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+	SSL_CTX_sess_set_new_cb(context->ctx, store_session);
+	return context;
+}
+
+void stcp_close_tls_context(stcp_tls_context* context)
+{
+	if (context)
+	{
+		for (int i = 0; i < STCP_TLS_SESSIONS; ++i)
+		{
+			if (context->sessions[i].session)
+				SSL_SESSION_free(context->sessions[i].session);
+		}
+
+		SSL_CTX_free(context->ctx);
+		STCP_MUTEX_DESTROY(&context->lock);
+		stcp_free(context);
+	}
+}
+
+// ----- Handshakes -----
+static stcp_tls* create_tls(stcp_channel* channel, stcp_tls_context* context)
+{
+	SSL* ssl = SSL_new(context->ctx);
+	if (!ssl || SSL_set_fd(ssl, (int) channel->socket) != 1)
+	{
+		stcp_raise_ssl_error(SSL_ERROR_SSL);
+		SSL_free(ssl);
+		return NULL;
+	}
+
+	stcp_tls* tls = MALLOC(stcp_tls);
+	memset(tls, 0, sizeof(stcp_tls));
+	tls->ssl = ssl;
+	tls->context = context;
+	SSL_set_app_data(ssl, tls);
+	return tls;
+}
+
+static bool handshake(stcp_channel* channel, long long deadline)
+{
+	SSL* ssl = channel->tls->ssl;
+	while (true)
+	{
+		ERR_clear_error();
+		int ret = SSL_do_handshake(ssl);
+		if (ret == 1)
+			return true;
+
+		int err = SSL_get_error(ssl, ret);
+		if (err != SSL_ERROR_WANT_READ && err != SSL_ERROR_WANT_WRITE)
+		{
+			stcp_raise_ssl_error(err);
+			return false;
+		}
+
+		int timeout_milliseconds = stcp_remaining_milliseconds(deadline);
+		if (timeout_milliseconds == 0)
+		{
+			stcp_raise_error(STCP_ETIMEDOUT);
+			return false;
+		}
+
+		bool ready = err == SSL_ERROR_WANT_READ
+				? stcp_socket_poll_read(&channel->socket, timeout_milliseconds)
+				: stcp_socket_poll_write(&channel->socket, timeout_milliseconds);
+
+		if (!ready)
+			return false;
+	}
+}
+
+// private function to handshake, or undo the TLS state if it fails
+static bool start(stcp_channel* channel, stcp_tls* tls, long long deadline)
+{
+	channel->tls = tls;
+	if (!handshake(channel, deadline))
+	{
+		stcp_tls_close(channel);
+		return false;
+	}
+
+	return true;
+}
+
+static bool start_tls(stcp_channel* channel,
+		stcp_tls_context* context,
+		const char* server_name,
+		int timeout_milliseconds)
+{
+	assert(channel);
+	assert(context);
+	assert(server_name);
+	assert(!channel->tls);
+
+	if (strlen(server_name) >= STCP_TLS_SERVER_NAME_MAX)
+	{
+		stcp_raise_error(STCP_ENAMETOOLONG);
+		return false;
+	}
+
+	stcp_tls* tls = create_tls(channel, context);
+	if (!tls)
+		return false;
+
+	strcpy(tls->server_name, server_name);
+	SSL_set_connect_state(tls->ssl);
+	SSL_set_tlsext_host_name(tls->ssl, server_name);
+	if (context->verify_peer)
+		SSL_set1_host(tls->ssl, server_name);
+
+	// Resume the last session with this server
+	STCP_LOCK(&context->lock);
+	for (int i = 0; i < STCP_TLS_SESSIONS; ++i)
+	{
+		if (context->sessions[i].session && strcmp(context->sessions[i].server_name, server_name) == 0)
+		{
+			SSL_set_session(tls->ssl, context->sessions[i].session);
+			break;
+		}
+	}
+	STCP_UNLOCK(&context->lock);
+
+	return start(channel, tls, stcp_make_deadline(timeout_milliseconds));
+}
+
+bool stcp_start_tls(stcp_channel* channel,
+		stcp_tls_context* context,
+		const char* server_name,
+		int timeout_milliseconds)
+{
+	const stcp_error_handler* previous = stcp_enter_channel(channel);
+	bool started = start_tls(channel, context, server_name, timeout_milliseconds);
+	stcp_leave_channel(previous);
+	return started;
+}
+
+bool stcp_tls_accept(stcp_channel* channel, stcp_tls_context* context, long long deadline)
+{
+	assert(!channel->tls);
+
+	stcp_tls* tls = create_tls(channel, context);
+	if (!tls)
+		return false;
+
+	SSL_set_accept_state(tls->ssl);
+	return start(channel, tls, deadline);
+}
+
+bool stcp_accept_tls(stcp_channel* channel, stcp_tls_context* context, int timeout_milliseconds)
+{
+	assert(channel);
+	assert(context);
+
+	const stcp_error_handler* previous = stcp_enter_channel(channel);
+	bool accepted = stcp_tls_accept(channel, context, stcp_make_deadline(timeout_milliseconds));
+	stcp_leave_channel(previous);
+	return accepted;
+}
+
+bool stcp_is_tls_session_reused(const stcp_channel* channel)
+{
+	assert(channel);
+	return channel->tls && SSL_session_reused(channel->tls->ssl);
+}
+
+int stcp_get_tls_offload(const stcp_channel* channel)
+{
+	assert(channel);
+
+	int offload = 0;
+	if (channel->tls)
+	{
+		if (BIO_get_ktls_send(SSL_get_wbio(channel->tls->ssl)))
+			offload |= STCP_TLS_OFFLOAD_SEND;
+		if (BIO_get_ktls_recv(SSL_get_rbio(channel->tls->ssl)))
+			offload |= STCP_TLS_OFFLOAD_RECEIVE;
+	}
+
+	return offload;
+}
+
+// ----- Transfers -----
+// private function to turn a failed call into a transfer result
+static int transfer_error(stcp_tls* tls, int ret)
+{
+	int err = SSL_get_error(tls->ssl, ret);
+	switch (err)
+	{
+	case SSL_ERROR_WANT_READ:
+		tls->want_read = true;
+		return STCP_SOCKET_WOULD_BLOCK;
+
+	case SSL_ERROR_WANT_WRITE:
+		tls->want_read = false;
+		return STCP_SOCKET_WOULD_BLOCK;
+
+	case SSL_ERROR_ZERO_RETURN:
+		// The peer closed the session, which reads like a closed socket
+		return 0;
+
+	default:
+		stcp_raise_ssl_error(err);
+		return 0;
+	}
+}
+
+int stcp_tls_write(stcp_channel* channel, const char* buffer, int n)
+{
+	stcp_tls* tls = channel->tls;
+
+	ERR_clear_error();
+	int ret = SSL_write(tls->ssl, buffer, n);
+	if (ret > 0)
+	{
+		tls->want_read = false;
+		return ret;
+	}
+
+	return transfer_error(tls, ret);
+}
+
+int stcp_tls_writev(stcp_channel* channel, const stcp_iovec* buffers, int count)
+{
+	// A large buffer fills records by itself
+	if (buffers[0].length >= STCP_TLS_RECORD_SIZE || count == 1)
+		return stcp_tls_write(channel, (const char*) buffers[0].base, (int) buffers[0].length);
+
+	// Small buffers are gathered into one record rather than one record each
+	char record[STCP_TLS_RECORD_SIZE];
+	int length = 0;
+	for (int i = 0; i < count && length < STCP_TLS_RECORD_SIZE; ++i)
+	{
+		size_t n = buffers[i].length;
+		if (n > (size_t) (STCP_TLS_RECORD_SIZE - length))
+			n = STCP_TLS_RECORD_SIZE - length;
+
+		memcpy(record + length, buffers[i].base, n);
+		length += (int) n;
+	}
+
+	return stcp_tls_write(channel, record, length);
+}
+
+int stcp_tls_read(stcp_channel* channel, char* buffer, int n)
+{
+	stcp_tls* tls = channel->tls;
+
+	ERR_clear_error();
+	int ret = SSL_read(tls->ssl, buffer, n);
+	if (ret > 0)
+		return ret;
+
+	return transfer_error(tls, ret);
+}
+
+int stcp_tls_readv(stcp_channel* channel, stcp_iovec* buffers, int count)
+{
+	int bytes_received = 0;
+	for (int i = 0; i < count; ++i)
+	{
+		int ret = stcp_tls_read(channel, (char*) buffers[i].base, (int) buffers[i].length);
+		if (ret == STCP_SOCKET_WOULD_BLOCK || ret == 0)
+			return bytes_received > 0 ? bytes_received : ret;
+
+		bytes_received += ret;
+		if ((size_t) ret < buffers[i].length)
+			break;
+	}
+
+	return bytes_received;
+}
+
+int stcp_tls_send_file(stcp_channel* channel, int fd, long long offset, int n)
+{
+	stcp_tls* tls = channel->tls;
+
+	// The kernel encrypts, so the file still never passes through user space
+	if (BIO_get_ktls_send(SSL_get_wbio(tls->ssl)))
+	{
+		ERR_clear_error();
+		ossl_ssize_t ret = SSL_sendfile(tls->ssl, fd, (off_t) offset, (size_t) n, 0);
+		if (ret > 0)
+			return (int) ret;
+
+		return transfer_error(tls, (int) ret);
+	}
+
+	char buffer[STCP_TLS_RECORD_SIZE];
+	if (n > STCP_TLS_RECORD_SIZE)
+		n = STCP_TLS_RECORD_SIZE;
+
+	int bytes_read = stcp_socket_read_file(fd, offset, buffer, n);
+	if (bytes_read == 0)
+		return 0;
+
+	return stcp_tls_write(channel, buffer, bytes_read);
+}
+
+bool stcp_tls_wants_read(const stcp_channel* channel)
+{
+	return channel->tls->want_read;
+}
+
+bool stcp_tls_pending(const stcp_channel* channel)
+{
+	return SSL_has_pending(channel->tls->ssl);
+}
+
+void stcp_tls_close(stcp_channel* channel)
+{
+	stcp_tls* tls = channel->tls;
+
+	// One attempt at a close_notify, without waiting for the peer's
+	if (SSL_is_init_finished(tls->ssl))
+		SSL_shutdown(tls->ssl);
+
+	ERR_clear_error();
+	SSL_free(tls->ssl);
+	stcp_free(tls);
+	channel->tls = NULL;
+}
+
+#else
+// ----- Without OpenSSL -----
+stcp_tls_context* stcp_open_tls_server_context(const char* certificate_file, const char* private_key_file)
+{
+	(void) certificate_file;
+	(void) private_key_file;
+	stcp_raise_error(STCP_EOPNOTSUPP);
+	return NULL;
+}
+
+stcp_tls_context* stcp_open_tls_client_context(const char* ca_file, bool verify_peer)
+{
+	(void) ca_file;
+	(void) verify_peer;
+	stcp_raise_error(STCP_EOPNOTSUPP);
+	return NULL;
+}
+
+void stcp_close_tls_context(stcp_tls_context* context)
+{
+	(void) context;
+}
+
+bool stcp_start_tls(stcp_channel* channel,
+		stcp_tls_context* context,
+		const char* server_name,
+		int timeout_milliseconds)
+{
+	(void) channel;
+	(void) context;
+	(void) server_name;
+	(void) timeout_milliseconds;
+	stcp_raise_error(STCP_EOPNOTSUPP);
+	return false;
+}
+
+bool stcp_tls_accept(stcp_channel* channel, stcp_tls_context* context, long long deadline)
+{
+	(void) channel;
+	(void) context;
+	(void) deadline;
+	stcp_raise_error(STCP_EOPNOTSUPP);
+	return false;
+}
+
+bool stcp_accept_tls(stcp_channel* channel, stcp_tls_context* context, int timeout_milliseconds)
+{
+	(void) channel;
+	(void) context;
+	(void) timeout_milliseconds;
+	stcp_raise_error(STCP_EOPNOTSUPP);
+	return false;
+}
+
+bool stcp_is_tls_session_reused(const stcp_channel* channel)
+{
+	(void) channel;
+	return false;
+}
+
+int stcp_get_tls_offload(const stcp_channel* channel)
+{
+	(void) channel;
+	return 0;
+}
+
+// Channels never have TLS state without OpenSSL, so these are never reached
+int stcp_tls_write(stcp_channel* channel, const char* buffer, int n)
+{
+	return stcp_socket_write(&channel->socket, buffer, n);
+}
+
+int stcp_tls_writev(stcp_channel* channel, const stcp_iovec* buffers, int count)
+{
+	return stcp_socket_writev(&channel->socket, buffers, count);
+}
+
+int stcp_tls_read(stcp_channel* channel, char* buffer, int n)
+{
+	return stcp_socket_read(&channel->socket, buffer, n);
+}
+
+int stcp_tls_readv(stcp_channel* channel, stcp_iovec* buffers, int count)
+{
+	return stcp_socket_readv(&channel->socket, buffers, count);
+}
+
+int stcp_tls_send_file(stcp_channel* channel, int fd, long long offset, int n)
+{
+	return stcp_socket_send_file(&channel->socket, fd, offset, n);
+}
+
+bool stcp_tls_wants_read(const stcp_channel* channel)
+{
+	(void) channel;
+	return false;
+}
+
+bool stcp_tls_pending(const stcp_channel* channel)
+{
+	(void) channel;
+	return false;
+}
+
+void stcp_tls_close(stcp_channel* channel)
+{
+	channel->tls = NULL;
+}
+#endif
@@ -0,0 +1,673 @@
+// uring.c
+#include "stcp.h"
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "internal.h"
+#include "native/native.h"
+
+#ifdef __linux__
+#include <linux/io_uring.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <time.h>
+
+/*
+ * A minimal io_uring driver written against the raw syscalls,
+ * so there is no dependency on liburing.
+ *
+ * Every queued operation owns a request record whose address is the
+ * sqe user_data. Multishot operations keep their record until the
+ * kernel posts a completion without IORING_CQE_F_MORE.
+ */
+
+// Buffer group id used for the registered receive buffers
+#define STCP_URING_BUFFER_GROUP 0
+
+typedef struct io_uring_sqe io_uring_sqe;
+typedef struct io_uring_cqe io_uring_cqe;
+typedef struct io_uring_params io_uring_params;
+typedef struct io_uring_buf_ring io_uring_buf_ring;
+typedef struct io_uring_buf_reg io_uring_buf_reg;
+typedef struct io_uring_getevents_arg io_uring_getevents_arg;
+typedef struct io_uring_probe io_uring_probe;
+typedef struct io_uring_probe_op io_uring_probe_op;
+
+typedef struct stcp_uring_request
+{
+	stcp_uring_op op;
+	void* user_data;
+
+	// accepts: the server's options, copied since the accept can outlive the server
+	bool has_options;
+	stcp_options options;
+
+	// live requests are freed when the ring closes
+	struct stcp_uring_request* prev;
+	struct stcp_uring_request* next;
+} stcp_uring_request;
+
+struct stcp_uring
+{
+	int fd;
+
+	// submission queue
+	void* sq_ring;
+	size_t sq_ring_size;
+	unsigned int* sq_head;
+	unsigned int* sq_tail;
+	unsigned int sq_mask;
+	unsigned int* sq_array;
+	io_uring_sqe* sqes;
+	size_t sqes_size;
+	unsigned int sq_pending;
+
+	// completion queue
+	void* cq_ring;
+	size_t cq_ring_size;
+	unsigned int* cq_head;
+	unsigned int* cq_tail;
+	unsigned int cq_mask;
+	io_uring_cqe* cqes;
+
+	// registered receive buffers
+	io_uring_buf_ring* buffer_ring;
+	size_t buffer_ring_size;
+	char* buffers;
+	int buffer_count;
+	int buffer_size;
+
+	// request bookkeeping
+	stcp_uring_request* live;
+	stcp_uring_request* free;
+};
+
+static int uring_setup(unsigned int entries, io_uring_params* params)
+{
+	return (int) syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int uring_enter(int fd, unsigned int to_submit, unsigned int min_complete, unsigned int flags, void* arg, size_t arg_size)
+{
+	return (int) syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, arg, arg_size);
+}
+
+static int uring_register(int fd, unsigned int opcode, void* arg, unsigned int nr_args)
+{
+	return (int) syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+static void unmap_rings(stcp_uring* ring)
+{
+	if (ring->cq_ring && ring->cq_ring != ring->sq_ring)
+		munmap(ring->cq_ring, ring->cq_ring_size);
+	if (ring->sq_ring)
+		munmap(ring->sq_ring, ring->sq_ring_size);
+	if (ring->sqes)
+		munmap(ring->sqes, ring->sqes_size);
+	if (ring->buffer_ring)
+		munmap(ring->buffer_ring, ring->buffer_ring_size);
+	stcp_free(ring->buffers);
+}
+
+static bool map_rings(stcp_uring* ring, const io_uring_params* params)
+{
+	ring->sq_ring_size = params->sq_off.array + params->sq_entries * sizeof(unsigned int);
+	ring->cq_ring_size = params->cq_off.cqes + params->cq_entries * sizeof(io_uring_cqe);
+	ring->sqes_size = params->sq_entries * sizeof(io_uring_sqe);
+
+	bool single_mmap = params->features & IORING_FEAT_SINGLE_MMAP;
+	if (single_mmap)
+	{
+		if (ring->cq_ring_size > ring->sq_ring_size)
+			ring->sq_ring_size = ring->cq_ring_size;
+		ring->cq_ring_size = ring->sq_ring_size;
+	}
+
+	ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+	if (ring->sq_ring == MAP_FAILED)
+	{
+		ring->sq_ring = NULL;
+		return false;
+	}
+
+	if (single_mmap)
+	{
+		ring->cq_ring = ring->sq_ring;
+	}
+	else
+	{
+		ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE,
+				MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+		if (ring->cq_ring == MAP_FAILED)
+		{
+			ring->cq_ring = NULL;
+			return false;
+		}
+	}
+
+	ring->sqes = (io_uring_sqe*) mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+	if (ring->sqes == MAP_FAILED)
+	{
+		ring->sqes = NULL;
+		return false;
+	}
+
+	char* sq = (char*) ring->sq_ring;
+	ring->sq_head = (unsigned int*) (sq + params->sq_off.head);
+	ring->sq_tail = (unsigned int*) (sq + params->sq_off.tail);
+	ring->sq_mask = *(unsigned int*) (sq + params->sq_off.ring_mask);
+	ring->sq_array = (unsigned int*) (sq + params->sq_off.array);
+
+	char* cq = (char*) ring->cq_ring;
+	ring->cq_head = (unsigned int*) (cq + params->cq_off.head);
+	ring->cq_tail = (unsigned int*) (cq + params->cq_off.tail);
+	ring->cq_mask = *(unsigned int*) (cq + params->cq_off.ring_mask);
+	ring->cqes = (io_uring_cqe*) (cq + params->cq_off.cqes);
+	return true;
+}
+
+// Hands a receive buffer (back) to the kernel
+static void provide_buffer(stcp_uring* ring, int buffer_id)
+{
+	unsigned short tail = ring->buffer_ring->tail;
+	struct io_uring_buf* buffer = &ring->buffer_ring->bufs[tail & (ring->buffer_count - 1)];
+	buffer->addr = (unsigned long long) (ring->buffers + (size_t) buffer_id * ring->buffer_size);
+	buffer->len = ring->buffer_size;
+	buffer->bid = (unsigned short) buffer_id;
+	__atomic_store_n(&ring->buffer_ring->tail, (unsigned short) (tail + 1), __ATOMIC_RELEASE);
+}
+
+// private function to check for multishot receives (6.0). There is no way to probe
+// an opcode's flags, but IORING_OP_SEND_ZC came in the same release
+static bool supports_multishot_receive(const stcp_uring* ring)
+{
+	size_t probe_size = sizeof(io_uring_probe) + IORING_OP_LAST * sizeof(io_uring_probe_op);
+	io_uring_probe* probe = (io_uring_probe*) stcp_malloc(probe_size);
+	memset(probe, 0, probe_size);
+
+	bool supported = 0 == uring_register(ring->fd, IORING_REGISTER_PROBE, probe, IORING_OP_LAST)
+			&& probe->last_op >= IORING_OP_SEND_ZC
+			&& (probe->ops[IORING_OP_SEND_ZC].flags & IO_URING_OP_SUPPORTED);
+
+	stcp_free(probe);
+	return supported;
+}
+
+static bool register_buffers(stcp_uring* ring)
+{
+	size_t buffers_size = (size_t) ring->buffer_count * ring->buffer_size;
+	ring->buffers = (char*) stcp_malloc(buffers_size);
+
+	// The buffer ring must be page aligned
+	ring->buffer_ring_size = ring->buffer_count * sizeof(struct io_uring_buf);
+	ring->buffer_ring = (io_uring_buf_ring*) mmap(NULL, ring->buffer_ring_size,
+			PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (ring->buffer_ring == MAP_FAILED)
+	{
+		ring->buffer_ring = NULL;
+		return false;
+	}
+
+	io_uring_buf_reg reg;
+	memset(&reg, 0, sizeof(io_uring_buf_reg));
+	reg.ring_addr = (unsigned long long) ring->buffer_ring;
+	reg.ring_entries = ring->buffer_count;
+	reg.bgid = STCP_URING_BUFFER_GROUP;
+	if (0 != uring_register(ring->fd, IORING_REGISTER_PBUF_RING, &reg, 1))
+		return false;
+
+	ring->buffer_ring->tail = 0;
+	for (int i = 0; i < ring->buffer_count; ++i)
+		provide_buffer(ring, i);
+
+	return true;
+}
+
+stcp_uring* stcp_open_uring(int entries, int buffer_count, int buffer_size)
+{
+	assert(entries > 0);
+	assert(buffer_count > 0 && buffer_count <= 32768);
+	assert((buffer_count & (buffer_count - 1)) == 0);
+	assert(buffer_size > 0);
+
+	stcp_uring* ring = MALLOC(stcp_uring);
+	memset(ring, 0, sizeof(stcp_uring));
+	ring->buffer_count = buffer_count;
+	ring->buffer_size = buffer_size;
+
+	io_uring_params params;
+	memset(&params, 0, sizeof(io_uring_params));
+	ring->fd = uring_setup(entries, &params);
+	if (ring->fd < 0)
+	{
+		stcp_raise_error(stcp_get_last_error() == STCP_EINVAL ? STCP_EINVAL : STCP_EOPNOTSUPP);
+		stcp_free(ring);
+		return NULL;
+	}
+
+	// Timed waits need IORING_ENTER_EXT_ARG (5.11), the buffer ring and multishot
+	// accepts need 5.19, and multishot receives 6.0
+	if (!(params.features & IORING_FEAT_EXT_ARG)
+			|| !supports_multishot_receive(ring)
+			|| !map_rings(ring, &params)
+			|| !register_buffers(ring))
+	{
+		stcp_raise_error(STCP_EOPNOTSUPP);
+		unmap_rings(ring);
+		close(ring->fd);
+		stcp_free(ring);
+		return NULL;
+	}
+
+	return ring;
+}
+
+static unsigned int submit(stcp_uring* ring, unsigned int min_complete, unsigned int flags, void* arg, size_t arg_size)
+{
+	int ret = uring_enter(ring->fd, ring->sq_pending, min_complete, flags, arg, arg_size);
+	if (ret < 0)
+		return 0;
+
+	ring->sq_pending -= (unsigned int) ret;
+	return (unsigned int) ret;
+}
+
+static io_uring_sqe* next_sqe(stcp_uring* ring)
+{
+	unsigned int tail = *ring->sq_tail;
+	unsigned int head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+
+	// Full submission queue, so submit what's there to make room
+	if (tail - head > ring->sq_mask)
+	{
+		submit(ring, 0, 0, NULL, 0);
+		head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+		if (tail - head > ring->sq_mask)
+		{
+			stcp_raise_error(STCP_ENOBUFS);
+			return NULL;
+		}
+	}
+
+	unsigned int index = tail & ring->sq_mask;
+	io_uring_sqe* sqe = &ring->sqes[index];
+	memset(sqe, 0, sizeof(io_uring_sqe));
+	ring->sq_array[index] = index;
+	return sqe;
+}
+
+static void push_sqe(stcp_uring* ring)
+{
+	__atomic_store_n(ring->sq_tail, *ring->sq_tail + 1, __ATOMIC_RELEASE);
+	++ring->sq_pending;
+}
+
+static stcp_uring_request* make_request(stcp_uring* ring, stcp_uring_op op, void* user_data)
+{
+	stcp_uring_request* request = ring->free;
+	if (request)
+	{
+		ring->free = request->next;
+	}
+	else
+	{
+		request = MALLOC(stcp_uring_request);
+	}
+
+	request->op = op;
+	request->user_data = user_data;
+	request->has_options = false;
+	request->prev = NULL;
+	request->next = ring->live;
+	if (ring->live)
+		ring->live->prev = request;
+	ring->live = request;
+	return request;
+}
+
+static void free_request(stcp_uring* ring, stcp_uring_request* request)
+{
+	if (request->prev)
+		request->prev->next = request->next;
+	else
+		ring->live = request->next;
+	if (request->next)
+		request->next->prev = request->prev;
+
+	request->next = ring->free;
+	ring->free = request;
+}
+
+bool stcp_uring_accept(stcp_uring* ring, stcp_server* server, void* user_data)
+{
+	assert(ring);
+	assert(server);
+
+	// Completions can't run a handshake
+	if (server->tls)
+	{
+		stcp_raise_error(STCP_EOPNOTSUPP);
+		return false;
+	}
+
+	io_uring_sqe* sqe = next_sqe(ring);
+	if (!sqe)
+		return false;
+
+	stcp_uring_request* request = make_request(ring, STCP_URING_ACCEPT, user_data);
+	request->has_options = server->has_options;
+	if (server->has_options)
+		request->options = server->options;
+
+	sqe->opcode = IORING_OP_ACCEPT;
+	sqe->fd = (int) server->socket;
+	sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+	sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+	sqe->user_data = (unsigned long long) request;
+	push_sqe(ring);
+	return true;
+}
+
+// private function to check that a channel's data goes straight through its socket
+static bool check_plain(const stcp_channel* channel)
+{
+	if (channel->tls || channel->shared)
+	{
+		stcp_raise_error(STCP_EOPNOTSUPP);
+		return false;
+	}
+
+	return true;
+}
+
+bool stcp_uring_receive(stcp_uring* ring, stcp_channel* channel, void* user_data)
+{
+	assert(ring);
+	assert(channel);
+
+	if (!check_plain(channel))
+		return false;
+
+	io_uring_sqe* sqe = next_sqe(ring);
+	if (!sqe)
+		return false;
+
+	sqe->opcode = IORING_OP_RECV;
+	sqe->fd = (int) channel->socket;
+	sqe->flags = IOSQE_BUFFER_SELECT;
+	sqe->buf_group = STCP_URING_BUFFER_GROUP;
+	sqe->ioprio = IORING_RECV_MULTISHOT;
+	sqe->user_data = (unsigned long long) make_request(ring, STCP_URING_RECEIVE, user_data);
+	push_sqe(ring);
+	return true;
+}
+
+bool stcp_uring_send(stcp_uring* ring,
+		stcp_channel* channel,
+		const char* buffer,
+		int length,
+		void* user_data)
+{
+	assert(ring);
+	assert(channel);
+	assert(buffer);
+	assert(length > 0);
+
+	if (!check_plain(channel))
+		return false;
+
+	io_uring_sqe* sqe = next_sqe(ring);
+	if (!sqe)
+		return false;
+
+	// MSG_WAITALL makes the kernel retry short sends on stream sockets
+	sqe->opcode = IORING_OP_SEND;
+	sqe->fd = (int) channel->socket;
+	sqe->addr = (unsigned long long) buffer;
+	sqe->len = (unsigned int) length;
+	sqe->msg_flags = MSG_WAITALL | MSG_NOSIGNAL;
+	sqe->user_data = (unsigned long long) make_request(ring, STCP_URING_SEND, user_data);
+	push_sqe(ring);
+	return true;
+}
+
+// private function to cancel every operation on a socket
+static bool cancel_socket(stcp_uring* ring, socket_t s)
+{
+	io_uring_sqe* sqe = next_sqe(ring);
+	if (!sqe)
+		return false;
+
+	sqe->opcode = IORING_OP_ASYNC_CANCEL;
+	sqe->fd = (int) s;
+	sqe->cancel_flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+	sqe->user_data = (unsigned long long) make_request(ring, STCP_URING_CANCEL, NULL);
+	push_sqe(ring);
+	return true;
+}
+
+bool stcp_uring_cancel(stcp_uring* ring, stcp_channel* channel)
+{
+	assert(ring);
+	assert(channel);
+
+	return cancel_socket(ring, channel->socket);
+}
+
+bool stcp_uring_cancel_accept(stcp_uring* ring, stcp_server* server)
+{
+	assert(ring);
+	assert(server);
+
+	// The armed accept holds the listener open, even past stcp_close_server()
+	return cancel_socket(ring, server->socket);
+}
+
+static void make_completion(stcp_uring* ring, const io_uring_cqe* cqe, stcp_completion* completion)
+{
+	stcp_uring_request* request = (stcp_uring_request*) cqe->user_data;
+
+	memset(completion, 0, sizeof(stcp_completion));
+	completion->op = request->op;
+	completion->user_data = request->user_data;
+	completion->result = cqe->res;
+	completion->buffer_id = -1;
+	completion->more = cqe->flags & IORING_CQE_F_MORE;
+
+	if (request->op == STCP_URING_ACCEPT && cqe->res >= 0)
+	{
+		completion->channel = stcp_create_channel(cqe->res);
+		completion->result = 0;
+		if (request->has_options && !stcp_apply_options(&completion->channel->socket, &request->options, STCP_OPTIONS_ACCEPTED))
+		{
+			completion->result = -(int) stcp_get_thread_error();
+			stcp_close_channel(completion->channel);
+			completion->channel = NULL;
+		}
+	}
+	else if (cqe->flags & IORING_CQE_F_BUFFER)
+	{
+		completion->buffer_id = (int) (cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+		completion->buffer = ring->buffers + (size_t) completion->buffer_id * ring->buffer_size;
+	}
+
+	if (!completion->more)
+		free_request(ring, request);
+}
+
+int stcp_uring_wait(stcp_uring* ring,
+		stcp_completion* completions,
+		int max_completions,
+		int timeout_milliseconds)
+{
+	assert(ring);
+	assert(completions);
+	assert(max_completions > 0);
+
+	unsigned int head = *ring->cq_head;
+	unsigned int tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+
+	// Submit and wait in a single syscall when nothing is ready yet
+	if (head == tail && timeout_milliseconds != 0)
+	{
+		if (timeout_milliseconds < 0)
+		{
+			submit(ring, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+		}
+		else
+		{
+			struct __kernel_timespec timeout;
+			timeout.tv_sec = timeout_milliseconds / 1000;
+			timeout.tv_nsec = (timeout_milliseconds % 1000) * 1000000LL;
+
+			io_uring_getevents_arg arg;
+			memset(&arg, 0, sizeof(io_uring_getevents_arg));
+			arg.sigmask_sz = _NSIG / 8;
+			arg.ts = (unsigned long long) &timeout;
+			submit(ring, 1, IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg, sizeof(arg));
+		}
+
+		tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+	}
+	else if (ring->sq_pending)
+	{
+		submit(ring, 0, 0, NULL, 0);
+	}
+
+	int n = 0;
+	while (head != tail && n < max_completions)
+	{
+		const io_uring_cqe* cqe = &ring->cqes[head & ring->cq_mask];
+		stcp_uring_request* request = (stcp_uring_request*) cqe->user_data;
+
+		// Cancellation requests complete silently
+		if (request->op == STCP_URING_CANCEL)
+			free_request(ring, request);
+		else
+			make_completion(ring, cqe, &completions[n++]);
+
+		++head;
+	}
+
+	__atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+	return n;
+}
+
+void stcp_uring_release_buffer(stcp_uring* ring, int buffer_id)
+{
+	assert(ring);
+	assert(buffer_id >= 0 && buffer_id < ring->buffer_count);
+	provide_buffer(ring, buffer_id);
+}
+
+void stcp_close_uring(stcp_uring* ring)
+{
+	if (ring)
+	{
+		// Closing the ring cancels everything still in flight
+		close(ring->fd);
+		unmap_rings(ring);
+
+		while (ring->live)
+			free_request(ring, ring->live);
+		while (ring->free)
+		{
+			stcp_uring_request* next = ring->free->next;
+			stcp_free(ring->free);
+			ring->free = next;
+		}
+
+		stcp_free(ring);
+	}
+}
+
+#else
+// ----- io_uring is linux only -----
+stcp_uring* stcp_open_uring(int entries, int buffer_count, int buffer_size)
+{
+	(void) entries;
+	(void) buffer_count;
+	(void) buffer_size;
+	stcp_raise_error(STCP_EOPNOTSUPP);
+	return NULL;
+}
+
+bool stcp_uring_accept(stcp_uring* ring, stcp_server* server, void* user_data)
+{
+	(void) ring;
+	(void) server;
+	(void) user_data;
+	stcp_raise_error(STCP_EOPNOTSUPP);
+	return false;
+}
+
+bool stcp_uring_receive(stcp_uring* ring, stcp_channel* channel, void* user_data)
+{
+	(void) ring;
+	(void) channel;
+	(void) user_data;
+	stcp_raise_error(STCP_EOPNOTSUPP);
+	return false;
+}
+
+bool stcp_uring_send(stcp_uring* ring,
+		stcp_channel* channel,
+		const char* buffer,
+		int length,
+		void* user_data)
+{
+	(void) ring;
+	(void) channel;
+	(void) buffer;
+	(void) length;
+	(void) user_data;
+	stcp_raise_error(STCP_EOPNOTSUPP);
+	return false;
+}
+
+bool stcp_uring_cancel(stcp_uring* ring, stcp_channel* channel)
+{
+	(void) ring;
+	(void) channel;
+	stcp_raise_error(STCP_EOPNOTSUPP);
+	return false;
+}
+
+bool stcp_uring_cancel_accept(stcp_uring* ring, stcp_server* server)
+{
+	(void) ring;
+	(void) server;
+	stcp_raise_error(STCP_EOPNOTSUPP);
+	return false;
+}
+
+int stcp_uring_wait(stcp_uring* ring,
+		stcp_completion* completions,
+		int max_completions,
+		int timeout_milliseconds)
+{
+	(void) ring;
+	(void) completions;
+	(void) max_completions;
+	(void) timeout_milliseconds;
+	stcp_raise_error(STCP_EOPNOTSUPP);
+	return 0;
+}
+
+void stcp_uring_release_buffer(stcp_uring* ring, int buffer_id)
+{
+	(void) ring;
+	(void) buffer_id;
+}
+
+void stcp_close_uring(stcp_uring* ring)
+{
+	(void) ring;
+}
+#endif
@@ -0,0 +1,283 @@
+// zerocopy.c
+#include "stcp.h"
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "internal.h"
+
+/*
+ * The kernel numbers every successful MSG_ZEROCOPY write on a socket
+ * and later reports ranges of numbers whose pages it has released.
+ * A buffer may take several writes, so it is released once all of
+ * its numbers have been reported.
+ */
+
+// Buffers released per callback batch
+#define STCP_ZEROCOPY_BATCH 32
+
+// How long closing a channel waits for the kernel to finish with pending buffers
+#define STCP_ZEROCOPY_LINGER_MILLISECONDS 100
+
+typedef struct stcp_zerocopy_buffer
+{
+	const char* buffer;
+	unsigned int first;
+	unsigned int count;
+	unsigned int completed;
+	bool copied;
+} stcp_zerocopy_buffer;
+
+struct stcp_zerocopy
+{
+	int threshold;
+	zerocopy_release_fn release;
+	void* user_data;
+
+	// number the kernel gives the next write
+	unsigned int next;
+
+	// buffers in the order they were sent
+	stcp_zerocopy_buffer* pending;
+	int pending_count;
+	size_t pending_capacity;
+};
+
+bool stcp_enable_zerocopy(stcp_channel* channel,
+		int threshold,
+		zerocopy_release_fn release,
+		void* user_data)
+{
+	assert(channel);
+	assert(threshold > 0);
+	assert(release);
+
+	if (!channel->zerocopy)
+	{
+		if (!stcp_socket_enable_zerocopy(&channel->socket))
+			return false;
+
+		channel->zerocopy = MALLOC(stcp_zerocopy);
+		memset(channel->zerocopy, 0, sizeof(stcp_zerocopy));
+	}
+
+	channel->zerocopy->threshold = threshold;
+	channel->zerocopy->release = release;
+	channel->zerocopy->user_data = user_data;
+	return true;
+}
+
+int stcp_zerocopy_threshold(const stcp_channel* channel)
+{
+	assert(channel);
+	assert(channel->zerocopy);
+	return channel->zerocopy->threshold;
+}
+
+int stcp_get_zerocopy_pending(const stcp_channel* channel)
+{
+	assert(channel);
+	return channel->zerocopy ? channel->zerocopy->pending_count : 0;
+}
+
+static void push_pending(stcp_zerocopy* zerocopy, const stcp_zerocopy_buffer* buffer)
+{
+	size_t used = zerocopy->pending_count * sizeof(stcp_zerocopy_buffer);
+	if (used == zerocopy->pending_capacity)
+	{
+		size_t capacity = used ? used * 2 : 16 * sizeof(stcp_zerocopy_buffer);
+		stcp_zerocopy_buffer* pending = (stcp_zerocopy_buffer*) stcp_alloc_buffer(&capacity);
+		if (used)
+			memcpy(pending, zerocopy->pending, used);
+
+		stcp_free_buffer(zerocopy->pending, zerocopy->pending_capacity);
+		zerocopy->pending = pending;
+		zerocopy->pending_capacity = capacity - capacity % sizeof(stcp_zerocopy_buffer);
+	}
+
+	zerocopy->pending[zerocopy->pending_count++] = *buffer;
+}
+
+// Counts a released range of numbers against the pending buffers
+static void complete_range(stcp_zerocopy* zerocopy, unsigned int first, unsigned int last, bool copied)
+{
+	for (int i = 0; i < zerocopy->pending_count; ++i)
+	{
+		stcp_zerocopy_buffer* buffer = &zerocopy->pending[i];
+		if (buffer->first > last)
+			break;
+
+		unsigned int buffer_last = buffer->first + buffer->count - 1;
+		unsigned int low = buffer->first > first ? buffer->first : first;
+		unsigned int high = buffer_last < last ? buffer_last : last;
+		if (low <= high)
+		{
+			buffer->completed += high - low + 1;
+			buffer->copied |= copied;
+		}
+	}
+}
+
+// Removes completed buffers and calls release for them.
+// The callback may send again, so released buffers are copied out first
+static int release_completed(stcp_zerocopy* zerocopy)
+{
+	int released = 0;
+	int n;
+	do
+	{
+		stcp_zerocopy_buffer batch[STCP_ZEROCOPY_BATCH];
+		n = 0;
+
+		int kept = 0;
+		for (int i = 0; i < zerocopy->pending_count; ++i)
+		{
+			stcp_zerocopy_buffer* buffer = &zerocopy->pending[i];
+			if (buffer->completed == buffer->count && n < STCP_ZEROCOPY_BATCH)
+				batch[n++] = *buffer;
+			else
+				zerocopy->pending[kept++] = *buffer;
+		}
+		zerocopy->pending_count = kept;
+
+		for (int i = 0; i < n; ++i)
+			zerocopy->release(batch[i].buffer, batch[i].copied, zerocopy->user_data);
+
+		released += n;
+	} while (n == STCP_ZEROCOPY_BATCH);
+
+	return released;
+}
+
+// Reads every completion queued so far without waiting
+// Returns false if there were none
+static bool read_completions(stcp_channel* channel)
+{
+	unsigned int first;
+	unsigned int last;
+	bool copied;
+	bool any = false;
+	while (stcp_socket_read_zerocopy(&channel->socket, &first, &last, &copied))
+	{
+		complete_range(channel->zerocopy, first, last, copied);
+		any = true;
+	}
+
+	return any;
+}
+
+// Releases the buffers completed so far without waiting
+static int drain(stcp_channel* channel)
+{
+	return read_completions(channel) ? release_completed(channel->zerocopy) : 0;
+}
+
+int stcp_drain_zerocopy(stcp_channel* channel, int timeout_milliseconds)
+{
+	assert(channel);
+
+	if (!channel->zerocopy || channel->zerocopy->pending_count == 0)
+		return 0;
+
+	int released = drain(channel);
+	if (released == 0 && timeout_milliseconds != 0
+			&& stcp_socket_poll_error(&channel->socket, timeout_milliseconds))
+	{
+		released = drain(channel);
+	}
+
+	return released;
+}
+
+bool stcp_zerocopy_send(stcp_channel* channel, const char* buffer, int length, long long deadline)
+{
+	stcp_zerocopy* zerocopy = channel->zerocopy;
+
+	// Completions also return pinned memory to the socket's budget
+	if (zerocopy->pending_count)
+		drain(channel);
+
+	stcp_zerocopy_buffer pending;
+	pending.buffer = buffer;
+	pending.first = zerocopy->next;
+	pending.count = 0;
+	pending.completed = 0;
+	pending.copied = false;
+
+	bool success = true;
+	int bytes_sent = 0;
+	while (bytes_sent < length)
+	{
+		bool copied;
+		int ret = stcp_socket_write_zerocopy(&channel->socket,
+				buffer + bytes_sent,
+				length - bytes_sent,
+				&copied);
+
+		stcp_count_write(channel, length - bytes_sent, ret);
+		if (ret == STCP_SOCKET_WOULD_BLOCK)
+		{
+			if (!stcp_wait_write(channel, deadline))
+			{
+				success = false;
+				break;
+			}
+
+			continue;
+		}
+
+		if (ret == 0)
+		{
+			success = false;
+			break;
+		}
+
+		if (copied)
+		{
+			pending.copied = true;
+		}
+		else
+		{
+			++pending.count;
+			++zerocopy->next;
+		}
+
+		bytes_sent += ret;
+	}
+
+	// Nothing left in the kernel, so the buffer can be reused right away
+	if (pending.count == 0)
+		zerocopy->release(buffer, pending.copied, zerocopy->user_data);
+	else
+		push_pending(zerocopy, &pending);
+
+	return success;
+}
+
+void stcp_zerocopy_close(stcp_channel* channel)
+{
+	stcp_zerocopy* zerocopy = channel->zerocopy;
+	if (zerocopy->pending_count)
+		drain(channel);
+
+	long long deadline = stcp_make_deadline(STCP_ZEROCOPY_LINGER_MILLISECONDS);
+	while (zerocopy->pending_count)
+	{
+		int remaining = stcp_remaining_milliseconds(deadline);
+		if (remaining == 0 || !stcp_socket_poll_error(&channel->socket, remaining))
+			break;
+
+		// A hangup or a socket error keeps the poll ready without completions
+		if (!read_completions(channel))
+			break;
+
+		release_completed(zerocopy);
+	}
+
+	// The kernel may still send from whatever is left, so those buffers are never released
+
+	stcp_free_buffer(zerocopy->pending, zerocopy->pending_capacity);
+	stcp_free(zerocopy);
+	channel->zerocopy = NULL;
+}
@@ -0,0 +1,169 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <unistd.h>
+
+#include "../src/stcp.hpp"
+
+// Tests of the C++ coroutine interface over loopback
+
+#define LOOPBACK_ADDRESS "127.0.0.1"
+
+#define CHECK(condition) \
+	do { \
+		if (!(condition)) \
+		{ \
+			std::fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #condition); \
+			std::exit(-1); \
+		} \
+	} while (0)
+
+// Sessions that run at once on the one thread
+#define SESSION_COUNT 500
+
+// Larger than the socket buffers, so senders have to wait for space
+#define BULK_LENGTH (8 * 1024 * 1024)
+
+static char port[8];
+
+static void ignore_error(stcp_error e, void* user_data)
+{
+	(void) e;
+	(void) user_data;
+}
+
+static int echoed = 0;
+static int completed = 0;
+
+// Echoes a channel's data back until the client closes it
+static stcp::task<void> echo(stcp::channel c)
+{
+	char buffer[256];
+	while (true)
+	{
+		int n = co_await c.receive(buffer, sizeof(buffer));
+		if (n <= 0)
+			break;
+
+		CHECK(co_await c.send(buffer, n));
+		echoed += n;
+	}
+}
+
+static stcp::task<void> serve(stcp::event_loop& loop, stcp::server& server, int count)
+{
+	for (int i = 0; i < count; ++i)
+	{
+		stcp::channel c = co_await server.accept();
+		CHECK(c);
+		loop.spawn(echo(std::move(c)));
+	}
+}
+
+static stcp::task<void> session(stcp::event_loop& loop, int id)
+{
+	stcp::channel c = co_await loop.connect(LOOPBACK_ADDRESS, port);
+	CHECK(c);
+
+	std::string message = "session " + std::to_string(id);
+	CHECK(co_await c.send(message.data(), (int) message.size()));
+
+	char buffer[64];
+	int received = 0;
+	while (received < (int) message.size())
+	{
+		int n = co_await c.receive(buffer + received, sizeof(buffer) - received);
+		CHECK(n > 0);
+		received += n;
+	}
+
+	CHECK(std::memcmp(buffer, message.data(), message.size()) == 0);
+	++completed;
+}
+
+static void test_sessions()
+{
+	stcp::event_loop loop;
+	stcp::server server(loop, LOOPBACK_ADDRESS, port, SESSION_COUNT);
+
+	loop.spawn(serve(loop, server, SESSION_COUNT));
+	for (int i = 0; i < SESSION_COUNT; ++i)
+		loop.spawn(session(loop, i));
+
+	loop.run();
+	CHECK(completed == SESSION_COUNT);
+}
+
+static stcp::task<void> send_bulk(stcp::server& server, const char* data)
+{
+	stcp::channel c = co_await server.accept();
+	CHECK(c);
+	CHECK(co_await c.send(data, BULK_LENGTH));
+}
+
+static stcp::task<void> receive_bulk(stcp::event_loop& loop, const char* data)
+{
+	stcp::channel c = co_await loop.connect(LOOPBACK_ADDRESS, port);
+	CHECK(c);
+
+	std::string received;
+	char buffer[65536];
+	while (true)
+	{
+		int n = co_await c.receive(buffer, sizeof(buffer));
+		if (n <= 0)
+			break;
+		received.append(buffer, n);
+	}
+
+	CHECK(received.size() == BULK_LENGTH);
+	CHECK(std::memcmp(received.data(), data, BULK_LENGTH) == 0);
+}
+
+static void test_bulk()
+{
+	char* data = (char*) std::malloc(BULK_LENGTH);
+	CHECK(data);
+	for (int i = 0; i < BULK_LENGTH; ++i)
+		data[i] = (char) (i * 13);
+
+	stcp::event_loop loop;
+	stcp::server server(loop, LOOPBACK_ADDRESS, port, 4);
+	loop.spawn(send_bulk(server, data));
+	loop.spawn(receive_bulk(loop, data));
+	loop.run();
+	std::free(data);
+}
+
+static stcp::task<void> connect_refused(stcp::event_loop& loop, const char* closed_port)
+{
+	stcp::channel c = co_await loop.connect(LOOPBACK_ADDRESS, closed_port);
+	CHECK(!c);
+}
+
+static void test_refused()
+{
+	// Nothing listens one port up
+	char closed_port[16];
+	std::snprintf(closed_port, sizeof(closed_port), "%d", std::atoi(port) + 1);
+
+	stcp::event_loop loop;
+	loop.spawn(connect_refused(loop, closed_port));
+	loop.run();
+}
+
+int main()
+{
+	std::snprintf(port, sizeof(port), "%d", 10000 + getpid() % 10000);
+	stcp_set_error_callback(ignore_error, NULL);
+	CHECK(stcp_initialize());
+
+	test_sessions();
+	test_bulk();
+	test_refused();
+
+	stcp_terminate();
+	std::printf("All coroutine tests passed\n");
+	return 0;
+}
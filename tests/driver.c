@@ -8,6 +8,7 @@ stcp_channel* channel = NULL;
 
 void process_error(stcp_error e, void* user_data)
 {
+	(void) user_data;
 	stcp_print_error(e);
 	stcp_close_channel(channel);
 	stcp_terminate();
@@ -0,0 +1,1871 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#ifdef STCP_TLS
+#include <openssl/evp.h>
+#include <openssl/pem.h>
+#include <openssl/x509.h>
+#endif
+
+#include "../src/stcp.h"
+
+// Loopback tests that run without network access
+
+#define LOOPBACK_ADDRESS "127.0.0.1"
+
+// Picked per process so a rerun doesn't collide with sockets in TIME_WAIT,
+// and below the ephemeral range so it's never taken by an outbound socket
+static char LOOPBACK_PORT[8];
+
+// The pool test closes server ends first, which leaves its port in TIME_WAIT,
+// so it gets a range of its own, also below the ephemeral ports
+static char POOL_PORT[8];
+
+#define CHECK(condition) \
+	do { \
+		if (!(condition)) \
+		{ \
+			fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #condition); \
+			exit(-1); \
+		} \
+	} while (0)
+
+// Timeouts are expected by some tests, so errors are only recorded
+static stcp_error last_error = STCP_NO_ERROR;
+
+void record_error(stcp_error e, void* user_data)
+{
+	(void) user_data;
+	last_error = e;
+}
+
+// Connects a client to the server and accepts it
+static void open_pair(stcp_server* server, stcp_channel** client, stcp_channel** accepted)
+{
+	*client = stcp_connect(LOOPBACK_ADDRESS, LOOPBACK_PORT);
+	CHECK(*client);
+	*accepted = stcp_accept(server, 1000);
+	CHECK(*accepted);
+}
+
+// Counts the library's allocations
+static int allocations = 0;
+
+void* counting_allocate(size_t size, void* user_data)
+{
+	(void) user_data;
+	++allocations;
+	return malloc(size);
+}
+
+void counting_deallocate(void* pointer, void* user_data)
+{
+	(void) user_data;
+	free(pointer);
+}
+
+static void test_pooled_channels()
+{
+	stcp_server* server = stcp_open_server(LOOPBACK_ADDRESS, LOOPBACK_PORT, 16);
+
+	// Warm up the pools, then churn channels without new allocations
+	stcp_channel* client;
+	stcp_channel* accepted;
+	open_pair(server, &client, &accepted);
+	stcp_close_channel(client);
+	stcp_close_channel(accepted);
+
+	int before = allocations;
+	for (int i = 0; i < 200; ++i)
+	{
+		open_pair(server, &client, &accepted);
+		stcp_close_channel(client);
+		stcp_close_channel(accepted);
+	}
+	CHECK(allocations == before);
+
+	stcp_close_server(server);
+}
+
+static void test_resolver()
+{
+	stcp_server* server = stcp_open_server(LOOPBACK_ADDRESS, LOOPBACK_PORT, 4);
+
+	// The second lookup is served from the cache, so only the copy is allocated
+	stcp_clear_resolver_cache();
+	stcp_address* address = stcp_resolve(LOOPBACK_ADDRESS, LOOPBACK_PORT);
+	CHECK(address);
+	stcp_free_address(address);
+
+	int before = allocations;
+	address = stcp_resolve(LOOPBACK_ADDRESS, LOOPBACK_PORT);
+	CHECK(address);
+	CHECK(allocations == before + 1);
+
+	stcp_channel* client = stcp_connect_address(address);
+	CHECK(client);
+	stcp_channel* accepted = stcp_accept(server, 1000);
+	CHECK(accepted);
+	CHECK(stcp_send(client, "ping", 4, 1000));
+
+	char buffer[4];
+	CHECK(stcp_receive(accepted, buffer, 4, 1000) == 4);
+	CHECK(memcmp(buffer, "ping", 4) == 0);
+
+	stcp_close_channel(client);
+	stcp_close_channel(accepted);
+	stcp_free_address(address);
+
+	// Unresolvable names are recoverable errors
+	last_error = STCP_NO_ERROR;
+	CHECK(stcp_resolve(LOOPBACK_ADDRESS, "no-such-service") == NULL);
+	CHECK(last_error != STCP_NO_ERROR);
+
+	stcp_close_server(server);
+}
+
+// Does nothing, so the signal only interrupts whatever the thread is waiting in
+static void ignore_signal(int signal)
+{
+	(void) signal;
+}
+
+// Signals a thread once it has had time to start waiting
+static void* interrupt_later(void* thread)
+{
+	usleep(50000);
+	CHECK(pthread_kill(*(pthread_t*) thread, SIGUSR1) == 0);
+	return NULL;
+}
+
+// Connects until the server's accept queue is full, which leaves the last channel pending
+// Returns the number of channels opened
+static int fill_accept_queue(stcp_channel** queued, int max)
+{
+	for (int i = 0; i < max; ++i)
+	{
+		queued[i] = stcp_connect_async(LOOPBACK_ADDRESS, LOOPBACK_PORT);
+		CHECK(queued[i]);
+		if (!stcp_connect_wait(queued[i], 100))
+			return i + 1;
+	}
+
+	CHECK(false);
+	return max;
+}
+
+static void test_connect_race()
+{
+	// Every address refusing fails with the refusal rather than a timeout
+	last_error = STCP_NO_ERROR;
+	CHECK(stcp_connect_race(LOOPBACK_ADDRESS, LOOPBACK_PORT, 1000, NULL) == NULL);
+	CHECK(last_error == STCP_ECONNREFUSED);
+
+	stcp_server* server = stcp_open_server(LOOPBACK_ADDRESS, LOOPBACK_PORT, 4);
+	long long connect_microseconds = 0;
+	stcp_channel* client = stcp_connect_race(LOOPBACK_ADDRESS, LOOPBACK_PORT, 1000, &connect_microseconds);
+	CHECK(client);
+	CHECK(connect_microseconds > 0 && connect_microseconds < 1000000);
+	stcp_channel* accepted = stcp_accept(server, 1000);
+	CHECK(accepted);
+	CHECK(stcp_send(client, "raced", 5, 1000));
+
+	char buffer[8];
+	CHECK(stcp_receive(accepted, buffer, sizeof(buffer), 1000) == 5);
+	stcp_close_channel(client);
+	stcp_close_channel(accepted);
+	stcp_close_server(server);
+
+	// A signal during the wait leaves it running until the timeout
+	server = stcp_open_server(LOOPBACK_ADDRESS, LOOPBACK_PORT, 1);
+	stcp_channel* queued[8];
+	int queued_count = fill_accept_queue(queued, 8);
+	pthread_t self = pthread_self();
+	pthread_t thread;
+	CHECK(pthread_create(&thread, NULL, interrupt_later, &self) == 0);
+	last_error = STCP_NO_ERROR;
+	CHECK(stcp_connect_race(LOOPBACK_ADDRESS, LOOPBACK_PORT, 300, NULL) == NULL);
+	CHECK(last_error == STCP_ETIMEDOUT);
+	CHECK(pthread_join(thread, NULL) == 0);
+	for (int i = 0; i < queued_count; ++i)
+		stcp_close_channel(queued[i]);
+	stcp_close_server(server);
+
+	// IPv6 only if the host has it, which a refusal shows
+	last_error = STCP_NO_ERROR;
+	CHECK(stcp_connect_race("::1", LOOPBACK_PORT, 1000, NULL) == NULL);
+	if (last_error != STCP_ECONNREFUSED)
+		return;
+
+	server = stcp_open_server("::1", LOOPBACK_PORT, 4);
+	CHECK(server);
+	client = stcp_connect_race("::1", LOOPBACK_PORT, 1000, NULL);
+	CHECK(client);
+	accepted = stcp_accept(server, 1000);
+	CHECK(accepted);
+
+	char peer[64];
+	char expected[64];
+	snprintf(expected, sizeof(expected), "[::1]:%s", LOOPBACK_PORT);
+	CHECK(stcp_get_peer_address(client, peer, sizeof(peer)));
+	CHECK(strcmp(peer, expected) == 0);
+	CHECK(stcp_send(client, "six", 3, 1000));
+	CHECK(stcp_receive(accepted, buffer, sizeof(buffer), 1000) == 3);
+
+	stcp_close_channel(client);
+	stcp_close_channel(accepted);
+	stcp_close_server(server);
+}
+
+static void test_connect_many()
+{
+	// A refused connect shows up in the wait rather than the first transfer
+	last_error = STCP_NO_ERROR;
+	stcp_channel* refused = stcp_connect_async(LOOPBACK_ADDRESS, LOOPBACK_PORT);
+	if (refused)
+	{
+		CHECK(!stcp_connect_wait(refused, 1000));
+		stcp_close_channel(refused);
+	}
+	CHECK(last_error == STCP_ECONNREFUSED);
+
+	stcp_server* server = stcp_open_server(LOOPBACK_ADDRESS, LOOPBACK_PORT, 64);
+	stcp_channel* client = stcp_connect_async(LOOPBACK_ADDRESS, LOOPBACK_PORT);
+	CHECK(client);
+	CHECK(stcp_connect_wait(client, 1000));
+	CHECK(stcp_connect_wait(client, 0));
+	stcp_channel* accepted = stcp_accept(server, 1000);
+	CHECK(accepted);
+	stcp_close_channel(client);
+	stcp_close_channel(accepted);
+
+	// Every channel is connected when the call returns
+	stcp_channel* clients[32];
+	CHECK(stcp_connect_many(LOOPBACK_ADDRESS, LOOPBACK_PORT, clients, 32, 1000) == 32);
+	for (int i = 0; i < 32; ++i)
+		CHECK(stcp_connect_wait(clients[i], 0));
+
+	stcp_channel* accepted_many[32];
+	int count = 0;
+	while (count < 32)
+	{
+		int n = stcp_accept_batch(server, accepted_many + count, 32 - count, 1000);
+		CHECK(n > 0);
+		count += n;
+	}
+
+	for (int i = 0; i < 32; ++i)
+	{
+		stcp_close_channel(clients[i]);
+		stcp_close_channel(accepted_many[i]);
+	}
+
+	// Running out of descriptors leaves slots empty instead of ending the process
+	int lowest_free = dup(STDERR_FILENO);
+	CHECK(lowest_free != -1);
+	close(lowest_free);
+	struct rlimit limit;
+	CHECK(getrlimit(RLIMIT_NOFILE, &limit) == 0);
+	struct rlimit lowered = limit;
+	lowered.rlim_cur = lowest_free + 4;
+	CHECK(setrlimit(RLIMIT_NOFILE, &lowered) == 0);
+	last_error = STCP_NO_ERROR;
+	int connected = stcp_connect_many(LOOPBACK_ADDRESS, LOOPBACK_PORT, clients, 32, 1000);
+	CHECK(setrlimit(RLIMIT_NOFILE, &limit) == 0);
+	CHECK(connected > 0 && connected < 32);
+	CHECK(clients[connected] == NULL);
+	CHECK(last_error == STCP_EMFILE);
+
+	count = 0;
+	while (count < connected)
+	{
+		int n = stcp_accept_batch(server, accepted_many + count, connected - count, 1000);
+		CHECK(n > 0);
+		count += n;
+	}
+
+	for (int i = 0; i < connected; ++i)
+	{
+		stcp_close_channel(clients[i]);
+		stcp_close_channel(accepted_many[i]);
+	}
+
+	// Warming stops at the idle limit, and acquires then skip connecting
+	stcp_pool* pool = stcp_open_pool(8, 16);
+	CHECK(stcp_pool_warm(pool, LOOPBACK_ADDRESS, LOOPBACK_PORT, 20, 1000) == 8);
+	CHECK(stcp_get_pool_size(pool) == 8);
+	CHECK(stcp_pool_warm(pool, LOOPBACK_ADDRESS, LOOPBACK_PORT, 4, 1000) == 0);
+
+	client = stcp_pool_acquire(pool, LOOPBACK_ADDRESS, LOOPBACK_PORT);
+	CHECK(client);
+	CHECK(stcp_get_pool_size(pool) == 8);
+	stcp_pool_release(pool, client, true);
+
+	count = 0;
+	while (count < 8)
+	{
+		int n = stcp_accept_batch(server, accepted_many + count, 8 - count, 1000);
+		CHECK(n > 0);
+		count += n;
+	}
+
+	stcp_close_pool(pool);
+	for (int i = 0; i < 8; ++i)
+		stcp_close_channel(accepted_many[i]);
+
+	stcp_close_server(server);
+
+	// A signal during the wait leaves it running until the timeout
+	server = stcp_open_server(LOOPBACK_ADDRESS, LOOPBACK_PORT, 1);
+	stcp_channel* queued[8];
+	int queued_count = fill_accept_queue(queued, 8);
+	pthread_t self = pthread_self();
+	pthread_t thread;
+	CHECK(pthread_create(&thread, NULL, interrupt_later, &self) == 0);
+	last_error = STCP_NO_ERROR;
+	CHECK(!stcp_connect_wait(queued[queued_count - 1], 300));
+	CHECK(last_error == STCP_ETIMEDOUT);
+	CHECK(pthread_join(thread, NULL) == 0);
+	for (int i = 0; i < queued_count; ++i)
+		stcp_close_channel(queued[i]);
+	stcp_close_server(server);
+}
+
+// Records the errors of one channel
+static void record_channel_error(stcp_error e, void* user_data)
+{
+	*(stcp_error*) user_data = e;
+}
+
+static void* time_out_receive(void* channel)
+{
+	char buffer[16];
+	stcp_clear_thread_error();
+	CHECK(stcp_receive((stcp_channel*) channel, buffer, sizeof(buffer), 10) == 0);
+	CHECK(stcp_get_thread_error() == STCP_ETIMEDOUT);
+	return NULL;
+}
+
+static void* initialize_and_terminate(void* user_data)
+{
+	(void) user_data;
+	for (int i = 0; i < 1000; ++i)
+	{
+		CHECK(stcp_initialize());
+		stcp_terminate();
+	}
+	return NULL;
+}
+
+static void test_error_context()
+{
+	stcp_server* server = stcp_open_server(LOOPBACK_ADDRESS, LOOPBACK_PORT, 4);
+	stcp_channel* client;
+	stcp_channel* accepted;
+	open_pair(server, &client, &accepted);
+
+	// The channel's own callback replaces the shared one
+	stcp_error channel_error = STCP_NO_ERROR;
+	stcp_set_channel_error_callback(client, record_channel_error, &channel_error);
+	last_error = STCP_NO_ERROR;
+	char buffer[16];
+	CHECK(stcp_receive(client, buffer, sizeof(buffer), 10) == 0);
+	CHECK(channel_error == STCP_ETIMEDOUT);
+	CHECK(last_error == STCP_NO_ERROR);
+	CHECK(stcp_get_thread_error() == STCP_ETIMEDOUT);
+
+	// Other channels and functions still use the shared callback
+	CHECK(stcp_receive(accepted, buffer, sizeof(buffer), 10) == 0);
+	CHECK(last_error == STCP_ETIMEDOUT);
+	stcp_set_channel_error_callback(client, NULL, NULL);
+
+	// A signal during the wait doesn't end it early, or fail it
+	pthread_t self = pthread_self();
+	pthread_t interrupter;
+	CHECK(pthread_create(&interrupter, NULL, interrupt_later, &self) == 0);
+	last_error = STCP_NO_ERROR;
+	CHECK(stcp_receive(client, buffer, sizeof(buffer), 300) == 0);
+	CHECK(last_error == STCP_ETIMEDOUT);
+	CHECK(pthread_join(interrupter, NULL) == 0);
+
+	// Errors on other threads don't show up on this one
+	stcp_clear_thread_error();
+	pthread_t thread;
+	CHECK(pthread_create(&thread, NULL, time_out_receive, accepted) == 0);
+	CHECK(pthread_join(thread, NULL) == 0);
+	CHECK(stcp_get_thread_error() == STCP_NO_ERROR);
+
+	// Nested initialization from several threads keeps the library running
+	pthread_t threads[4];
+	for (int i = 0; i < 4; ++i)
+		CHECK(pthread_create(&threads[i], NULL, initialize_and_terminate, NULL) == 0);
+	for (int i = 0; i < 4; ++i)
+		CHECK(pthread_join(threads[i], NULL) == 0);
+	CHECK(stcp_send(accepted, "ok", 2, 1000));
+	CHECK(stcp_receive(client, buffer, sizeof(buffer), 1000) == 2);
+
+	stcp_close_channel(client);
+	stcp_close_channel(accepted);
+	stcp_close_server(server);
+}
+
+static void* churn_pool(void* pool)
+{
+	for (int i = 0; i < 200; ++i)
+	{
+		stcp_channel* channel = stcp_pool_acquire((stcp_pool*) pool, LOOPBACK_ADDRESS, POOL_PORT);
+		CHECK(channel);
+		stcp_pool_release((stcp_pool*) pool, channel, true);
+	}
+
+	return NULL;
+}
+
+static void test_pool()
+{
+	stcp_server* server = stcp_open_server(LOOPBACK_ADDRESS, POOL_PORT, 16);
+	stcp_pool* pool = stcp_open_pool(4, 4);
+
+	// Released channels are handed out again without connecting
+	stcp_channel* client = stcp_pool_acquire(pool, LOOPBACK_ADDRESS, POOL_PORT);
+	CHECK(client);
+	stcp_channel* accepted = stcp_accept(server, 1000);
+	CHECK(accepted);
+	stcp_pool_release(pool, client, true);
+	CHECK(stcp_pool_acquire(pool, LOOPBACK_ADDRESS, POOL_PORT) == client);
+	CHECK(stcp_accept(server, 0) == NULL);
+
+	// Channels the peer closed are replaced on checkout
+	stcp_pool_release(pool, client, true);
+	stcp_close_channel(accepted);
+	client = stcp_pool_acquire(pool, LOOPBACK_ADDRESS, POOL_PORT);
+	CHECK(client);
+	accepted = stcp_accept(server, 1000);
+	CHECK(accepted);
+	CHECK(stcp_get_pool_size(pool) == 1);
+	stcp_pool_release(pool, client, false);
+	stcp_close_channel(accepted);
+	CHECK(stcp_get_pool_size(pool) == 0);
+
+	// Threads sharing the pool never open more than max_total channels
+	pthread_t threads[4];
+	for (int i = 0; i < 4; ++i)
+		CHECK(pthread_create(&threads[i], NULL, churn_pool, pool) == 0);
+	for (int i = 0; i < 4; ++i)
+		CHECK(pthread_join(threads[i], NULL) == 0);
+
+	CHECK(stcp_get_pool_size(pool) <= 4);
+	int connected = 0;
+	while ((accepted = stcp_accept(server, 0)) != NULL)
+	{
+		stcp_close_channel(accepted);
+		++connected;
+	}
+	CHECK(connected == stcp_get_pool_size(pool));
+
+	// A full pool refuses to connect more
+	stcp_channel* held[4];
+	for (int i = 0; i < 4; ++i)
+	{
+		held[i] = stcp_pool_acquire(pool, LOOPBACK_ADDRESS, POOL_PORT);
+		CHECK(held[i]);
+	}
+	last_error = STCP_NO_ERROR;
+	CHECK(stcp_pool_acquire(pool, LOOPBACK_ADDRESS, POOL_PORT) == NULL);
+	CHECK(last_error == STCP_EWOULDBLOCK);
+	for (int i = 0; i < 4; ++i)
+		stcp_pool_release(pool, held[i], false);
+
+	stcp_close_pool(pool);
+	stcp_close_server(server);
+}
+
+static void test_options()
+{
+	stcp_options options = stcp_make_options(STCP_PROFILE_LOW_LATENCY);
+	options.receive_buffer_size = 256 * 1024;
+	stcp_server* server = stcp_open_server_with_options(LOOPBACK_ADDRESS, LOOPBACK_PORT, 4, &options);
+	CHECK(server);
+
+	stcp_channel* client = stcp_connect_with_options(LOOPBACK_ADDRESS, LOOPBACK_PORT, &options);
+	CHECK(client);
+	stcp_channel* accepted = stcp_accept(server, 1000);
+	CHECK(accepted);
+
+	// Both ends report the profile back, including accepted channels
+	stcp_options applied;
+	stcp_get_channel_options(client, &applied);
+	CHECK(applied.no_delay);
+	CHECK(applied.receive_buffer_size >= options.receive_buffer_size);
+	CHECK(applied.not_sent_low_water == options.not_sent_low_water);
+	stcp_get_channel_options(accepted, &applied);
+	CHECK(applied.no_delay);
+	CHECK(applied.not_sent_low_water == options.not_sent_low_water);
+	CHECK(applied.receive_buffer_size >= options.receive_buffer_size);
+
+	// Options can change on an open channel
+	stcp_options defaults = stcp_make_options(STCP_PROFILE_DEFAULT);
+	defaults.send_buffer_size = 64 * 1024;
+	CHECK(stcp_set_channel_options(client, &defaults));
+	stcp_get_channel_options(client, &applied);
+	CHECK(applied.send_buffer_size >= defaults.send_buffer_size);
+
+	stcp_close_channel(client);
+	stcp_close_channel(accepted);
+	stcp_close_server(server);
+
+#ifdef __linux__
+	// Listener-only options
+	options = stcp_make_options(STCP_PROFILE_DEFAULT);
+	options.fast_open = 16;
+	options.defer_accept_seconds = 1;
+	server = stcp_open_server_with_options(LOOPBACK_ADDRESS, LOOPBACK_PORT, 4, &options);
+	CHECK(server);
+	stcp_get_server_options(server, &applied);
+	CHECK(applied.fast_open == 16);
+	CHECK(applied.defer_accept_seconds > 0);
+	stcp_close_server(server);
+#endif
+}
+
+static void test_stats()
+{
+	stcp_server* server = stcp_open_server(LOOPBACK_ADDRESS, LOOPBACK_PORT, 4);
+	stcp_stats before;
+	stcp_get_stats(&before);
+
+	stcp_channel* client;
+	stcp_channel* accepted;
+	open_pair(server, &client, &accepted);
+
+	char buffer[1024];
+	memset(buffer, 's', sizeof(buffer));
+	CHECK(stcp_send(client, buffer, sizeof(buffer), 1000));
+	int received = 0;
+	while (received < (int) sizeof(buffer))
+	{
+		int ret = stcp_receive(accepted, buffer + received, sizeof(buffer) - received, 1000);
+		CHECK(ret > 0);
+		received += ret;
+	}
+
+	// Nothing more is coming, so this waits out its timeout
+	CHECK(stcp_receive(accepted, buffer, sizeof(buffer), 20) == 0);
+	last_error = STCP_NO_ERROR;
+
+	stcp_stats stats;
+	stcp_get_channel_stats(client, &stats);
+	CHECK(stats.bytes_sent == sizeof(buffer));
+	CHECK(stats.send_calls >= 1);
+	CHECK(stats.bytes_received == 0);
+	CHECK(stats.timeouts == 0);
+	stcp_get_channel_stats(accepted, &stats);
+	CHECK(stats.bytes_received == sizeof(buffer));
+	CHECK(stats.receive_calls >= 1);
+	CHECK(stats.poll_waits >= 2);
+	CHECK(stats.poll_wait_microseconds >= 10000);
+	CHECK(stats.timeouts == 1);
+	CHECK(stats.accepts == 0);
+
+	// The library's counters cover both ends
+	stcp_stats after;
+	stcp_get_stats(&after);
+	CHECK(after.bytes_sent - before.bytes_sent >= sizeof(buffer));
+	CHECK(after.bytes_received - before.bytes_received >= sizeof(buffer));
+	CHECK(after.accepts - before.accepts >= 1);
+	CHECK(after.timeouts - before.timeouts >= 1);
+
+	stcp_close_channel(client);
+	stcp_close_channel(accepted);
+	stcp_close_server(server);
+}
+
+static void* send_late(void* channel)
+{
+	usleep(30000);
+	CHECK(stcp_send((stcp_channel*) channel, "late", 4, 1000));
+	return NULL;
+}
+
+static void test_busy_poll()
+{
+	stcp_server* server = stcp_open_server(LOOPBACK_ADDRESS, LOOPBACK_PORT, 4);
+	stcp_channel* client;
+	stcp_channel* accepted;
+	open_pair(server, &client, &accepted);
+
+	CHECK(stcp_get_busy_poll_budget(accepted) == 0);
+	stcp_set_busy_poll(accepted, 1000);
+	int budget = stcp_get_busy_poll_budget(accepted);
+	CHECK(budget > 0 && budget <= 1000);
+
+	// Data that is already there is found by the spin
+	char buffer[16];
+	CHECK(stcp_send(client, "early", 5, 1000));
+	CHECK(stcp_receive(accepted, buffer, sizeof(buffer), 1000) == 5);
+	CHECK(stcp_get_busy_poll_budget(accepted) == budget);
+
+	// Data that arrives long after the limit backs the spin off
+	for (int i = 0; i < 8 && stcp_get_busy_poll_budget(accepted) > 0; ++i)
+	{
+		pthread_t thread;
+		CHECK(pthread_create(&thread, NULL, send_late, client) == 0);
+		CHECK(stcp_receive(accepted, buffer, sizeof(buffer), 1000) == 4);
+		pthread_join(thread, NULL);
+	}
+
+	CHECK(stcp_get_busy_poll_budget(accepted) == 0);
+
+	stcp_stats stats;
+	stcp_get_channel_stats(accepted, &stats);
+	CHECK(stats.busy_poll_hits >= 1);
+	CHECK(stats.busy_poll_misses >= 1);
+	CHECK(stats.busy_poll_microseconds > 0);
+	CHECK(stats.bytes_received >= 9);
+
+	stcp_set_busy_poll(accepted, 0);
+	CHECK(stcp_get_busy_poll_budget(accepted) == 0);
+
+	stcp_close_channel(client);
+	stcp_close_channel(accepted);
+	stcp_close_server(server);
+}
+
+static void test_accept_batch()
+{
+	stcp_server* server = stcp_open_server(LOOPBACK_ADDRESS, LOOPBACK_PORT, 16);
+	stcp_channel* clients[8];
+	for (int i = 0; i < 8; ++i)
+	{
+		clients[i] = stcp_connect(LOOPBACK_ADDRESS, LOOPBACK_PORT);
+		CHECK(clients[i]);
+	}
+
+	// Loopback handshakes finish in the kernel, so they all land in the backlog
+	usleep(50000);
+
+	stcp_channel* accepted[16];
+	CHECK(stcp_accept_batch(server, accepted, 3, 1000) == 3);
+	int count = 3;
+	while (count < 8)
+	{
+		int n = stcp_accept_batch(server, accepted + count, 16 - count, 1000);
+		CHECK(n > 0);
+		count += n;
+	}
+
+	CHECK(count == 8);
+	CHECK(stcp_accept_batch(server, accepted + count, 16 - count, 0) == 0);
+
+	// Accepted channels know their peer, clients ask for theirs
+	char address[64];
+	for (int i = 0; i < count; ++i)
+	{
+		CHECK(stcp_get_peer_address(accepted[i], address, sizeof(address)));
+		CHECK(strncmp(address, LOOPBACK_ADDRESS ":", strlen(LOOPBACK_ADDRESS ":")) == 0);
+	}
+
+	char expected[64];
+	snprintf(expected, sizeof(expected), "%s:%s", LOOPBACK_ADDRESS, LOOPBACK_PORT);
+	CHECK(stcp_get_peer_address(clients[0], address, sizeof(address)));
+	CHECK(strcmp(address, expected) == 0);
+	CHECK(!stcp_get_peer_address(clients[0], address, 4));
+
+	// Accepted sockets are non-blocking without an extra call
+	char buffer[4];
+	CHECK(stcp_try_receive(accepted[0], buffer, sizeof(buffer)) == STCP_SOCKET_WOULD_BLOCK);
+
+	for (int i = 0; i < count; ++i)
+	{
+		stcp_close_channel(clients[i]);
+		stcp_close_channel(accepted[i]);
+	}
+
+	stcp_close_server(server);
+}
+
+static void test_datagrams()
+{
+	stcp_datagram* receiver = stcp_open_datagram(LOOPBACK_ADDRESS, LOOPBACK_PORT);
+	CHECK(receiver);
+	stcp_datagram* sender = stcp_connect_datagram(LOOPBACK_ADDRESS, LOOPBACK_PORT);
+	CHECK(sender);
+
+	// Equal sizes with a short one last, the shape that goes out segmented
+	enum { COUNT = 100, SIZE = 1000 };
+	static char payloads[COUNT][SIZE];
+	stcp_message messages[COUNT];
+	for (int i = 0; i < COUNT; ++i)
+	{
+		memset(payloads[i], 'a' + i % 26, SIZE);
+		messages[i].buffer = payloads[i];
+		messages[i].length = i == COUNT - 1 ? SIZE / 2 : SIZE;
+		messages[i].address.length = 0;
+	}
+
+	CHECK(stcp_send_datagrams(sender, messages, COUNT, 1000) == COUNT);
+
+	static char buffers[COUNT][SIZE + 1];
+	stcp_message received[COUNT];
+	int count = 0;
+	while (count < COUNT)
+	{
+		for (int i = count; i < COUNT; ++i)
+		{
+			received[i].buffer = buffers[i];
+			received[i].length = SIZE + 1;
+		}
+
+		int n = stcp_receive_datagrams(receiver, received + count, COUNT - count, 1000);
+		CHECK(n > 0);
+		count += n;
+	}
+
+	// Datagrams keep their boundaries and order on loopback
+	for (int i = 0; i < COUNT; ++i)
+	{
+		CHECK(received[i].length == messages[i].length);
+		CHECK(buffers[i][0] == 'a' + i % 26 && buffers[i][received[i].length - 1] == 'a' + i % 26);
+	}
+
+	// Replies go back to the sender's address
+	stcp_message reply = { "pong", 4, received[0].address };
+	CHECK(stcp_send_datagrams(receiver, &reply, 1, 1000) == 1);
+	char buffer[16];
+	stcp_message answer = { buffer, sizeof(buffer), { { 0 }, 0 } };
+	CHECK(stcp_receive_datagrams(sender, &answer, 1, 1000) == 1);
+	CHECK(answer.length == 4 && memcmp(buffer, "pong", 4) == 0);
+
+	// Unconnected sockets send to resolved addresses
+	stcp_datagram* other = stcp_open_datagram(LOOPBACK_ADDRESS, "0");
+	stcp_address* address = stcp_resolve(LOOPBACK_ADDRESS, LOOPBACK_PORT);
+	CHECK(address);
+	stcp_message ping = { "ping", 4, { { 0 }, 0 } };
+	stcp_set_message_address(&ping, address);
+	CHECK(stcp_send_datagrams(other, &ping, 1, 1000) == 1);
+	answer.length = sizeof(buffer);
+	CHECK(stcp_receive_datagrams(receiver, &answer, 1, 1000) == 1);
+	CHECK(answer.length == 4 && memcmp(buffer, "ping", 4) == 0);
+	stcp_free_address(address);
+
+	// Nothing left to receive
+	stcp_clear_thread_error();
+	answer.length = sizeof(buffer);
+	CHECK(stcp_receive_datagrams(receiver, &answer, 1, 10) == 0);
+	CHECK(stcp_get_thread_error() == STCP_ETIMEDOUT);
+	last_error = STCP_NO_ERROR;
+
+	stcp_close_datagram(other);
+	stcp_close_datagram(sender);
+	stcp_close_datagram(receiver);
+}
+
+static void test_local_sockets()
+{
+	char path[64];
+	char address[80];
+	snprintf(path, sizeof(path), "/tmp/stcp-loopback-%d.sock", (int) getpid());
+	snprintf(address, sizeof(address), "unix:%s", path);
+
+	// Options that only apply to TCP are left out rather than failing
+	stcp_options options = stcp_make_options(STCP_PROFILE_LOW_LATENCY);
+	last_error = STCP_NO_ERROR;
+	stcp_server* server = stcp_open_server_with_options(address, "", 4, &options);
+	CHECK(server);
+	CHECK(access(path, F_OK) == 0);
+
+	stcp_channel* client = stcp_connect(address, "");
+	CHECK(client);
+	stcp_channel* accepted = stcp_accept(server, 1000);
+	CHECK(accepted);
+
+	stcp_options applied;
+	stcp_get_channel_options(accepted, &applied);
+	CHECK(!applied.no_delay);
+	CHECK(last_error == STCP_NO_ERROR);
+
+	// Channels work the same as over TCP
+	char buffer[16];
+	CHECK(stcp_send(client, "local", 5, 1000));
+	stcp_poll_entry entry = { accepted, NULL, STCP_EVENT_READ, 0 };
+	CHECK(stcp_poll(&entry, 1, 1000) == 1);
+	CHECK(stcp_receive(accepted, buffer, sizeof(buffer), 1000) == 5);
+	CHECK(memcmp(buffer, "local", 5) == 0);
+	CHECK(stcp_send(accepted, "reply", 5, 1000));
+	CHECK(stcp_receive(client, buffer, sizeof(buffer), 1000) == 5);
+
+	char peer[96];
+	CHECK(stcp_get_peer_address(client, peer, sizeof(peer)));
+	CHECK(strcmp(peer, address) == 0);
+	CHECK(stcp_get_peer_address(accepted, peer, sizeof(peer)));
+	CHECK(strcmp(peer, "unix:") == 0);
+
+	// A path that a live server holds is refused without touching it
+	last_error = STCP_NO_ERROR;
+	CHECK(stcp_open_server(address, "", 4) == NULL);
+	CHECK(last_error == STCP_EADDRINUSE);
+	CHECK(access(path, F_OK) == 0);
+	CHECK(stcp_send(client, "still", 5, 1000));
+	CHECK(stcp_receive(accepted, buffer, sizeof(buffer), 1000) == 5);
+
+	stcp_close_channel(client);
+	stcp_close_channel(accepted);
+	stcp_close_server(server);
+	CHECK(access(path, F_OK) != 0);
+
+	// The file of a server that died without closing is replaced
+	struct sockaddr_un local;
+	memset(&local, 0, sizeof(local));
+	local.sun_family = AF_UNIX;
+	snprintf(local.sun_path, sizeof(local.sun_path), "%s", path);
+	int stale = socket(AF_UNIX, SOCK_STREAM, 0);
+	CHECK(stale != -1);
+	CHECK(bind(stale, (struct sockaddr*) &local, sizeof(local)) == 0);
+	close(stale);
+	CHECK(access(path, F_OK) == 0);
+	server = stcp_open_server(address, "", 4);
+	CHECK(server);
+	client = stcp_connect(address, "");
+	CHECK(client);
+	stcp_close_channel(client);
+	stcp_close_server(server);
+	CHECK(access(path, F_OK) != 0);
+
+#ifdef __linux__
+	// Abstract names leave nothing on the filesystem
+	snprintf(address, sizeof(address), "unix:@stcp-loopback-%d", (int) getpid());
+	server = stcp_open_server(address, "", 4);
+	CHECK(server);
+	client = stcp_connect(address, "");
+	CHECK(client);
+	accepted = stcp_accept(server, 1000);
+	CHECK(accepted);
+	CHECK(stcp_send(client, "abstract", 8, 1000));
+	CHECK(stcp_receive(accepted, buffer, sizeof(buffer), 1000) == 8);
+	CHECK(stcp_get_peer_address(client, peer, sizeof(peer)));
+	CHECK(strcmp(peer, address) == 0);
+
+	stcp_close_channel(client);
+	stcp_close_channel(accepted);
+	stcp_close_server(server);
+#endif
+}
+
+static void test_event_loop(bool edge_triggered)
+{
+	stcp_event_loop* loop = stcp_open_event_loop(edge_triggered);
+	CHECK(loop);
+
+	stcp_server* server = stcp_open_server(LOOPBACK_ADDRESS, LOOPBACK_PORT, 4);
+	CHECK(stcp_event_loop_add_server(loop, server, STCP_EVENT_READ, server));
+
+	stcp_event events[4];
+	CHECK(stcp_event_loop_wait(loop, events, 4, 0) == 0);
+
+	stcp_channel* client = stcp_connect(LOOPBACK_ADDRESS, LOOPBACK_PORT);
+	CHECK(stcp_event_loop_wait(loop, events, 4, 1000) == 1);
+	CHECK(events[0].user_data == server);
+	CHECK(events[0].events & STCP_EVENT_READ);
+
+	stcp_channel* accepted = stcp_accept(server, 0);
+	CHECK(accepted);
+	CHECK(stcp_event_loop_add_channel(loop, accepted, STCP_EVENT_READ, accepted));
+
+	const char* message = "event loop";
+	CHECK(stcp_send(client, message, strlen(message), 1000));
+	CHECK(stcp_event_loop_wait(loop, events, 4, 1000) == 1);
+	CHECK(events[0].user_data == accepted);
+	CHECK(events[0].events & STCP_EVENT_READ);
+
+	char buffer[64];
+	CHECK(stcp_receive(accepted, buffer, sizeof(buffer), 0) == (int) strlen(message));
+	CHECK(memcmp(buffer, message, strlen(message)) == 0);
+
+	// Writability is reported once the interest is changed
+	CHECK(stcp_event_loop_modify_channel(loop, accepted, STCP_EVENT_WRITE, client));
+	CHECK(stcp_event_loop_wait(loop, events, 4, 1000) == 1);
+	CHECK(events[0].user_data == client);
+	CHECK(events[0].events & STCP_EVENT_WRITE);
+
+	// Closing the peer reports a hangup
+	CHECK(stcp_event_loop_modify_channel(loop, accepted, STCP_EVENT_READ, accepted));
+	stcp_close_channel(client);
+	CHECK(stcp_event_loop_wait(loop, events, 4, 1000) == 1);
+	CHECK(events[0].events & (STCP_EVENT_HANGUP | STCP_EVENT_READ));
+
+	CHECK(stcp_event_loop_remove_channel(loop, accepted));
+	CHECK(stcp_event_loop_remove_server(loop, server));
+	CHECK(stcp_event_loop_wait(loop, events, 4, 0) == 0);
+
+	stcp_close_channel(accepted);
+	stcp_close_server(server);
+	stcp_close_event_loop(loop);
+}
+
+static void test_poll()
+{
+	stcp_server* server = stcp_open_server(LOOPBACK_ADDRESS, LOOPBACK_PORT, 4);
+	stcp_channel* clients[2];
+	stcp_channel* accepted[2];
+	open_pair(server, &clients[0], &accepted[0]);
+	open_pair(server, &clients[1], &accepted[1]);
+
+	stcp_poll_entry entries[3];
+	memset(entries, 0, sizeof(entries));
+	entries[0].channel = accepted[0];
+	entries[0].events = STCP_EVENT_READ;
+	entries[1].channel = accepted[1];
+	entries[1].events = STCP_EVENT_READ;
+	entries[2].server = server;
+	entries[2].events = STCP_EVENT_READ;
+	CHECK(stcp_poll(entries, 3, 0) == 0);
+
+	// Only the channel with pending data is reported
+	CHECK(stcp_send(clients[1], "x", 1, 1000));
+	CHECK(stcp_poll(entries, 3, 1000) == 1);
+	CHECK(entries[0].revents == 0);
+	CHECK(entries[1].revents & STCP_EVENT_READ);
+	CHECK(entries[2].revents == 0);
+
+	entries[0].events = STCP_EVENT_WRITE;
+	CHECK(stcp_poll(entries, 2, 1000) == 2);
+	CHECK(entries[0].revents & STCP_EVENT_WRITE);
+	CHECK(entries[1].revents & STCP_EVENT_READ);
+
+	for (int i = 0; i < 2; ++i)
+	{
+		stcp_close_channel(clients[i]);
+		stcp_close_channel(accepted[i]);
+	}
+	stcp_close_server(server);
+}
+
+static void test_scatter_gather()
+{
+	stcp_server* server = stcp_open_server(LOOPBACK_ADDRESS, LOOPBACK_PORT, 4);
+	stcp_channel* client;
+	stcp_channel* accepted;
+	open_pair(server, &client, &accepted);
+
+	char header[] = "header:";
+	char body[4096];
+	char trailer[] = ":trailer";
+	memset(body, 'b', sizeof(body));
+
+	stcp_iovec buffers[4];
+	buffers[0].base = header;
+	buffers[0].length = strlen(header);
+	buffers[1].base = NULL;
+	buffers[1].length = 0;
+	buffers[2].base = body;
+	buffers[2].length = sizeof(body);
+	buffers[3].base = trailer;
+	buffers[3].length = strlen(trailer);
+	CHECK(stcp_sendv(client, buffers, 4, 1000));
+
+	const int total = strlen(header) + sizeof(body) + strlen(trailer);
+	char first[100];
+	char second[8192];
+	stcp_iovec targets[2];
+	targets[0].base = first;
+	targets[0].length = sizeof(first);
+	targets[1].base = second;
+	targets[1].length = sizeof(second);
+
+	int received = 0;
+	int count = 2;
+	while (received < total)
+	{
+		int ret = stcp_receivev(accepted, targets, count, 1000);
+		CHECK(ret > 0);
+		received += ret;
+
+		// Continue after the bytes already received
+		if (received < (int) sizeof(first))
+		{
+			targets[0].base = first + received;
+			targets[0].length = sizeof(first) - received;
+		}
+		else
+		{
+			targets[0].base = second + received - sizeof(first);
+			targets[0].length = sizeof(second) - (received - sizeof(first));
+			count = 1;
+		}
+	}
+
+	CHECK(memcmp(first, header, strlen(header)) == 0);
+	CHECK(first[strlen(header)] == 'b');
+	CHECK(memcmp(second + total - sizeof(first) - strlen(trailer), trailer, strlen(trailer)) == 0);
+
+	stcp_close_channel(client);
+	stcp_close_channel(accepted);
+	stcp_close_server(server);
+}
+
+// Drains a channel on another thread so large sends can complete
+typedef struct reader
+{
+	pthread_t thread;
+	stcp_channel* channel;
+	char* buffer;
+	int length;
+	int received;
+} reader;
+
+static void* read_all(void* user_data)
+{
+	reader* r = (reader*) user_data;
+	while (r->received < r->length)
+	{
+		int ret = stcp_receive(r->channel, r->buffer + r->received, r->length - r->received, 5000);
+		if (ret <= 0)
+			break;
+		r->received += ret;
+	}
+
+	return NULL;
+}
+
+static void start_reader(reader* r, stcp_channel* channel, int length)
+{
+	r->channel = channel;
+	r->buffer = (char*) malloc(length);
+	r->length = length;
+	r->received = 0;
+	CHECK(r->buffer);
+	CHECK(pthread_create(&r->thread, NULL, read_all, r) == 0);
+}
+
+static void join_reader(reader* r)
+{
+	CHECK(pthread_join(r->thread, NULL) == 0);
+	CHECK(r->received == r->length);
+}
+
+static void test_send_file()
+{
+	stcp_server* server = stcp_open_server(LOOPBACK_ADDRESS, LOOPBACK_PORT, 4);
+	stcp_channel* client;
+	stcp_channel* accepted;
+	open_pair(server, &client, &accepted);
+
+	// Larger than the socket buffers, so the sender has to wait for space
+	const int length = 8 * 1024 * 1024;
+	const int offset = 100;
+	char* contents = (char*) malloc(length + offset);
+	CHECK(contents);
+	for (int i = 0; i < length + offset; ++i)
+		contents[i] = (char) (i * 31);
+
+	FILE* file = tmpfile();
+	CHECK(file);
+	CHECK(fwrite(contents, 1, length + offset, file) == (size_t) (length + offset));
+	CHECK(fflush(file) == 0);
+
+	reader r;
+	start_reader(&r, client, length);
+	CHECK(stcp_send_file(accepted, fileno(file), offset, length, 5000));
+	join_reader(&r);
+	CHECK(memcmp(r.buffer, contents + offset, length) == 0);
+	free(r.buffer);
+
+	// Pipes are spliced from their current position
+	int pipe_fds[2];
+	CHECK(pipe(pipe_fds) == 0);
+	CHECK(write(pipe_fds[1], contents, 4096) == 4096);
+	CHECK(stcp_send_file(accepted, pipe_fds[0], 0, 4096, 1000));
+
+	char buffer[4096];
+	int received = 0;
+	while (received < 4096)
+	{
+		int ret = stcp_receive(client, buffer + received, sizeof(buffer) - received, 1000);
+		CHECK(ret > 0);
+		received += ret;
+	}
+	CHECK(memcmp(buffer, contents, 4096) == 0);
+
+	close(pipe_fds[0]);
+	close(pipe_fds[1]);
+	fclose(file);
+	free(contents);
+	stcp_close_channel(client);
+	stcp_close_channel(accepted);
+	stcp_close_server(server);
+}
+
+static const char* released_buffer = NULL;
+static int released_count = 0;
+
+void record_release(const char* buffer, bool copied, void* user_data)
+{
+	(void) copied;
+	(void) user_data;
+	released_buffer = buffer;
+	++released_count;
+}
+
+static void test_send_queue()
+{
+	stcp_server* server = stcp_open_server(LOOPBACK_ADDRESS, LOOPBACK_PORT, 4);
+	stcp_channel* client;
+	stcp_channel* accepted;
+	open_pair(server, &client, &accepted);
+
+	// Big enough to outgrow the autotuned loopback buffers
+	const int length = 32 * 1024 * 1024;
+	char* contents = (char*) malloc(length);
+	CHECK(contents);
+	for (int i = 0; i < length; ++i)
+		contents[i] = (char) (i * 7);
+
+	// A send larger than the socket buffers waits for the reader instead of failing
+	reader r;
+	start_reader(&r, client, length);
+	CHECK(stcp_send(accepted, contents, length, 5000));
+	join_reader(&r);
+	CHECK(memcmp(r.buffer, contents, length) == 0);
+	free(r.buffer);
+
+	// Queued sends return at once, and report backpressure past the high-water mark
+	stcp_set_send_queue_high_water(accepted, 1024 * 1024);
+	CHECK(stcp_queue_send(accepted, contents, length / 2));
+	CHECK(stcp_get_send_queue_length(accepted) > 0);
+	CHECK(stcp_is_send_queue_full(accepted));
+	CHECK(stcp_queue_send(accepted, contents + length / 2, length / 4));
+
+	// Later sends go out after the queue
+	start_reader(&r, client, length);
+	CHECK(stcp_send(accepted, contents + length / 2 + length / 4, length / 4, 5000));
+	CHECK(stcp_get_send_queue_length(accepted) == 0);
+	CHECK(!stcp_is_send_queue_full(accepted));
+	join_reader(&r);
+	CHECK(memcmp(r.buffer, contents, length) == 0);
+	free(r.buffer);
+
+	// Closing a channel drops whatever is still queued
+	CHECK(stcp_queue_send(accepted, contents, length));
+
+	free(contents);
+	stcp_close_channel(client);
+	stcp_close_channel(accepted);
+	stcp_close_server(server);
+}
+
+// Length-prefixed messages, with payload bytes derived from the message number
+#define MESSAGE_COUNT 2000
+
+static int message_size(int i)
+{
+	return 1 + (i * 7919) % 12000;
+}
+
+typedef struct sender
+{
+	pthread_t thread;
+	stcp_channel* channel;
+} sender;
+
+static void* send_messages(void* user_data)
+{
+	sender* s = (sender*) user_data;
+	char message[4 + 12000];
+	for (int i = 0; i < MESSAGE_COUNT; ++i)
+	{
+		int size = message_size(i);
+		memcpy(message, &size, 4);
+		memset(message + 4, (char) i, size);
+		CHECK(stcp_send(s->channel, message, 4 + size, 5000));
+	}
+
+	return NULL;
+}
+
+static int parse_messages(const char* buffer, int length, void* user_data)
+{
+	int* received = (int*) user_data;
+	int consumed = 0;
+	while (length - consumed >= 4)
+	{
+		int size;
+		memcpy(&size, buffer + consumed, 4);
+		if (length - consumed - 4 < size)
+			break;
+
+		CHECK(size == message_size(*received));
+		for (int i = 0; i < size; ++i)
+			CHECK(buffer[consumed + 4 + i] == (char) *received);
+
+		consumed += 4 + size;
+		++*received;
+	}
+
+	return consumed;
+}
+
+// Consumes no more than the bytes still wanted
+static int consume_some(const char* buffer, int length, void* user_data)
+{
+	(void) buffer;
+	int* wanted = (int*) user_data;
+	int consumed = length < *wanted ? length : *wanted;
+	*wanted -= consumed;
+	return consumed;
+}
+
+static void test_receive_buffer()
+{
+	stcp_server* server = stcp_open_server(LOOPBACK_ADDRESS, LOOPBACK_PORT, 4);
+	stcp_channel* client;
+	stcp_channel* accepted;
+	open_pair(server, &client, &accepted);
+
+	// Messages larger than a page wrap around the ring all the time
+	CHECK(stcp_set_receive_buffer(client, 16000));
+	CHECK(stcp_get_receive_buffer_size(client) >= 16000);
+
+	sender s;
+	s.channel = accepted;
+	CHECK(pthread_create(&s.thread, NULL, send_messages, &s) == 0);
+
+	int received = 0;
+	while (received < MESSAGE_COUNT)
+		CHECK(stcp_stream_consume(client, parse_messages, &received, 5000));
+
+	CHECK(pthread_join(s.thread, NULL) == 0);
+	CHECK(stcp_get_receive_buffer_length(client) == 0);
+
+	// Plain receives pick up what the consumer left, without waiting on the socket
+	CHECK(stcp_send(accepted, "headtail", 8, 1000));
+	int wanted = 4;
+	while (wanted > 0)
+		CHECK(stcp_stream_consume(client, consume_some, &wanted, 1000));
+	char tail[8];
+	int tail_length = 0;
+	while (tail_length < 4)
+	{
+		int ret = stcp_receive(client, tail + tail_length, sizeof(tail) - tail_length, 1000);
+		CHECK(ret > 0);
+		tail_length += ret;
+	}
+	CHECK(tail_length == 4);
+	CHECK(memcmp(tail, "tail", 4) == 0);
+	CHECK(stcp_get_receive_buffer_length(client) == 0);
+
+	// A message that can't fit is an error rather than a stall
+	CHECK(stcp_set_receive_buffer(client, 1));
+	int size = stcp_get_receive_buffer_size(client) + 1;
+	char* message = (char*) calloc(4 + size, 1);
+	CHECK(message);
+	memcpy(message, &size, 4);
+	CHECK(stcp_send(accepted, message, 4 + size, 1000));
+
+	last_error = STCP_NO_ERROR;
+	received = 0;
+	while (last_error == STCP_NO_ERROR)
+		CHECK(stcp_stream_consume(client, parse_messages, &received, 1000) || last_error == STCP_EMSGSIZE);
+	free(message);
+
+	stcp_close_channel(client);
+	stcp_close_channel(accepted);
+	stcp_close_server(server);
+}
+
+typedef struct sharer
+{
+	pthread_t thread;
+	stcp_channel* channel;
+	bool enabled;
+} sharer;
+
+static void* enable_shared(void* user_data)
+{
+	sharer* s = (sharer*) user_data;
+	s->enabled = stcp_enable_shared_memory(s->channel, 16000, 1000);
+	return NULL;
+}
+
+static void test_shared_memory()
+{
+	stcp_server* server = stcp_open_server(LOOPBACK_ADDRESS, LOOPBACK_PORT, 4);
+	stcp_channel* client;
+	stcp_channel* accepted;
+	open_pair(server, &client, &accepted);
+
+	// A peer that doesn't take part leaves the channel on its socket
+	char buffer[64];
+	memset(buffer, 0, sizeof(buffer));
+	CHECK(stcp_send(accepted, buffer, 33, 1000));
+	last_error = STCP_NO_ERROR;
+	CHECK(!stcp_enable_shared_memory(client, 16000, 1000));
+	CHECK(last_error == STCP_EOPNOTSUPP);
+	CHECK(!stcp_is_shared_memory(client));
+	int received = 0;
+	while (received < 33)
+		received += stcp_receive(accepted, buffer, 33 - received, 1000);
+	CHECK(stcp_send(client, "socket", 6, 1000));
+	CHECK(stcp_receive(accepted, buffer, sizeof(buffer), 1000) == 6);
+
+	// Both ends have to negotiate at the same time
+	sharer peer;
+	peer.channel = accepted;
+	CHECK(pthread_create(&peer.thread, NULL, enable_shared, &peer) == 0);
+	CHECK(stcp_enable_shared_memory(client, 16000, 1000));
+	CHECK(pthread_join(peer.thread, NULL) == 0);
+	CHECK(peer.enabled);
+	CHECK(stcp_is_shared_memory(client));
+	CHECK(stcp_is_shared_memory(accepted));
+
+	// Messages larger than a page wrap around the peer's ring and are consumed in place
+	sender s;
+	s.channel = accepted;
+	CHECK(pthread_create(&s.thread, NULL, send_messages, &s) == 0);
+	received = 0;
+	while (received < MESSAGE_COUNT)
+		CHECK(stcp_stream_consume(client, parse_messages, &received, 5000));
+	CHECK(pthread_join(s.thread, NULL) == 0);
+
+	// A send many times the ring's size waits for the reader to make room
+	const int length = 1 << 20;
+	char* data = (char*) malloc(length);
+	CHECK(data);
+	for (int i = 0; i < length; ++i)
+		data[i] = (char) (i * 7);
+
+	reader r;
+	start_reader(&r, accepted, length);
+	CHECK(stcp_send(client, data, length, 5000));
+	join_reader(&r);
+	CHECK(memcmp(r.buffer, data, length) == 0);
+	free(r.buffer);
+	free(data);
+
+	stcp_stats stats;
+	stcp_get_channel_stats(client, &stats);
+	CHECK(stats.bytes_sent >= (unsigned long long) length);
+
+	// Closing one end is the end of the stream at the other
+	stcp_close_channel(client);
+	CHECK(stcp_receive(accepted, buffer, sizeof(buffer), 1000) == 0);
+
+	stcp_close_channel(accepted);
+	stcp_close_server(server);
+}
+
+typedef struct frames
+{
+	char data[4096];
+	int length;
+	int count;
+} frames;
+
+// Joins received frames with '|' so a whole exchange can be compared at once
+static bool collect_frame(const char* frame, int length, void* user_data)
+{
+	frames* f = (frames*) user_data;
+	CHECK(f->length + length + 1 <= (int) sizeof(f->data));
+	memcpy(f->data + f->length, frame, length);
+	f->length += length;
+	f->data[f->length++] = '|';
+	++f->count;
+	return true;
+}
+
+static void receive_frames(stcp_framer* framer, frames* f, int count)
+{
+	memset(f, 0, sizeof(frames));
+	while (f->count < count)
+		CHECK(stcp_receive_frames(framer, collect_frame, f, 1000));
+}
+
+static void test_framer()
+{
+	stcp_server* server = stcp_open_server(LOOPBACK_ADDRESS, LOOPBACK_PORT, 4);
+	stcp_channel* client;
+	stcp_channel* accepted;
+	open_pair(server, &client, &accepted);
+
+	frames f;
+	stcp_iovec batch[3];
+	batch[0].base = "alpha";
+	batch[0].length = 5;
+	batch[1].base = "";
+	batch[1].length = 0;
+	batch[2].base = "gamma";
+	batch[2].length = 5;
+
+	// Length prefixes, with a frame that arrives in pieces
+	stcp_framer* sender = stcp_open_length_framer(accepted, 2, 1000);
+	stcp_framer* receiver = stcp_open_length_framer(client, 2, 1000);
+	CHECK(sender && receiver);
+	CHECK(stcp_send_frames(sender, batch, 3, 1000));
+	CHECK(stcp_send(accepted, "\0\4da", 4, 1000));
+	receive_frames(receiver, &f, 3);
+	CHECK(stcp_send(accepted, "ta", 2, 1000));
+	receive_frames(receiver, &f, 1);
+	CHECK(f.length == 5 && memcmp(f.data, "data|", 5) == 0);
+	stcp_close_framer(sender);
+	stcp_close_framer(receiver);
+
+	// Varints, including one that needs two bytes
+	static char large[300];
+	memset(large, 'x', sizeof(large));
+	batch[1].base = large;
+	batch[1].length = sizeof(large);
+	sender = stcp_open_varint_framer(accepted, 1000);
+	receiver = stcp_open_varint_framer(client, 1000);
+	CHECK(stcp_send_frames(sender, batch, 3, 1000));
+	receive_frames(receiver, &f, 3);
+	CHECK(f.length == 5 + 300 + 5 + 3);
+	CHECK(memcmp(f.data, "alpha|x", 7) == 0 && memcmp(f.data + 307, "gamma|", 6) == 0);
+
+	// Frames over the limit are errors, and nothing of their batch is sent
+	stcp_framer* small = stcp_open_varint_framer(accepted, 100);
+	last_error = STCP_NO_ERROR;
+	CHECK(!stcp_send_frames(small, batch, 3, 1000));
+	CHECK(last_error == STCP_EMSGSIZE);
+	stcp_close_framer(small);
+
+	// So are limits a length prefix can't hold
+	last_error = STCP_NO_ERROR;
+	CHECK(stcp_open_length_framer(accepted, 1, 256) == NULL);
+	CHECK(last_error == STCP_EINVAL);
+	CHECK(stcp_open_length_framer(accepted, 2, 65536) == NULL);
+	small = stcp_open_length_framer(accepted, 1, 255);
+	CHECK(small);
+	stcp_close_framer(small);
+
+	last_error = STCP_NO_ERROR;
+	CHECK(stcp_send(accepted, "\xe9\x07", 2, 1000));
+	CHECK(!stcp_receive_frames(receiver, collect_frame, &f, 1000));
+	CHECK(last_error == STCP_EMSGSIZE);
+	stcp_close_framer(sender);
+	stcp_close_framer(receiver);
+	stcp_close_channel(client);
+	stcp_close_channel(accepted);
+
+	// Delimiters, split in the middle of one
+	open_pair(server, &client, &accepted);
+	receiver = stcp_open_delimiter_framer(client, "\r\n", 2, 64);
+	CHECK(stcp_send(accepted, "GET / HTTP/1.1\r\nHost: a\r", 24, 1000));
+	receive_frames(receiver, &f, 1);
+	CHECK(stcp_send(accepted, "\n\r\n", 3, 1000));
+	receive_frames(receiver, &f, 2);
+	CHECK(f.length == 9 && memcmp(f.data, "Host: a||", 9) == 0);
+	stcp_close_framer(receiver);
+
+	stcp_close_channel(client);
+	stcp_close_channel(accepted);
+	stcp_close_server(server);
+}
+
+#ifdef STCP_TLS
+// Writes a self-signed certificate for localhost and its key to temporary files
+static void make_certificate(char* certificate_file, char* key_file)
+{
+	EVP_PKEY* key = EVP_EC_gen("P-256");
+	X509* certificate = X509_new();
+	CHECK(key && certificate);
+
+	ASN1_INTEGER_set(X509_get_serialNumber(certificate), 1);
+	X509_gmtime_adj(X509_getm_notBefore(certificate), 0);
+	X509_gmtime_adj(X509_getm_notAfter(certificate), 3600);
+	X509_NAME* name = X509_get_subject_name(certificate);
+	X509_NAME_add_entry_by_txt(name, "CN", MBSTRING_ASC, (const unsigned char*) "localhost", -1, -1, 0);
+	X509_set_issuer_name(certificate, name);
+	X509_set_pubkey(certificate, key);
+	CHECK(X509_sign(certificate, key, EVP_sha256()) > 0);
+
+	strcpy(certificate_file, "/tmp/stcp_certXXXXXX");
+	strcpy(key_file, "/tmp/stcp_keyXXXXXX");
+	FILE* file = fdopen(mkstemp(certificate_file), "w");
+	CHECK(file && PEM_write_X509(file, certificate));
+	fclose(file);
+	file = fdopen(mkstemp(key_file), "w");
+	CHECK(file && PEM_write_PrivateKey(file, key, NULL, NULL, 0, NULL, NULL));
+	fclose(file);
+
+	X509_free(certificate);
+	EVP_PKEY_free(key);
+}
+
+typedef struct tls_acceptor
+{
+	pthread_t thread;
+	stcp_server* server;
+	stcp_tls_context* context;
+	stcp_channel* accepted;
+} tls_acceptor;
+
+// The server handshake runs alongside the client's
+static void* accept_tls(void* user_data)
+{
+	tls_acceptor* a = (tls_acceptor*) user_data;
+	a->accepted = stcp_accept(a->server, 5000);
+	return NULL;
+}
+
+// Runs a server handshake that the client aborts
+static void* reject_tls(void* user_data)
+{
+	tls_acceptor* a = (tls_acceptor*) user_data;
+	CHECK(!stcp_accept_tls(a->accepted, a->context, 1000));
+	return NULL;
+}
+
+static void open_tls_pair(stcp_server* server, stcp_tls_context* client_context, stcp_channel** client, stcp_channel** accepted)
+{
+	tls_acceptor a;
+	a.server = server;
+	CHECK(pthread_create(&a.thread, NULL, accept_tls, &a) == 0);
+	*client = stcp_connect(LOOPBACK_ADDRESS, LOOPBACK_PORT);
+	CHECK(*client);
+	CHECK(stcp_start_tls(*client, client_context, "localhost", 5000));
+	CHECK(pthread_join(a.thread, NULL) == 0);
+	CHECK(a.accepted);
+	*accepted = a.accepted;
+}
+
+static void test_tls()
+{
+	char certificate_file[32];
+	char key_file[32];
+	make_certificate(certificate_file, key_file);
+
+	stcp_tls_context* server_context = stcp_open_tls_server_context(certificate_file, key_file);
+	stcp_tls_context* client_context = stcp_open_tls_client_context(certificate_file, true);
+	CHECK(server_context && client_context);
+
+	stcp_server* server = stcp_open_server(LOOPBACK_ADDRESS, LOOPBACK_PORT, 4);
+	stcp_set_server_tls(server, server_context);
+	stcp_channel* client;
+	stcp_channel* accepted;
+	open_tls_pair(server, client_context, &client, &accepted);
+	CHECK(!stcp_is_tls_session_reused(client));
+
+	// io_uring moves raw socket bytes, so it turns TLS away instead of leaking ciphertext
+	stcp_uring* ring = stcp_open_uring(8, 8, 256);
+	if (ring)
+	{
+		last_error = STCP_NO_ERROR;
+		CHECK(!stcp_uring_accept(ring, server, NULL));
+		CHECK(last_error == STCP_EOPNOTSUPP);
+		last_error = STCP_NO_ERROR;
+		CHECK(!stcp_uring_receive(ring, client, NULL));
+		CHECK(last_error == STCP_EOPNOTSUPP);
+		last_error = STCP_NO_ERROR;
+		CHECK(!stcp_uring_send(ring, client, "x", 1, NULL));
+		CHECK(last_error == STCP_EOPNOTSUPP);
+		stcp_close_uring(ring);
+	}
+
+	// Enough records that both sides wait on each other
+	const int length = 4 * 1024 * 1024;
+	char* contents = (char*) malloc(length);
+	CHECK(contents);
+	for (int i = 0; i < length; ++i)
+		contents[i] = (char) (i * 7);
+
+	reader r;
+	start_reader(&r, client, length);
+	CHECK(stcp_send(accepted, contents, length, 5000));
+	join_reader(&r);
+	CHECK(memcmp(r.buffer, contents, length) == 0);
+	free(r.buffer);
+
+	// Files go through sendfile with kernel TLS, or are encrypted from a copy without it
+	FILE* file = tmpfile();
+	CHECK(file);
+	CHECK(fwrite(contents, 1, length, file) == (size_t) length);
+	CHECK(fflush(file) == 0);
+	start_reader(&r, client, length - 10);
+	CHECK(stcp_send_file(accepted, fileno(file), 10, length - 10, 5000));
+	join_reader(&r);
+	CHECK(memcmp(r.buffer, contents + 10, length - 10) == 0);
+	free(r.buffer);
+	fclose(file);
+
+	stcp_close_channel(client);
+	stcp_close_channel(accepted);
+
+	// The client read the server's ticket with the data, so the next handshake resumes
+	open_tls_pair(server, client_context, &client, &accepted);
+	CHECK(stcp_is_tls_session_reused(client));
+	CHECK(stcp_send(client, "ping", 4, 1000));
+	char buffer[4];
+	CHECK(stcp_receive(accepted, buffer, 4, 1000) == 4);
+	CHECK(memcmp(buffer, "ping", 4) == 0);
+
+	// The client's first read wakes for the new ticket alone and waits on for the data
+	pthread_t thread;
+	CHECK(pthread_create(&thread, NULL, send_late, accepted) == 0);
+	stcp_iovec vector;
+	vector.base = buffer;
+	vector.length = 4;
+	CHECK(stcp_receivev(client, &vector, 1, 1000) == 4);
+	CHECK(memcmp(buffer, "late", 4) == 0);
+	pthread_join(thread, NULL);
+
+	// The rest of a record that was only partly read is readable without the socket saying so
+	CHECK(stcp_send(accepted, contents, 16 * 1024, 1000));
+	char part[1024];
+	CHECK(stcp_receive(client, part, sizeof(part), 1000) == (int) sizeof(part));
+	CHECK(memcmp(part, contents, sizeof(part)) == 0);
+	stcp_poll_entry entry;
+	memset(&entry, 0, sizeof(entry));
+	entry.channel = client;
+	entry.events = STCP_EVENT_READ;
+	CHECK(stcp_poll(&entry, 1, 1000) == 1);
+	CHECK(entry.revents & STCP_EVENT_READ);
+	int rest = 0;
+	while (rest < 15 * 1024)
+	{
+		int ret = stcp_try_receive(client, part, sizeof(part));
+		CHECK(ret > 0);
+		rest += ret;
+	}
+	CHECK(stcp_try_receive(client, part, sizeof(part)) == STCP_SOCKET_WOULD_BLOCK);
+	stcp_close_channel(client);
+	stcp_close_channel(accepted);
+
+	// A client that never starts its handshake gives up the accept without a timeout of its own.
+	// The server closes first, so this runs over a unix socket that leaves no TIME_WAIT behind
+	char address[80];
+	snprintf(address, sizeof(address), "unix:/tmp/stcp-handshake-%d.sock", (int) getpid());
+	stcp_server* local_server = stcp_open_server(address, "", 4);
+	CHECK(local_server);
+	stcp_set_server_tls(local_server, server_context);
+	stcp_set_server_handshake_timeout(local_server, 100);
+	client = stcp_connect(address, "");
+	CHECK(client);
+	CHECK(!stcp_accept(local_server, -1));
+	CHECK(last_error == STCP_ETIMEDOUT);
+	stcp_close_channel(client);
+	stcp_close_server(local_server);
+
+	// A client that only trusts the system's CAs rejects the certificate
+	stcp_tls_context* untrusting_context = stcp_open_tls_client_context(NULL, true);
+	CHECK(untrusting_context);
+	stcp_set_server_tls(server, NULL);
+	open_pair(server, &client, &accepted);
+
+	tls_acceptor a;
+	a.context = server_context;
+	a.accepted = accepted;
+	CHECK(pthread_create(&a.thread, NULL, reject_tls, &a) == 0);
+	CHECK(!stcp_start_tls(client, untrusting_context, "localhost", 1000));
+	CHECK(pthread_join(a.thread, NULL) == 0);
+
+	stcp_close_channel(client);
+	stcp_close_channel(accepted);
+	stcp_close_server(server);
+	stcp_close_tls_context(untrusting_context);
+	stcp_close_tls_context(client_context);
+	stcp_close_tls_context(server_context);
+	remove(certificate_file);
+	remove(key_file);
+	free(contents);
+}
+#endif
+
+static void test_zerocopy()
+{
+	stcp_server* server = stcp_open_server(LOOPBACK_ADDRESS, LOOPBACK_PORT, 4);
+	stcp_channel* client;
+	stcp_channel* accepted;
+	open_pair(server, &client, &accepted);
+
+	if (!stcp_enable_zerocopy(accepted, 4096, record_release, NULL))
+	{
+		printf("MSG_ZEROCOPY not supported, skipping\n");
+		stcp_close_channel(client);
+		stcp_close_channel(accepted);
+		stcp_close_server(server);
+		return;
+	}
+
+	// Small sends take the copy path and are never pending
+	CHECK(stcp_send(accepted, "small", 5, 1000));
+	CHECK(stcp_get_zerocopy_pending(accepted) == 0);
+	CHECK(released_count == 0);
+
+	const int length = 4 * 1024 * 1024;
+	char* buffer = (char*) malloc(length);
+	CHECK(buffer);
+	for (int i = 0; i < length; ++i)
+		buffer[i] = (char) (i * 7);
+
+	reader r;
+	start_reader(&r, client, length + 5);
+	CHECK(stcp_send(accepted, buffer, length, 5000));
+	join_reader(&r);
+	CHECK(memcmp(r.buffer + 5, buffer, length) == 0);
+	free(r.buffer);
+
+	for (int i = 0; i < 100 && stcp_get_zerocopy_pending(accepted) > 0; ++i)
+		stcp_drain_zerocopy(accepted, 100);
+
+	CHECK(stcp_get_zerocopy_pending(accepted) == 0);
+	CHECK(released_count == 1);
+	CHECK(released_buffer == buffer);
+
+	// Closing waits for the kernel to report a buffer it's still sending
+	CHECK(stcp_send(accepted, buffer, 64 * 1024, 1000));
+	stcp_close_channel(accepted);
+	CHECK(released_count == 2);
+	CHECK(released_buffer == buffer);
+
+	free(buffer);
+	stcp_close_channel(client);
+	stcp_close_server(server);
+}
+
+// Waits until the ring produces a completion
+static stcp_completion wait_completion(stcp_uring* ring)
+{
+	stcp_completion completion;
+	CHECK(stcp_uring_wait(ring, &completion, 1, 1000) == 1);
+	return completion;
+}
+
+static void test_uring()
+{
+	stcp_uring* ring = stcp_open_uring(32, 8, 256);
+	if (!ring)
+	{
+		printf("io_uring not supported, skipping\n");
+		return;
+	}
+
+	stcp_options options = stcp_make_options(STCP_PROFILE_LOW_LATENCY);
+	stcp_server* server = stcp_open_server_with_options(LOOPBACK_ADDRESS, LOOPBACK_PORT, 4, &options);
+	CHECK(stcp_uring_accept(ring, server, server));
+
+	// One multishot accept yields every pending channel, tuned like stcp_accept() would
+	stcp_channel* clients[2];
+	stcp_channel* accepted[2];
+	for (int i = 0; i < 2; ++i)
+	{
+		clients[i] = stcp_connect(LOOPBACK_ADDRESS, LOOPBACK_PORT);
+		stcp_completion completion = wait_completion(ring);
+		CHECK(completion.op == STCP_URING_ACCEPT);
+		CHECK(completion.user_data == server);
+		CHECK(completion.result == 0);
+		CHECK(completion.more);
+		accepted[i] = completion.channel;
+
+		stcp_options applied;
+		stcp_get_channel_options(accepted[i], &applied);
+		CHECK(applied.no_delay);
+	}
+
+	CHECK(stcp_uring_receive(ring, accepted[0], accepted[0]));
+	for (int i = 0; i < 3; ++i)
+	{
+		char message[16];
+		int length = snprintf(message, sizeof(message), "message %d", i);
+		CHECK(stcp_send(clients[0], message, length, 1000));
+
+		stcp_completion completion = wait_completion(ring);
+		CHECK(completion.op == STCP_URING_RECEIVE);
+		CHECK(completion.user_data == accepted[0]);
+		CHECK(completion.result == length);
+		CHECK(completion.more);
+		CHECK(memcmp(completion.buffer, message, length) == 0);
+		stcp_uring_release_buffer(ring, completion.buffer_id);
+	}
+
+	const char* reply = "uring reply";
+	CHECK(stcp_uring_send(ring, accepted[1], reply, strlen(reply), clients[1]));
+	stcp_completion completion = wait_completion(ring);
+	CHECK(completion.op == STCP_URING_SEND);
+	CHECK(completion.user_data == clients[1]);
+	CHECK(completion.result == (int) strlen(reply));
+
+	char buffer[64];
+	CHECK(stcp_receive(clients[1], buffer, sizeof(buffer), 1000) == (int) strlen(reply));
+	CHECK(memcmp(buffer, reply, strlen(reply)) == 0);
+
+	// Cancelling ends the multishot receive
+	CHECK(stcp_uring_cancel(ring, accepted[0]));
+	completion = wait_completion(ring);
+	CHECK(completion.op == STCP_URING_RECEIVE);
+	CHECK(!completion.more);
+	CHECK(stcp_uring_wait(ring, &completion, 1, 0) == 0);
+
+	// Cancelling the accept lets the server's port be bound again
+	CHECK(stcp_uring_cancel_accept(ring, server));
+	completion = wait_completion(ring);
+	CHECK(completion.op == STCP_URING_ACCEPT);
+	CHECK(!completion.more);
+
+	for (int i = 0; i < 2; ++i)
+	{
+		stcp_close_channel(clients[i]);
+		stcp_close_channel(accepted[i]);
+	}
+	stcp_close_server(server);
+	stcp_close_uring(ring);
+}
+
+int main()
+{
+	snprintf(LOOPBACK_PORT, sizeof(LOOPBACK_PORT), "%d", 20000 + getpid() % 10000);
+	snprintf(POOL_PORT, sizeof(POOL_PORT), "%d", 10000 + getpid() % 10000);
+	stcp_set_error_callback(record_error, NULL);
+	signal(SIGUSR1, ignore_signal);
+	stcp_set_allocator(counting_allocate, counting_deallocate, NULL);
+	CHECK(stcp_initialize());
+
+	test_pooled_channels();
+	test_resolver();
+	test_connect_race();
+	test_connect_many();
+	test_error_context();
+	test_pool();
+	test_options();
+	test_stats();
+	test_busy_poll();
+	test_accept_batch();
+	test_datagrams();
+	test_local_sockets();
+	test_event_loop(false);
+#ifdef __linux__
+	test_event_loop(true);
+#endif
+	test_poll();
+	test_scatter_gather();
+	test_send_file();
+	test_send_queue();
+	test_receive_buffer();
+#ifdef __linux__
+	test_shared_memory();
+#endif
+	test_framer();
+#ifdef STCP_TLS
+	test_tls();
+#endif
+	test_zerocopy();
+	test_uring();
+
+	// Objects still open when the library terminates can be closed afterwards
+	stcp_server* server = stcp_open_server(LOOPBACK_ADDRESS, LOOPBACK_PORT, 4);
+	stcp_channel* client;
+	stcp_channel* accepted;
+	open_pair(server, &client, &accepted);
+	stcp_terminate();
+	stcp_close_channel(client);
+	stcp_close_channel(accepted);
+	stcp_close_server(server);
+
+	printf("All loopback tests passed\n");
+	return 0;
+}